@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "clock_now.h"
+
+/**
+ * @return CLOCK_MONOTONIC (us), the clock the pipeline times itself by
+ */
+int64_t bench_now(void)
+{
+   return clock_now_us();
+}
+
+/**
+ * @return CLOCK_MONOTONIC (ns), for cases too short to time in microseconds
+ */
+int64_t bench_now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @param when bench_now() time to sleep until, returns at once if it has passed
+ */
+void bench_sleep_until(int64_t when)
+{
+   int64_t left = when - bench_now();
+
+   if (left > 0)
+      usleep(left);
+}
+
+/**
+ * Next number of a linear congruential sequence, the same run to run
+ * for the same seed
+ *
+ * @return 24 random bits
+ */
+uint32_t bench_random(uint32_t *seed)
+{
+   *seed = *seed * 1664525u + 1013904223u;
+   return *seed >> 8;
+}
+
+/**
+ * qsort comparison for int64_t
+ */
+int bench_compare_int64(const void *a, const void *b)
+{
+   int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/**
+ * Sorts the values in place
+ *
+ * @return The given percentile of the values, 0 if there are none
+ */
+int64_t bench_percentile(int64_t *values, int count, int percent)
+{
+   if (!count)
+      return 0;
+   qsort(values, count, sizeof(*values), bench_compare_int64);
+   return values[(int64_t)(count - 1) * percent / 100];
+}
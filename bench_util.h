@@ -0,0 +1,18 @@
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#include <stdint.h>
+
+/** Helpers every benchmark needs: a clock to time against, a repeatable
+ *  random sequence for synthetic inputs and percentiles of the timings.
+ *  Linked into the benchmarks only.
+ */
+
+int64_t bench_now(void);
+int64_t bench_now_ns(void);
+void bench_sleep_until(int64_t when);
+uint32_t bench_random(uint32_t *seed);
+int bench_compare_int64(const void *a, const void *b);
+int64_t bench_percentile(int64_t *values, int count, int percent);
+
+#endif /* BENCH_UTIL_H_ */
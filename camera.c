@@ -20,6 +20,21 @@
 #include "RaspiGPS.h"
 #include "RaspiPreview.h"
 
+#include "exposure_cache.h"
+#include "storage.h"
+#include "scheduler.h"
+#include "pipeline.h"
+#include "synthetic_camera.h"
+#include "metrics.h"
+#include "detector.h"
+#include "day_night.h"
+#include "event_push.h"
+#include "rtsp_server.h"
+#include "servo_control.h"
+#include "servo_bus_pi.h"
+#include "patrol.h"
+#include "privacy_mask.h"
+
 #include <semaphore.h>
 #include <math.h>
 #include <pthread.h>
@@ -40,6 +55,16 @@
 #define PREVIEW_FRAME_RATE_NUM 0
 #define PREVIEW_FRAME_RATE_DEN 1
 
+//analysis stream on the video port, low resolution I420 for the motion gate and detector
+#define ANALYSIS_WIDTH  320
+#define ANALYSIS_HEIGHT 240
+#define ANALYSIS_FRAME_RATE_NUM 10
+#define ANALYSIS_FRAME_RATE_DEN 1
+
+//recording, H.264 off the preview port at the preview size
+#define RECORD_BITRATE      4000000
+#define RECORD_INTRA_PERIOD 10         // frames, a second at the day profile's rate
+
 /// Video render needs at least 2 buffers.
 #define VIDEO_OUTPUT_BUFFERS_NUM 3
 
@@ -53,12 +78,42 @@
 /// exposure etc. in milliseconds.
 #define CAMERA_SETTLE_TIME       1000
 
-//central hub of data and parameters
-typedef struct 
+/// Settle time used instead when exposure/AWB were restored from the cache,
+/// just long enough for a few frames to flow through with the seeded values
+#define CAMERA_SETTLE_TIME_RESTORED 150
+
+/// Where converged exposure/AWB is persisted between runs, %d is the camera number
+#define EXPOSURE_CACHE_PATH "/var/tmp/securitycam%d.exposure"
+
+struct RASPISTILL_STATE_S;
+
+/** Struct used to pass information in encoder port userdata to callback
+ */
+typedef struct
+{
+   CAMERA_PIPELINE *pipeline;           /// Pipeline whose writer gets the buffer data
+   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
+   int write_failed;                    /// Set if the writer could not keep up with the data (out of storage)
+   int stalled;                         /// Set when the watchdog gave up waiting for the frame end
+   struct RASPISTILL_STATE_S *pstate;   /// pointer to our state in case required in callback
+} PORT_USERDATA;
+
+/** Camera output masked on its way to an encoder. Its connection isn't
+ *  tunnelled, so every frame passes through masked_connection_callback.
+ */
+typedef struct
+{
+   CAMERA_PIPELINE *pipeline;           /// Pipeline whose privacy masks apply
+   PRIVACY_FILTER filter;               /// Masks rasterised for this output's frame size
+   pthread_mutex_t lock;                /// Camera and encoder threads both call back, one masks at a time
+} MASKED_STREAM;
+
+//central hub of data and parameters, one per camera
+typedef struct RASPISTILL_STATE_S
 {
    RASPICOMMONSETTINGS_PARAMETERS common_settings;     /// Common settings
    int timeout;                        /// Time taken before frame is grabbed and app then shuts down. Units are milliseconds
-   char *linkname;                     /// filename of output file
+   int timeout_set;                    /// Timeout given with -t rather than the default, a restored exposure doesn't cut it short
    int frameStart;                     /// First number of frame output counter
    MMAL_FOURCC_T encoding;             /// Encoding to use for the output file.
    //const char *exifTags[MAX_USER_EXIF_TAGS]; /// Array of pointers to tags supplied from the command line
@@ -74,31 +129,40 @@ typedef struct
    MMAL_CONNECTION_T *preview_connection; /// Pointer to the connection from camera to preview
    MMAL_CONNECTION_T *encoder_connection; /// Pointer to the connection from camera to encode
    MMAL_POOL_T *encoder_pool; /// Pointer to the pool of buffers used by encoder output port
+   MMAL_POOL_T *analysis_pool; /// Pointer to the pool of buffers used by the camera video port
+   size_t encoder_pool_bytes;          /// Counted against the memory budget for each pool
+   size_t record_pool_bytes;
+   size_t analysis_pool_bytes;
+   int analysis;                       /// Run the analysis stream on the video port
+   int recording;                      /// Record H.264 from the preview port instead of previewing
+   MMAL_COMPONENT_T *record_component; /// Pointer to the H.264 encoder component
+   MMAL_CONNECTION_T *record_connection; /// Pointer to the connection from camera preview to H.264 encoder
+   MMAL_POOL_T *record_pool;           /// Pointer to the pool of buffers used by H.264 encoder output port
+   int record_frame_start;             /// Next H.264 buffer starts a frame
+   int record_after_config;            /// Last H.264 buffer was SPS/PPS, the keyframe started there
+   int masking;                        /// Privacy masks go on between the camera and the encoders
+   MASKED_STREAM capture_mask;         /// Stills port to the still encoder
+   MASKED_STREAM record_mask;          /// Preview port to the H.264 encoder
+   PRIVACY_FILTER analysis_filter;     /// Video port, its frames end up in pushed thumbnails
+
+   PORT_USERDATA callback_data;        /// Encoder output port userdata
+   int preview_created;                /// raspipreview_create succeeded
+   int semaphore_created;              /// callback_data.complete_semaphore is valid
+   int64_t ready_time;                 /// get_microseconds64() the camera has settled by
+   int encoder_watch;                  /// Watchdog port for the encoder output
+
+   char *exposure_cache_path;          /// File the converged exposure/AWB is persisted to
+   EXPOSURE_STATE exposure;            /// Latest exposure/AWB reported by the camera
+   int exposure_stable_count;          /// Consecutive reports the exposure has stayed settled for
+   int exposure_restored;              /// Exposure/AWB were seeded from the cache at startup
+   int exposure_auto;                  /// Camera is running its own AGC/AWB (reports are worth saving)
+   DAY_NIGHT day_night;                /// Day/night profile picked from the settled exposure
+   int day_night_auto;                 /// Switch day/night profiles from the exposure reports
+   int64_t start_time;                 /// get_microseconds64() when the app started
+   int64_t first_frame_time;           /// Time to first good frame in ms, -1 until captured
 }RASPISTILL_STATE;
 
 
-/** Struct used to pass information in encoder port userdata to callback
- */
-typedef struct
-{
-   FILE *file_handle;                   /// File handle to write buffer data to.
-   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
-   RASPISTILL_STATE *pstate;            /// pointer to our state in case required in callback
-} PORT_USERDATA;
-
-//camera commands
-enum
-{
-   FRAME_NEXT_SINGLE,
-   FRAME_NEXT_TIMELAPSE,
-   FRAME_NEXT_KEYPRESS,
-   FRAME_NEXT_FOREVER,
-   FRAME_NEXT_GPIO,
-   FRAME_NEXT_SIGNAL,
-   FRAME_NEXT_IMMEDIATELY
-};
-
-
 /**
  * Assign a default set of parameters to the state passed in
  *
@@ -117,7 +181,6 @@ static void default_status(RASPISTILL_STATE *state)
    raspicommonsettings_set_defaults(&state->common_settings);
 
    state->timeout = -1; // replaced with 5000ms later if unset
-   state->linkname = NULL;
    state->frameStart = 0;
    state->camera_component = NULL;
    state->encoder_component = NULL;
@@ -125,9 +188,29 @@ static void default_status(RASPISTILL_STATE *state)
    state->encoder_connection = NULL;
    state->encoder_pool = NULL;
    state->encoding = MMAL_ENCODING_JPEG;
+   state->analysis_pool = NULL;
+   state->encoder_pool_bytes = 0;
+   state->record_pool_bytes = 0;
+   state->analysis_pool_bytes = 0;
+   state->analysis = 0;
+   state->recording = 0;
+   state->record_component = NULL;
+   state->record_connection = NULL;
+   state->record_pool = NULL;
    state->frameNextMethod = FRAME_NEXT_SINGLE;
    state->numExifTags = 0;
    state->enableExifTags = 1;
+   state->exposure_cache_path = NULL;
+   state->exposure_stable_count = 0;
+   state->exposure_restored = 0;
+   state->exposure_auto = 1;
+   day_night_init(&state->day_night);
+   state->day_night_auto = 0;
+   state->start_time = get_microseconds64();
+   state->first_frame_time = -1;
+   state->preview_created = 0;
+   state->semaphore_created = 0;
+   state->ready_time = 0;
 
    // Setup preview window defaults
    raspipreview_set_defaults(&state->preview_parameters);
@@ -136,219 +219,38 @@ static void default_status(RASPISTILL_STATE *state)
    raspicamcontrol_set_defaults(&state->camera_parameters);
 }
 
-static int wait_for_frame(RASPISTILL_STATE *state, int *frame)
-{
-   static int64_t complete_time = -1;
-   int keep_running = 1;
-
-   int64_t current_time = get_microseconds64()/1000;
-
-   if (complete_time == -1)
-   {
-      complete_time = current_time + state->timeout;
-   }
-   //if timeout == 0 then continue
-   if(current_time >= complete_time && state->timeout != 0)
-   {
-      keep_running = 0;
-   }
-
-   //for development for the option to be frame next single 
-   state->frameNextMethod = FRAME_NEXT_SINGLE;
-
-   switch (state->frameNextMethod)
-   {
-      case FRAME_NEXT_SINGLE :
-         // simple timeout for a single capture
-         vcos_sleep(state->timeout);
-         return 0;
-      
-      case FRAME_NEXT_KEYPRESS :
-      {
-         int ch;
-
-         if (state->common_settings.verbose)
-            fprintf(stderr, "Press Enter to capture, X then ENTER to exit\n");
-
-         ch = getchar();
-         //will wait forever?
-
-         *frame+=1;
-         if (ch == 'x' || ch == 'X')
-            return 0;
-         else
-         {
-            return keep_running;
-         }
-      }
-      case FRAME_NEXT_IMMEDIATELY :
-      {
-         // Not waiting, just go to next frame.
-         // Actually, we do need a slight delay here otherwise exposure goes
-         // badly wrong since we never allow it frames to work it out
-         // This could probably be tuned down.
-         // First frame has a much longer delay to ensure we get exposure to a steady state
-         if (*frame == 0)
-            vcos_sleep(CAMERA_SETTLE_TIME);
-         else
-            vcos_sleep(30);
-
-         *frame+=1;
-
-         return keep_running;
-      }
-
-      case FRAME_NEXT_GPIO :
-      {
-         // Intended for GPIO firing of a capture
-         return 0;
-      }
-      case FRAME_NEXT_SIGNAL :
-      {
-         // Need to wait for a SIGUSR1 or SIGUSR2 signal
-         sigset_t waitset;
-         int sig;
-         int result = 0;
-
-         sigemptyset( &waitset );
-         sigaddset( &waitset, SIGUSR1 );
-         sigaddset( &waitset, SIGUSR2 );
-
-         // We are multi threaded because we use mmal, so need to use the pthread
-         // variant of procmask to block until a SIGUSR1 or SIGUSR2 signal appears
-         pthread_sigmask( SIG_BLOCK, &waitset, NULL );
-
-         if (state->common_settings.verbose)
-         {
-            fprintf(stderr, "Waiting for SIGUSR1 to initiate capture and continue or SIGUSR2 to capture and exit\n");
-         }
-
-         result = sigwait( &waitset, &sig );
-
-         if (result == 0)
-         {
-            if (sig == SIGUSR1)
-            {
-               if (state->common_settings.verbose)
-                  fprintf(stderr, "Received SIGUSR1\n");
-            }
-            else if (sig == SIGUSR2)
-            {
-               if (state->common_settings.verbose)
-                  fprintf(stderr, "Received SIGUSR2\n");
-               keep_running = 0;
-            }
-         }
-         else
-         {
-            if (state->common_settings.verbose)
-               fprintf(stderr, "Bad signal received - error %d\n", errno);
-         }
-
-         *frame+=1;
-
-         return keep_running;
-      }
-   } // end of switch
-
-   // Should have returned by now, but default to timeout
-   return keep_running;
-}
-
-
-
 /**
- * Allocates and generates a filename based on the
- * user-supplied pattern and the frame number.
- * On successful return, finalName and tempName point to malloc()ed strings
- * which must be freed externally.  (On failure, returns nulls that
- * don't need free()ing.)
+ * Create a port's buffer pool and count it against the memory budget.
+ * mmal allocates the payloads itself, the budget only keeps the tally.
  *
- * @param finalName pointer receives an
- * @param pattern sprintf pattern with %d to be replaced by frame
- * @param frame for timelapse, the frame number
- * @return Returns a MMAL_STATUS_T giving result of operation
-*/
-
-MMAL_STATUS_T name_photo(char** finalName, char** tempName, char * pattern, int frame)
+ * @param stage Budget stage the buffers belong to
+ * @param reserved Receives the bytes counted, for destroy_port_pool
+ * @return The pool, NULL if mmal couldn't create it or it doesn't fit the budget
+ */
+static MMAL_POOL_T *create_port_pool(MMAL_PORT_T *port, MEMORY_STAGE stage, size_t *reserved)
 {
-   *finalName = NULL;
-   *tempName = NULL;
-   if (0 > asprintf(finalName, pattern, frame) ||
-         0 > asprintf(tempName, "%s~", *finalName))
-   {
-      if (*finalName != NULL)
-      {
-         free(*finalName);
-      }
-      return MMAL_ENOMEM;    // It may be some other error, but it is not worth getting it right
-   }
-   return MMAL_SUCCESS;
-}
-
+   size_t bytes = (size_t)port->buffer_num * port->buffer_size;
+   MMAL_POOL_T *pool;
 
-//linked filename to data using gnu opeartions
-static void rename_file(RASPISTILL_STATE *state, FILE *output_file,
-                        const char *final_filename, const char *temp_filename, int frame)
-{
-   MMAL_STATUS_T status;
+   if (memory_reserve(stage, bytes) != 0)
+      return NULL;
 
-   fclose(output_file);
-   vcos_assert(temp_filename != NULL && final_filename != NULL);
-   if (0 != rename(temp_filename, final_filename))
-   {
-      vcos_log_error("Could not rename temp file to: %s; %s",
-                     final_filename,strerror(errno));
-   }
-   if (state->linkname)
+   pool = mmal_port_pool_create(port, port->buffer_num, port->buffer_size);
+   if (!pool)
    {
-      char *use_link;
-      char *final_link;
-      status = name_photo(&final_link, &use_link, state->linkname, frame);
-
-      // Create hard link if possible, symlink otherwise
-      if (status != MMAL_SUCCESS
-            || (0 != link(final_filename, use_link)
-                &&  0 != symlink(final_filename, use_link))
-            || 0 != rename(use_link, final_link))
-      {
-         vcos_log_error("Could not link as filename: %s; %s",
-                        state->linkname,strerror(errno));
-      }
-      if (use_link) free(use_link);
-      if (final_link) free(final_link);
+      memory_release(stage, bytes);
+      return NULL;
    }
+   *reserved = bytes;
+   return pool;
 }
 
-
-int open_filename(RASPISTILL_STATE *state, char *use_filename, char *final_filename, FILE *output_file, int frame, PORT_USERDATA callback_data)
+static void destroy_port_pool(MMAL_PORT_T *port, MMAL_POOL_T *pool, MEMORY_STAGE stage, size_t *reserved)
 {
-   // Open the file
-         MMAL_STATUS_T status;
-         vcos_assert(use_filename == NULL && final_filename == NULL);
-         status = name_photo(&final_filename, &use_filename, state->common_settings.filename, frame);
-         if (status  != MMAL_SUCCESS)
-         {
-            vcos_log_error("Unable to create filenames");
-            //goto error;
-            exit(1);
-         }
-
-         if (state->common_settings.verbose)
-            fprintf(stderr, "Opening output file %s\n", final_filename);
-         // Technically it is opening the temp~ filename which will be renamed to the final filename
-
-         output_file = fopen(use_filename, "wb");
-
-         if (!output_file)
-         {
-            // Notify user, carry on but discarding encoded output buffers
-            vcos_log_error("%s: Error opening output file: %s\nNo output file will be generated\n", __func__, use_filename);
-         }
-   
-      callback_data.file_handle = output_file;
+   mmal_port_pool_destroy(port, pool);
+   memory_release(stage, *reserved);
+   *reserved = 0;
 }
-          
 
 /**
  * Create the encoder component, set up its ports
@@ -398,6 +300,10 @@ static MMAL_STATUS_T create_encoder_component(RASPISTILL_STATE *state)
    if (encoder_output->buffer_num < encoder_output->buffer_num_min)
       encoder_output->buffer_num = encoder_output->buffer_num_min;
 
+   // Fewer than recommended if that is all the packets budget has room for
+   encoder_output->buffer_num = memory_fit(MEMORY_STAGE_PACKETS, encoder_output->buffer_size,
+                                           encoder_output->buffer_num, encoder_output->buffer_num_min);
+
    // Commit the port changes to the output port
    status = mmal_port_format_commit(encoder_output);
 
@@ -438,11 +344,13 @@ static MMAL_STATUS_T create_encoder_component(RASPISTILL_STATE *state)
    }
 
    /* Create pool of buffer headers for the output port to consume */
-   pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+   pool = create_port_pool(encoder_output, MEMORY_STAGE_PACKETS, &state->encoder_pool_bytes);
 
    if (!pool)
    {
       vcos_log_error("Failed to create buffer header pool for encoder output port %s", encoder_output->name);
+      status = MMAL_ENOMEM;
+      goto error;
    }
 
    state->encoder_pool = pool;
@@ -472,7 +380,17 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
    // Get rid of any port buffers first
    if (state->encoder_pool)
    {
-      mmal_port_pool_destroy(state->encoder_component->output[0], state->encoder_pool);
+      // Every header should be back by now (port disabled), anything missing
+      // is still held by someone and would leak on each pipeline restart
+      unsigned queued = mmal_queue_length(state->encoder_pool->queue);
+
+      if (queued != state->encoder_pool->headers_num)
+         vcos_log_error("Encoder pool destroyed with %u of %u buffers outstanding",
+                        state->encoder_pool->headers_num - queued, state->encoder_pool->headers_num);
+
+      destroy_port_pool(state->encoder_component->output[0], state->encoder_pool, MEMORY_STAGE_PACKETS,
+                        &state->encoder_pool_bytes);
+      state->encoder_pool = NULL;
    }
 
    if (state->encoder_component)
@@ -484,6 +402,220 @@ static void destroy_encoder_component(RASPISTILL_STATE *state)
 
 
 
+/**
+ * Create the H.264 encoder for recording, set up its ports
+ *
+ * @param state Pointer to state control struct. record_component member set to the created component if successful.
+ *
+ * @return a MMAL_STATUS, MMAL_SUCCESS if all OK, something else otherwise
+ */
+static MMAL_STATUS_T create_record_component(RASPISTILL_STATE *state)
+{
+   MMAL_COMPONENT_T *encoder = 0;
+   MMAL_PORT_T *encoder_input = NULL, *encoder_output = NULL;
+   MMAL_STATUS_T status;
+   MMAL_POOL_T *pool;
+
+   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to create H.264 encoder component");
+      goto error;
+   }
+
+   if (!encoder->input_num || !encoder->output_num)
+   {
+      status = MMAL_ENOSYS;
+      vcos_log_error("H.264 encoder doesn't have input/output ports");
+      goto error;
+   }
+
+   encoder_input = encoder->input[0];
+   encoder_output = encoder->output[0];
+
+   // We want same format on input and output
+   mmal_format_copy(encoder_output->format, encoder_input->format);
+
+   encoder_output->format->encoding = MMAL_ENCODING_H264;
+   encoder_output->format->bitrate = RECORD_BITRATE;
+
+   encoder_output->buffer_size = encoder_output->buffer_size_recommended;
+
+   if (encoder_output->buffer_size < encoder_output->buffer_size_min)
+      encoder_output->buffer_size = encoder_output->buffer_size_min;
+
+   encoder_output->buffer_num = encoder_output->buffer_num_recommended;
+
+   if (encoder_output->buffer_num < encoder_output->buffer_num_min)
+      encoder_output->buffer_num = encoder_output->buffer_num_min;
+
+   // Fewer than recommended if that is all the packets budget has room for
+   encoder_output->buffer_num = memory_fit(MEMORY_STAGE_PACKETS, encoder_output->buffer_size,
+                                           encoder_output->buffer_num, encoder_output->buffer_num_min);
+
+   // Variable frame rate, the camera's FPS range decides
+   encoder_output->format->es->video.frame_rate.num = 0;
+   encoder_output->format->es->video.frame_rate.den = 1;
+
+   status = mmal_port_format_commit(encoder_output);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set format on H.264 encoder output port");
+      goto error;
+   }
+
+   if (mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_INTRAPERIOD, RECORD_INTRA_PERIOD) != MMAL_SUCCESS)
+      vcos_log_error("Unable to set intra period");
+
+   // SPS/PPS before every keyframe, so any keyframe can start a segment
+   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set inline headers");
+      status = MMAL_ENOSYS;
+      goto error;
+   }
+
+   status = mmal_component_enable(encoder);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to enable H.264 encoder component");
+      goto error;
+   }
+
+   pool = create_port_pool(encoder_output, MEMORY_STAGE_PACKETS, &state->record_pool_bytes);
+
+   if (!pool)
+   {
+      vcos_log_error("Failed to create buffer header pool for H.264 encoder output port %s", encoder_output->name);
+      status = MMAL_ENOMEM;
+      goto error;
+   }
+
+   state->record_pool = pool;
+   state->record_component = encoder;
+
+   if (state->common_settings.verbose)
+      fprintf(stderr, "H.264 encoder component done\n");
+
+   return status;
+
+error:
+
+   if (encoder)
+      mmal_component_destroy(encoder);
+
+   return status;
+}
+
+/**
+ * Destroy the H.264 encoder component
+ *
+ * @param state Pointer to state control struct
+ */
+static void destroy_record_component(RASPISTILL_STATE *state)
+{
+   if (state->record_pool)
+   {
+      destroy_port_pool(state->record_component->output[0], state->record_pool, MEMORY_STAGE_PACKETS,
+                        &state->record_pool_bytes);
+      state->record_pool = NULL;
+   }
+
+   if (state->record_component)
+   {
+      mmal_component_destroy(state->record_component);
+      state->record_component = NULL;
+   }
+}
+
+/**
+ *  buffer header callback function for the H.264 encoder
+ *
+ *  Hands each buffer to the pipeline's recorder and RTSP stream, marking
+ *  where keyframes start and frames end. With inline headers a keyframe
+ *  starts at the SPS/PPS in front of it.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void record_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)port->userdata;
+   int config = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) != 0;
+
+   if (buffer->length)
+   {
+      int flags = 0;
+
+      if (config || (state->record_frame_start && !state->record_after_config &&
+                     (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)))
+         flags |= RECORDER_FLAG_KEYFRAME;
+      if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+         flags |= RECORDER_FLAG_FRAME_END;
+
+      mmal_buffer_header_mem_lock(buffer);
+      pipeline_record(state->callback_data.pipeline, buffer->data + buffer->offset, buffer->length, flags,
+                      buffer->pts);
+      mmal_buffer_header_mem_unlock(buffer);
+   }
+
+   state->record_after_config = config;
+   state->record_frame_start = config || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+
+   // release buffer back to the pool
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled)
+   {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer;
+
+      new_buffer = mmal_queue_get(state->record_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the H.264 encoder port");
+   }
+}
+
+/**
+ * Start recording, the H.264 encoder output feeding record_buffer_callback
+ *
+ * @param state Pointer to state control struct, camera connected to the encoder
+ * @return MMAL_SUCCESS if packets are flowing
+ */
+static MMAL_STATUS_T start_recording(RASPISTILL_STATE *state)
+{
+   MMAL_PORT_T *record_output = state->record_component->output[0];
+   MMAL_STATUS_T status;
+   int num;
+
+   state->record_frame_start = 1;
+   state->record_after_config = 0;
+
+   record_output->userdata = (struct MMAL_PORT_USERDATA_T *)state;
+   if ((status = mmal_port_enable(record_output, record_buffer_callback)) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Failed to enable H.264 encoder output");
+      return status;
+   }
+
+   num = mmal_queue_length(state->record_pool->queue);
+   for (int q = 0; q < num; q++)
+   {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->record_pool->queue);
+
+      if (!buffer || mmal_port_send_buffer(record_output, buffer) != MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to H.264 encoder output port (%d)", q);
+   }
+   return MMAL_SUCCESS;
+}
+
 /**
  *  buffer header callback function for encoder
  *
@@ -496,19 +628,23 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
 {
    int complete = 0;
 
-   // We pass our file handle and other stuff in via the userdata field.
+   // We pass our pipeline and other stuff in via the userdata field.
 
    PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
 
    if (pData)
    {
-      int bytes_written = buffer->length;
+      size_t bytes_written = buffer->length;
+
+      watchdog_kick(&pData->pipeline->watchdog, pData->pstate->encoder_watch);
+      pipeline_count_buffer(pData->pipeline, buffer->length, buffer->alloc_size);
 
-      if (buffer->length && pData->file_handle)
+      if (buffer->length)
       {
          mmal_buffer_header_mem_lock(buffer);
 
-         bytes_written = fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+         // Goes to this camera's writer, discarded if it has no open file
+         bytes_written = pipeline_write(pData->pipeline, buffer->data, buffer->length, buffer->pts);
 
          mmal_buffer_header_mem_unlock(buffer);
       }
@@ -517,6 +653,7 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       if (bytes_written != buffer->length)
       {
          vcos_log_error("Unable to write buffer to file - aborting");
+         pData->write_failed = 1;
          complete = 1;
       }
 
@@ -552,9 +689,451 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       vcos_semaphore_post(&(pData->complete_semaphore));
 }
 
+/**
+ *  buffer header callback function for the analysis stream on the camera video port
+ *
+ *  Hands the luma plane to the pipeline's motion gate/detector, which copy
+ *  whatever they need so the buffer can go straight back to the port.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void analysis_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)port->userdata;
 
+   if (buffer->length)
+   {
+      mmal_buffer_header_mem_lock(buffer);
+      if (state->masking)
+         pipeline_mask_frame(state->callback_data.pipeline, &state->analysis_filter, buffer->data + buffer->offset,
+                             NULL, NULL, ANALYSIS_WIDTH, ANALYSIS_HEIGHT, port->format->es->video.width, 0);
+      pipeline_analyse(state->callback_data.pipeline, buffer->data + buffer->offset, ANALYSIS_WIDTH,
+                       ANALYSIS_HEIGHT, port->format->es->video.width, buffer->pts);
+      mmal_buffer_header_mem_unlock(buffer);
+   }
+
+   // release buffer back to the pool
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled)
+   {
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer;
+
+      new_buffer = mmal_queue_get(state->analysis_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the analysis port");
+   }
+}
+
+/**
+ * Mask one I420 frame from the camera in place
+ *
+ * @param port Camera output the frame came from
+ */
+static void mask_buffer(MASKED_STREAM *stream, MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+   // Planes are padded to the aligned size, chroma a quarter of luma each
+   size_t luma_size = (size_t)video->width * video->height;
+
+   mmal_buffer_header_mem_lock(buffer);
+   if (buffer->length >= luma_size * 3 / 2)
+   {
+      uint8_t *luma = buffer->data + buffer->offset;
+
+      pthread_mutex_lock(&stream->lock);
+      pipeline_mask_frame(stream->pipeline, &stream->filter, luma, luma + luma_size, luma + luma_size * 5 / 4,
+                          video->crop.width, video->crop.height, video->width, video->width / 2);
+      pthread_mutex_unlock(&stream->lock);
+   }
+   else
+   {
+      // Part of a frame can't be masked reliably, the encoder gets nothing
+      vcos_log_error("Short frame of %u bytes on a masked connection", buffer->length);
+      buffer->length = 0;
+   }
+   mmal_buffer_header_mem_unlock(buffer);
+}
+
+/**
+ * Called by mmal whenever a masked connection has a frame from the camera
+ * or an empty buffer back from the encoder. Frames are masked on this
+ * thread and passed on, empty buffers go back to the camera.
+ *
+ * @param connection Connection whose user_data is the MASKED_STREAM
+ */
+static void masked_connection_callback(MMAL_CONNECTION_T *connection)
+{
+   MASKED_STREAM *stream = (MASKED_STREAM *)connection->user_data;
+   MMAL_BUFFER_HEADER_T *buffer;
+
+   while ((buffer = mmal_queue_get(connection->queue)) != NULL)
+   {
+      // Events from the camera, nothing for the encoder
+      if (buffer->cmd)
+      {
+         mmal_buffer_header_release(buffer);
+         continue;
+      }
+
+      if (buffer->length)
+         mask_buffer(stream, connection->out, buffer);
+      if (mmal_port_send_buffer(connection->in, buffer) != MMAL_SUCCESS)
+         mmal_buffer_header_release(buffer);
+   }
+
+   while (connection->out->is_enabled && (buffer = mmal_queue_get(connection->pool->queue)) != NULL)
+   {
+      if (mmal_port_send_buffer(connection->out, buffer) != MMAL_SUCCESS)
+      {
+         mmal_queue_put_back(connection->pool->queue, buffer);
+         vcos_log_error("Unable to return a buffer to a masked camera port");
+         break;
+      }
+   }
+}
+
+/**
+ * Connect a camera output to an encoder. Without privacy masks this is
+ * the usual tunnel, with them the frames come up to masked_connection_callback
+ * and go back down to the encoder masked.
+ *
+ * @param stream Mask state for this output
+ * @return MMAL_SUCCESS if the connection is up
+ */
+static MMAL_STATUS_T connect_masked_ports(RASPISTILL_STATE *state, MMAL_PORT_T *output_port, MMAL_PORT_T *input_port,
+                                          MMAL_CONNECTION_T **connection, MASKED_STREAM *stream)
+{
+   MMAL_STATUS_T status;
+
+   if (!state->masking)
+      return connect_ports(output_port, input_port, connection);
+
+   status = mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+   if (status != MMAL_SUCCESS)
+      return status;
+
+   (*connection)->user_data = stream;
+   (*connection)->callback = masked_connection_callback;
+
+   mmal_format_copy(input_port->format, output_port->format);
+   if ((status = mmal_port_format_commit(input_port)) == MMAL_SUCCESS &&
+       (status = mmal_connection_enable(*connection)) == MMAL_SUCCESS)
+   {
+      // Hand the camera the whole pool to start with
+      masked_connection_callback(*connection);
+      return MMAL_SUCCESS;
+   }
+
+   mmal_connection_destroy(*connection);
+   *connection = NULL;
+   return status;
+}
+
+/**
+ * Set up the mask state for a pipeline with privacy masks
+ */
+static void init_masking(RASPISTILL_STATE *state, CAMERA_PIPELINE *pipeline)
+{
+   MASKED_STREAM *streams[2] = { &state->capture_mask, &state->record_mask };
+
+   for (int i = 0; i < 2; i++)
+   {
+      streams[i]->pipeline = pipeline;
+      privacy_filter_init(&streams[i]->filter, &pipeline->privacy);
+      pthread_mutex_init(&streams[i]->lock, NULL);
+   }
+   privacy_filter_init(&state->analysis_filter, &pipeline->privacy);
+   state->masking = 1;
+}
+
+/**
+ * Free the mask state, once no connection can call back
+ */
+static void destroy_masking(RASPISTILL_STATE *state)
+{
+   MASKED_STREAM *streams[2] = { &state->capture_mask, &state->record_mask };
+
+   if (!state->masking)
+      return;
+
+   for (int i = 0; i < 2; i++)
+   {
+      privacy_filter_destroy(&streams[i]->filter);
+      pthread_mutex_destroy(&streams[i]->lock);
+   }
+   privacy_filter_destroy(&state->analysis_filter);
+   state->masking = 0;
+}
+
+/**
+ * Start the analysis stream, the camera video port feeding analysis_buffer_callback
+ *
+ * @param state Pointer to state control struct, camera already enabled
+ * @return MMAL_SUCCESS if frames are flowing
+ */
+static MMAL_STATUS_T start_analysis(RASPISTILL_STATE *state)
+{
+   MMAL_PORT_T *video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+   MMAL_STATUS_T status;
+   int num;
+
+   state->analysis_pool = create_port_pool(video_port, MEMORY_STAGE_FRAMES, &state->analysis_pool_bytes);
+   if (!state->analysis_pool)
+   {
+      vcos_log_error("Failed to create buffer header pool for analysis port %s", video_port->name);
+      return MMAL_ENOMEM;
+   }
+
+   video_port->userdata = (struct MMAL_PORT_USERDATA_T *)state;
+   if ((status = mmal_port_enable(video_port, analysis_buffer_callback)) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Failed to enable analysis port");
+      return status;
+   }
+
+   // Send all the buffers to the video port
+   num = mmal_queue_length(state->analysis_pool->queue);
+   for (int q = 0; q < num; q++)
+   {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->analysis_pool->queue);
+
+      if (!buffer || mmal_port_send_buffer(video_port, buffer) != MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to analysis port (%d)", q);
+   }
+
+   // Unlike the preview, the video port only produces frames while capturing
+   return mmal_port_parameter_set_boolean(video_port, MMAL_PARAMETER_CAPTURE, 1);
+}
+
+
+
+
+static float rational_to_float(MMAL_RATIONAL_T value)
+{
+   return value.den ? (float)value.num / (float)value.den : 0.0f;
+}
+
+/**
+ *  Camera control callback
+ *
+ *  Same as the default one but also picks up the camera settings reports
+ *  so the converged exposure/AWB can be persisted at shutdown.
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)port->userdata;
+
+   if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED)
+   {
+      MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *)buffer->data;
+
+      if (state && param->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS)
+      {
+         MMAL_PARAMETER_CAMERA_SETTINGS_T *settings = (MMAL_PARAMETER_CAMERA_SETTINGS_T*)param;
+         EXPOSURE_STATE current;
+
+         current.valid = 1;
+         current.exposure = settings->exposure;
+         current.analog_gain = rational_to_float(settings->analog_gain);
+         current.digital_gain = rational_to_float(settings->digital_gain);
+         current.awb_red_gain = rational_to_float(settings->awb_red_gain);
+         current.awb_blue_gain = rational_to_float(settings->awb_blue_gain);
+         current.saved_at = 0;
+
+         // Only reports from the camera's own AGC/AWB tell us anything,
+         // while seeded the values just echo back what we set
+         if (state->exposure_auto && exposure_state_settled(&state->exposure, &current))
+            state->exposure_stable_count++;
+         else
+            state->exposure_stable_count = 0;
+
+         state->exposure = current;
+
+         // Only decide here, setting parameters from a callback can deadlock
+         // so the pipeline thread applies the new profile
+         if (state->day_night_auto && state->exposure_stable_count > 0 &&
+               day_night_update(&state->day_night, &current))
+         {
+            if (state->common_settings.verbose)
+               fprintf(stderr, "Camera %d: switching to %s profile\n", state->common_settings.cameraNum,
+                       day_night_profile(&state->day_night)->name);
+            if (state->callback_data.pipeline)
+               pipeline_request_settings(state->callback_data.pipeline);
+         }
+      }
+   }
+   else if (buffer->cmd == MMAL_EVENT_ERROR)
+   {
+      vcos_log_error("No data received from sensor. Check all connections, including the Sunny one on the camera board");
+   }
+   else
+   {
+      vcos_log_error("Received unexpected camera control callback event, 0x%08x", buffer->cmd);
+   }
+
+   mmal_buffer_header_release(buffer);
+}
+
+/**
+ * Seed the camera parameters with the exposure/AWB the last run converged to,
+ * so the first frame is usable without waiting for the AGC to settle.
+ * Anything the user set by hand is left alone.
+ *
+ * @param state Pointer to state control struct
+ * @return 1 if the cached values were applied, 0 otherwise
+ */
+static int restore_exposure(RASPISTILL_STATE *state)
+{
+   RASPICAM_CAMERA_PARAMETERS *params = &state->camera_parameters;
+   EXPOSURE_STATE cached;
+
+   if (!state->exposure_cache_path)
+      return 0;
+
+   if (params->shutter_speed || params->analog_gain || params->digital_gain ||
+         params->awbMode != MMAL_PARAM_AWBMODE_AUTO)
+      return 0;
+
+   if (exposure_cache_load(state->exposure_cache_path, &cached, EXPOSURE_CACHE_MAX_AGE) != 0)
+      return 0;
+
+   params->shutter_speed = cached.exposure;
+   params->analog_gain = cached.analog_gain;
+   params->digital_gain = cached.digital_gain;
+   params->awbMode = MMAL_PARAM_AWBMODE_OFF;
+   params->awb_gains_r = cached.awb_red_gain;
+   params->awb_gains_b = cached.awb_blue_gain;
+
+   state->exposure_restored = 1;
+   state->exposure_auto = 0;
+
+   if (state->common_settings.verbose)
+      fprintf(stderr, "Restored exposure %uus gain %.2f/%.2f awb %.2f/%.2f\n",
+              cached.exposure, cached.analog_gain, cached.digital_gain,
+              cached.awb_red_gain, cached.awb_blue_gain);
+   return 1;
+}
+
+/**
+ * Hand exposure/AWB back to the camera once the fast first frame is taken,
+ * the seeded values are a starting point not a fixed setting.
+ *
+ * @param state Pointer to state control struct
+ */
+static void release_exposure(RASPISTILL_STATE *state)
+{
+   MMAL_COMPONENT_T *camera = state->camera_component;
+
+   if (!state->exposure_restored || state->exposure_auto)
+      return;
+
+   state->camera_parameters.shutter_speed = 0;
+   state->camera_parameters.analog_gain = 0;
+   state->camera_parameters.digital_gain = 0;
+   state->camera_parameters.awbMode = MMAL_PARAM_AWBMODE_AUTO;
+
+   // No camera when called from teardown, the parameters still need putting back for a restart
+   if (camera)
+   {
+      raspicamcontrol_set_shutter_speed(camera, 0);
+      raspicamcontrol_set_gains(camera, 0, 0);
+      raspicamcontrol_set_awb_mode(camera, MMAL_PARAM_AWBMODE_AUTO);
+   }
+
+   state->exposure_stable_count = 0;
+   state->exposure_auto = 1;
+}
+
+/**
+ * Persist the exposure/AWB if the camera's own loops reported settled values.
+ * A run that never left the seeded values leaves the old cache to age out.
+ *
+ * @param state Pointer to state control struct
+ */
+static void save_exposure(RASPISTILL_STATE *state)
+{
+   if (!state->exposure_cache_path || !state->exposure_auto ||
+         state->exposure_stable_count < EXPOSURE_CONVERGE_COUNT)
+      return;
+
+   if (exposure_cache_save(state->exposure_cache_path, &state->exposure) != 0)
+      vcos_log_error("Could not save exposure cache %s; %s", state->exposure_cache_path, strerror(errno));
+   else if (state->common_settings.verbose)
+      fprintf(stderr, "Saved exposure %uus to %s\n", state->exposure.exposure, state->exposure_cache_path);
+}
+
+static int enable_port(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera, MMAL_PORT_T *port);
+
+/**
+ * Frame rate range the camera ports should run at. A long manual shutter
+ * needs a slow range to fit in, otherwise day/night picks it.
+ *
+ * @param state Pointer to state control struct
+ * @param fps_low Receives the bottom of the range, thousandths of a frame per second
+ * @param fps_high Receives the top of the range
+ * @return 1 if the range should be set, 0 to leave the camera's default
+ */
+static int camera_fps_range(RASPISTILL_STATE *state, int *fps_low, int *fps_high)
+{
+   CAMERA_PIPELINE *pipeline = state->callback_data.pipeline;
+
+   if (state->camera_parameters.shutter_speed > 6000000)
+   {
+      *fps_low = 50;
+      *fps_high = 166;
+      return 1;
+   }
+   if (state->camera_parameters.shutter_speed > 1000000)
+   {
+      *fps_low = 166;
+      *fps_high = 999;
+      return 1;
+   }
+   // Recording slows down for static scenes even without day/night
+   if (!state->day_night_auto && !state->recording)
+      return 0;
+
+   day_night_fps_range(&state->day_night, pipeline ? __atomic_load_n(&pipeline->idle, __ATOMIC_ACQUIRE) : 0,
+                       fps_low, fps_high);
+   return 1;
+}
+
+static void set_fps_range(MMAL_PORT_T *port, int fps_low, int fps_high)
+{
+   MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+      { fps_low, 1000 }, { fps_high, 1000 }
+   };
+
+   if (mmal_port_parameter_set(port, &fps_range.hdr) != MMAL_SUCCESS)
+      vcos_log_error("Unable to set frame rate range %d-%d/1000", fps_low, fps_high);
+}
+
+/**
+ * Apply the ISO and denoise of the current day/night profile
+ *
+ * @param state Pointer to state control struct
+ * @param camera Camera component
+ */
+static void apply_profile_controls(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera)
+{
+   const DAY_NIGHT_PROFILE *profile = day_night_profile(&state->day_night);
+
+   state->camera_parameters.ISO = profile->iso;
+   raspicamcontrol_set_ISO(camera, profile->iso);
+   mmal_port_parameter_set_boolean(camera->control, MMAL_PARAMETER_VIDEO_DENOISE, profile->denoise);
+   mmal_port_parameter_set_boolean(camera->control, MMAL_PARAMETER_STILLS_DENOISE, profile->denoise);
+}
 
-
 int create_camera_component(RASPISTILL_STATE *state)
 {
 	MMAL_COMPONENT_T *camera = 0;
@@ -571,7 +1150,7 @@ int create_camera_component(RASPISTILL_STATE *state)
 	if (operation_status != MMAL_SUCCESS)
 	{
 		printf("Unable to create camera component : error code : %d\n", operation_status );
-		exit(1);
+		goto error;
 	}
 
 	//seems like I need the stereoscopic mode for good photos, possibility I don't need them.
@@ -582,8 +1161,8 @@ int create_camera_component(RASPISTILL_STATE *state)
    if (operation_status != MMAL_SUCCESS)
    {
       vcos_log_error("Could not set stereo mode : error %d", operation_status);
-      exit(1);
-      //goto error;
+      operation_status = MMAL_EINVAL;
+      goto error;
    }
    
    MMAL_PARAMETER_INT32_T camera_num =
@@ -594,15 +1173,14 @@ int create_camera_component(RASPISTILL_STATE *state)
    if (operation_status != MMAL_SUCCESS)
    {
       vcos_log_error("Could not select camera : error %d", operation_status);
-      exit(1);
-//      goto error;
+      goto error;
    }
 
 	if (!camera->output_num)
 	{
 		operation_status = MMAL_ENOSYS;
 		printf("Camera has no output ports\n");
-		exit(1);
+		goto error;
 	}
 
 	//may want to set sensor mode for sport shot or night shot
@@ -616,18 +1194,18 @@ int create_camera_component(RASPISTILL_STATE *state)
 
 	//set up ports
 	preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
-	//video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+	video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
 	still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
 
 	//enabling camera and setup control callback function
-	operation_status = mmal_port_enable(camera->control, default_camera_control_callback);
+	camera->control->userdata = (struct MMAL_PORT_USERDATA_T *)state;
+	operation_status = mmal_port_enable(camera->control, camera_control_callback);
 
 	if(operation_status != MMAL_SUCCESS) 
 	{
 		printf("Error enabling control port: error code:%d \n Destroying camera",operation_status);
-		mmal_component_destroy(camera);
-		exit(1);
-	}	
+		goto error;
+	}
 
    //  set up the camera configuration
    MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
@@ -642,7 +1220,9 @@ int create_camera_component(RASPISTILL_STATE *state)
       .num_preview_video_frames = 3,
       .stills_capture_circular_buffer_height = 0,
       .fast_preview_resume = 0,
-      .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+      // Raw rather than reset so frame timestamps share a time base with
+      // MMAL_PARAMETER_SYSTEM_TIME, which the pipeline's frame clock reads
+      .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC
    };
 
 	//since fullResPreview setting is ommitted preview will not be as nice as actual photo
@@ -651,30 +1231,60 @@ int create_camera_component(RASPISTILL_STATE *state)
 	//shoudl eb done to all ports(encoder, camera) when variables are being set
 	mmal_port_parameter_set(camera->control, &cam_config.hdr);
 
+	//ask for the settings reports so the converged exposure can be saved
+	MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
+	{
+		{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
+		MMAL_PARAMETER_CAMERA_SETTINGS, 1
+	};
+
+	if (mmal_port_parameter_set(camera->control, &change_event_request.hdr) != MMAL_SUCCESS)
+		vcos_log_error("No camera settings events");
+
+	//start from last run's exposure if there is one
+	restore_exposure(state);
+
 	//apply the paramters
 	raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+	if (state->day_night_auto)
+		apply_profile_controls(state, camera);
 
 	//enable preview port
-	operation_status = enable_port(&state, camera, preview_port);
+	if ((operation_status = enable_port(state, camera, preview_port)) != MMAL_SUCCESS)
+		goto error;
 	//enable still/photo
-	operation_status = enable_port(&state, camera, still_port);
+	if ((operation_status = enable_port(state, camera, still_port)) != MMAL_SUCCESS)
+		goto error;
+	//analysis frames come off the otherwise unused video port
+	if (state->analysis && (operation_status = enable_port(state, camera, video_port)) != MMAL_SUCCESS)
+		goto error;
 
 	/* Enable component */
    operation_status = mmal_component_enable(camera);
 
+   if (operation_status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Camera component couldn't be enabled");
+      goto error;
+   }
+
    state->camera_component = camera;
 
-   if (operation_status == MMAL_SUCCESS)
+   if (state->common_settings.verbose)
       fprintf(stderr, "Camera component done\n");
 
    return operation_status;
 
-// error:
+error:
 
-//    if (camera)
-//       mmal_component_destroy(camera);
+   if (camera)
+   {
+      // Control port callback has to go before the component
+      check_disable_port(camera->control);
+      mmal_component_destroy(camera);
+   }
 
-//    return status;
+   return operation_status;
 }
 
 
@@ -694,34 +1304,24 @@ static void destroy_camera_component(RASPISTILL_STATE *state)
 }
 
 
-int enable_port(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera, MMAL_PORT_T *port)
+static int enable_port(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera, MMAL_PORT_T *port)
 {
    MMAL_STATUS_T status;
    MMAL_ES_FORMAT_T *format;
+   int fps_low, fps_high;
 
 	format = port->format;
 
-	if(state->camera_parameters.shutter_speed > 6000000)
-	{
-		MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-			{ 50, 1000 }, {166, 1000}
-		};
-		mmal_port_parameter_set(port, &fps_range.hdr);
-	}
-	else if(state->camera_parameters.shutter_speed > 1000000)
-	{
-		MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-			{ 166, 1000 }, {999, 1000}
-		};
-		mmal_port_parameter_set(port, &fps_range.hdr);
-	}
+	if(camera_fps_range(state, &fps_low, &fps_high))
+		set_fps_range(port, fps_low, fps_high);
 
 	// could use Fullrespreview but more frames is betterUse a full FOV 4:3 mode
 
 	if(port == camera->output[MMAL_CAMERA_PREVIEW_PORT])
 	{
 
-      format->encoding = MMAL_ENCODING_OPAQUE;   
+      // Opaque buffers never reach the ARM side, masks need the pixels
+      format->encoding = state->masking && state->recording ? MMAL_ENCODING_I420 : MMAL_ENCODING_OPAQUE;
 		format->encoding_variant = MMAL_ENCODING_I420;
    	format->es->video.width = VCOS_ALIGN_UP(state->preview_parameters.previewWindow.width, 32);
 	   format->es->video.height = VCOS_ALIGN_UP(state->preview_parameters.previewWindow.height, 16);
@@ -745,6 +1345,11 @@ int enable_port(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera, MMAL_PORT_T *
 	}
 	else if(port == camera->output[MMAL_CAMERA_CAPTURE_PORT])
 	{
+      if (state->masking)
+      {
+         format->encoding = MMAL_ENCODING_I420;
+         format->encoding_variant = MMAL_ENCODING_I420;
+      }
       //for some reason using the preview parameters works but not the common settings ones
       format->es->video.width = VCOS_ALIGN_UP(state->preview_parameters.previewWindow.width, 32);
 	   format->es->video.height = VCOS_ALIGN_UP(state->preview_parameters.previewWindow.height, 16);
@@ -771,13 +1376,36 @@ int enable_port(RASPISTILL_STATE *state, MMAL_COMPONENT_T *camera, MMAL_PORT_T *
 			goto error;
 		}
 	}
-	return 0;
-error:
+	else if(port == camera->output[MMAL_CAMERA_VIDEO_PORT])
+	{
+		// Only the luma plane is looked at, so the width is also the stride
+		format->encoding = MMAL_ENCODING_I420;
+		format->encoding_variant = MMAL_ENCODING_I420;
+		format->es->video.width = VCOS_ALIGN_UP(ANALYSIS_WIDTH, 32);
+		format->es->video.height = VCOS_ALIGN_UP(ANALYSIS_HEIGHT, 16);
+		format->es->video.crop.x = 0;
+		format->es->video.crop.y = 0;
+		format->es->video.crop.width = ANALYSIS_WIDTH;
+		format->es->video.crop.height = ANALYSIS_HEIGHT;
+		format->es->video.frame_rate.num = ANALYSIS_FRAME_RATE_NUM;
+		format->es->video.frame_rate.den = ANALYSIS_FRAME_RATE_DEN;
+
+		status = mmal_port_format_commit(port);
+		if (status != MMAL_SUCCESS)
+		{
+			vcos_log_error("camera analysis format couldn't be set");
+			goto error;
+		}
 
-if (camera)
-   mmal_component_destroy(camera);
+		port->buffer_size = port->buffer_size_recommended;
+		if (port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+			port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+	}
+	return MMAL_SUCCESS;
+error:
 
-return status;
+   // camera is left for the caller to destroy
+   return status;
 }
 
 //might not work tbh
@@ -804,170 +1432,275 @@ return status;
 
 
 
-int main()
+/**
+ * Tear down everything mmal_pipeline_create built, safe on a partly built pipeline
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ */
+static void mmal_pipeline_destroy(CAMERA_PIPELINE *pipeline)
 {
-   RASPISTILL_STATE state;
-   int exit_code = EX_OK;
-
-   MMAL_STATUS_T status = MMAL_SUCCESS;
-   MMAL_PORT_T *camera_preview_port = NULL;
-   //MMAL_PORT_T *camera_video_port = NULL;
-   MMAL_PORT_T *camera_still_port = NULL;
-   MMAL_PORT_T *preview_input_port = NULL;
-   MMAL_PORT_T *encoder_input_port = NULL;
-   MMAL_PORT_T *encoder_output_port = NULL;
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
 
+   save_exposure(state);
+   release_exposure(state);
 
-//what is thiss??
-   bcm_host_init();
-
-      // Register our application with the logging system
-      //what is this??
-      // some threading thing, probably will replace with pthread stuff
-   vcos_log_register("RaspiStill", VCOS_LOG_CATEGORY);
+   // Strict reverse of setup. Output ports first so no more buffer callbacks
+   // can arrive, this also hands every in flight buffer back to the pool
+   if (state->analysis_pool)
+   {
+      check_disable_port(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT]);
+      destroy_port_pool(state->camera_component->output[MMAL_CAMERA_VIDEO_PORT], state->analysis_pool,
+                        MEMORY_STAGE_FRAMES, &state->analysis_pool_bytes);
+   }
+   state->analysis_pool = NULL;
 
+   if (state->encoder_component)
+      check_disable_port(state->encoder_component->output[0]);
+   if (state->record_component)
+      check_disable_port(state->record_component->output[0]);
+
+   // Then the data flow between components
+   if (state->encoder_connection)
+      mmal_connection_destroy(state->encoder_connection);
+   if (state->preview_connection)
+      mmal_connection_destroy(state->preview_connection);
+   if (state->record_connection)
+      mmal_connection_destroy(state->record_connection);
+   state->encoder_connection = NULL;
+   state->preview_connection = NULL;
+   state->record_connection = NULL;
 
-//not sure what the signal stuff is
-   signal(SIGINT, default_signal_handler);
+   // Then stop the components before any of them go away
+   if (state->encoder_component)
+      mmal_component_disable(state->encoder_component);
+   if (state->record_component)
+      mmal_component_disable(state->record_component);
+   if (state->preview_created)
+      mmal_component_disable(state->preview_parameters.preview_component);
+   if (state->camera_component)
+   {
+      mmal_component_disable(state->camera_component);
+      check_disable_port(state->camera_component->control);
+   }
 
-   // Disable USR1 and USR2 for the moment - may be reenabled if go in to signal capture mode
-   signal(SIGUSR1, SIG_IGN);
-   signal(SIGUSR2, SIG_IGN);
-   default_status(&state);
+   destroy_encoder_component(state);
+   destroy_record_component(state);
 
+   if (state->preview_created)
+      raspipreview_destroy(&state->preview_parameters);
+   state->preview_created = 0;
 
-   if (state.timeout == -1)
-      state.timeout = 5000;
+   destroy_camera_component(state);
+   destroy_masking(state);
 
-   // Setup for sensor specific parameters
-   get_sensor_defaults(state.common_settings.cameraNum, state.common_settings.camera_name,
-                       &state.common_settings.width, &state.common_settings.height);
+   if (state->semaphore_created)
+      vcos_semaphore_delete(&state->callback_data.complete_semaphore);
+   state->semaphore_created = 0;
 
+   free(state->exposure_cache_path);
+   state->exposure_cache_path = NULL;
+}
 
-   //create camera, preview and encoder component
-   if ((status = create_camera_component(&state)) != MMAL_SUCCESS)
-   {
-      vcos_log_error("%s: Failed to create camera component", __func__);
-      exit_code = EX_SOFTWARE;
-   }
-   if ((status = raspipreview_create(&state.preview_parameters)) != MMAL_SUCCESS)
-   {
-      vcos_log_error("%s: Failed to create preview component", __func__);
-      destroy_camera_component(&state);
-      exit_code = EX_SOFTWARE;
-   }
-   if ((status = create_encoder_component(&state)) != MMAL_SUCCESS)
-   {
-      vcos_log_error("%s: Failed to create encode component", __func__);
-      raspipreview_destroy(&state.preview_parameters);
-      destroy_camera_component(&state);
-      exit_code = EX_SOFTWARE;
-   }
-
-   PORT_USERDATA callback_data;
+/**
+ * Build the camera, preview and encoder for one camera and connect them up
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ * @return 0 on success, -1 on failure
+ */
+static int mmal_pipeline_create(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+   MMAL_STATUS_T status = MMAL_SUCCESS;
+   VCOS_STATUS_T vcos_status;
+   int settle_time;
+   int fps_low, fps_high;
 
-   fprintf(stderr, "Starting component connection stage\n");
+   state->common_settings.cameraNum = pipeline->camera_num;
+   state->analysis = pipeline->analysis;
+   // Streaming needs the encoder as much as recording does
+   state->recording = pipeline->recording || pipeline->stream;
 
-   camera_preview_port = state.camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
-   //camera_video_port   = state.camera_component->output[MMAL_CAMERA_VIDEO_PORT];
-   camera_still_port   = state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
-   encoder_input_port  = state.encoder_component->input[0];
-   encoder_output_port = state.encoder_component->output[0];
+   // Masks want raw frames off the camera, set up before its ports are
+   if (pipeline->privacy.num_masks)
+      init_masking(state, pipeline);
 
-   fprintf(stderr, "Connecting camera preview port to video render.\n");
+   // Measured per pipeline so restarts get their own time to first frame
+   state->start_time = get_microseconds64();
+   state->first_frame_time = -1;
+   state->exposure_restored = 0;
+   state->exposure_auto = 1;
+   state->exposure_stable_count = 0;
 
-   // Note we are lucky that the preview and null sink components use the same input port
-   // so we can simple do this without conditionals
-   preview_input_port  = state.preview_parameters.preview_component->input[0];
+   // Setup for sensor specific parameters
+   get_sensor_defaults(state->common_settings.cameraNum, state->common_settings.camera_name,
+                       &state->common_settings.width, &state->common_settings.height);
 
-   // Connect camera to preview (which might be a null_sink if no preview required)
-   status = connect_ports(camera_preview_port, preview_input_port, &state.preview_connection);
+   if (asprintf(&state->exposure_cache_path, EXPOSURE_CACHE_PATH, state->common_settings.cameraNum) < 0)
+      state->exposure_cache_path = NULL;
 
-   VCOS_STATUS_T vcos_status;
-
-   if (status == MMAL_SUCCESS)
+   //create camera, preview and encoder component
+   if ((status = create_camera_component(state)) != MMAL_SUCCESS)
    {
-         fprintf(stderr, "Connecting camera stills port to encoder input port\n");
-
-      // Now connect the camera to the encoder
-      status = connect_ports(camera_still_port, encoder_input_port, &state.encoder_connection);
-
-      if (status != MMAL_SUCCESS)
+      vcos_log_error("%s: Failed to create camera component", __func__);
+      goto error;
+   }
+   // Recording takes the preview port, there is no preview while it runs
+   if (state->recording)
+   {
+      if ((status = create_record_component(state)) != MMAL_SUCCESS)
       {
-         vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
-         exit(1);
+         vcos_log_error("%s: Failed to create H.264 encoder component", __func__);
+         goto error;
       }
    }
    else
    {
-      exit(1);
+      if ((status = raspipreview_create(&state->preview_parameters)) != MMAL_SUCCESS)
+      {
+         vcos_log_error("%s: Failed to create preview component", __func__);
+         goto error;
+      }
+      state->preview_created = 1;
+   }
+
+   if ((status = create_encoder_component(state)) != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to create encode component", __func__);
+      goto error;
    }
-   
 
+   if (state->common_settings.verbose)
+      fprintf(stderr, "Connecting camera preview port to video render.\n");
 
-//I believe this is where the photo data will be stored for useage
+   // Note we are lucky that the preview and null sink components use the same input port
+   // so we can simple do this without conditionals
+   // Connect camera to preview (which might be a null_sink if no preview required)
+   if (state->recording)
+      status = connect_masked_ports(state, state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT],
+                                    state->record_component->input[0], &state->record_connection,
+                                    &state->record_mask);
+   else
+      status = connect_ports(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT],
+                             state->preview_parameters.preview_component->input[0],
+                             &state->preview_connection);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to connect camera to preview", __func__);
+      goto error;
+   }
 
-   callback_data.file_handle = NULL;
-   callback_data.pstate = &state;
+   if (state->common_settings.verbose)
+      fprintf(stderr, "Connecting camera stills port to encoder input port\n");
 
-   //threading stuff tah will need to be researched
-   vcos_status = vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0);
-   vcos_assert(vcos_status == VCOS_SUCCESS);
+   // Now connect the camera to the encoder
+   status = connect_masked_ports(state, state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT],
+                                 state->encoder_component->input[0], &state->encoder_connection,
+                                 &state->capture_mask);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
+      goto error;
+   }
 
+   state->callback_data.pipeline = pipeline;
+   state->callback_data.pstate = state;
+   state->callback_data.write_failed = 0;
 
-//below is the operation of the raspistill functions
-   int frame, keep_looping = 1;
-   FILE *output_file = NULL;
-   char *use_filename = NULL;      // Temporary filename while image being written
-   char *final_filename = NULL;    // Name that file gets once writing complete
+   vcos_status = vcos_semaphore_create(&state->callback_data.complete_semaphore, "RaspiStill-sem", 0);
+   if (vcos_status != VCOS_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to create semaphore", __func__);
+      goto error;
+   }
+   state->semaphore_created = 1;
 
-//wish there was comments for what frame is exactly
-   frame = state.frameStart - 1;
+   mmal_port_parameter_set_boolean(state->encoder_component->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1);
 
-// need to get frame or something
-   wait_for_frame(&state, &frame);
+   // There is a possibility that shutter needs to be set each loop. may not be necessary
+   if (mmal_status_to_int(mmal_port_parameter_set_uint32(state->camera_component->control, MMAL_PARAMETER_SHUTTER_SPEED, state->camera_parameters.shutter_speed)) != MMAL_SUCCESS)
+      vcos_log_error("Unable to set shutter speed");
 
-   // need to open the filename so data can be allocated to it
-   //possibly add functionality to add date to name so we can keep making new photo files
-   //use a set filename for now for testing
+   // Single shots wait out their timeout, everything else just the settle
+   // time. A restored exposure cuts either down to a few frames, unless the
+   // single shot's timeout was asked for with -t
+   if (state->frameNextMethod == FRAME_NEXT_SINGLE && (state->timeout_set || !state->exposure_restored))
+      settle_time = state->timeout;
+   else if (state->exposure_restored)
+      settle_time = CAMERA_SETTLE_TIME_RESTORED;
+   else
+      settle_time = CAMERA_SETTLE_TIME;
 
-   char testing_photo_name[10] =  "photo.jpeg";
-   int len = strlen(testing_photo_name);
-   state.common_settings.filename = malloc(len + 10); // leave enough space for any timelapse generated changes to filename
-   vcos_assert(state.common_settings.filename);
-   if (state.common_settings.filename)
-      strncpy(state.common_settings.filename, testing_photo_name, len+1);
+   state->ready_time = state->start_time + (int64_t)settle_time * 1000;
+   state->encoder_watch = watchdog_add_port(&pipeline->watchdog, "encoder output");
 
-   open_filename(&state, use_filename, final_filename, output_file, frame, callback_data);
+   if (state->analysis && start_analysis(state) != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to start analysis stream", __func__);
+      goto error;
+   }
 
-   if (!output_file)
+   if (state->recording && start_recording(state) != MMAL_SUCCESS)
    {
-        fprintf(stderr, "No output file avaliable");
-        exit(1); 
+      vcos_log_error("%s: Failed to start recording", __func__);
+      goto error;
    }
 
-   mmal_port_parameter_set_boolean(state.encoder_component->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1);
+   // Watchdog and motion gate plan for the slowest the camera may go
+   if (camera_fps_range(state, &fps_low, &fps_high))
+      pipeline_set_frame_rate(pipeline, fps_low);
+   return 0;
 
-   // There is a possibility that shutter needs to be set each loop. may not be necessary
-   if (mmal_status_to_int(mmal_port_parameter_set_uint32(state.camera_component->control, MMAL_PARAMETER_SHUTTER_SPEED, state.camera_parameters.shutter_speed)) != MMAL_SUCCESS)
-      vcos_log_error("Unable to set shutter speed");
+error:
+   mmal_pipeline_destroy(pipeline);
+   return -1;
+}
 
+/**
+ * Capture one frame through the encoder into the pipeline's writer
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ * @return 0 if a complete frame was written, -1 otherwise
+ */
+static int mmal_pipeline_capture(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+   MMAL_PORT_T *encoder_output_port = state->encoder_component->output[0];
+   MMAL_PORT_T *camera_still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+   MMAL_STATUS_T status;
+   int64_t now = get_microseconds64();
+   int result = 0;
+
+   // First frame has a much longer delay to ensure we get exposure to a steady state
+   if (now < state->ready_time)
+      vcos_sleep((uint32_t)((state->ready_time - now) / 1000));
+   else if (state->frameNextMethod == FRAME_NEXT_IMMEDIATELY)
+      // Actually, we do need a slight delay here otherwise exposure goes
+      // badly wrong since we never allow it frames to work it out
+      vcos_sleep(30);
+
+   state->callback_data.write_failed = 0;
+   state->callback_data.stalled = 0;
 
    // Enable the encoder output port
-   encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&callback_data;
+   encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&state->callback_data;
 
-   if (state.common_settings.verbose)
+   if (state->common_settings.verbose)
       fprintf(stderr, "Enabling encoder output port\n");
 
    // Enable the encoder output port and tell it its callback function
    status = mmal_port_enable(encoder_output_port, encoder_buffer_callback);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to enable encoder output port", __func__);
+      return -1;
+   }
 
    // Send all the buffers to the encoder output port
-   int num = mmal_queue_length(state.encoder_pool->queue);
+   int num = mmal_queue_length(state->encoder_pool->queue);
 
    for (int q=0; q<num; q++)
    {
-      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.encoder_pool->queue);
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->encoder_pool->queue);
 
       if (!buffer)
          vcos_log_error("Unable to get a required buffer %d from pool queue", q);
@@ -976,44 +1709,708 @@ int main()
          vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
    }
 
+   // The deadline runs from the capture request, a lost frame end gets us woken by the watchdog
+   watchdog_arm(&pipeline->watchdog, state->encoder_watch);
+
    //capture?
    if (mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
    {
       vcos_log_error("%s: Failed to start capture", __func__);
+      result = -1;
    }
    else
    {
       // Wait for capture to complete
       // For some reason using vcos_semaphore_wait_timeout sometimes returns immediately with bad parameter error
-      // even though it appears to be all correct, so reverting to untimed one until figure out why its erratic
-      vcos_semaphore_wait(&callback_data.complete_semaphore);
-      if (state.common_settings.verbose)
-         fprintf(stderr, "Finished capture %d\n", frame);
+      // even though it appears to be all correct, so the wait is untimed and the watchdog posts the
+      // semaphore instead if the frame end never turns up
+      vcos_semaphore_wait(&state->callback_data.complete_semaphore);
+
+      if (state->callback_data.stalled)
+         result = PIPELINE_CAPTURE_STALLED;
+      else if (state->callback_data.write_failed)
+         result = -1;
+
+      if (state->first_frame_time < 0)
+      {
+         // Time to first good frame, the number the exposure cache is there to cut down
+         state->first_frame_time = (int64_t)(get_microseconds64() - state->start_time) / 1000;
+         fprintf(stderr, "Camera %d: time to first frame: %lld ms (%s exposure)\n", pipeline->camera_num,
+                 (long long)state->first_frame_time, state->exposure_restored ? "restored" : "cold");
+
+         release_exposure(state);
+      }
    }
 
+   watchdog_disarm(&pipeline->watchdog, state->encoder_watch);
+
    // Ensure we don't die if get callback with no open file
-  
-   callback_data.file_handle = NULL;
-  
-   rename_file(&state, output_file, final_filename, use_filename, frame);
-   
-   status = mmal_port_disable(encoder_output_port);
-   
-   if (use_filename)
+   mmal_port_disable(encoder_output_port);
+
+   return result;
+}
+
+/**
+ * Called from the watchdog thread when the encoder output has stalled,
+ * wakes the capture waiting on the semaphore.
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ */
+static void mmal_pipeline_abort_capture(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+
+   state->callback_data.stalled = 1;
+   vcos_semaphore_post(&state->callback_data.complete_semaphore);
+}
+
+/**
+ * Rebuild the encoder and its connection after a stall, the camera and
+ * preview keep running so exposure doesn't have to settle again.
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ * @return 0 on success, -1 if the whole pipeline needs rebuilding
+ */
+static int mmal_pipeline_recover(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+   MMAL_PORT_T *camera_still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+   MMAL_STATUS_T status;
+
+   vcos_log_error("Camera %d: encoder stalled, rebuilding encoder", pipeline->camera_num);
+
+   // Abandon the capture in progress
+   mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 0);
+
+   // Same order as the full teardown, but stopping at the encoder
+   check_disable_port(state->encoder_component->output[0]);
+   if (state->encoder_connection)
+      mmal_connection_destroy(state->encoder_connection);
+   state->encoder_connection = NULL;
+   mmal_component_disable(state->encoder_component);
+   destroy_encoder_component(state);
+
+   // A frame end that turned up late would otherwise complete the next capture early
+   while (vcos_semaphore_trywait(&state->callback_data.complete_semaphore) == VCOS_SUCCESS)
+      ;
+
+   if ((status = create_encoder_component(state)) != MMAL_SUCCESS)
    {
-      free(use_filename);
-      use_filename = NULL;
+      vcos_log_error("%s: Failed to recreate encode component", __func__);
+      return -1;
    }
-   if (final_filename)
+
+   status = connect_masked_ports(state, camera_still_port, state->encoder_component->input[0],
+                                 &state->encoder_connection, &state->capture_mask);
+   if (status != MMAL_SUCCESS)
    {
-      free(final_filename);
-      final_filename = NULL;
+      vcos_log_error("%s: Failed to reconnect camera to encoder", __func__);
+      return -1;
    }
-   
-   vcos_semaphore_delete(&callback_data.complete_semaphore);
-   fprintf(stderr,"Done");
 
-	return 0;
+   mmal_port_parameter_set_boolean(state->encoder_component->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1);
+   return 0;
+}
+
+/**
+ * Called on the pipeline thread after a day/night switch or a change to
+ * idle, applies the profile and frame rate to the running camera.
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ */
+static void mmal_apply_settings(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+   MMAL_COMPONENT_T *camera = state->camera_component;
+   int fps_low, fps_high;
+
+   if (!camera || !camera_fps_range(state, &fps_low, &fps_high))
+      return;
+
+   if (state->day_night_auto)
+      apply_profile_controls(state, camera);
+
+   set_fps_range(camera->output[MMAL_CAMERA_PREVIEW_PORT], fps_low, fps_high);
+   set_fps_range(camera->output[MMAL_CAMERA_CAPTURE_PORT], fps_low, fps_high);
+   if (state->analysis)
+      set_fps_range(camera->output[MMAL_CAMERA_VIDEO_PORT], fps_low, fps_high);
+
+   pipeline_set_frame_rate(pipeline, fps_low);
+
+   if (state->common_settings.verbose)
+      fprintf(stderr, "Camera %d: %s profile, %d-%d/1000 fps\n", pipeline->camera_num,
+              day_night_profile(&state->day_night)->name, fps_low, fps_high);
+}
+
+/**
+ * Make the H.264 encoder's next frame an IDR, for an RTSP client that
+ * has just joined or lost packets
+ *
+ * @param pipeline Pipeline whose backend_state is the RASPISTILL_STATE
+ */
+static void mmal_request_keyframe(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+
+   if (!state->record_component)
+      return;
+
+   if (mmal_port_parameter_set_boolean(state->record_component->output[0],
+                                       MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1) != MMAL_SUCCESS)
+      vcos_log_error("Unable to request an I frame");
+}
+
+/**
+ * Read the VideoCore's STC, the clock the camera timestamps frames by.
+ * Called from the buffer callbacks, about twice a second.
+ *
+ * @return STC (us), -1 if it couldn't be read
+ */
+static int64_t mmal_sensor_time(CAMERA_PIPELINE *pipeline)
+{
+   RASPISTILL_STATE *state = (RASPISTILL_STATE *)pipeline->backend_state;
+   uint64_t stc;
+
+   if (!state->camera_component ||
+       mmal_port_parameter_get_uint64(state->camera_component->control, MMAL_PARAMETER_SYSTEM_TIME, &stc) != MMAL_SUCCESS)
+      return -1;
+   return (int64_t)stc;
+}
+
+static const PIPELINE_BACKEND mmal_backend =
+{
+   "mmal",
+   "jpg",
+   mmal_pipeline_create,
+   mmal_pipeline_capture,
+   mmal_pipeline_destroy,
+   mmal_pipeline_abort_capture,
+   mmal_pipeline_recover,
+   mmal_apply_settings,
+   "h264",
+   mmal_request_keyframe,
+   mmal_sensor_time
+};
+
+#define MAX_CAMERAS 4
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-n cameras] [-S] [-o directory] [-t timeout_ms] [-l interval_ms] [-k] [-s] [-w deadline_ms] [-M] [-N] [-R] [-D model] [-Z zones] [-P masks] [-E url] [-T port] [-H presets] [-m port] [-L seconds] [-B megabytes] [-I] [-v]\n", app);
+   fprintf(stderr, "  -n  number of cameras, each gets its own pipeline (max %d)\n", MAX_CAMERAS);
+   fprintf(stderr, "  -S  use the synthetic camera backend instead of mmal\n");
+   fprintf(stderr, "  -o  output directory\n");
+   fprintf(stderr, "  -t  timeout, delay before a single capture or total run time otherwise\n");
+   fprintf(stderr, "  -l  timelapse, capture every interval_ms\n");
+   fprintf(stderr, "  -k  capture on Enter, X then Enter to exit\n");
+   fprintf(stderr, "  -s  capture on SIGUSR1, capture and exit on SIGUSR2\n");
+   fprintf(stderr, "  -w  watchdog deadline for a stalled encoder, 0 disables (default %d)\n", WATCHDOG_DEFAULT_DEADLINE);
+   fprintf(stderr, "  -M  capture when the analysis stream sees motion\n");
+   fprintf(stderr, "  -R  record H.264, full rate around motion and a keyframe every %ds otherwise\n",
+           RECORDER_DEFAULT_IDLE_INTERVAL / 1000);
+   fprintf(stderr, "  -N  switch day/night camera profiles from the exposure\n");
+   fprintf(stderr, "  -D  only capture motion the detector model finds a person/vehicle etc. in\n");
+   fprintf(stderr, "  -Z  motion zones and masks for -M/-D, %%d in the name is the camera number\n");
+   fprintf(stderr, "  -P  privacy masks blacked out or blurred before anything is encoded, %%d as for -Z\n");
+   fprintf(stderr, "  -E  POST events for -M/-D to http://host[:port]/path, queued in <directory>/outbox while it is down\n");
+   fprintf(stderr, "  -T  serve each camera's H.264 as rtsp://<host>:port/camN (usually %d)\n", RTSP_DEFAULT_PORT);
+   fprintf(stderr, "  -H  drive camera 0's pan/tilt head through the presets file's tour, captures wait while it moves\n");
+   fprintf(stderr, "  -m  serve Prometheus metrics on http://<host>:port/metrics\n");
+   fprintf(stderr, "  -L  log a metrics summary line every so many seconds\n");
+   fprintf(stderr, "  -B  memory every pipeline's frames, packets and records share, 0 for no limit (default %d)\n",
+           MEMORY_DEFAULT_BUDGET / (1024 * 1024));
+   fprintf(stderr, "  -I  list when each file's first frame was taken in <directory>/%s\n", STORAGE_DEFAULT_INDEX);
+   fprintf(stderr, "  -v  verbose\n");
+}
+
+/** State shared with the signal handling thread
+ */
+typedef struct
+{
+   CAPTURE_SCHEDULER *scheduler;
+   sigset_t waitset;                   /// Signals the thread waits for, blocked everywhere else
+   int verbose;
+} SIGNAL_THREAD_DATA;
+
+/**
+ * All signals are handled here with sigwait rather than in a handler, so
+ * shutdown can take locks and let the pipelines drain properly.
+ *
+ * SIGINT/SIGTERM stop the scheduler, every pipeline finishes the frame it is
+ * on and tears down. A second one means the drain is stuck, so give up.
+ * SIGUSR1 captures, SIGUSR2 captures and exits (signal mode only).
+ */
+static void *signal_thread(void *arg)
+{
+   SIGNAL_THREAD_DATA *data = (SIGNAL_THREAD_DATA *)arg;
+   int sig, stopping = 0;
+
+   while (sigwait(&data->waitset, &sig) == 0)
+   {
+      if (sig == SIGINT || sig == SIGTERM)
+      {
+         if (stopping)
+         {
+            fprintf(stderr, "Second %s, exiting without cleanup\n", sig == SIGINT ? "SIGINT" : "SIGTERM");
+            _exit(EX_SOFTWARE);
+         }
+
+         fprintf(stderr, "Received %s, finishing captures in progress\n", sig == SIGINT ? "SIGINT" : "SIGTERM");
+         stopping = 1;
+         scheduler_stop(data->scheduler);
+      }
+      else
+      {
+         if (data->verbose)
+            fprintf(stderr, "Received %s\n", sig == SIGUSR1 ? "SIGUSR1" : "SIGUSR2");
+
+         scheduler_trigger(data->scheduler, sig == SIGUSR2);
+      }
+   }
+   return NULL;
+}
+
+/**
+ * Servo control's move callback, the head carries camera 0
+ */
+static void head_moved(void *userdata, int moving)
+{
+   pipeline_set_head_moving((CAMERA_PIPELINE *)userdata, moving);
+}
+
+/**
+ * Camera 0's view of where the head points, for its ego motion seed
+ */
+static void head_position(void *userdata, int *pan, int *tilt)
+{
+   servo_control_position((SERVO_CONTROL *)userdata, pan, tilt);
+}
+
+int main(int argc, char **argv)
+{
+   RASPISTILL_STATE states[MAX_CAMERAS];
+   SYNTHETIC_CAMERA synthetic[MAX_CAMERAS];
+   CAMERA_PIPELINE pipelines[MAX_CAMERAS];
+   STORAGE_MANAGER storage;
+   CAPTURE_SCHEDULER scheduler;
+   DETECTOR detector;
+   CNN_MODEL model;
+   EVENT_PUSH push;
+   RTSP_SERVER rtsp;
+   SERVO_CONTROL head;
+   SERVO_MOCK_BUS head_mock;
+   SERVO_PI_BUS head_pi = { 0, 1, 0 };
+   PATROL patrol;
+   const PIPELINE_BACKEND *backend = &mmal_backend;
+   const char *directory = NULL, *model_path = NULL, *zones_path = NULL, *masks_path = NULL, *push_url = NULL;
+   const char *presets_path = NULL;
+   int num_cameras = 1, verbose = 0, timeout = -1, timeout_set, interval = 0;
+   int deadline = WATCHDOG_DEFAULT_DEADLINE;
+   int metrics_port = 0, metrics_interval = 0, rtsp_port = 0;
+   int day_night = 0, recording = 0;
+   int budget = MEMORY_DEFAULT_BUDGET / (1024 * 1024), write_index = 0;
+   int method = FRAME_NEXT_SINGLE;
+   int exit_code = EX_OK;
+   int opt;
+   SIGNAL_THREAD_DATA signal_data;
+   pthread_t signal_thread_id;
+   int started = 0, detecting = 0, pushing = 0, streaming = 0, heading = 0;
+
+   while ((opt = getopt(argc, argv, "n:So:t:l:ksw:MNRD:Z:P:E:T:H:m:L:B:Ivh")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n' : num_cameras = atoi(optarg); break;
+         case 'S' : backend = &synthetic_backend; break;
+         case 'o' : directory = optarg; break;
+         case 't' : timeout = atoi(optarg); break;
+         case 'l' : interval = atoi(optarg); method = FRAME_NEXT_TIMELAPSE; break;
+         case 'k' : method = FRAME_NEXT_KEYPRESS; break;
+         case 's' : method = FRAME_NEXT_SIGNAL; break;
+         case 'w' : deadline = atoi(optarg); break;
+         case 'M' : method = FRAME_NEXT_EVENT; break;
+         case 'N' : day_night = 1; break;
+         case 'R' : recording = 1; break;
+         case 'D' : model_path = optarg; method = FRAME_NEXT_EVENT; break;
+         case 'Z' : zones_path = optarg; break;
+         case 'P' : masks_path = optarg; break;
+         case 'E' : push_url = optarg; break;
+         case 'T' : rtsp_port = atoi(optarg); break;
+         case 'H' : presets_path = optarg; break;
+         case 'm' : metrics_port = atoi(optarg); break;
+         case 'L' : metrics_interval = atoi(optarg); break;
+         case 'B' : budget = atoi(optarg); break;
+         case 'I' : write_index = 1; break;
+         case 'v' : verbose = 1; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? EX_OK : EX_SOFTWARE;
+      }
+   }
+
+   if (num_cameras < 1 || num_cameras > MAX_CAMERAS)
+   {
+      print_usage(argv[0]);
+      return EX_SOFTWARE;
+   }
+
+   timeout_set = timeout != -1;
+   if (timeout == -1)
+      timeout = 5000;
+
+   if (backend == &mmal_backend)
+   {
+      bcm_host_init();
+
+      // Register our application with the logging system
+      vcos_log_register("RaspiStill", VCOS_LOG_CATEGORY);
+   }
+
+   // Disable USR1 and USR2 for the moment - may be reenabled if go in to signal capture mode
+   signal(SIGUSR1, SIG_IGN);
+   signal(SIGUSR2, SIG_IGN);
+
+   // Block everything we handle before any other thread exists, so they all
+   // inherit the mask and only the signal thread ever sees them
+   sigemptyset(&signal_data.waitset);
+   sigaddset(&signal_data.waitset, SIGINT);
+   sigaddset(&signal_data.waitset, SIGTERM);
+   if (method == FRAME_NEXT_SIGNAL)
+   {
+      sigaddset(&signal_data.waitset, SIGUSR1);
+      sigaddset(&signal_data.waitset, SIGUSR2);
+   }
+   pthread_sigmask(SIG_BLOCK, &signal_data.waitset, NULL);
+
+   // Everything the pipelines allocate from here on comes out of the budget
+   if (budget > 0 && memory_budget_init((size_t)budget * 1024 * 1024) != 0)
+      return EX_SOFTWARE;
+
+   if (storage_init(&storage, directory, NULL) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return EX_SOFTWARE;
+   }
+   if (write_index && storage_open_index(&storage, STORAGE_DEFAULT_INDEX) != 0)
+   {
+      storage_destroy(&storage);
+      return EX_SOFTWARE;
+   }
+   if (scheduler_init(&scheduler, method, interval, method == FRAME_NEXT_SINGLE ? 0 : timeout) != 0)
+   {
+      fprintf(stderr, "Unable to create scheduler\n");
+      storage_destroy(&storage);
+      return EX_SOFTWARE;
+   }
+   scheduler.verbose = verbose;
+
+   // Telemetry is best effort, carry on capturing without it
+   if (metrics_port && metrics_http_start(metrics_port) != 0)
+      fprintf(stderr, "Metrics endpoint not available\n");
+   if (metrics_log_start(metrics_interval) != 0)
+      fprintf(stderr, "Metrics log not available\n");
+
+   // The detector is shared, loaded once for every pipeline
+   if (model_path)
+   {
+      if (cnn_model_load(&model, model_path) != 0 ||
+          detector_init(&detector, &model, DETECTOR_DEFAULT_THRESHOLD, pipeline_detected) != 0)
+      {
+         fprintf(stderr, "Unable to load detector model %s\n", model_path);
+         metrics_log_stop();
+         metrics_http_stop();
+         scheduler_destroy(&scheduler);
+         storage_destroy(&storage);
+         return EX_SOFTWARE;
+      }
+      if (detector_start(&detector) != 0)
+         fprintf(stderr, "Unable to start detector, capturing on motion alone\n");
+      else
+         detecting = 1;
+
+      if (verbose)
+         fprintf(stderr, "Detector %dx%d using %s kernels\n", detector.model.input_width,
+                 detector.model.input_height, cnn_kernel_name());
+   }
+
+   // Events are pushed best effort too, they are on disk whatever happens
+   if (push_url)
+   {
+      char *outbox = NULL;
+
+      if (asprintf(&outbox, "%s/outbox", directory ? directory : ".") < 0 ||
+          event_push_init(&push, push_url, outbox) != 0)
+         fprintf(stderr, "Events will not be pushed\n");
+      else if (event_push_start(&push) != 0)
+      {
+         fprintf(stderr, "Unable to start event push, events will not be pushed\n");
+         event_push_destroy(&push);
+      }
+      else
+         pushing = 1;
+      free(outbox);
+   }
+
+   // Live video is best effort as well, and only the mmal encoder makes H.264
+   if (rtsp_port && backend != &mmal_backend)
+      fprintf(stderr, "RTSP needs the mmal backend's H.264 encoder, not streaming\n");
+   else if (rtsp_port && rtsp_server_init(&rtsp, rtsp_port) != 0)
+      fprintf(stderr, "Video will not be streamed\n");
+   else if (rtsp_port)
+      streaming = 1;
+
+   signal_data.scheduler = &scheduler;
+   signal_data.verbose = verbose;
+   if (pthread_create(&signal_thread_id, NULL, signal_thread, &signal_data) != 0)
+   {
+      fprintf(stderr, "Unable to start signal thread\n");
+      if (streaming)
+         rtsp_server_destroy(&rtsp);
+      if (pushing)
+         event_push_destroy(&push);
+      if (model_path)
+         detector_destroy(&detector);
+      metrics_log_stop();
+      metrics_http_stop();
+      scheduler_destroy(&scheduler);
+      storage_destroy(&storage);
+      return EX_SOFTWARE;
+   }
+
+   // The head is best effort as well, camera 0 captures wherever it points.
+   // The synthetic camera gets a mock head with the stick left centred.
+   if (presets_path)
+   {
+      int on_pi = backend == &mmal_backend;
+
+      if (!on_pi)
+         servo_mock_init(&head_mock);
+      if (servo_control_init(&head, on_pi ? &servo_pi_bus : &servo_mock_bus, on_pi ? (void *)&head_pi : &head_mock) != 0)
+         fprintf(stderr, "Pan/tilt head not available\n");
+      else
+      {
+         head.on_move = head_moved;
+         head.move_userdata = &pipelines[0];
+         patrol_init(&patrol, &head);
+         if (patrol_load(&patrol, presets_path) != 0)
+         {
+            fprintf(stderr, "Pan/tilt head not started\n");
+            patrol_destroy(&patrol);
+            servo_control_destroy(&head);
+         }
+         else
+            heading = 1;
+      }
+   }
+
+   // One pipeline per camera, they only share the storage and scheduler
+   for (int i = 0; i < num_cameras; i++)
+   {
+      void *backend_state;
+
+      if (backend == &mmal_backend)
+      {
+         default_status(&states[i]);
+         states[i].timeout = timeout;
+         states[i].timeout_set = timeout_set;
+         states[i].frameNextMethod = method;
+         states[i].common_settings.verbose = verbose;
+         states[i].day_night_auto = day_night;
+         backend_state = &states[i];
+      }
+      else
+      {
+         synthetic_camera_set_defaults(&synthetic[i]);
+         backend_state = &synthetic[i];
+      }
+
+      if (pipeline_init(&pipelines[i], i, backend, backend_state, &storage, &scheduler) != 0)
+      {
+         fprintf(stderr, "Unable to create pipeline for camera %d\n", i);
+         exit_code = EX_SOFTWARE;
+         break;
+      }
+      pipelines[i].verbose = verbose;
+      pipelines[i].watchdog.deadline = deadline;
+      pipelines[i].analysis = method == FRAME_NEXT_EVENT || recording;
+      pipelines[i].recording = recording;
+      pipelines[i].detector = detecting ? &detector : NULL;
+      pipelines[i].push = pushing ? &push : NULL;
+
+      // Camera 0 rides on the head, it keeps looking for motion through a
+      // move by taking out what the head did
+      if (i == 0 && heading)
+      {
+         pipelines[i].motion.ego_motion = 1;
+         pipelines[i].head_position = head_position;
+         pipelines[i].head_userdata = &head;
+      }
+      if (streaming)
+      {
+         char name[16];
+
+         snprintf(name, sizeof(name), "cam%d", i);
+         pipelines[i].rtsp = &rtsp;
+         pipelines[i].stream = rtsp_server_add_stream(&rtsp, name, pipeline_request_keyframe, &pipelines[i]);
+      }
+
+      if (zones_path)
+      {
+         char *path = NULL;
+         int status = asprintf(&path, zones_path, i) < 0 ? -1 : motion_load_zones(&pipelines[i].motion, path);
+
+         free(path);
+         if (status != 0)
+         {
+            fprintf(stderr, "Unable to load motion zones for camera %d\n", i);
+            pipeline_destroy(&pipelines[i]);
+            exit_code = EX_SOFTWARE;
+            break;
+         }
+      }
+
+      // Same as zones, but a camera whose masks are bad must not record at all
+      if (masks_path)
+      {
+         char *path = NULL;
+         int status = asprintf(&path, masks_path, i) < 0 ? -1 : privacy_mask_load(&pipelines[i].privacy, path);
+
+         free(path);
+         if (status != 0)
+         {
+            fprintf(stderr, "Unable to load privacy masks for camera %d\n", i);
+            pipeline_destroy(&pipelines[i]);
+            exit_code = EX_SOFTWARE;
+            break;
+         }
+      }
+
+      if (pipeline_start(&pipelines[i]) != 0)
+      {
+         fprintf(stderr, "Unable to start pipeline for camera %d\n", i);
+         pipeline_destroy(&pipelines[i]);
+         exit_code = EX_SOFTWARE;
+         break;
+      }
+      started++;
+   }
+
+   // Clients can connect once every stream is there
+   if (streaming && rtsp_server_start(&rtsp) != 0)
+      fprintf(stderr, "Unable to start RTSP server, video will not be streamed\n");
+   else if (streaming && verbose)
+      fprintf(stderr, "Streaming %d cameras at rtsp://<host>:%d/camN\n", rtsp.num_streams, rtsp_port);
+
+   // Moves start once camera 0's pipeline is there to hear about them
+   if (heading && started && (servo_control_start(&head) != 0 || patrol_start(&patrol) != 0))
+      fprintf(stderr, "Pan/tilt head not started\n");
+   else if (heading && started && verbose)
+      fprintf(stderr, "Pan/tilt head on the %s bus, %d presets, %d tour stops\n", head.bus->name,
+              patrol.num_presets, patrol.num_stops);
+   if (heading && !started)
+   {
+      patrol_destroy(&patrol);
+      servo_control_destroy(&head);
+      heading = 0;
+   }
+
+   if (exit_code == EX_OK && scheduler_start(&scheduler) != 0)
+      exit_code = EX_SOFTWARE;
+
+   if (exit_code != EX_OK)
+      scheduler_stop(&scheduler);
+
+   // Teardown is the reverse of setup: pipelines (each drains and destroys
+   // its own components), then the signal thread, scheduler and storage
+   for (int i = 0; i < started; i++)
+   {
+      if (pipeline_join(&pipelines[i]) != 0)
+         exit_code = EX_SOFTWARE;
+
+      // The head tells camera 0 when it moves, so it stops before that pipeline goes
+      if (i == 0 && heading)
+      {
+         patrol_stop(&patrol);
+         servo_control_stop(&head);
+         if (verbose)
+            fprintf(stderr, "Pan/tilt head: %llu tour stops, %llu interrupted, %llu control overruns\n",
+                    (unsigned long long)patrol.visits, (unsigned long long)patrol.interruptions,
+                    (unsigned long long)head.overruns);
+         patrol_destroy(&patrol);
+         servo_control_destroy(&head);
+         heading = 0;
+      }
+
+      if (verbose)
+         fprintf(stderr, "Camera %d: %llu frames, %llu errors, %llu stalls, %llu recovered, %lld ms down\n", i,
+                 (unsigned long long)pipelines[i].frames_captured,
+                 (unsigned long long)pipelines[i].capture_errors,
+                 (unsigned long long)pipelines[i].watchdog.stalls,
+                 (unsigned long long)pipelines[i].watchdog.recoveries,
+                 (long long)pipelines[i].watchdog.downtime / 1000);
+      if (verbose && recording)
+         fprintf(stderr, "Camera %d: recorded %llu of %llu bytes in %llu segments, %llu events\n", i,
+                 (unsigned long long)pipelines[i].recorder.bytes_written,
+                 (unsigned long long)pipelines[i].recorder.bytes_in,
+                 (unsigned long long)pipelines[i].recorder.segments,
+                 (unsigned long long)pipelines[i].recorder.events);
+      if (verbose && day_night && backend == &mmal_backend)
+         fprintf(stderr, "Camera %d: %llu day/night switches, ended in %s\n", i,
+                 (unsigned long long)states[i].day_night.switches,
+                 day_night_profile(&states[i].day_night)->name);
+
+      pipeline_destroy(&pipelines[i]);
+   }
+
+   pthread_cancel(signal_thread_id);
+   pthread_join(signal_thread_id, NULL);
+
+   // Every encoder has stopped, nothing is handing the server packets
+   if (streaming)
+   {
+      if (verbose)
+         for (int i = 0; i < rtsp.num_streams; i++)
+            fprintf(stderr, "Stream %s: %llu packets, %llu sent, %llu dropped, %llu keyframes requested\n",
+                    rtsp.streams[i].name, (unsigned long long)rtsp.streams[i].packets,
+                    (unsigned long long)rtsp.streams[i].sends, (unsigned long long)rtsp.streams[i].dropped,
+                    (unsigned long long)rtsp.streams[i].keyframe_requests);
+      rtsp_server_destroy(&rtsp);
+   }
+
+   // Anything still queued is sent or goes to the outbox for next time
+   if (pushing)
+   {
+      event_push_stop(&push);
+      if (verbose)
+         fprintf(stderr, "Events: %llu pushed, %d batches waiting in the outbox, %llu dropped\n",
+                 (unsigned long long)push.sent, push.num_files, (unsigned long long)push.dropped);
+      event_push_destroy(&push);
+   }
+
+   if (model_path)
+   {
+      if (verbose)
+         fprintf(stderr, "Detector: %llu frames in %llu batches, %llu skipped\n",
+                 (unsigned long long)detector.processed, (unsigned long long)detector.batches,
+                 (unsigned long long)detector.skipped);
+      detector_destroy(&detector);
+   }
+
+   metrics_log_stop();
+   metrics_http_stop();
+
+   scheduler_destroy(&scheduler);
+
+   if (verbose)
+      fprintf(stderr, "Wrote %llu files, %llu bytes\n",
+              (unsigned long long)storage.files_written, (unsigned long long)storage.bytes_written);
+
+   if (verbose)
+      memory_budget_report(stderr);
+
+   storage_destroy(&storage);
+   memory_budget_destroy();
+   fprintf(stderr,"Done\n");
 
+   return exit_code;
 }
-     
\ No newline at end of file
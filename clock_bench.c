@@ -0,0 +1,355 @@
+/**
+ * Accuracy of the frame clock, sensor timestamps mapped to host time.
+ *
+ * First against a simulated camera, ten minutes of 30fps frames per
+ * scenario: a sensor clock drifting against the host's, reads of it
+ * bracketed by anything from tens of microseconds to a preempted 5 ms,
+ * frames arriving after a jittery delay with the odd long stall, and in
+ * one scenario the sensor clock starting over as it does when the camera
+ * is rebuilt. Every timestamped frame has to land within a millisecond of
+ * when it was really taken, and the drift has to come out within a few
+ * ppm. Frames without a timestamp are reported, they can only be as good
+ * as the delivery jitter.
+ *
+ * Then end to end through a synthetic pipeline with analysis and
+ * recording: every still and segment in the storage index has to be
+ * stamped inside the capture it came from, and its wall clock time has to
+ * agree with its CLOCK_MONOTONIC one.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "bench_util.h"
+#include "pipeline.h"
+#include "synthetic_camera.h"
+
+/// Frame period of the simulated camera, 30fps
+#define SIM_PERIOD      33333
+
+/// Delivery delay of every simulated frame, ISP and encoder, before jitter
+#define SIM_DELAY       20000
+
+/// Mean of the exponential jitter on top
+#define SIM_JITTER      2000
+
+/// One frame in this many is held up by SIM_STALL more
+#define SIM_STALL_EVERY 100
+#define SIM_STALL       30000
+
+/// One sensor clock read in this many is preempted for SIM_PREEMPT
+#define SIM_PREEMPT_EVERY 20
+#define SIM_PREEMPT     5000
+
+/// One frame in this many arrives without a timestamp
+#define SIM_UNKNOWN_EVERY 15
+
+/// Furthest a timestamped frame may land from when it was taken (us)
+#define MAX_ERROR       1000
+
+/// Furthest the drift estimate may end up from the truth (ppm)
+#define MAX_DRIFT_ERROR 5
+
+/// Furthest an untimestamped frame may land, it only has the delivery delay to go on (us)
+#define MAX_UNKNOWN_ERROR 50000
+
+typedef struct
+{
+   const char *name;
+   int drift;                       /// ppm the sensor clock runs fast
+   int restart;                     /// Seconds in the sensor clock starts over, 0 never
+} SCENARIO;
+
+static const SCENARIO scenarios[] =
+{
+   { "no drift", 0, 0 },
+   { "40 ppm fast", 40, 0 },
+   { "150 ppm slow", -150, 0 },
+   { "200 ppm fast, restart", 200, 300 },
+};
+
+#define NUM_SCENARIOS ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+/// Uniform in [0, 1)
+static double uniform(uint32_t *seed)
+{
+   return (bench_random(seed) & 0xffffff) / (double)0x1000000;
+}
+
+/**
+ * Sensor clock of the simulated camera at a host time
+ */
+static int64_t sim_sensor(const SCENARIO *scenario, int64_t started, int64_t host)
+{
+   int64_t elapsed = host - started;
+
+   return elapsed + (int64_t)llrint(elapsed * (scenario->drift / 1e6));
+}
+
+/**
+ * Run one scenario through a frame clock as pipeline_frame_time would
+ *
+ * @return 1 if it failed
+ */
+static int simulate(const SCENARIO *scenario, int seconds, uint32_t seed)
+{
+   FRAME_CLOCK clock;
+   int64_t host_start = 1000000000000LL, started = host_start;
+   int64_t worst = 0, worst_unknown = 0;
+   double total = 0, drift_error;
+   long frames = (long)seconds * 1000000 / SIM_PERIOD, timed = 0;
+   int restarted = 0, failed = 0;
+
+   frame_clock_init(&clock);
+
+   for (long f = 0; f < frames; f++)
+   {
+      int64_t taken = host_start + f * SIM_PERIOD, arrival, pts, mapped, error;
+
+      // The camera rebuilt, its clock starts over and so does the mapping
+      if (scenario->restart && !restarted && taken - host_start >= (int64_t)scenario->restart * 1000000)
+      {
+         started = taken - SIM_PERIOD / 2;
+         frame_clock_reset(&clock);
+         restarted = 1;
+      }
+
+      arrival = taken + SIM_DELAY + (int64_t)(-SIM_JITTER * log(1 - uniform(&seed)));
+      if (bench_random(&seed) % SIM_STALL_EVERY == 0)
+         arrival += SIM_STALL;
+
+      if (frame_clock_sync_due(&clock, arrival))
+      {
+         int64_t bracket = 20 + bench_random(&seed) % 400;
+
+         if (bench_random(&seed) % SIM_PREEMPT_EVERY == 0)
+            bracket += SIM_PREEMPT;
+         frame_clock_sync(&clock, sim_sensor(scenario, started, arrival + (int64_t)(uniform(&seed) * bracket)),
+                          arrival, arrival + bracket);
+      }
+
+      pts = f % SIM_UNKNOWN_EVERY == SIM_UNKNOWN_EVERY - 1 ? FRAME_TIME_UNKNOWN : sim_sensor(scenario, started, taken);
+      mapped = frame_clock_map(&clock, pts, arrival);
+      error = llabs(mapped - taken);
+
+      if (pts == FRAME_TIME_UNKNOWN)
+      {
+         if (error > worst_unknown)
+            worst_unknown = error;
+         continue;
+      }
+      if (error > worst)
+         worst = error;
+      total += error;
+      timed++;
+   }
+
+   drift_error = fabs(frame_clock_drift(&clock) - scenario->drift);
+   printf("%-24s %8.1f %8lld %10lld %10.1f %10.2f %6llu\n", scenario->name, total / timed, (long long)worst,
+          (long long)worst_unknown, frame_clock_drift(&clock), drift_error, (unsigned long long)clock.syncs);
+
+   if (worst > MAX_ERROR)
+   {
+      printf("  frames mapped more than %d us out\n", MAX_ERROR);
+      failed = 1;
+   }
+   if (drift_error > MAX_DRIFT_ERROR)
+   {
+      printf("  drift more than %d ppm out\n", MAX_DRIFT_ERROR);
+      failed = 1;
+   }
+   if (worst_unknown > MAX_UNKNOWN_ERROR)
+   {
+      printf("  untimestamped frames more than %d us out\n", MAX_UNKNOWN_ERROR);
+      failed = 1;
+   }
+
+   frame_clock_destroy(&clock);
+   return failed;
+}
+
+/**
+ * Capture through a synthetic pipeline and check the index it leaves
+ *
+ * @return 1 if it failed
+ */
+static int end_to_end(const char *directory, int frames, int interval)
+{
+   static const char index_name[] = "clock_bench_index.tsv";
+   STORAGE_MANAGER storage;
+   CAPTURE_SCHEDULER scheduler;
+   CAMERA_PIPELINE pipeline;
+   SYNTHETIC_CAMERA camera;
+   int64_t *start = calloc(frames, sizeof(int64_t)), *end = calloc(frames, sizeof(int64_t));
+   int64_t run_start, run_end, worst_wall = 0;
+   char path[STORAGE_NAME_MAX], line[STORAGE_NAME_MAX + 80];
+   int stills = 0, segments = 0, outside = 0, failed = 0;
+   FILE *index;
+
+   snprintf(path, sizeof(path), "%s/%s", directory, index_name);
+   remove(path);
+
+   if (!start || !end || storage_init(&storage, directory, "clock%d_%04d") != 0 ||
+       scheduler_init(&scheduler, FRAME_NEXT_IMMEDIATELY, 0, 0) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   if (storage_open_index(&storage, index_name) != 0)
+      return 1;
+
+   synthetic_camera_set_defaults(&camera);
+   camera.width = 320;
+   camera.height = 240;
+   camera.encode_time = 2000;
+   camera.analysis_interval = 33333;
+   // Recording starts with the pipeline, its first segment can open before the first still
+   run_start = bench_now();
+   if (pipeline_init(&pipeline, 0, &synthetic_backend, &camera, &storage, &scheduler) != 0 ||
+       (pipeline.analysis = pipeline.recording = 1, pipeline_setup(&pipeline)) != 0)
+   {
+      fprintf(stderr, "Unable to create pipeline\n");
+      return 1;
+   }
+
+   for (int f = 0; f < frames; f++)
+   {
+      usleep(interval * 1000);
+      start[f] = bench_now();
+      if (pipeline_capture_frame(&pipeline) != 0)
+         failed = 1;
+      end[f] = bench_now();
+   }
+   pipeline_teardown(&pipeline);
+   run_end = bench_now();
+
+   printf("\n%d stills and the recording from a synthetic camera %d ppm fast\n", frames, camera.clock_drift);
+   printf("clock        %llu reference points, last read to within %lld us, %.0f frames timed\n",
+          (unsigned long long)pipeline.clock.syncs, (long long)frame_clock_error(&pipeline.clock),
+          metrics_read(pipeline.frame_delay_metric));
+
+   pipeline_destroy(&pipeline);
+   scheduler_destroy(&scheduler);
+   storage_destroy(&storage);
+
+   index = fopen(path, "r");
+   while (index && fgets(line, sizeof(line), index))
+   {
+      char name[STORAGE_NAME_MAX], file[2 * STORAGE_NAME_MAX];
+      int cam, frame;
+      long long seconds, micros, monotonic;
+      int64_t wall;
+
+      if (line[0] == '#')
+         continue;
+      if (sscanf(line, "%255s %d %d %lld.%lld %lld", name, &cam, &frame, &seconds, &micros, &monotonic) != 6)
+      {
+         printf("unreadable index line: %s", line);
+         failed = 1;
+         continue;
+      }
+
+      // Wall clock and monotonic stamps are the same instant
+      wall = llabs(seconds * 1000000 + micros - frame_clock_realtime(monotonic));
+      if (wall > worst_wall)
+         worst_wall = wall;
+
+      if (strstr(name, synthetic_backend.record_extension))
+      {
+         segments++;
+         if (monotonic < run_start || monotonic > run_end)
+         {
+            printf("%s stamped %lld us into a run of %lld us\n", name,
+                   (long long)(monotonic - run_start), (long long)(run_end - run_start));
+            outside++;
+         }
+      }
+      else
+      {
+         stills++;
+         if (frame < 0 || frame >= frames || monotonic < start[frame] - MAX_ERROR || monotonic > end[frame])
+         {
+            printf("%s stamped %lld us into a capture of %lld us\n", name,
+                   frame < 0 || frame >= frames ? 0 : (long long)(monotonic - start[frame]),
+                   frame < 0 || frame >= frames ? 0 : (long long)(end[frame] - start[frame]));
+            outside++;
+         }
+      }
+
+      snprintf(file, sizeof(file), "%s/%s", directory, name);
+      remove(file);
+   }
+   if (index)
+      fclose(index);
+   remove(path);
+
+   printf("index        %d stills, %d segments, %d stamped outside their capture, wall clock within %lld us\n",
+          stills, segments, outside, (long long)worst_wall);
+
+   if (stills != frames || segments < 1)
+   {
+      printf("index missing files\n");
+      failed = 1;
+   }
+   if (outside)
+   {
+      printf("files stamped outside their capture\n");
+      failed = 1;
+   }
+   if (worst_wall > MAX_ERROR)
+   {
+      printf("wall clock stamps disagree with monotonic ones\n");
+      failed = 1;
+   }
+
+   free(start);
+   free(end);
+   return failed;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-t seconds] [-f frames] [-i interval_ms] [-o directory]\n", app);
+   fprintf(stderr, "  -t  simulated time per scenario (default 600)\n");
+   fprintf(stderr, "  -f  stills captured end to end (default 20)\n");
+   fprintf(stderr, "  -o  where they go, removed at the end (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+   int seconds = 600, frames = 20, interval = 50, opt, failed = 0;
+   const char *directory = "/tmp";
+
+   while ((opt = getopt(argc, argv, "t:f:i:o:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 't' : seconds = atoi(optarg); break;
+         case 'f' : frames = atoi(optarg); break;
+         case 'i' : interval = atoi(optarg); break;
+         case 'o' : directory = optarg; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (seconds < 60 || frames < 1 || interval < 0)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   printf("%-24s %8s %8s %10s %10s %10s %6s\n", "scenario", "mean_us", "max_us", "unknown_us", "drift_ppm",
+          "drift_err", "syncs");
+   for (int i = 0; i < NUM_SCENARIOS; i++)
+      failed |= simulate(&scenarios[i], seconds, 7 + i);
+
+   failed |= end_to_end(directory, frames, interval);
+
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
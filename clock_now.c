@@ -0,0 +1,14 @@
+#include <time.h>
+
+#include "clock_now.h"
+
+/**
+ * @return CLOCK_MONOTONIC (us), for timing and deadlines that mustn't jump with the wall clock
+ */
+int64_t clock_now_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,8 @@
+#ifndef CLOCK_NOW_H_
+#define CLOCK_NOW_H_
+
+#include <stdint.h>
+
+int64_t clock_now_us(void);
+
+#endif /* CLOCK_NOW_H_ */
@@ -0,0 +1,620 @@
+/**
+ * Small int8 CNN inference engine for running a detector on the CPU.
+ *
+ * Only what a tiny single channel detector needs: 3x3/1x1 convolutions with
+ * per channel requantisation and fused ReLU, and 2x2 max pooling. Each
+ * convolution gathers the input patch for one output pixel and dots it with
+ * every filter, the dot product is the only hot loop and has NEON and SSE2
+ * versions. A batch is run layer by layer so a layer's weights stay in
+ * cache while every frame in the batch goes through it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cnn.h"
+
+#define CNN_MAGIC   "SCNN"
+#define CNN_VERSION 1
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/**
+ * Dot product of two int8 rows, length is a multiple of CNN_ROW_ALIGN
+ */
+#if defined(__ARM_NEON)
+static int32_t dot_s8(const int8_t *a, const int8_t *b, int length)
+{
+   int32x4_t acc = vdupq_n_s32(0);
+
+   for (int i = 0; i < length; i += 16)
+   {
+      int8x16_t va = vld1q_s8(a + i);
+      int8x16_t vb = vld1q_s8(b + i);
+
+      // Weights are never -128 so two products always fit an int16 lane
+      int16x8_t products = vmull_s8(vget_low_s8(va), vget_low_s8(vb));
+      products = vmlal_s8(products, vget_high_s8(va), vget_high_s8(vb));
+      acc = vpadalq_s16(acc, products);
+   }
+
+#if defined(__aarch64__)
+   return vaddvq_s32(acc);
+#else
+   int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+   sum = vpadd_s32(sum, sum);
+   return vget_lane_s32(sum, 0);
+#endif
+}
+
+const char *cnn_kernel_name(void)
+{
+   return "neon";
+}
+#elif defined(__SSE2__)
+static int32_t dot_s8(const int8_t *a, const int8_t *b, int length)
+{
+   __m128i acc = _mm_setzero_si128();
+
+   for (int i = 0; i < length; i += 16)
+   {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+      // Sign extend to int16 by unpacking into the high byte and shifting back down
+      __m128i a_lo = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8);
+      __m128i a_hi = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+      __m128i b_lo = _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8);
+      __m128i b_hi = _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8);
+
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(a_lo, b_lo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(a_hi, b_hi));
+   }
+
+   acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+   acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+   return _mm_cvtsi128_si32(acc);
+}
+
+const char *cnn_kernel_name(void)
+{
+   return "sse2";
+}
+#else
+static int32_t dot_s8(const int8_t *a, const int8_t *b, int length)
+{
+   int32_t acc = 0;
+
+   for (int i = 0; i < length; i++)
+      acc += (int32_t)a[i] * b[i];
+   return acc;
+}
+
+const char *cnn_kernel_name(void)
+{
+   return "scalar";
+}
+#endif
+
+/**
+ * Start an empty model, layers are then added with cnn_model_add_conv and
+ * cnn_model_add_maxpool in order from the input
+ *
+ * @return 0 on success, -1 if the dimensions are unusable
+ */
+int cnn_model_create(CNN_MODEL *model, int input_width, int input_height, int num_classes)
+{
+   memset(model, 0, sizeof(*model));
+
+   if (input_width <= 0 || input_height <= 0 || num_classes <= 0 || num_classes > CNN_MAX_CLASSES)
+      return -1;
+
+   model->input_width = input_width;
+   model->input_height = input_height;
+   model->num_classes = num_classes;
+   model->output_scale = 1.0f;
+   model->max_activation = (size_t)input_width * input_height;
+
+   for (int i = 0; i < num_classes; i++)
+      snprintf(model->class_names[i], CNN_CLASS_NAME_LEN, "class%c", '0' + i);
+   return 0;
+}
+
+/**
+ * Shape a new layer from the output of the one before it
+ */
+static CNN_LAYER *add_layer(CNN_MODEL *model, int type)
+{
+   CNN_LAYER *layer;
+
+   if (model->num_layers >= CNN_MAX_LAYERS)
+      return NULL;
+
+   layer = &model->layers[model->num_layers];
+   memset(layer, 0, sizeof(*layer));
+   layer->type = type;
+
+   if (model->num_layers)
+   {
+      const CNN_LAYER *prev = &model->layers[model->num_layers - 1];
+
+      layer->in_width = prev->out_width;
+      layer->in_height = prev->out_height;
+      layer->in_channels = prev->out_channels;
+   }
+   else
+   {
+      layer->in_width = model->input_width;
+      layer->in_height = model->input_height;
+      layer->in_channels = 1;
+   }
+   return layer;
+}
+
+static void account_layer(CNN_MODEL *model, const CNN_LAYER *layer)
+{
+   size_t activation = (size_t)layer->out_width * layer->out_height * layer->out_channels;
+
+   if (activation > model->max_activation)
+      model->max_activation = activation;
+   if ((size_t)layer->row_stride > model->patch_size)
+      model->patch_size = layer->row_stride;
+   model->num_layers++;
+}
+
+/**
+ * Add a convolution, weights are zeroed and scales set to 1 for the caller to fill in
+ *
+ * @return The new layer, NULL if it doesn't fit
+ */
+CNN_LAYER *cnn_model_add_conv(CNN_MODEL *model, int out_channels, int kernel, int stride, int relu)
+{
+   CNN_LAYER *layer = add_layer(model, CNN_LAYER_CONV);
+
+   if (!layer || out_channels <= 0 || kernel <= 0 || (kernel & 1) == 0 || stride <= 0)
+      return NULL;
+
+   layer->kernel = kernel;
+   layer->stride = stride;
+   layer->relu = relu;
+   layer->out_channels = out_channels;
+   layer->out_width = (layer->in_width - 1) / stride + 1;
+   layer->out_height = (layer->in_height - 1) / stride + 1;
+   layer->row_length = kernel * kernel * layer->in_channels;
+   layer->row_stride = ALIGN_UP(layer->row_length, CNN_ROW_ALIGN);
+
+   layer->weights = calloc((size_t)out_channels, layer->row_stride);
+   layer->bias = calloc((size_t)out_channels, sizeof(*layer->bias));
+   layer->scale = malloc((size_t)out_channels * sizeof(*layer->scale));
+
+   if (!layer->weights || !layer->bias || !layer->scale)
+   {
+      free(layer->weights);
+      free(layer->bias);
+      free(layer->scale);
+      return NULL;
+   }
+
+   for (int i = 0; i < out_channels; i++)
+      layer->scale[i] = 1.0f;
+
+   account_layer(model, layer);
+   return layer;
+}
+
+/**
+ * Add a 2x2 max pool
+ *
+ * @return 0 on success, -1 if it doesn't fit
+ */
+int cnn_model_add_maxpool(CNN_MODEL *model)
+{
+   CNN_LAYER *layer = add_layer(model, CNN_LAYER_MAXPOOL);
+
+   if (!layer || layer->in_width < 2 || layer->in_height < 2)
+      return -1;
+
+   layer->kernel = 2;
+   layer->stride = 2;
+   layer->out_channels = layer->in_channels;
+   layer->out_width = layer->in_width / 2;
+   layer->out_height = layer->in_height / 2;
+
+   account_layer(model, layer);
+   return 0;
+}
+
+void cnn_model_destroy(CNN_MODEL *model)
+{
+   for (int i = 0; i < model->num_layers; i++)
+   {
+      free(model->layers[i].weights);
+      free(model->layers[i].bias);
+      free(model->layers[i].scale);
+   }
+   memset(model, 0, sizeof(*model));
+}
+
+/*
+ * Model file, all values little endian like every target we build for:
+ *   "SCNN" u32 version
+ *   u16 input_width u16 input_height u16 num_classes u16 num_layers f32 output_scale
+ *   char class_names[num_classes][16]
+ *   per layer: u8 type u8 kernel u8 stride u8 relu u16 out_channels
+ *     conv only: i8 weights[out_channels][kernel * kernel * in_channels]
+ *                i32 bias[out_channels] f32 scale[out_channels]
+ */
+typedef struct
+{
+   uint16_t input_width;
+   uint16_t input_height;
+   uint16_t num_classes;
+   uint16_t num_layers;
+   float output_scale;
+} CNN_FILE_HEADER;
+
+typedef struct
+{
+   uint8_t type;
+   uint8_t kernel;
+   uint8_t stride;
+   uint8_t relu;
+   uint16_t out_channels;
+} CNN_FILE_LAYER;
+
+/**
+ * Load a model written by cnn_model_save (or the training export)
+ *
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int cnn_model_load(CNN_MODEL *model, const char *path)
+{
+   FILE *file = fopen(path, "rb");
+   CNN_FILE_HEADER header;
+   char magic[4];
+   uint32_t version;
+
+   memset(model, 0, sizeof(*model));
+
+   if (!file)
+      return -1;
+
+   if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, CNN_MAGIC, sizeof(magic)) != 0 ||
+       fread(&version, sizeof(version), 1, file) != 1 || version != CNN_VERSION ||
+       fread(&header, sizeof(header), 1, file) != 1 ||
+       cnn_model_create(model, header.input_width, header.input_height, header.num_classes) != 0)
+      goto error;
+
+   model->output_scale = header.output_scale;
+
+   for (int i = 0; i < model->num_classes; i++)
+   {
+      if (fread(model->class_names[i], CNN_CLASS_NAME_LEN, 1, file) != 1)
+         goto error;
+      model->class_names[i][CNN_CLASS_NAME_LEN - 1] = '\0';
+   }
+
+   for (int i = 0; i < header.num_layers; i++)
+   {
+      CNN_FILE_LAYER file_layer;
+      CNN_LAYER *layer;
+
+      if (fread(&file_layer, sizeof(file_layer), 1, file) != 1)
+         goto error;
+
+      if (file_layer.type == CNN_LAYER_MAXPOOL)
+      {
+         if (cnn_model_add_maxpool(model) != 0)
+            goto error;
+         continue;
+      }
+
+      if (file_layer.type != CNN_LAYER_CONV)
+         goto error;
+
+      layer = cnn_model_add_conv(model, file_layer.out_channels, file_layer.kernel,
+                                 file_layer.stride, file_layer.relu);
+      if (!layer)
+         goto error;
+
+      for (int c = 0; c < layer->out_channels; c++)
+      {
+         int8_t *row = layer->weights + (size_t)c * layer->row_stride;
+
+         if (fread(row, layer->row_length, 1, file) != 1)
+            goto error;
+
+         // Keep the weights symmetric, the kernels rely on it
+         for (int k = 0; k < layer->row_length; k++)
+            if (row[k] == -128)
+               row[k] = -127;
+      }
+
+      if (fread(layer->bias, sizeof(*layer->bias), layer->out_channels, file) != (size_t)layer->out_channels ||
+          fread(layer->scale, sizeof(*layer->scale), layer->out_channels, file) != (size_t)layer->out_channels)
+         goto error;
+   }
+
+   // Has to end in one logit per class for the grid
+   if (!model->num_layers || model->layers[model->num_layers - 1].type != CNN_LAYER_CONV ||
+       model->layers[model->num_layers - 1].out_channels != model->num_classes)
+      goto error;
+
+   fclose(file);
+   return 0;
+
+error:
+   fprintf(stderr, "%s: not a usable model\n", path);
+   fclose(file);
+   cnn_model_destroy(model);
+   return -1;
+}
+
+/**
+ * Write a model in the format cnn_model_load reads
+ *
+ * @return 0 on success, -1 on failure
+ */
+int cnn_model_save(const CNN_MODEL *model, const char *path)
+{
+   FILE *file = fopen(path, "wb");
+   CNN_FILE_HEADER header;
+   uint32_t version = CNN_VERSION;
+   int status = 0;
+
+   if (!file)
+      return -1;
+
+   memset(&header, 0, sizeof(header));
+   header.input_width = (uint16_t)model->input_width;
+   header.input_height = (uint16_t)model->input_height;
+   header.num_classes = (uint16_t)model->num_classes;
+   header.num_layers = (uint16_t)model->num_layers;
+   header.output_scale = model->output_scale;
+
+   if (fwrite(CNN_MAGIC, 4, 1, file) != 1 || fwrite(&version, sizeof(version), 1, file) != 1 ||
+       fwrite(&header, sizeof(header), 1, file) != 1 ||
+       fwrite(model->class_names, CNN_CLASS_NAME_LEN, model->num_classes, file) != (size_t)model->num_classes)
+      status = -1;
+
+   for (int i = 0; i < model->num_layers && status == 0; i++)
+   {
+      const CNN_LAYER *layer = &model->layers[i];
+      CNN_FILE_LAYER file_layer = { (uint8_t)layer->type, (uint8_t)layer->kernel, (uint8_t)layer->stride,
+                                    (uint8_t)layer->relu, (uint16_t)layer->out_channels };
+
+      if (fwrite(&file_layer, sizeof(file_layer), 1, file) != 1)
+         status = -1;
+
+      if (layer->type != CNN_LAYER_CONV)
+         continue;
+
+      for (int c = 0; c < layer->out_channels && status == 0; c++)
+         if (fwrite(layer->weights + (size_t)c * layer->row_stride, layer->row_length, 1, file) != 1)
+            status = -1;
+
+      if (status == 0 &&
+          (fwrite(layer->bias, sizeof(*layer->bias), layer->out_channels, file) != (size_t)layer->out_channels ||
+           fwrite(layer->scale, sizeof(*layer->scale), layer->out_channels, file) != (size_t)layer->out_channels))
+         status = -1;
+   }
+
+   if (fclose(file) != 0)
+      status = -1;
+   return status;
+}
+
+/**
+ * Allocate the working memory to run up to batch frames at once
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int cnn_scratch_init(CNN_SCRATCH *scratch, const CNN_MODEL *model, int batch)
+{
+   memset(scratch, 0, sizeof(*scratch));
+   scratch->batch = batch;
+   scratch->activations[0] = malloc((size_t)batch * model->max_activation);
+   scratch->activations[1] = malloc((size_t)batch * model->max_activation);
+   scratch->patch = calloc(1, model->patch_size ? model->patch_size : CNN_ROW_ALIGN);
+
+   if (!scratch->activations[0] || !scratch->activations[1] || !scratch->patch)
+   {
+      cnn_scratch_destroy(scratch);
+      return -1;
+   }
+   return 0;
+}
+
+void cnn_scratch_destroy(CNN_SCRATCH *scratch)
+{
+   free(scratch->activations[0]);
+   free(scratch->activations[1]);
+   free(scratch->patch);
+   memset(scratch, 0, sizeof(*scratch));
+}
+
+/**
+ * Scale a luma plane to the model input, nearest neighbour, and centre it on 0
+ *
+ * @param input Receives input_width * input_height values
+ */
+void cnn_prepare_input(const CNN_MODEL *model, const uint8_t *luma, int width, int height, int stride,
+                       int8_t *input)
+{
+   uint32_t step_x = ((uint32_t)width << 16) / model->input_width;
+   uint32_t step_y = ((uint32_t)height << 16) / model->input_height;
+   uint32_t src_y = step_y / 2;
+
+   for (int y = 0; y < model->input_height; y++, src_y += step_y)
+   {
+      const uint8_t *row = luma + (size_t)(src_y >> 16) * stride;
+      uint32_t src_x = step_x / 2;
+
+      for (int x = 0; x < model->input_width; x++, src_x += step_x)
+         *input++ = (int8_t)(row[src_x >> 16] - 128);
+   }
+}
+
+static inline int8_t requantise(int32_t acc, float scale, int relu)
+{
+   float value = acc * scale;
+   int out = (int)(value >= 0 ? value + 0.5f : value - 0.5f);
+
+   if (out > 127)
+      out = 127;
+   if (out < (relu ? 0 : -128))
+      out = relu ? 0 : -128;
+   return (int8_t)out;
+}
+
+static void conv_layer(const CNN_LAYER *layer, const int8_t *in, int8_t *out, int8_t *patch)
+{
+   int pad = layer->kernel / 2;
+   size_t span = (size_t)layer->kernel * layer->in_channels;
+
+   // The tail past row_length is never written, so it stays zero and adds nothing
+   memset(patch, 0, layer->row_stride);
+
+   for (int oy = 0; oy < layer->out_height; oy++)
+   {
+      for (int ox = 0; ox < layer->out_width; ox++)
+      {
+         int x0 = ox * layer->stride - pad;
+         int y0 = oy * layer->stride - pad;
+         int8_t *p = patch;
+
+         for (int ky = 0; ky < layer->kernel; ky++, p += span)
+         {
+            int iy = y0 + ky;
+            const int8_t *row = in + (size_t)iy * layer->in_width * layer->in_channels;
+
+            if (iy < 0 || iy >= layer->in_height)
+               memset(p, 0, span);
+            else if (x0 >= 0 && x0 + layer->kernel <= layer->in_width)
+               memcpy(p, row + (size_t)x0 * layer->in_channels, span);
+            else
+            {
+               for (int kx = 0; kx < layer->kernel; kx++)
+               {
+                  int ix = x0 + kx;
+
+                  if (ix < 0 || ix >= layer->in_width)
+                     memset(p + kx * layer->in_channels, 0, layer->in_channels);
+                  else
+                     memcpy(p + kx * layer->in_channels, row + (size_t)ix * layer->in_channels,
+                            layer->in_channels);
+               }
+            }
+         }
+
+         for (int c = 0; c < layer->out_channels; c++)
+         {
+            int32_t acc = dot_s8(patch, layer->weights + (size_t)c * layer->row_stride, layer->row_stride);
+
+            *out++ = requantise(acc + layer->bias[c], layer->scale[c], layer->relu);
+         }
+      }
+   }
+}
+
+static void maxpool_layer(const CNN_LAYER *layer, const int8_t *in, int8_t *out)
+{
+   int channels = layer->in_channels;
+   size_t row = (size_t)layer->in_width * channels;
+
+   for (int oy = 0; oy < layer->out_height; oy++)
+   {
+      const int8_t *top = in + (size_t)oy * 2 * row;
+      const int8_t *bottom = top + row;
+
+      for (int ox = 0; ox < layer->out_width; ox++, top += 2 * channels, bottom += 2 * channels)
+      {
+         for (int c = 0; c < channels; c++)
+         {
+            int8_t a = top[c] > top[c + channels] ? top[c] : top[c + channels];
+            int8_t b = bottom[c] > bottom[c + channels] ? bottom[c] : bottom[c + channels];
+
+            *out++ = a > b ? a : b;
+         }
+      }
+   }
+}
+
+/**
+ * Run a batch of prepared inputs through the model
+ *
+ * @param inputs count inputs from cnn_prepare_input
+ * @param count Frames in the batch, no more than the scratch was sized for
+ * @return Output grid of the first frame, frame i's is max_activation bytes further on
+ */
+const int8_t *cnn_run_batch(const CNN_MODEL *model, CNN_SCRATCH *scratch, const int8_t *const *inputs, int count)
+{
+   size_t size = model->max_activation;
+
+   if (count > scratch->batch)
+      count = scratch->batch;
+
+   for (int l = 0; l < model->num_layers; l++)
+   {
+      const CNN_LAYER *layer = &model->layers[l];
+      const int8_t *in_base = scratch->activations[(l + 1) & 1];
+      int8_t *out_base = scratch->activations[l & 1];
+
+      for (int i = 0; i < count; i++)
+      {
+         const int8_t *in = l ? in_base + i * size : inputs[i];
+
+         if (layer->type == CNN_LAYER_CONV)
+            conv_layer(layer, in, out_base + i * size, scratch->patch);
+         else
+            maxpool_layer(layer, in, out_base + i * size);
+      }
+   }
+
+   return scratch->activations[(model->num_layers - 1) & 1];
+}
+
+/**
+ * Turn an output grid into detections, one per cell and class over the threshold
+ *
+ * @param threshold Minimum score, 0..1
+ * @return Number of detections filled in
+ */
+int cnn_decode(const CNN_MODEL *model, const int8_t *output, float threshold,
+               CNN_DETECTION *detections, int max_detections)
+{
+   const CNN_LAYER *last = &model->layers[model->num_layers - 1];
+   int cell_width = model->input_width / last->out_width;
+   int cell_height = model->input_height / last->out_height;
+   int count = 0;
+
+   for (int y = 0; y < last->out_height; y++)
+   {
+      for (int x = 0; x < last->out_width; x++)
+      {
+         for (int c = 0; c < model->num_classes; c++)
+         {
+            float score = 1.0f / (1.0f + expf(-*output++ * model->output_scale));
+
+            if (score < threshold || count >= max_detections)
+               continue;
+
+            detections[count].class_id = c;
+            detections[count].score = score;
+            detections[count].x = x * cell_width;
+            detections[count].y = y * cell_height;
+            detections[count].width = cell_width;
+            detections[count].height = cell_height;
+            count++;
+         }
+      }
+   }
+   return count;
+}
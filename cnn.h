@@ -0,0 +1,92 @@
+#ifndef CNN_H_
+#define CNN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CNN_MAX_LAYERS     16
+#define CNN_MAX_CLASSES    8
+#define CNN_CLASS_NAME_LEN 16
+
+/// Rows of weights and input patches are padded to this so the kernels never need a tail
+#define CNN_ROW_ALIGN      16
+
+enum
+{
+   CNN_LAYER_CONV,                  /// kernel x kernel convolution, "same" padding
+   CNN_LAYER_MAXPOOL                /// 2x2 max pool, stride 2
+};
+
+/** One layer of a quantised network.
+ *  Activations are int8 HWC with a zero point of 0, weights are symmetric
+ *  int8 in [-127, 127] so a pair of products always fits an int16.
+ */
+typedef struct
+{
+   int type;                        /// CNN_LAYER_ value
+   int kernel;                      /// Kernel width and height
+   int stride;
+   int relu;                        /// Clamp outputs at 0
+   int in_width, in_height, in_channels;
+   int out_width, out_height, out_channels;
+   int row_length;                  /// kernel * kernel * in_channels
+   int row_stride;                  /// row_length padded to CNN_ROW_ALIGN
+   int8_t *weights;                 /// [out_channels][row_stride]
+   int32_t *bias;                   /// [out_channels], in accumulator units
+   float *scale;                    /// [out_channels], accumulator to output requantisation
+} CNN_LAYER;
+
+/** A small detection network.
+ *  The input is the luma of a frame scaled to input_width x input_height,
+ *  the last layer is a grid with one logit per class per cell.
+ */
+typedef struct
+{
+   int input_width;
+   int input_height;
+   int num_classes;
+   float output_scale;              /// Last layer's int8 output to logits
+   char class_names[CNN_MAX_CLASSES][CNN_CLASS_NAME_LEN];
+   int num_layers;
+   CNN_LAYER layers[CNN_MAX_LAYERS];
+   size_t max_activation;           /// Largest activation of any layer in bytes
+   size_t patch_size;               /// Largest padded input patch in bytes
+} CNN_MODEL;
+
+/** One cell of the output grid that scored over the threshold,
+ *  box is in model input pixels.
+ */
+typedef struct
+{
+   int class_id;
+   float score;                     /// 0..1
+   int x, y, width, height;
+} CNN_DETECTION;
+
+/** Working memory for running a batch, one per thread
+ */
+typedef struct
+{
+   int batch;                       /// Frames the buffers are sized for
+   int8_t *activations[2];          /// Ping pong buffers, batch * max_activation each
+   int8_t *patch;                   /// Current input patch
+} CNN_SCRATCH;
+
+int cnn_model_create(CNN_MODEL *model, int input_width, int input_height, int num_classes);
+CNN_LAYER *cnn_model_add_conv(CNN_MODEL *model, int out_channels, int kernel, int stride, int relu);
+int cnn_model_add_maxpool(CNN_MODEL *model);
+int cnn_model_load(CNN_MODEL *model, const char *path);
+int cnn_model_save(const CNN_MODEL *model, const char *path);
+void cnn_model_destroy(CNN_MODEL *model);
+
+int cnn_scratch_init(CNN_SCRATCH *scratch, const CNN_MODEL *model, int batch);
+void cnn_scratch_destroy(CNN_SCRATCH *scratch);
+
+void cnn_prepare_input(const CNN_MODEL *model, const uint8_t *luma, int width, int height, int stride,
+                       int8_t *input);
+const int8_t *cnn_run_batch(const CNN_MODEL *model, CNN_SCRATCH *scratch, const int8_t *const *inputs, int count);
+int cnn_decode(const CNN_MODEL *model, const int8_t *output, float threshold,
+               CNN_DETECTION *detections, int max_detections);
+const char *cnn_kernel_name(void);
+
+#endif /* CNN_H_ */
@@ -0,0 +1,240 @@
+/**
+ * Stick to servo latency and loop jitter of the manual control loop.
+ *
+ * Runs the control loop on the mock bus, with transfers taking as long as
+ * they do on the Pi's SPI and I2C. The stick is stepped between centre
+ * and full deflection at random points in the loop's cycle, and the time
+ * from each step to the command that reaches the servo controller with
+ * half, then nine tenths, of the new speed is measured. A centred stick
+ * with noise and glitched samples comes first, it must not move the head.
+ *
+ * -l adds threads burning CPU alongside, to see what SCHED_FIFO buys when
+ * the Pi is busy encoding.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bench_util.h"
+#include "servo_control.h"
+
+#define MAX_STEPS  10000
+#define MAX_LOAD   16
+
+/// Stick to servo latency target
+#define TARGET_LATENCY 20000
+
+/// ThreadSanitizer slows every lock and atomic far past the target
+#if defined(__SANITIZE_THREAD__)
+#define LATENCY_CHECKED 0
+#else
+#define LATENCY_CHECKED 1
+#endif
+
+/** Watches the commands for the response to each step
+ */
+typedef struct
+{
+   pthread_mutex_t lock;
+   int level;                       /// Stick step under way: -1, 0 or 1
+   int previous;                    /// Level before the step
+   int64_t step_time;               /// When the stick moved (us)
+   int half_seen, most_seen;        /// Response reached 50% / 90% of the step
+   int full_speed;                  /// Command at full stick, tenths of a degree per second
+   int64_t half[MAX_STEPS];         /// Step to 50% (us)
+   int64_t most[MAX_STEPS];         /// Step to 90% (us)
+   int num_half, num_most;
+   uint64_t commands;
+   uint64_t moved;                  /// Commands that weren't zero during the still phase
+   int still;                       /// Still phase
+} RESPONSE;
+
+/**
+ * Fraction of the way from the old speed to the new one
+ */
+static float progress(const RESPONSE *response, int pan)
+{
+   int from = response->previous * response->full_speed, to = response->level * response->full_speed;
+
+   return from == to ? 1 : (float)(pan - from) / (to - from);
+}
+
+static void on_command(void *userdata, const SERVO_COMMAND *command)
+{
+   RESPONSE *response = (RESPONSE *)userdata;
+   int64_t now = bench_now();
+
+   pthread_mutex_lock(&response->lock);
+   response->commands++;
+   if (response->still && (command->pan || command->tilt))
+      response->moved++;
+
+   if (response->step_time)
+   {
+      float done = progress(response, command->pan);
+
+      if (!response->half_seen && done >= 0.5f && response->num_half < MAX_STEPS)
+      {
+         response->half[response->num_half++] = now - response->step_time;
+         response->half_seen = 1;
+      }
+      if (!response->most_seen && done >= 0.9f && response->num_most < MAX_STEPS)
+      {
+         response->most[response->num_most++] = now - response->step_time;
+         response->most_seen = 1;
+      }
+   }
+   pthread_mutex_unlock(&response->lock);
+}
+
+static int load_quit;
+
+static void *load_thread(void *arg)
+{
+   volatile uint64_t spin = 0;
+
+   (void)arg;
+   while (!__atomic_load_n(&load_quit, __ATOMIC_RELAXED))
+      spin++;
+   return NULL;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-t seconds] [-p period_us] [-s smoothing_us] [-P priority] [-l load_threads] [-w write_us]\n", app);
+   fprintf(stderr, "  -P  SCHED_FIFO priority of the loop, 0 for an ordinary thread (default %d)\n", SERVO_DEFAULT_PRIORITY);
+   fprintf(stderr, "  -l  threads burning CPU alongside the loop (max %d)\n", MAX_LOAD);
+   fprintf(stderr, "  -w  time a command write takes on the bus (default I2C at 100kHz)\n");
+}
+
+int main(int argc, char **argv)
+{
+   int seconds = 10, period = SERVO_DEFAULT_PERIOD, smoothing = SERVO_DEFAULT_SMOOTHING;
+   int priority = SERVO_DEFAULT_PRIORITY, load = 0, write_time = -1, opt, failed = 0;
+   static RESPONSE response;
+   pthread_t load_threads[MAX_LOAD];
+   SERVO_CONTROL control;
+   SERVO_MOCK_BUS mock;
+   unsigned seed = 1;
+   int64_t end;
+   int step = 0;
+
+   while ((opt = getopt(argc, argv, "t:p:s:P:l:w:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 't' : seconds = atoi(optarg); break;
+         case 'p' : period = atoi(optarg); break;
+         case 's' : smoothing = atoi(optarg); break;
+         case 'P' : priority = atoi(optarg); break;
+         case 'l' : load = atoi(optarg); break;
+         case 'w' : write_time = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (seconds < 2 || period < 500 || smoothing < 0 || priority < 0 || priority > 99 || load < 0 || load > MAX_LOAD)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   servo_mock_init(&mock);
+   if (write_time >= 0)
+      mock.write_time = write_time;
+   mock.noise = 6;
+   mock.glitch_every = 37;
+   mock.on_command = on_command;
+   mock.userdata = &response;
+
+   pthread_mutex_init(&response.lock, NULL);
+   response.full_speed = SERVO_DEFAULT_MAX_SPEED * 10;
+   response.still = 1;
+
+   if (servo_control_init(&control, &servo_mock_bus, &mock) != 0)
+      return 1;
+   control.period = period;
+   control.smoothing = smoothing;
+   control.priority = priority;
+
+   for (int i = 0; i < load; i++)
+      pthread_create(&load_threads[i], NULL, load_thread, NULL);
+
+   if (servo_control_start(&control) != 0)
+   {
+      fprintf(stderr, "Unable to start the control loop\n");
+      return 1;
+   }
+
+   printf("%d us period, %d us smoothing, read %d us, write %d us, %s%s, %d load threads\n\n", period, smoothing,
+          mock.read_time, mock.write_time, control.realtime ? "SCHED_FIFO" : "ordinary thread",
+          control.locked ? ", memory locked" : "", load);
+
+   // A second of a centred, noisy, glitching stick first
+   sleep(1);
+   pthread_mutex_lock(&response.lock);
+   response.still = 0;
+   pthread_mutex_unlock(&response.lock);
+
+   // Then steps through centre, full right, centre, full left, landing anywhere in a cycle
+   end = bench_now() + (int64_t)(seconds - 1) * 1000000;
+   while (bench_now() < end)
+   {
+      static const int levels[4] = { 1, 0, -1, 0 };
+      int level = levels[step++ % 4];
+
+      usleep(150000 + rand_r(&seed) % period);
+
+      pthread_mutex_lock(&response.lock);
+      response.previous = response.level;
+      response.level = level;
+      response.half_seen = response.most_seen = 0;
+      __atomic_store_n(&mock.x, level < 0 ? 0 : level > 0 ? SERVO_ADC_MAX : (SERVO_ADC_MAX + 1) / 2, __ATOMIC_RELEASE);
+      response.step_time = bench_now();
+      pthread_mutex_unlock(&response.lock);
+   }
+   usleep(150000);
+
+   servo_control_stop(&control);
+   __atomic_store_n(&load_quit, 1, __ATOMIC_RELAXED);
+   for (int i = 0; i < load; i++)
+      pthread_join(load_threads[i], NULL);
+
+   printf("%llu cycles, %llu overruns, %llu commands\n", (unsigned long long)control.cycles,
+          (unsigned long long)control.overruns, (unsigned long long)response.commands);
+   printf("jitter      p50 %6lld us  p99 %6lld us  max %6lld us\n",
+          (long long)servo_stats_percentile(&control.jitter, 50),
+          (long long)servo_stats_percentile(&control.jitter, 99), (long long)control.jitter.max);
+   printf("cycle       p50 %6lld us  p99 %6lld us  max %6lld us\n",
+          (long long)servo_stats_percentile(&control.cycle, 50),
+          (long long)servo_stats_percentile(&control.cycle, 99), (long long)control.cycle.max);
+   printf("stick->50%%  p50 %6lld us  p99 %6lld us  max %6lld us  (%d steps)\n",
+          (long long)bench_percentile(response.half, response.num_half, 50),
+          (long long)bench_percentile(response.half, response.num_half, 99),
+          (long long)bench_percentile(response.half, response.num_half, 100), response.num_half);
+   printf("stick->90%%  p50 %6lld us  p99 %6lld us  max %6lld us  (%d steps)\n",
+          (long long)bench_percentile(response.most, response.num_most, 50),
+          (long long)bench_percentile(response.most, response.num_most, 99),
+          (long long)bench_percentile(response.most, response.num_most, 100), response.num_most);
+   printf("%llu commands moved the head while the stick was centred\n", (unsigned long long)response.moved);
+
+   if (response.moved || response.num_half < step - 1)
+      failed = 1;
+   if (LATENCY_CHECKED && bench_percentile(response.half, response.num_half, 99) > TARGET_LATENCY)
+   {
+      printf("stick to servo p99 over the %d ms target\n", TARGET_LATENCY / 1000);
+      failed = 1;
+   }
+
+   servo_control_destroy(&control);
+   pthread_mutex_destroy(&response.lock);
+
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "day_night.h"
+
+/**
+ * Assign the default profiles and levels, starting in day mode
+ */
+void day_night_init(DAY_NIGHT *day_night)
+{
+   DAY_NIGHT_PROFILE *day = &day_night->profiles[DAY_NIGHT_DAY];
+   DAY_NIGHT_PROFILE *night = &day_night->profiles[DAY_NIGHT_NIGHT];
+
+   memset(day_night, 0, sizeof(*day_night));
+
+   // Fixed 10fps for the analysis stream, halved while the scene is static
+   day->name = "day";
+   day->iso = 0;
+   day->fps_low = 10000;
+   day->fps_high = 10000;
+   day->idle_fps = 5000;
+   day->denoise = 0;
+
+   // Up to half second exposures before the gain has to go up, which is
+   // where night time noise comes from
+   night->name = "night";
+   night->iso = 800;
+   night->fps_low = 2000;
+   night->fps_high = 10000;
+   night->idle_fps = 2000;
+   night->denoise = 1;
+
+   day_night->night_level = DAY_NIGHT_DEFAULT_NIGHT_LEVEL;
+   day_night->day_level = DAY_NIGHT_DEFAULT_DAY_LEVEL;
+   day_night->hold = DAY_NIGHT_DEFAULT_HOLD;
+   day_night->mode = DAY_NIGHT_DAY;
+}
+
+/**
+ * How dark the scene is, as exposure time x total gain in microseconds
+ */
+double day_night_level(const EXPOSURE_STATE *exposure)
+{
+   double gain = exposure->analog_gain > 0 ? exposure->analog_gain : 1.0;
+
+   if (exposure->digital_gain > 0)
+      gain *= exposure->digital_gain;
+   return exposure->exposure * gain;
+}
+
+/**
+ * Feed in a settled exposure report
+ *
+ * @param exposure Exposure the AGC has settled on
+ * @return 1 if the mode just changed and the new profile wants applying, 0 if not
+ */
+int day_night_update(DAY_NIGHT *day_night, const EXPOSURE_STATE *exposure)
+{
+   double level;
+   int other;
+
+   if (!exposure->valid)
+      return 0;
+
+   level = day_night_level(exposure);
+   other = day_night->mode == DAY_NIGHT_DAY ? level >= day_night->night_level
+                                            : level <= day_night->day_level;
+
+   // One odd report, a car's headlights say, starts the count again
+   if (!other)
+   {
+      day_night->votes = 0;
+      return 0;
+   }
+
+   if (++day_night->votes < day_night->hold)
+      return 0;
+
+   day_night->mode = day_night->mode == DAY_NIGHT_DAY ? DAY_NIGHT_NIGHT : DAY_NIGHT_DAY;
+   day_night->votes = 0;
+   day_night->switches++;
+   return 1;
+}
+
+const DAY_NIGHT_PROFILE *day_night_profile(const DAY_NIGHT *day_night)
+{
+   return &day_night->profiles[day_night->mode];
+}
+
+/**
+ * Frame rate range the camera should run at
+ *
+ * @param idle Non zero if nothing has moved for a while
+ * @param fps_low Receives the bottom of the range, thousandths of a frame per second
+ * @param fps_high Receives the top of the range
+ * @return The bottom of the range, which is the rate the stages after the camera have to plan for
+ */
+int day_night_fps_range(const DAY_NIGHT *day_night, int idle, int *fps_low, int *fps_high)
+{
+   const DAY_NIGHT_PROFILE *profile = day_night_profile(day_night);
+
+   *fps_low = profile->fps_low;
+   *fps_high = profile->fps_high;
+
+   // Idling only lowers the top, the AGC keeps its long exposures
+   if (idle && profile->idle_fps && profile->idle_fps < *fps_high)
+   {
+      *fps_high = profile->idle_fps;
+      if (*fps_low > *fps_high)
+         *fps_low = *fps_high;
+   }
+   return *fps_low;
+}
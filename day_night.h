@@ -0,0 +1,64 @@
+#ifndef DAY_NIGHT_H_
+#define DAY_NIGHT_H_
+
+#include <stdint.h>
+
+#include "exposure_cache.h"
+
+/// Exposure time x gain (us) a settled scene has to reach before it counts as
+/// night, about the day profile's longest frame at the top of its gain
+#define DAY_NIGHT_DEFAULT_NIGHT_LEVEL 400000
+
+/// Exposure time x gain (us) the scene has to fall back below for day, well
+/// under the night level so dusk doesn't flap between the two
+#define DAY_NIGHT_DEFAULT_DAY_LEVEL   100000
+
+/// Settled exposure reports in a row that have to agree before switching
+#define DAY_NIGHT_DEFAULT_HOLD        10
+
+typedef enum
+{
+   DAY_NIGHT_DAY,
+   DAY_NIGHT_NIGHT,
+   DAY_NIGHT_MODES
+} DAY_NIGHT_MODE;
+
+/** Camera settings for one light level.
+ *  Frame rates are in thousandths of a frame per second, as the camera's
+ *  FPS range takes them. The bottom of the range is what limits the
+ *  exposure time, so it is also the slowest the stages after the camera
+ *  have to cope with.
+ */
+typedef struct
+{
+   const char *name;
+   int iso;                         /// 0 leaves it to the AGC
+   int fps_low;                     /// Slowest frame rate the AGC may drop to for a longer exposure
+   int fps_high;
+   int idle_fps;                    /// Top of the range once nothing has moved for a while, 0 never idles
+   int denoise;                     /// Denoise the video and stills
+} DAY_NIGHT_PROFILE;
+
+/** Picks the day or night profile from the exposure the AGC settles on.
+ *  The product of exposure time and gain tracks how dark the scene is
+ *  whichever way the AGC splits it, so it works under either profile.
+ */
+typedef struct
+{
+   DAY_NIGHT_PROFILE profiles[DAY_NIGHT_MODES];
+   double night_level;              /// DAY_NIGHT_DEFAULT_NIGHT_LEVEL
+   double day_level;                /// DAY_NIGHT_DEFAULT_DAY_LEVEL
+   int hold;                        /// DAY_NIGHT_DEFAULT_HOLD
+
+   DAY_NIGHT_MODE mode;             /// Profile in use
+   int votes;                       /// Reports in a row asking for the other mode
+   uint64_t switches;
+} DAY_NIGHT;
+
+void day_night_init(DAY_NIGHT *day_night);
+double day_night_level(const EXPOSURE_STATE *exposure);
+int day_night_update(DAY_NIGHT *day_night, const EXPOSURE_STATE *exposure);
+const DAY_NIGHT_PROFILE *day_night_profile(const DAY_NIGHT *day_night);
+int day_night_fps_range(const DAY_NIGHT *day_night, int idle, int *fps_low, int *fps_high);
+
+#endif /* DAY_NIGHT_H_ */
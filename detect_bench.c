@@ -0,0 +1,387 @@
+/**
+ * Throughput benchmark for the detection stage.
+ *
+ * Runs recorded clips through the int8 network at each batch size and
+ * reports frames per second and per frame latency, then feeds the clip to
+ * the detector queue at a real time frame rate from several cameras to show
+ * how many frames it would skip on this machine.
+ *
+ * Clips are PGM frames, either files or directories of them such as the
+ * output of the synthetic backend. Without a model (-m) a randomly weighted
+ * network of the default shape is timed instead, the timings only depend on
+ * the shape; -W writes that network out so the full app can load it.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "bench_util.h"
+#include "cnn.h"
+#include "detector.h"
+#include "synthetic_camera.h"
+
+#define MAX_CLIP_FRAMES 2000
+#define MAX_SOURCES     8
+
+typedef struct
+{
+   uint8_t *luma;
+   int width;
+   int height;
+} BENCH_FRAME;
+
+typedef struct
+{
+   BENCH_FRAME frames[MAX_CLIP_FRAMES];
+   int count;
+} BENCH_CLIP;
+
+static uint64_t detections_seen;
+
+static int compare_names(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Read the next number from a PGM header, skipping whitespace and comments
+ */
+static int read_header_value(FILE *file)
+{
+   int ch, value;
+
+   while ((ch = fgetc(file)) != EOF)
+   {
+      if (ch == '#')
+         while ((ch = fgetc(file)) != EOF && ch != '\n')
+            ;
+      else if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+         break;
+   }
+   if (ch == EOF)
+      return -1;
+
+   ungetc(ch, file);
+   return fscanf(file, "%d", &value) == 1 ? value : -1;
+}
+
+static int load_pgm(BENCH_CLIP *clip, const char *path)
+{
+   FILE *file = fopen(path, "rb");
+   BENCH_FRAME *frame = &clip->frames[clip->count];
+   int maxval;
+
+   if (!file)
+      return -1;
+
+   if (clip->count >= MAX_CLIP_FRAMES || fgetc(file) != 'P' || fgetc(file) != '5')
+      goto error;
+
+   frame->width = read_header_value(file);
+   frame->height = read_header_value(file);
+   maxval = read_header_value(file);
+   if (frame->width <= 0 || frame->height <= 0 || maxval != 255)
+      goto error;
+   fgetc(file);
+
+   frame->luma = malloc((size_t)frame->width * frame->height);
+   if (!frame->luma || fread(frame->luma, (size_t)frame->width * frame->height, 1, file) != 1)
+   {
+      free(frame->luma);
+      goto error;
+   }
+
+   fclose(file);
+   clip->count++;
+   return 0;
+
+error:
+   fprintf(stderr, "%s: not a binary PGM\n", path);
+   fclose(file);
+   return -1;
+}
+
+static int load_clip(BENCH_CLIP *clip, const char *path)
+{
+   DIR *dir = opendir(path);
+   struct dirent *entry;
+   char **names = NULL;
+   int count = 0, status = 0;
+
+   if (!dir)
+      return load_pgm(clip, path);
+
+   // Frames in name order, which is frame order for anything storage wrote
+   while ((entry = readdir(dir)) != NULL)
+   {
+      size_t length = strlen(entry->d_name);
+      char **grown;
+
+      if (length < 4 || strcmp(entry->d_name + length - 4, ".pgm") != 0)
+         continue;
+
+      grown = realloc(names, (count + 1) * sizeof(*names));
+      if (!grown)
+         break;
+      names = grown;
+      if (asprintf(&names[count], "%s/%s", path, entry->d_name) < 0)
+         break;
+      count++;
+   }
+   closedir(dir);
+
+   qsort(names, count, sizeof(*names), compare_names);
+   for (int i = 0; i < count; i++)
+   {
+      if (load_pgm(clip, names[i]) != 0)
+         status = -1;
+      free(names[i]);
+   }
+   free(names);
+   return status;
+}
+
+static void render_clip(BENCH_CLIP *clip, int count)
+{
+   for (int i = 0; i < count && clip->count < MAX_CLIP_FRAMES; i++)
+   {
+      BENCH_FRAME *frame = &clip->frames[clip->count];
+
+      frame->width = SYNTHETIC_DEFAULT_ANALYSIS_WIDTH;
+      frame->height = SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT;
+      frame->luma = malloc((size_t)frame->width * frame->height);
+      if (!frame->luma)
+         return;
+      synthetic_render_luma(frame->luma, frame->width, frame->height, frame->width, i);
+      clip->count++;
+   }
+}
+
+/**
+ * The default detector shape, 96x96 luma in, a 6x6 grid of person/vehicle out
+ */
+static int build_random_model(CNN_MODEL *model)
+{
+   static const struct { int out_channels, kernel, stride, relu; } shape[] =
+   {
+      { 8, 3, 2, 1 }, { 16, 3, 1, 1 }, { 0 }, { 32, 3, 1, 1 }, { 0 }, { 64, 3, 1, 1 }, { 0 }, { 2, 1, 1, 0 }
+   };
+   uint32_t seed = 12345;
+
+   if (cnn_model_create(model, 96, 96, 2) != 0)
+      return -1;
+   strcpy(model->class_names[0], "person");
+   strcpy(model->class_names[1], "vehicle");
+   model->output_scale = 1.0f / 32;
+
+   for (size_t i = 0; i < sizeof(shape) / sizeof(shape[0]); i++)
+   {
+      CNN_LAYER *layer;
+
+      if (!shape[i].out_channels)
+      {
+         if (cnn_model_add_maxpool(model) != 0)
+            return -1;
+         continue;
+      }
+
+      layer = cnn_model_add_conv(model, shape[i].out_channels, shape[i].kernel, shape[i].stride, shape[i].relu);
+      if (!layer)
+         return -1;
+
+      for (int c = 0; c < layer->out_channels; c++)
+      {
+         for (int k = 0; k < layer->row_length; k++)
+            layer->weights[(size_t)c * layer->row_stride + k] = (int8_t)((int)(bench_random(&seed) >> 16) % 255 - 127);
+         // Keeps the activations roughly in range whatever the fan in
+         layer->scale[c] = 2.0f / (sqrtf((float)layer->row_length) * 127);
+      }
+   }
+   return 0;
+}
+
+/**
+ * Time the network alone at one batch size
+ */
+static void bench_batch(const CNN_MODEL *model, const BENCH_CLIP *clip, int batch, int repeats)
+{
+   int runs = (clip->count * repeats + batch - 1) / batch;
+   int64_t *per_frame = malloc(runs * sizeof(*per_frame));
+   int8_t *inputs[DETECTOR_MAX_BATCH];
+   size_t input_size = (size_t)model->input_width * model->input_height;
+   CNN_SCRATCH scratch;
+   int64_t start, total;
+   int frames = 0;
+
+   if (!per_frame || cnn_scratch_init(&scratch, model, batch) != 0)
+   {
+      free(per_frame);
+      return;
+   }
+   for (int i = 0; i < batch; i++)
+      inputs[i] = malloc(input_size);
+
+   start = bench_now();
+   for (int run = 0; run < runs; run++)
+   {
+      int64_t run_start = bench_now();
+
+      // Preparing the input is part of the cost of every frame
+      for (int i = 0; i < batch; i++)
+      {
+         const BENCH_FRAME *frame = &clip->frames[(run * batch + i) % clip->count];
+
+         cnn_prepare_input(model, frame->luma, frame->width, frame->height, frame->width, inputs[i]);
+      }
+      cnn_run_batch(model, &scratch, (const int8_t *const *)inputs, batch);
+
+      per_frame[run] = (bench_now() - run_start) / batch;
+      frames += batch;
+   }
+   total = bench_now() - start;
+
+   qsort(per_frame, runs, sizeof(*per_frame), bench_compare_int64);
+   printf("batch %d: %d frames %.1f fps, per frame p50 %lld us p99 %lld us\n", batch, frames,
+          frames * 1e6 / (total ? total : 1), (long long)per_frame[runs / 2],
+          (long long)per_frame[runs * 99 / 100]);
+
+   for (int i = 0; i < batch; i++)
+      free(inputs[i]);
+   cnn_scratch_destroy(&scratch);
+   free(per_frame);
+}
+
+static void count_detections(void *source, const CNN_DETECTION *detections, int count)
+{
+   (void)source;
+   (void)detections;
+   __atomic_add_fetch(&detections_seen, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Play the clip into the detector queue in real time from several cameras
+ */
+static int bench_realtime(CNN_MODEL *model, const BENCH_CLIP *clip, int sources, int fps, float threshold)
+{
+   static int source_ids[MAX_SOURCES];
+   DETECTOR detector;
+   int64_t start, frame_time = 1000000 / fps;
+
+   if (detector_init(&detector, model, threshold, count_detections) != 0 || detector_start(&detector) != 0)
+   {
+      fprintf(stderr, "Unable to start detector\n");
+      return -1;
+   }
+
+   start = bench_now();
+   for (int i = 0; i < clip->count; i++)
+   {
+      int64_t due = start + i * frame_time, now = bench_now();
+
+      if (due > now)
+         usleep((useconds_t)(due - now));
+
+      for (int s = 0; s < sources; s++)
+      {
+         const BENCH_FRAME *frame = &clip->frames[(i + s * 7) % clip->count];
+
+         detector_submit(&detector, &source_ids[s], frame->luma, frame->width, frame->height, frame->width);
+      }
+   }
+
+   // Let the last batch finish
+   for (int s = 0; s < sources; s++)
+      detector_cancel(&detector, &source_ids[s]);
+   detector_stop(&detector);
+
+   printf("realtime %d cameras at %d fps: %llu submitted, %llu run in %llu batches (%.2f per batch), "
+          "%llu skipped (%.1f%%), %llu detections\n", sources, fps,
+          (unsigned long long)detector.submitted, (unsigned long long)detector.processed,
+          (unsigned long long)detector.batches,
+          detector.batches ? (double)detector.processed / detector.batches : 0.0,
+          (unsigned long long)detector.skipped,
+          detector.submitted ? 100.0 * detector.skipped / detector.submitted : 0.0,
+          (unsigned long long)detections_seen);
+
+   detector_destroy(&detector);
+   return 0;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-m model] [-W write_model] [-n synthetic_frames] [-r repeats]\n"
+                   "          [-c cameras] [-f fps] [-T threshold] [clip ...]\n", app);
+   fprintf(stderr, "  clip  PGM file or directory of PGM frames, a synthetic clip if none given\n");
+}
+
+int main(int argc, char **argv)
+{
+   static BENCH_CLIP clip;
+   CNN_MODEL model;
+   const char *model_path = NULL, *write_path = NULL;
+   int synthetic_frames = 200, repeats = 3, sources = 1, fps = 10, opt;
+   float threshold = DETECTOR_DEFAULT_THRESHOLD;
+
+   while ((opt = getopt(argc, argv, "m:W:n:r:c:f:T:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'm' : model_path = optarg; break;
+         case 'W' : write_path = optarg; break;
+         case 'n' : synthetic_frames = atoi(optarg); break;
+         case 'r' : repeats = atoi(optarg); break;
+         case 'c' : sources = atoi(optarg); break;
+         case 'f' : fps = atoi(optarg); break;
+         case 'T' : threshold = (float)atof(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (repeats < 1 || sources < 1 || sources > MAX_SOURCES || fps < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   for (int i = optind; i < argc; i++)
+      if (load_clip(&clip, argv[i]) != 0)
+         return 1;
+   if (optind == argc)
+      render_clip(&clip, synthetic_frames);
+   if (!clip.count)
+   {
+      fprintf(stderr, "No frames to run\n");
+      return 1;
+   }
+
+   if (model_path ? cnn_model_load(&model, model_path) != 0 : build_random_model(&model) != 0)
+   {
+      fprintf(stderr, "Unable to create model\n");
+      return 1;
+   }
+
+   if (write_path && cnn_model_save(&model, write_path) != 0)
+      fprintf(stderr, "Unable to write %s\n", write_path);
+
+   printf("%s kernels, model %dx%d in, %d layers, %d classes, clip %d frames %dx%d\n", cnn_kernel_name(),
+          model.input_width, model.input_height, model.num_layers, model.num_classes,
+          clip.count, clip.frames[0].width, clip.frames[0].height);
+
+   for (int batch = 1; batch <= DETECTOR_MAX_BATCH; batch *= 2)
+      bench_batch(&model, &clip, batch, repeats);
+
+   // The detector takes the model over
+   if (bench_realtime(&model, &clip, sources, fps, threshold) != 0)
+      return 1;
+
+   for (int i = 0; i < clip.count; i++)
+      free(clip.frames[i].luma);
+   return 0;
+}
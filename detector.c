@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "detector.h"
+#include "memory_budget.h"
+#include "clock_now.h"
+
+static const uint64_t batch_bounds[] = { 1, 2, 3, 4 };
+
+static void register_metrics(DETECTOR *detector)
+{
+   detector->frames_metric = metrics_counter("detector_frames_total", "Frames run through the detector", NULL);
+   detector->skipped_metric = metrics_counter("detector_skipped_total", "Frames the detector had no time for", NULL);
+   detector->batch_metric = metrics_histogram("detector_batch_size", "Frames run together per batch", NULL,
+                                              batch_bounds, sizeof(batch_bounds) / sizeof(batch_bounds[0]));
+   detector->inference_metric = metrics_histogram("detector_inference_us", "Network time per frame in microseconds",
+                                                  NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   detector->latency_metric = metrics_histogram("detector_latency_us", "Frame submission to result in microseconds",
+                                                NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+
+   for (int i = 0; i < detector->model.num_classes; i++)
+   {
+      char labels[48];
+
+      snprintf(labels, sizeof(labels), "class=\"%s\"", detector->model.class_names[i]);
+      detector->detections_metric[i] = metrics_counter("detections_total", "Frames with a detection of the class", labels);
+   }
+}
+
+static void free_inputs(DETECTOR *detector)
+{
+   size_t input_size = (size_t)detector->model.input_width * detector->model.input_height;
+
+   for (int i = 0; i < DETECTOR_QUEUE_SIZE; i++)
+      memory_free(MEMORY_STAGE_FRAMES, detector->queue[i].input, input_size);
+   for (int i = 0; i < DETECTOR_MAX_BATCH; i++)
+      memory_free(MEMORY_STAGE_FRAMES, detector->batch[i].input, input_size);
+}
+
+/**
+ * Set up a detector, takes over the model which is destroyed with the detector
+ *
+ * @param model Loaded model
+ * @param threshold Minimum score for a detection, 0..1
+ * @param callback Called with the detections in each frame
+ * @return 0 on success, -1 on failure
+ */
+int detector_init(DETECTOR *detector, CNN_MODEL *model, float threshold, DETECTOR_CALLBACK callback)
+{
+   size_t input_size = (size_t)model->input_width * model->input_height;
+
+   memset(detector, 0, sizeof(*detector));
+   detector->model = *model;
+   memset(model, 0, sizeof(*model));
+   detector->threshold = threshold;
+   detector->callback = callback;
+
+   if (cnn_scratch_init(&detector->scratch, &detector->model, DETECTOR_MAX_BATCH) != 0)
+      goto error;
+
+   // Frame copies waiting for the network, counted as frames in the memory budget
+   for (int i = 0; i < DETECTOR_QUEUE_SIZE; i++)
+      if (!(detector->queue[i].input = memory_alloc(MEMORY_STAGE_FRAMES, input_size)))
+         goto error;
+   for (int i = 0; i < DETECTOR_MAX_BATCH; i++)
+      if (!(detector->batch[i].input = memory_alloc(MEMORY_STAGE_FRAMES, input_size)))
+         goto error;
+
+   pthread_mutex_init(&detector->lock, NULL);
+   pthread_cond_init(&detector->cond, NULL);
+   register_metrics(detector);
+   return 0;
+
+error:
+   free_inputs(detector);
+   cnn_scratch_destroy(&detector->scratch);
+   cnn_model_destroy(&detector->model);
+   return -1;
+}
+
+/**
+ * Run one batch and hand out the results, called without the lock
+ */
+static void run_batch(DETECTOR *detector, int count)
+{
+   const int8_t *inputs[DETECTOR_MAX_BATCH];
+   CNN_DETECTION detections[DETECTOR_MAX_DETECTIONS];
+   const CNN_MODEL *model = &detector->model;
+   const int8_t *output;
+   int64_t start, end;
+
+   for (int i = 0; i < count; i++)
+      inputs[i] = detector->batch[i].input;
+
+   start = clock_now_us();
+   output = cnn_run_batch(model, &detector->scratch, inputs, count);
+   end = clock_now_us();
+
+   metrics_observe(detector->batch_metric, count);
+
+   for (int i = 0; i < count; i++, output += model->max_activation)
+   {
+      DETECTOR_FRAME *frame = &detector->batch[i];
+      int found = cnn_decode(model, output, detector->threshold, detections, DETECTOR_MAX_DETECTIONS);
+      unsigned seen = 0;
+
+      metrics_add(detector->frames_metric, 1);
+      metrics_observe(detector->inference_metric, (uint64_t)((end - start) / count));
+      metrics_observe(detector->latency_metric, (uint64_t)(end - frame->submitted));
+
+      if (!found)
+         continue;
+
+      // Back to the coordinates of the frame that was submitted
+      for (int d = 0; d < found; d++)
+      {
+         detections[d].x = detections[d].x * frame->width / model->input_width;
+         detections[d].y = detections[d].y * frame->height / model->input_height;
+         detections[d].width = detections[d].width * frame->width / model->input_width;
+         detections[d].height = detections[d].height * frame->height / model->input_height;
+
+         // Count frames rather than cells, a person usually covers several
+         if (!(seen & (1u << detections[d].class_id)))
+            metrics_add(detector->detections_metric[detections[d].class_id], 1);
+         seen |= 1u << detections[d].class_id;
+      }
+
+      detector->callback(frame->source, detections, found);
+   }
+}
+
+static void *detector_thread(void *arg)
+{
+   DETECTOR *detector = (DETECTOR *)arg;
+
+   pthread_mutex_lock(&detector->lock);
+
+   for (;;)
+   {
+      int count;
+
+      while (!detector->count && !detector->quit)
+         pthread_cond_wait(&detector->cond, &detector->lock);
+      if (detector->quit)
+         break;
+
+      // Take everything waiting up to a full batch, a backlog is what makes batches
+      count = detector->count < DETECTOR_MAX_BATCH ? detector->count : DETECTOR_MAX_BATCH;
+      for (int i = 0; i < count; i++)
+      {
+         DETECTOR_FRAME swap = detector->batch[i];
+
+         detector->batch[i] = detector->queue[detector->head];
+         detector->queue[detector->head] = swap;
+         detector->head = (detector->head + 1) % DETECTOR_QUEUE_SIZE;
+         detector->count--;
+      }
+      detector->batch_count = count;
+      pthread_mutex_unlock(&detector->lock);
+
+      run_batch(detector, count);
+
+      pthread_mutex_lock(&detector->lock);
+      detector->processed += count;
+      detector->batches++;
+      detector->batch_count = 0;
+      pthread_cond_broadcast(&detector->cond);
+   }
+
+   pthread_mutex_unlock(&detector->lock);
+   return NULL;
+}
+
+/**
+ * Start the detector thread
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int detector_start(DETECTOR *detector)
+{
+   detector->quit = 0;
+   if (pthread_create(&detector->thread, NULL, detector_thread, detector) != 0)
+      return -1;
+   detector->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Queue a frame for detection, never waits for the network
+ *
+ * @param source Handed back to the callback
+ * @param luma Luma plane of the frame
+ * @return 0 if queued, 1 if queued at the expense of a frame that will now be skipped
+ */
+int detector_submit(DETECTOR *detector, void *source, const uint8_t *luma, int width, int height, int stride)
+{
+   DETECTOR_FRAME *frame = NULL;
+   int skipped = 0;
+
+   pthread_mutex_lock(&detector->lock);
+
+   detector->submitted++;
+
+   // A newer frame from the same source is worth more than the one waiting
+   for (int i = 0; i < detector->count && !frame; i++)
+   {
+      DETECTOR_FRAME *queued = &detector->queue[(detector->head + i) % DETECTOR_QUEUE_SIZE];
+
+      if (queued->source == source)
+         frame = queued;
+   }
+
+   if (frame)
+      skipped = 1;
+   else
+   {
+      if (detector->count == DETECTOR_QUEUE_SIZE)
+      {
+         detector->head = (detector->head + 1) % DETECTOR_QUEUE_SIZE;
+         detector->count--;
+         skipped = 1;
+      }
+      frame = &detector->queue[(detector->head + detector->count) % DETECTOR_QUEUE_SIZE];
+      detector->count++;
+   }
+
+   frame->source = source;
+   frame->width = width;
+   frame->height = height;
+   frame->submitted = clock_now_us();
+   cnn_prepare_input(&detector->model, luma, width, height, stride, frame->input);
+
+   if (skipped)
+   {
+      detector->skipped++;
+      metrics_add(detector->skipped_metric, 1);
+   }
+
+   pthread_cond_broadcast(&detector->cond);
+   pthread_mutex_unlock(&detector->lock);
+   return skipped;
+}
+
+/**
+ * Drop any frames from a source and wait out a batch it is in, so the
+ * callback is never called for it once this returns.
+ * Must not be called from the callback.
+ */
+void detector_cancel(DETECTOR *detector, void *source)
+{
+   int kept = 0, busy;
+
+   pthread_mutex_lock(&detector->lock);
+
+   for (int i = 0; i < detector->count; i++)
+   {
+      int from = (detector->head + i) % DETECTOR_QUEUE_SIZE;
+      int to = (detector->head + kept) % DETECTOR_QUEUE_SIZE;
+
+      if (detector->queue[from].source == source)
+         continue;
+
+      if (from != to)
+      {
+         DETECTOR_FRAME swap = detector->queue[to];
+
+         detector->queue[to] = detector->queue[from];
+         detector->queue[from] = swap;
+      }
+      kept++;
+   }
+   detector->count = kept;
+
+   do
+   {
+      busy = 0;
+      for (int i = 0; i < detector->batch_count; i++)
+         if (detector->batch[i].source == source)
+            busy = 1;
+      if (busy)
+         pthread_cond_wait(&detector->cond, &detector->lock);
+   } while (busy);
+
+   pthread_mutex_unlock(&detector->lock);
+}
+
+/**
+ * Stop the detector thread, frames still queued are dropped
+ */
+void detector_stop(DETECTOR *detector)
+{
+   if (!detector->thread_running)
+      return;
+
+   pthread_mutex_lock(&detector->lock);
+   detector->quit = 1;
+   pthread_cond_broadcast(&detector->cond);
+   pthread_mutex_unlock(&detector->lock);
+
+   pthread_join(detector->thread, NULL);
+   detector->thread_running = 0;
+   detector->count = 0;
+}
+
+void detector_destroy(DETECTOR *detector)
+{
+   detector_stop(detector);
+   free_inputs(detector);
+
+   cnn_scratch_destroy(&detector->scratch);
+   cnn_model_destroy(&detector->model);
+   pthread_cond_destroy(&detector->cond);
+   pthread_mutex_destroy(&detector->lock);
+}
@@ -0,0 +1,78 @@
+#ifndef DETECTOR_H_
+#define DETECTOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "cnn.h"
+#include "metrics.h"
+
+/// Frames waiting for the detector, beyond this the oldest is skipped
+#define DETECTOR_QUEUE_SIZE        8
+
+/// Most frames run through the network together when backlogged
+#define DETECTOR_MAX_BATCH         4
+
+#define DETECTOR_MAX_DETECTIONS    16
+#define DETECTOR_DEFAULT_THRESHOLD 0.6f
+
+/** Called on the detector thread with the detections in one frame,
+ *  boxes are in the submitted frame's pixels. Only called when there is
+ *  at least one detection.
+ */
+typedef void (*DETECTOR_CALLBACK)(void *source, const CNN_DETECTION *detections, int count);
+
+/** A frame waiting for, or going through, the network
+ */
+typedef struct
+{
+   void *source;                    /// Who submitted it, handed back to the callback
+   int width, height;               /// Size of the submitted frame
+   int64_t submitted;               /// Monotonic time of submission in microseconds
+   int8_t *input;                   /// Frame scaled to the model input
+} DETECTOR_FRAME;
+
+/** Detection stage shared by every pipeline.
+ *  Submitting never waits on the network: frames are queued and a newer frame
+ *  from the same source replaces one still waiting, and once the queue is full
+ *  the oldest frame is skipped. A single thread drains the queue in batches.
+ */
+typedef struct
+{
+   CNN_MODEL model;
+   float threshold;                 /// Minimum score for a detection
+   DETECTOR_CALLBACK callback;
+   CNN_SCRATCH scratch;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   DETECTOR_FRAME queue[DETECTOR_QUEUE_SIZE];
+   int head;                        /// Oldest frame in the queue
+   int count;                       /// Frames in the queue
+   DETECTOR_FRAME batch[DETECTOR_MAX_BATCH]; /// Frames being run, swapped out of the queue
+   int batch_count;                 /// Frames in batch while the thread is running them
+   int quit;
+   pthread_t thread;
+   int thread_running;
+
+   uint64_t submitted;              /// Frames submitted
+   uint64_t skipped;                /// Frames dropped without being run
+   uint64_t processed;              /// Frames run through the network
+   uint64_t batches;                /// Batches run
+
+   METRIC *frames_metric;
+   METRIC *skipped_metric;
+   METRIC *batch_metric;            /// Frames per batch
+   METRIC *inference_metric;        /// Network time per frame (us)
+   METRIC *latency_metric;          /// Submission to result (us)
+   METRIC *detections_metric[CNN_MAX_CLASSES];
+} DETECTOR;
+
+int detector_init(DETECTOR *detector, CNN_MODEL *model, float threshold, DETECTOR_CALLBACK callback);
+int detector_start(DETECTOR *detector);
+int detector_submit(DETECTOR *detector, void *source, const uint8_t *luma, int width, int height, int stride);
+void detector_cancel(DETECTOR *detector, void *source);
+void detector_stop(DETECTOR *detector);
+void detector_destroy(DETECTOR *detector);
+
+#endif /* DETECTOR_H_ */
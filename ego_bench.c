@@ -0,0 +1,285 @@
+/**
+ * Motion detection while the head pans, with and without ego motion.
+ *
+ * Renders analysis frames as a view onto a larger textured scene that
+ * pans, tilts and stops the way a patrol tour moves the head, with sensor
+ * noise. One run has nothing moving in the scene, one has someone walking
+ * across it. Each is played with ego motion off, on, and on with a seed
+ * a few pixels out, as the servo positions give.
+ *
+ * Reported per mode: time per frame, how often the translation estimate
+ * was exact, frames reported as motion with nothing moving, and frames
+ * the walker was found in. Without ego motion every pan looks like a
+ * lighting change and the walker is lost until the background settles.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "motion.h"
+
+#define SCENE_WIDTH   2048
+#define SCENE_HEIGHT  1024
+#define WALKER_SIZE   24
+
+/// Seed error the servo positions are allowed, in pixels
+#define SEED_ERROR    3
+
+typedef enum
+{
+   MODE_OFF,
+   MODE_EGO,
+   MODE_SEEDED,
+   MODE_COUNT
+} MODE;
+
+static const char *mode_names[MODE_COUNT] = { "off", "ego", "seeded" };
+
+/** One leg of the head's path, in pixels per frame
+ */
+typedef struct
+{
+   int frames;
+   int dx, dy;
+} LEG;
+
+/**
+ * Blocks of random brightness over a gradient, something to match against
+ */
+static void render_scene(uint8_t *scene)
+{
+   uint32_t seed = 7;
+
+   for (int y = 0; y < SCENE_HEIGHT; y++)
+      for (int x = 0; x < SCENE_WIDTH; x++)
+         scene[(size_t)y * SCENE_WIDTH + x] = (uint8_t)(60 + x * 60 / SCENE_WIDTH + y * 40 / SCENE_HEIGHT);
+
+   for (int i = 0; i < 3000; i++)
+   {
+      int w = 6 + bench_random(&seed) % 60, h = 6 + bench_random(&seed) % 60;
+      int x0 = bench_random(&seed) % (SCENE_WIDTH - w), y0 = bench_random(&seed) % (SCENE_HEIGHT - h);
+      int level = 30 + bench_random(&seed) % 190;
+
+      for (int y = y0; y < y0 + h; y++)
+         memset(scene + (size_t)y * SCENE_WIDTH + x0, level, w);
+   }
+}
+
+/**
+ * Cut the view out of the scene, add the walker and noise
+ */
+static void render_view(uint8_t *frame, int width, int height, const uint8_t *scene, int view_x, int view_y,
+                        int walker_x, int walker_y, uint32_t *seed)
+{
+   for (int y = 0; y < height; y++)
+   {
+      const uint8_t *row = scene + (size_t)(view_y + y) * SCENE_WIDTH + view_x;
+
+      for (int x = 0; x < width; x++)
+      {
+         int sx = view_x + x, sy = view_y + y;
+         int value = row[x];
+
+         if (walker_x >= 0 && sx >= walker_x && sx < walker_x + WALKER_SIZE &&
+             sy >= walker_y && sy < walker_y + WALKER_SIZE * 2)
+            value = 240;
+         value += (int)(bench_random(seed) % 7) - 3;
+         frame[(size_t)y * width + x] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+      }
+   }
+}
+
+typedef struct
+{
+   double per_frame;                /// us
+   int frames;
+   int estimated, exact;            /// Estimates made, and those that were right
+   int panning;                     /// Frames taken while the head moved
+   int false_motion;                /// Motion reported with nothing moving
+   int walker_frames;               /// Frames the walker was in view
+   int walker_found;                /// ...and the motion box covered it
+} RESULT;
+
+/**
+ * Play the head's path through the detector
+ */
+static void play(MODE mode, int walker, const uint8_t *scene, uint8_t *frame, int width, int height,
+                 const LEG *legs, int num_legs, int repeats, RESULT *result)
+{
+   MOTION_DETECTOR motion;
+   uint32_t seed = 1, seed_noise = 5;
+   int view_x = 200, view_y = 300, walker_x = 300, walker_y = 400, walker_dx = 3;
+   int64_t elapsed = 0;
+
+   memset(result, 0, sizeof(*result));
+   motion_init(&motion);
+   motion.ego_motion = mode != MODE_OFF;
+
+   for (int r = 0; r < repeats; r++)
+   {
+      for (int l = 0; l < num_legs; l++)
+      {
+         for (int f = 0; f < legs[l].frames; f++)
+         {
+            int dx = legs[l].dx, dy = legs[l].dy, found, in_view;
+            int64_t start;
+
+            // The head turning right moves the scene left in the frame
+            view_x += dx;
+            view_y += dy;
+            if (view_x < 0 || view_x + width > SCENE_WIDTH || view_y < 0 || view_y + height > SCENE_HEIGHT)
+            {
+               fprintf(stderr, "Path leaves the scene\n");
+               exit(1);
+            }
+
+            if (walker)
+            {
+               walker_x += walker_dx;
+               if (walker_x < view_x - WALKER_SIZE || walker_x > view_x + width)
+                  walker_x = walker_dx > 0 ? view_x - WALKER_SIZE + 1 : view_x + width - 1;
+               walker_y = view_y + height / 2 - WALKER_SIZE;
+            }
+            render_view(frame, width, height, scene, view_x, view_y, walker ? walker_x : -1, walker_y, &seed);
+
+            if (mode == MODE_SEEDED)
+               motion_seed_shift(&motion, -dx + (int)(bench_random(&seed_noise) % (2 * SEED_ERROR + 1)) - SEED_ERROR,
+                                 -dy + (int)(bench_random(&seed_noise) % (2 * SEED_ERROR + 1)) - SEED_ERROR);
+
+            start = bench_now();
+            found = motion_process(&motion, frame, width, height, width);
+            elapsed += bench_now() - start;
+            result->frames++;
+
+            if (motion.ego.estimates > (uint64_t)result->estimated)
+            {
+               result->estimated = (int)motion.ego.estimates;
+               result->exact += motion.ego.shift_x == -dx && motion.ego.shift_y == -dy;
+            }
+
+            // The first pass lets the background settle
+            if (r == 0 && l == 0)
+               continue;
+            result->panning += dx || dy;
+
+            in_view = walker && walker_x > view_x && walker_x + WALKER_SIZE < view_x + width;
+            if (!walker)
+               result->false_motion += found;
+            else if (in_view)
+            {
+               int wx = walker_x - view_x;
+
+               result->walker_frames++;
+               result->walker_found += found && motion.box_x <= wx + WALKER_SIZE && motion.box_x + motion.box_width >= wx;
+            }
+         }
+      }
+   }
+
+   result->per_frame = (double)elapsed / result->frames;
+   motion_destroy(&motion);
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-W width] [-H height] [-s speed] [-r repeats]\n", app);
+   fprintf(stderr, "  -s  pan speed in pixels per frame (default 30, about 60 deg/s at 10fps and 320 wide)\n");
+}
+
+int main(int argc, char **argv)
+{
+   int width = 320, height = 240, speed = 30, repeats = 4, opt, failed = 0;
+   uint8_t *scene, *frame;
+   RESULT results[2][MODE_COUNT];
+
+   while ((opt = getopt(argc, argv, "W:H:s:r:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'W' : width = atoi(optarg); break;
+         case 'H' : height = atoi(optarg); break;
+         case 's' : speed = atoi(optarg); break;
+         case 'r' : repeats = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (width < 64 || height < 64 || width > 640 || height > 480 || speed < 1 ||
+       speed > EGO_MOTION_DEFAULT_MAX_SHIFT || repeats < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   {
+      // Settle, then out and back along a patrol, with a tilt on the way
+      const LEG legs[] =
+      {
+         { 30, 0, 0 },
+         { 1200 / speed, speed, 0 }, { 20, 0, 0 },
+         { 200 / speed, speed / 2, speed / 2 }, { 20, 0, 0 },
+         { 200 / speed, -speed / 2, -speed / 2 }, { 20, 0, 0 },
+         { 1200 / speed, -speed, 0 }, { 20, 0, 0 },
+      };
+      int num_legs = sizeof(legs) / sizeof(legs[0]);
+
+      scene = malloc((size_t)SCENE_WIDTH * SCENE_HEIGHT);
+      frame = malloc((size_t)width * height);
+      if (!scene || !frame)
+      {
+         fprintf(stderr, "Out of memory\n");
+         return 1;
+      }
+      render_scene(scene);
+
+      for (int walker = 0; walker < 2; walker++)
+         for (int m = 0; m < MODE_COUNT; m++)
+            play((MODE)m, walker, scene, frame, width, height, legs, num_legs, repeats, &results[walker][m]);
+   }
+
+   printf("%dx%d, panning %d pixels a frame, %d frames a run, %d while moving\n\n", width, height, speed,
+          results[0][0].frames, results[0][0].panning);
+   printf("%-8s %9s %9s %9s %13s %13s\n", "ego", "us/frame", "exact", "seeded", "false motion", "walker found");
+   for (int m = 0; m < MODE_COUNT; m++)
+   {
+      RESULT *still = &results[0][m], *walking = &results[1][m];
+
+      printf("%-8s %9.1f %8.1f%% %9s %6d/%-6d %6d/%-6d\n", mode_names[m],
+             (still->per_frame + walking->per_frame) / 2,
+             still->estimated ? 100.0 * (still->exact + walking->exact) / (still->estimated + walking->estimated) : 0,
+             m == MODE_SEEDED ? "yes" : "no", still->false_motion, still->frames,
+             walking->walker_found, walking->walker_frames);
+   }
+
+   // Ego motion has to be right nearly every frame, stay quiet on an empty
+   // scene and keep finding the walker while the head moves
+   for (int m = MODE_EGO; m < MODE_COUNT; m++)
+   {
+      RESULT *still = &results[0][m], *walking = &results[1][m];
+
+      if ((still->exact + walking->exact) * 100 < (still->estimated + walking->estimated) * 95)
+      {
+         printf("%s: translation estimates wrong too often\n", mode_names[m]);
+         failed = 1;
+      }
+      if (still->false_motion * 100 > still->frames * 2)
+      {
+         printf("%s: motion reported with nothing moving\n", mode_names[m]);
+         failed = 1;
+      }
+      if (walking->walker_found * 100 < walking->walker_frames * 80)
+      {
+         printf("%s: walker lost while the head moved\n", mode_names[m]);
+         failed = 1;
+      }
+   }
+
+   free(scene);
+   free(frame);
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
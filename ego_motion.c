@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ego_motion.h"
+
+/**
+ * No memory is allocated until the first frame
+ */
+void ego_motion_init(EGO_MOTION *ego)
+{
+   memset(ego, 0, sizeof(*ego));
+   ego->max_shift = EGO_MOTION_DEFAULT_MAX_SHIFT;
+}
+
+/**
+ * Forget the last frame, the next one starts afresh
+ */
+void ego_motion_reset(EGO_MOTION *ego)
+{
+   for (int l = 0; l < EGO_MOTION_LEVELS; l++)
+   {
+      free(ego->previous[l]);
+      free(ego->current[l]);
+      ego->previous[l] = ego->current[l] = NULL;
+   }
+   ego->width = ego->height = 0;
+   ego->have_previous = 0;
+   ego->seeded = 0;
+}
+
+void ego_motion_destroy(EGO_MOTION *ego)
+{
+   ego_motion_reset(ego);
+}
+
+/**
+ * Say how far the scene should move in the next frame, from what the head
+ * was told to do. Only the next estimate uses it.
+ *
+ * @param dx, dy Pixels the scene should move by, positive is right/down
+ */
+void ego_motion_seed(EGO_MOTION *ego, int dx, int dy)
+{
+   ego->seed_x = dx;
+   ego->seed_y = dy;
+   ego->seeded = 1;
+}
+
+static int allocate(EGO_MOTION *ego, int width, int height)
+{
+   ego_motion_reset(ego);
+   ego->width = width;
+   ego->height = height;
+
+   // A shift of a sixth of the frame still leaves two thirds of it to match
+   ego->limit = (width < height ? width : height) / 6;
+   if (ego->limit > ego->max_shift)
+      ego->limit = ego->max_shift;
+
+   for (int l = 0; l < EGO_MOTION_LEVELS; l++)
+   {
+      ego->level_width[l] = width >> l;
+      ego->level_height[l] = height >> l;
+      ego->previous[l] = malloc((size_t)ego->level_width[l] * ego->level_height[l]);
+      ego->current[l] = malloc((size_t)ego->level_width[l] * ego->level_height[l]);
+      if (!ego->previous[l] || !ego->current[l])
+      {
+         ego_motion_reset(ego);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/**
+ * Average 2x2 blocks into the next level down
+ */
+static void downsample(const uint8_t *src, int src_width, uint8_t *dst, int width, int height)
+{
+   for (int y = 0; y < height; y++)
+   {
+      const uint8_t *a = src + (size_t)2 * y * src_width, *b = a + src_width;
+
+      for (int x = 0; x < width; x++)
+         dst[(size_t)y * width + x] = (uint8_t)((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+   }
+}
+
+/**
+ * Sum of absolute differences between two blocks
+ */
+static uint32_t block_sad(const uint8_t *a, const uint8_t *b, int stride, int width, int height)
+{
+   uint32_t sad = 0;
+
+#if defined(__ARM_NEON)
+   if (!(width & 15))
+   {
+      uint32x4_t total = vdupq_n_u32(0);
+
+      for (int y = 0; y < height; y++, a += stride, b += stride)
+      {
+         // A row of 16 bit lanes can't overflow, the frame can
+         uint16x8_t row = vdupq_n_u16(0);
+
+         for (int x = 0; x < width; x += 16)
+         {
+            uint8x16_t pa = vld1q_u8(a + x), pb = vld1q_u8(b + x);
+
+            row = vabal_u8(row, vget_low_u8(pa), vget_low_u8(pb));
+            row = vabal_u8(row, vget_high_u8(pa), vget_high_u8(pb));
+         }
+         total = vpadalq_u16(total, row);
+      }
+#if defined(__aarch64__)
+      return vaddvq_u32(total);
+#else
+      uint64x2_t sum = vpaddlq_u32(total);
+      return (uint32_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+#endif
+   }
+#elif defined(__SSE2__)
+   if (!(width & 15))
+   {
+      __m128i total = _mm_setzero_si128();
+
+      for (int y = 0; y < height; y++, a += stride, b += stride)
+         for (int x = 0; x < width; x += 16)
+            total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                                      _mm_loadu_si128((const __m128i *)(b + x))));
+      return (uint32_t)(_mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8)));
+   }
+#endif
+
+   for (int y = 0; y < height; y++, a += stride, b += stride)
+      for (int x = 0; x < width; x++)
+         sad += (uint32_t)abs(a[x] - b[x]);
+   return sad;
+}
+
+/**
+ * Best shift of one pyramid level within a square around a centre
+ *
+ * @return 0 on success, -1 if the level is too small to search
+ */
+static int search_level(EGO_MOTION *ego, int level, int centre_x, int centre_y, int radius, int *best_x, int *best_y)
+{
+   int width = ego->level_width[level], height = ego->level_height[level];
+   // The window stays inside both frames for any shift up to the margin
+   int margin = (ego->limit >> level) + 2;
+   int window_width = width - 2 * margin, window_height = height - 2 * margin;
+   const uint8_t *current = ego->current[level] + (size_t)margin * width + margin;
+   const uint8_t *previous = ego->previous[level] + (size_t)margin * width + margin;
+   uint32_t best = UINT32_MAX;
+
+   // Whole vectors are much quicker than a ragged edge
+   if (window_width >= 16)
+      window_width &= ~15;
+   if (window_width <= 0 || window_height <= 0)
+      return -1;
+
+   for (int dy = centre_y - radius; dy <= centre_y + radius; dy++)
+   {
+      if (dy <= -margin || dy >= margin)
+         continue;
+      for (int dx = centre_x - radius; dx <= centre_x + radius; dx++)
+      {
+         uint32_t sad;
+
+         if (dx <= -margin || dx >= margin)
+            continue;
+
+         // This frame's pixel came from (x - dx, y - dy) in the last one
+         sad = block_sad(current, previous - (ptrdiff_t)dy * width - dx, width, window_width, window_height);
+         // Ties go to the smaller shift, a flat scene shouldn't drift
+         if (sad < best || (sad == best && abs(dx) + abs(dy) < abs(*best_x) + abs(*best_y)))
+         {
+            best = sad;
+            *best_x = dx;
+            *best_y = dy;
+         }
+      }
+   }
+   return 0;
+}
+
+/**
+ * Estimate how far the scene moved since the last frame. The frame is
+ * kept for the next estimate.
+ *
+ * @param luma Luma plane of the frame
+ * @param dx, dy Return the shift, this frame's pixel (x, y) was at (x - dx, y - dy)
+ * @return 0 on success, -1 on the first frame, a size change or out of memory
+ */
+int ego_motion_estimate(EGO_MOTION *ego, const uint8_t *luma, int width, int height, int stride, int *dx, int *dy)
+{
+   int centre_x = 0, centre_y = 0, radius, x = 0, y = 0, status = 0;
+   int top = EGO_MOTION_LEVELS - 1;
+   uint8_t *swap[EGO_MOTION_LEVELS];
+
+   *dx = *dy = 0;
+   if (width != ego->width || height != ego->height || !ego->current[0])
+   {
+      if (allocate(ego, width, height) != 0)
+         return -1;
+   }
+
+   for (int row = 0; row < height; row++)
+      memcpy(ego->current[0] + (size_t)row * width, luma + (size_t)row * stride, width);
+   for (int l = 1; l < EGO_MOTION_LEVELS; l++)
+      downsample(ego->current[l - 1], ego->level_width[l - 1], ego->current[l],
+                 ego->level_width[l], ego->level_height[l]);
+
+   radius = ego->limit;
+   if (!ego->have_previous)
+      status = -1;
+   else
+   {
+      if (ego->seeded)
+      {
+         centre_x = ego->seed_x;
+         centre_y = ego->seed_y;
+         radius = EGO_MOTION_SEED_MARGIN;
+         ego->seeded_estimates++;
+      }
+
+      // Round the centre to the top level, then a pixel either way at each level below
+      if (search_level(ego, top, centre_x >> top, centre_y >> top, (radius + (1 << top) - 1) >> top, &x, &y) != 0)
+         status = -1;
+      for (int l = top - 1; l >= 0 && status == 0; l--)
+      {
+         int refine_x = 2 * x, refine_y = 2 * y;
+
+         if (search_level(ego, l, refine_x, refine_y, 1, &x, &y) != 0)
+            status = -1;
+      }
+   }
+
+   if (status == 0)
+   {
+      *dx = ego->shift_x = x;
+      *dy = ego->shift_y = y;
+      ego->estimates++;
+   }
+
+   memcpy(swap, ego->previous, sizeof(swap));
+   memcpy(ego->previous, ego->current, sizeof(swap));
+   memcpy(ego->current, swap, sizeof(swap));
+   ego->have_previous = 1;
+   ego->seeded = 0;
+   return status;
+}
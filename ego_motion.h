@@ -0,0 +1,48 @@
+#ifndef EGO_MOTION_H_
+#define EGO_MOTION_H_
+
+#include <stdint.h>
+
+/// Largest translation looked for between two frames, in pixels of the analysis frame
+#define EGO_MOTION_DEFAULT_MAX_SHIFT 40
+
+/// Search either side of the shift the head was expected to cause, in pixels
+#define EGO_MOTION_SEED_MARGIN       6
+
+/// Pyramid levels, each half the size of the one above
+#define EGO_MOTION_LEVELS            3
+
+/** Global translation between consecutive analysis frames, for when the
+ *  camera itself moves.
+ *  Each frame is reduced to a half and a quarter size copy. The shift is
+ *  found by block matching (sum of absolute differences over a central
+ *  window) at quarter size, then refined a pixel either way at half and
+ *  full size. Without a seed the quarter size search covers max_shift,
+ *  with one it only looks around the shift the head should have caused.
+ */
+typedef struct
+{
+   int max_shift;                            /// EGO_MOTION_DEFAULT_MAX_SHIFT
+   int width, height;                        /// Frame size the pyramids are for
+   int limit;                                /// max_shift, or less if the frame is too small to leave a window
+   uint8_t *previous[EGO_MOTION_LEVELS];     /// Last frame, full, half and quarter size
+   uint8_t *current[EGO_MOTION_LEVELS];      /// This frame, swapped with previous once estimated
+   int level_width[EGO_MOTION_LEVELS];
+   int level_height[EGO_MOTION_LEVELS];
+   int have_previous;
+
+   int seeded;                               /// seed_x/y hold the shift expected for the next frame
+   int seed_x, seed_y;
+
+   int shift_x, shift_y;                     /// Last estimate, the scene moved this far between the frames
+   uint64_t estimates;
+   uint64_t seeded_estimates;
+} EGO_MOTION;
+
+void ego_motion_init(EGO_MOTION *ego);
+void ego_motion_seed(EGO_MOTION *ego, int dx, int dy);
+int ego_motion_estimate(EGO_MOTION *ego, const uint8_t *luma, int width, int height, int stride, int *dx, int *dy);
+void ego_motion_reset(EGO_MOTION *ego);
+void ego_motion_destroy(EGO_MOTION *ego);
+
+#endif /* EGO_MOTION_H_ */
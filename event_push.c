@@ -0,0 +1,818 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "event_push.h"
+#include "clock_now.h"
+
+/// ioprio_set(2) values, glibc has no header for them
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+static int64_t wall_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double link_up(void *userdata)
+{
+   return __atomic_load_n(&((EVENT_PUSH *)userdata)->link_up, __ATOMIC_RELAXED);
+}
+
+static double outbox_bytes(void *userdata)
+{
+   return (double)__atomic_load_n(&((EVENT_PUSH *)userdata)->outbox_bytes, __ATOMIC_RELAXED);
+}
+
+static void register_metrics(EVENT_PUSH *push)
+{
+   push->sent_metric = metrics_counter("event_push_sent_total", "Events delivered to the endpoint", NULL);
+   push->dropped_metric = metrics_counter("event_push_dropped_total", "Events lost to a full queue or outbox", NULL);
+   push->failures_metric = metrics_counter("event_push_failures_total", "POSTs the endpoint didn't accept", NULL);
+   push->latency_metric = metrics_histogram("event_push_latency_us", "Event to delivery in microseconds",
+                                            NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   push->callback_metrics[0] = metrics_callback("event_push_link_up", "Last POST to the endpoint got through",
+                                                NULL, METRIC_GAUGE, link_up, push);
+   push->callback_metrics[1] = metrics_callback("event_push_outbox_bytes", "Batches waiting in the outbox",
+                                                NULL, METRIC_GAUGE, outbox_bytes, push);
+}
+
+/**
+ * Split http://host[:port][/path] up
+ *
+ * @return 0 on success, -1 if it isn't an http URL
+ */
+static int parse_url(EVENT_PUSH *push, const char *url)
+{
+   const char *host, *end, *path;
+
+   if (strncmp(url, "http://", 7) != 0)
+      return -1;
+
+   host = url + 7;
+   path = strchr(host, '/');
+   if (!path)
+      path = host + strlen(host);
+   end = memchr(host, ':', path - host);
+
+   push->host = strndup(host, (end ? end : path) - host);
+   push->port = end ? strndup(end + 1, path - end - 1) : strdup("80");
+   push->path = strdup(*path ? path : "/");
+
+   return push->host && push->port && push->path && *push->host && *push->port ? 0 : -1;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+   uint64_t x = ((const EVENT_PUSH_FILE *)a)->sequence, y = ((const EVENT_PUSH_FILE *)b)->sequence;
+
+   return x < y ? -1 : x > y;
+}
+
+static char *outbox_name(const EVENT_PUSH *push, const EVENT_PUSH_FILE *file)
+{
+   char *name = NULL;
+
+   if (asprintf(&name, "%s/%020llu-%d.json", push->outbox, (unsigned long long)file->sequence, file->events) < 0)
+      return NULL;
+   return name;
+}
+
+/**
+ * Pick up the batches a previous run left in the outbox
+ *
+ * @return 0 on success, -1 if the directory can't be made or read
+ */
+static int outbox_scan(EVENT_PUSH *push)
+{
+   DIR *dir;
+   struct dirent *entry;
+
+   if (mkdir(push->outbox, 0755) != 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "Unable to create event outbox %s; %s\n", push->outbox, strerror(errno));
+      return -1;
+   }
+
+   dir = opendir(push->outbox);
+   if (!dir)
+      return -1;
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      unsigned long long sequence;
+      int events, used = 0;
+      char *name;
+      struct stat st;
+      EVENT_PUSH_FILE *grown;
+
+      if (sscanf(entry->d_name, "%20llu-%d.json%n", &sequence, &events, &used) != 2 ||
+          entry->d_name[used] != 0 || asprintf(&name, "%s/%s", push->outbox, entry->d_name) < 0)
+      {
+         // Half written batches from a crash are no use to anyone
+         size_t length = strlen(entry->d_name);
+
+         if (length > 6 && strcmp(entry->d_name + length - 6, ".json~") == 0 &&
+             asprintf(&name, "%s/%s", push->outbox, entry->d_name) >= 0)
+         {
+            remove(name);
+            free(name);
+         }
+         continue;
+      }
+
+      if (stat(name, &st) == 0 && (grown = realloc(push->files, (push->num_files + 1) * sizeof(*grown))))
+      {
+         push->files = grown;
+         push->files[push->num_files].sequence = sequence;
+         push->files[push->num_files].events = events;
+         push->files[push->num_files].size = st.st_size;
+         push->num_files++;
+         push->outbox_bytes += st.st_size;
+      }
+      free(name);
+   }
+   closedir(dir);
+
+   qsort(push->files, push->num_files, sizeof(*push->files), compare_files);
+   return 0;
+}
+
+/**
+ * Set up the event channel
+ *
+ * @param url http://host[:port][/path] events are POSTed to
+ * @param outbox Directory batches wait in while the endpoint can't be reached, NULL for none
+ * @return 0 on success, -1 on failure
+ */
+int event_push_init(EVENT_PUSH *push, const char *url, const char *outbox)
+{
+   pthread_condattr_t attr;
+
+   memset(push, 0, sizeof(*push));
+   push->batch_delay = EVENT_PUSH_DEFAULT_BATCH_DELAY;
+   push->rate = EVENT_PUSH_DEFAULT_RATE;
+   push->timeout = EVENT_PUSH_DEFAULT_TIMEOUT;
+   push->outbox_limit = EVENT_PUSH_DEFAULT_OUTBOX_LIMIT;
+   push->link_up = 1;
+
+   // Ids carry on from the last run without having to be stored anywhere
+   push->next_id = wall_us();
+
+   if (parse_url(push, url) != 0)
+   {
+      fprintf(stderr, "Event endpoint must be http://host[:port][/path], not %s\n", url);
+      goto error;
+   }
+
+   if (outbox && (!(push->outbox = strdup(outbox)) || outbox_scan(push) != 0))
+      goto error;
+
+   pthread_mutex_init(&push->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&push->cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   register_metrics(push);
+   return 0;
+
+error:
+   free(push->host);
+   free(push->port);
+   free(push->path);
+   free(push->outbox);
+   free(push->files);
+   return -1;
+}
+
+static void wait_until(EVENT_PUSH *push, int64_t when)
+{
+   struct timespec ts = { when / 1000000, (when % 1000000) * 1000 };
+
+   pthread_cond_timedwait(&push->cond, &push->lock, &ts);
+}
+
+/**
+ * Wait until length bytes of the rate budget are free, or the thread is
+ * asked to quit. Up to a second's worth can be saved up for a burst.
+ */
+static void throttle(EVENT_PUSH *push, size_t length)
+{
+   if (!push->rate)
+      return;
+
+   pthread_mutex_lock(&push->lock);
+   for (;;)
+   {
+      int64_t now = clock_now_us();
+      double burst = push->rate > (double)length ? push->rate : (double)length;
+
+      push->tokens += (double)(now - push->tokens_time) * push->rate / 1e6;
+      push->tokens_time = now;
+      if (push->tokens > burst)
+         push->tokens = burst;
+
+      if (push->tokens >= length || push->quit)
+         break;
+      wait_until(push, now + (int64_t)((length - push->tokens) * 1e6 / push->rate) + 1);
+   }
+   push->tokens -= length;
+   pthread_mutex_unlock(&push->lock);
+}
+
+/**
+ * Wait for a socket until the deadline
+ *
+ * @return 0 when ready, -1 on timeout or error
+ */
+static int wait_socket(int fd, short events, int64_t deadline)
+{
+   struct pollfd pfd = { fd, events, 0 };
+   int64_t left = deadline - clock_now_us();
+   int result;
+
+   if (left <= 0)
+      return -1;
+
+   while ((result = poll(&pfd, 1, (int)((left + 999) / 1000))) < 0 && errno == EINTR)
+      ;
+   return result > 0 && !(pfd.revents & (POLLERR | POLLNVAL)) ? 0 : -1;
+}
+
+static int send_all(int fd, const char *data, size_t length, int64_t deadline)
+{
+   while (length)
+   {
+      ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+
+      if (written < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+         if (wait_socket(fd, POLLOUT, deadline) != 0)
+            return -1;
+         continue;
+      }
+      data += written;
+      length -= written;
+   }
+   return 0;
+}
+
+static int connect_endpoint(EVENT_PUSH *push, int64_t deadline)
+{
+   struct addrinfo hints, *addresses, *address;
+   int fd = -1;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(push->host, push->port, &hints, &addresses) != 0)
+      return -1;
+
+   for (address = addresses; address; address = address->ai_next)
+   {
+      int error = 0;
+      socklen_t length = sizeof(error);
+
+      fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+      if (fd < 0)
+         continue;
+
+      if (connect(fd, address->ai_addr, address->ai_addrlen) == 0 ||
+          (errno == EINPROGRESS && wait_socket(fd, POLLOUT, deadline) == 0 &&
+           getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && !error))
+         break;
+
+      close(fd);
+      fd = -1;
+   }
+
+   freeaddrinfo(addresses);
+   return fd;
+}
+
+/**
+ * POST a batch and wait for the status line
+ *
+ * @return 0 if the endpoint took it, -1 otherwise
+ */
+static int http_post(EVENT_PUSH *push, const char *body, size_t length)
+{
+   int64_t deadline = clock_now_us() + (int64_t)push->timeout * 1000;
+   char *header = NULL, response[64];
+   size_t got = 0;
+   int fd, header_length, status = 0;
+
+   fd = connect_endpoint(push, deadline);
+   if (fd < 0)
+      return -1;
+
+   header_length = asprintf(&header, "POST %s HTTP/1.1\r\n"
+                            "Host: %s:%s\r\n"
+                            "Content-Type: application/json\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", push->path, push->host, push->port, length);
+
+   if (header_length > 0 && send_all(fd, header, header_length, deadline) == 0 &&
+       send_all(fd, body, length, deadline) == 0)
+   {
+      // Only the status matters, the rest of the response is left unread
+      while (got < sizeof(response) - 1 && !memchr(response, '\n', got))
+      {
+         ssize_t n = recv(fd, response + got, sizeof(response) - 1 - got, 0);
+
+         if (n > 0)
+            got += n;
+         else if (n == 0 || (errno != EINTR && (errno != EAGAIN || wait_socket(fd, POLLIN, deadline) != 0)))
+            break;
+      }
+      response[got] = 0;
+      if (sscanf(response, "HTTP/1.%*d %d", &status) != 1)
+         status = 0;
+   }
+
+   free(header);
+   close(fd);
+   return status >= 200 && status < 300 ? 0 : -1;
+}
+
+/**
+ * POST a batch within the rate budget, keeping track of whether the link is up
+ *
+ * @return 0 if it was delivered, -1 otherwise
+ */
+static int post_batch(EVENT_PUSH *push, const char *body, size_t length, int events, int64_t oldest)
+{
+   int64_t now;
+
+   throttle(push, length);
+
+   if (http_post(push, body, length) != 0)
+   {
+      now = clock_now_us();
+      push->failures++;
+      metrics_add(push->failures_metric, 1);
+      if (__atomic_exchange_n(&push->link_up, 0, __ATOMIC_RELAXED))
+         fprintf(stderr, "Event endpoint %s:%s not answering, queueing events\n", push->host, push->port);
+
+      // Back off so a dead endpoint isn't hammered
+      push->backoff = push->backoff ? push->backoff * 2 : 1000;
+      if (push->backoff > EVENT_PUSH_MAX_BACKOFF)
+         push->backoff = EVENT_PUSH_MAX_BACKOFF;
+      push->retry_at = now + (int64_t)push->backoff * 1000;
+      return -1;
+   }
+
+   if (!__atomic_exchange_n(&push->link_up, 1, __ATOMIC_RELAXED))
+      fprintf(stderr, "Event endpoint %s:%s back\n", push->host, push->port);
+   push->backoff = 0;
+   push->sent += events;
+   push->batches_sent++;
+   metrics_add(push->sent_metric, events);
+   metrics_observe(push->latency_metric, (uint64_t)(wall_us() - oldest));
+   return 0;
+}
+
+static int link_usable(EVENT_PUSH *push)
+{
+   return __atomic_load_n(&push->link_up, __ATOMIC_RELAXED) || clock_now_us() >= push->retry_at;
+}
+
+static void outbox_remove_oldest(EVENT_PUSH *push)
+{
+   char *name = outbox_name(push, &push->files[0]);
+
+   if (name)
+      remove(name);
+   free(name);
+
+   __atomic_sub_fetch(&push->outbox_bytes, push->files[0].size, __ATOMIC_RELAXED);
+   memmove(push->files, push->files + 1, (push->num_files - 1) * sizeof(*push->files));
+   push->num_files--;
+}
+
+/**
+ * Keep a batch in the outbox, or drop it without one
+ */
+static void outbox_write(EVENT_PUSH *push, const char *body, size_t length, int events, int64_t oldest)
+{
+   EVENT_PUSH_FILE file = { (uint64_t)oldest, events, length };
+   EVENT_PUSH_FILE *grown;
+   char *name = NULL, *temp = NULL;
+   FILE *handle;
+
+   if (!push->outbox)
+      goto dropped;
+
+   // Clocks can go backwards, the outbox order mustn't
+   if (push->num_files && file.sequence <= push->files[push->num_files - 1].sequence)
+      file.sequence = push->files[push->num_files - 1].sequence + 1;
+
+   grown = realloc(push->files, (push->num_files + 1) * sizeof(*grown));
+   if (!grown)
+      goto dropped;
+   push->files = grown;
+
+   name = outbox_name(push, &file);
+   if (!name || asprintf(&temp, "%s~", name) < 0)
+      goto dropped;
+
+   throttle(push, length);
+
+   // Same temp and rename dance as storage, a crash never leaves half a batch
+   handle = fopen(temp, "wb");
+   if (!handle)
+      goto dropped;
+   if (fwrite(body, 1, length, handle) != length || fclose(handle) != 0 || rename(temp, name) != 0)
+   {
+      remove(temp);
+      goto dropped;
+   }
+
+   push->files[push->num_files++] = file;
+   __atomic_add_fetch(&push->outbox_bytes, length, __ATOMIC_RELAXED);
+   push->outbox_written++;
+   free(name);
+   free(temp);
+
+   while (push->outbox_bytes > push->outbox_limit && push->num_files > 1)
+   {
+      push->dropped += push->files[0].events;
+      metrics_add(push->dropped_metric, push->files[0].events);
+      outbox_remove_oldest(push);
+   }
+   return;
+
+dropped:
+   free(name);
+   free(temp);
+   push->dropped += events;
+   metrics_add(push->dropped_metric, events);
+}
+
+/**
+ * @return Non zero if new events are piling up behind the batch being sent
+ */
+static int backlogged(EVENT_PUSH *push)
+{
+   int count;
+
+   pthread_mutex_lock(&push->lock);
+   count = push->count;
+   pthread_mutex_unlock(&push->lock);
+   return count >= EVENT_PUSH_QUEUE_SIZE / 2;
+}
+
+static int quitting(EVENT_PUSH *push)
+{
+   int quit;
+
+   pthread_mutex_lock(&push->lock);
+   quit = push->quit;
+   pthread_mutex_unlock(&push->lock);
+   return quit;
+}
+
+/**
+ * Send the outbox oldest first while the link holds up. Stops early if new
+ * events are backing up, they go to the outbox rather than overflow.
+ */
+static void outbox_drain(EVENT_PUSH *push)
+{
+   while (push->num_files && link_usable(push) && !backlogged(push) && !quitting(push))
+   {
+      EVENT_PUSH_FILE *file = &push->files[0];
+      char *name = outbox_name(push, file), *body = NULL;
+      FILE *handle = name ? fopen(name, "rb") : NULL;
+      int status = -1;
+
+      if (handle)
+      {
+         throttle(push, file->size);
+         body = malloc(file->size ? file->size : 1);
+         if (body && fread(body, 1, file->size, handle) == file->size)
+            status = 0;
+         fclose(handle);
+      }
+      free(name);
+
+      // Unreadable batches are lost, they would block the outbox forever
+      if (status != 0)
+      {
+         push->dropped += file->events;
+         metrics_add(push->dropped_metric, file->events);
+         outbox_remove_oldest(push);
+      }
+      else if (post_batch(push, body, file->size, file->events, (int64_t)file->sequence) == 0)
+         outbox_remove_oldest(push);
+
+      free(body);
+   }
+}
+
+static void write_base64(FILE *out, const uint8_t *data, size_t length)
+{
+   static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+   for (size_t i = 0; i < length; i += 3)
+   {
+      uint32_t bits = (uint32_t)data[i] << 16;
+
+      if (i + 1 < length)
+         bits |= (uint32_t)data[i + 1] << 8;
+      if (i + 2 < length)
+         bits |= data[i + 2];
+
+      fputc(digits[bits >> 18], out);
+      fputc(digits[(bits >> 12) & 63], out);
+      fputc(i + 1 < length ? digits[(bits >> 6) & 63] : '=', out);
+      fputc(i + 2 < length ? digits[bits & 63] : '=', out);
+   }
+}
+
+/**
+ * Events as {"events":[...]}, thumbnails are base64 PGMs
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int format_batch(const EVENT_PUSH_EVENT *events, int count, char **body, size_t *length)
+{
+   FILE *out = open_memstream(body, length);
+
+   if (!out)
+      return -1;
+
+   fputs("{\"events\":[", out);
+   for (int i = 0; i < count; i++)
+   {
+      const EVENT_PUSH_EVENT *event = &events[i];
+
+      fprintf(out, "%s{\"id\":%llu,\"camera\":%d,\"time\":%lld.%06lld,\"type\":\"", i ? "," : "",
+              (unsigned long long)event->id, event->camera, (long long)(event->time / 1000000),
+              (long long)(event->time % 1000000));
+      for (const char *c = event->label; *c && c < event->label + sizeof(event->label); c++)
+         if (*c != '"' && *c != '\\' && (unsigned char)*c >= ' ')
+            fputc(*c, out);
+      fprintf(out, "\",\"score\":%.3f,\"box\":[%d,%d,%d,%d]", event->score, event->x, event->y,
+              event->width, event->height);
+
+      if (event->thumbnail_width)
+      {
+         char header[32];
+         int header_length = snprintf(header, sizeof(header), "P5\n%d %d\n255\n", event->thumbnail_width,
+                                      event->thumbnail_height);
+         size_t size = (size_t)event->thumbnail_width * event->thumbnail_height;
+         uint8_t *pgm = malloc(header_length + size);
+
+         if (pgm)
+         {
+            memcpy(pgm, header, header_length);
+            memcpy(pgm + header_length, event->thumbnail, size);
+            fputs(",\"thumbnail\":\"data:image/x-portable-graymap;base64,", out);
+            write_base64(out, pgm, header_length + size);
+            fputc('"', out);
+            free(pgm);
+         }
+      }
+      fputc('}', out);
+   }
+   fputs("]}", out);
+
+   return fclose(out) == 0 ? 0 : -1;
+}
+
+/**
+ * Send a batch, or queue it in the outbox behind the ones already there
+ */
+static void deliver(EVENT_PUSH *push, int count)
+{
+   char *body = NULL;
+   size_t length = 0;
+   int64_t oldest = push->batch[0].time;
+
+   if (format_batch(push->batch, count, &body, &length) != 0)
+   {
+      push->dropped += count;
+      metrics_add(push->dropped_metric, count);
+      return;
+   }
+
+   // A consumer slower than the cameras pushes the backlog onto disk
+   // rather than the queue dropping events
+   if (!(push->outbox && backlogged(push)))
+   {
+      outbox_drain(push);
+      if (!push->num_files && link_usable(push) &&
+          post_batch(push, body, length, count, oldest) == 0)
+         count = 0;
+   }
+
+   if (count)
+      outbox_write(push, body, length, count, oldest);
+   free(body);
+}
+
+/**
+ * Make the push thread's disk I/O wait for everyone else's. Best effort,
+ * the rate budget still applies without it.
+ */
+static void lower_io_priority(void)
+{
+#ifdef SYS_ioprio_set
+   syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+static void *push_thread(void *arg)
+{
+   EVENT_PUSH *push = (EVENT_PUSH *)arg;
+
+   lower_io_priority();
+
+   pthread_mutex_lock(&push->lock);
+   push->tokens_time = clock_now_us();
+
+   for (;;)
+   {
+      int64_t gather;
+      int count;
+
+      // Sleep until there are events, or it is time to retry the outbox
+      while (!push->count && !push->quit)
+      {
+         if (!push->num_files)
+            pthread_cond_wait(&push->cond, &push->lock);
+         else if (push->link_up || clock_now_us() >= push->retry_at)
+            break;
+         else
+            wait_until(push, push->retry_at);
+      }
+      if (!push->count && push->quit)
+         break;
+
+      if (!push->count)
+      {
+         pthread_mutex_unlock(&push->lock);
+         outbox_drain(push);
+         pthread_mutex_lock(&push->lock);
+         continue;
+      }
+
+      // Give the rest of a burst a moment to join the batch
+      gather = clock_now_us() + (int64_t)push->batch_delay * 1000;
+      while (push->count < EVENT_PUSH_MAX_BATCH && !push->quit && clock_now_us() < gather)
+         wait_until(push, gather);
+
+      count = push->count < EVENT_PUSH_MAX_BATCH ? push->count : EVENT_PUSH_MAX_BATCH;
+      for (int i = 0; i < count; i++)
+      {
+         push->batch[i] = push->queue[push->head];
+         push->head = (push->head + 1) % EVENT_PUSH_QUEUE_SIZE;
+         push->count--;
+      }
+      pthread_mutex_unlock(&push->lock);
+
+      deliver(push, count);
+
+      pthread_mutex_lock(&push->lock);
+   }
+
+   pthread_mutex_unlock(&push->lock);
+   return NULL;
+}
+
+/**
+ * Start the push thread
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int event_push_start(EVENT_PUSH *push)
+{
+   push->quit = 0;
+   if (pthread_create(&push->thread, NULL, push_thread, push) != 0)
+      return -1;
+   push->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Scale a frame down into an event's thumbnail by averaging blocks of pixels
+ *
+ * @param luma Luma plane of the frame
+ * @param stride Bytes per row
+ */
+void event_push_thumbnail(EVENT_PUSH_EVENT *event, const uint8_t *luma, int width, int height, int stride)
+{
+   int scale_x = (width + EVENT_PUSH_THUMBNAIL_WIDTH - 1) / EVENT_PUSH_THUMBNAIL_WIDTH;
+   int scale_y = (height + EVENT_PUSH_THUMBNAIL_HEIGHT - 1) / EVENT_PUSH_THUMBNAIL_HEIGHT;
+   int scale = scale_x > scale_y ? scale_x : scale_y;
+
+   if (scale < 1)
+      scale = 1;
+   event->thumbnail_width = width / scale;
+   event->thumbnail_height = height / scale;
+
+   for (int y = 0; y < event->thumbnail_height; y++)
+   {
+      for (int x = 0; x < event->thumbnail_width; x++)
+      {
+         const uint8_t *block = luma + (size_t)y * scale * stride + x * scale;
+         int sum = 0;
+
+         for (int by = 0; by < scale; by++)
+            for (int bx = 0; bx < scale; bx++)
+               sum += block[(size_t)by * stride + bx];
+         event->thumbnail[y * event->thumbnail_width + x] = (uint8_t)(sum / (scale * scale));
+      }
+   }
+}
+
+/**
+ * Queue an event to be pushed, never waits on the network or disk
+ *
+ * @param event Event to copy, its id is filled in
+ * @return 0 if queued, 1 if queued at the expense of the oldest event
+ */
+int event_push_submit(EVENT_PUSH *push, EVENT_PUSH_EVENT *event)
+{
+   int dropped = 0;
+
+   pthread_mutex_lock(&push->lock);
+
+   push->submitted++;
+   if (push->count == EVENT_PUSH_QUEUE_SIZE)
+   {
+      push->head = (push->head + 1) % EVENT_PUSH_QUEUE_SIZE;
+      push->count--;
+      push->dropped++;
+      metrics_add(push->dropped_metric, 1);
+      dropped = 1;
+   }
+
+   event->id = push->next_id++;
+   push->queue[(push->head + push->count) % EVENT_PUSH_QUEUE_SIZE] = *event;
+   push->count++;
+   pthread_cond_broadcast(&push->cond);
+
+   pthread_mutex_unlock(&push->lock);
+   return dropped;
+}
+
+/**
+ * Stop the push thread. Events still queued are sent if the endpoint is
+ * there, otherwise they join the outbox for the next run.
+ */
+void event_push_stop(EVENT_PUSH *push)
+{
+   if (!push->thread_running)
+      return;
+
+   pthread_mutex_lock(&push->lock);
+   push->quit = 1;
+   pthread_cond_broadcast(&push->cond);
+   pthread_mutex_unlock(&push->lock);
+
+   pthread_join(push->thread, NULL);
+   push->thread_running = 0;
+}
+
+void event_push_destroy(EVENT_PUSH *push)
+{
+   event_push_stop(push);
+
+   // The callbacks read this channel, the plain counters live on in the registry
+   for (int i = 0; i < 2; i++)
+   {
+      metrics_unregister(push->callback_metrics[i]);
+      push->callback_metrics[i] = NULL;
+   }
+
+   pthread_cond_destroy(&push->cond);
+   pthread_mutex_destroy(&push->lock);
+   free(push->host);
+   free(push->port);
+   free(push->path);
+   free(push->outbox);
+   free(push->files);
+   push->host = push->port = push->path = push->outbox = NULL;
+   push->files = NULL;
+}
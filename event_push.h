@@ -0,0 +1,121 @@
+#ifndef EVENT_PUSH_H_
+#define EVENT_PUSH_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cnn.h"
+#include "metrics.h"
+
+/// Events waiting for the push thread, beyond this the oldest is dropped
+#define EVENT_PUSH_QUEUE_SIZE       32
+
+/// Most events sent in one POST
+#define EVENT_PUSH_MAX_BATCH        16
+
+/// Time the first event of a batch waits for others to join it (ms)
+#define EVENT_PUSH_DEFAULT_BATCH_DELAY 500
+
+/// Bytes per second the push thread may move over the network and to/from the outbox
+#define EVENT_PUSH_DEFAULT_RATE     (256 * 1024)
+
+/// Time a POST may take before the link is taken as down (ms)
+#define EVENT_PUSH_DEFAULT_TIMEOUT  5000
+
+/// Longest wait between attempts while the link is down (ms)
+#define EVENT_PUSH_MAX_BACKOFF      60000
+
+/// Outbox size beyond which the oldest batches are thrown away
+#define EVENT_PUSH_DEFAULT_OUTBOX_LIMIT (64 * 1024 * 1024)
+
+/// Largest thumbnail sent with an event, the frame is scaled down to fit
+#define EVENT_PUSH_THUMBNAIL_WIDTH  80
+#define EVENT_PUSH_THUMBNAIL_HEIGHT 60
+
+/** Something one of the cameras saw
+ */
+typedef struct
+{
+   uint64_t id;                     /// Set by event_push_submit, increases across restarts
+   int camera;
+   int64_t time;                    /// Wall clock time (us since the epoch)
+   char label[CNN_CLASS_NAME_LEN];  /// Detected class, or "motion"
+   float score;                     /// Detector score, 0 for motion alone
+   int x, y, width, height;         /// Box in analysis frame pixels
+   int thumbnail_width;             /// 0 for no thumbnail
+   int thumbnail_height;
+   uint8_t thumbnail[EVENT_PUSH_THUMBNAIL_WIDTH * EVENT_PUSH_THUMBNAIL_HEIGHT];
+} EVENT_PUSH_EVENT;
+
+/** A batch waiting in the outbox directory
+ */
+typedef struct
+{
+   uint64_t sequence;               /// Wall clock time of its oldest event (us), batches go out in this order
+   int events;
+   size_t size;
+} EVENT_PUSH_FILE;
+
+/** Outbound event channel shared by every pipeline.
+ *  Events are POSTed as JSON in batches to an HTTP endpoint by one thread.
+ *  Submitting never waits on the network or the disk. While the endpoint
+ *  can't be reached batches go to an outbox directory instead, and once
+ *  it answers again the outbox is sent oldest first ahead of anything new.
+ *  Uploads and outbox I/O share a byte rate budget, and the thread runs at
+ *  idle I/O priority, so pushing events never takes bandwidth from the
+ *  pipelines writing captures and recordings.
+ */
+typedef struct
+{
+   char *host;
+   char *port;
+   char *path;
+   char *outbox;                    /// Outbox directory, NULL to drop batches while the link is down
+   int batch_delay;                 /// EVENT_PUSH_DEFAULT_BATCH_DELAY
+   int rate;                        /// EVENT_PUSH_DEFAULT_RATE, 0 for no limit
+   int timeout;                     /// EVENT_PUSH_DEFAULT_TIMEOUT
+   size_t outbox_limit;             /// EVENT_PUSH_DEFAULT_OUTBOX_LIMIT
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   EVENT_PUSH_EVENT queue[EVENT_PUSH_QUEUE_SIZE];
+   int head;                        /// Oldest event in the queue
+   int count;                       /// Events in the queue
+   EVENT_PUSH_EVENT batch[EVENT_PUSH_MAX_BATCH]; /// Events being sent, swapped out of the queue
+   uint64_t next_id;
+   int quit;
+   pthread_t thread;
+   int thread_running;
+
+   double tokens;                   /// Bytes that may be moved now
+   int64_t tokens_time;             /// When tokens was last topped up (us)
+   int link_up;                     /// Last POST got through
+   int64_t retry_at;                /// No POSTs before then while the link is down (us)
+   int backoff;                     /// Current wait between attempts (ms)
+   EVENT_PUSH_FILE *files;          /// Outbox batches, oldest first
+   int num_files;
+   size_t outbox_bytes;
+
+   uint64_t submitted;              /// Events submitted
+   uint64_t dropped;                /// Events lost to a full queue or outbox
+   uint64_t sent;                   /// Events delivered
+   uint64_t batches_sent;
+   uint64_t failures;               /// POSTs that didn't get a 2xx
+   uint64_t outbox_written;         /// Batches that had to wait in the outbox
+
+   METRIC *sent_metric;
+   METRIC *dropped_metric;
+   METRIC *failures_metric;
+   METRIC *latency_metric;          /// Event to delivery (us)
+   METRIC *callback_metrics[2];     /// Callback metrics reading the link and outbox
+} EVENT_PUSH;
+
+int event_push_init(EVENT_PUSH *push, const char *url, const char *outbox);
+int event_push_start(EVENT_PUSH *push);
+void event_push_thumbnail(EVENT_PUSH_EVENT *event, const uint8_t *luma, int width, int height, int stride);
+int event_push_submit(EVENT_PUSH *push, EVENT_PUSH_EVENT *event);
+void event_push_stop(EVENT_PUSH *push);
+void event_push_destroy(EVENT_PUSH *push);
+
+#endif /* EVENT_PUSH_H_ */
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "exposure_cache.h"
+
+/**
+ * Read a previously saved exposure state back in.
+ *
+ * The file is a handful of key=value lines written by exposure_cache_save.
+ * Unknown keys are skipped so older/newer versions can share the file.
+ *
+ * @param path Cache file to read
+ * @param exposure Receives the values, valid is only set on success
+ * @param max_age Maximum age of the cache in seconds, 0 to accept any age
+ * @return 0 if usable values were loaded, -1 otherwise
+ */
+int exposure_cache_load(const char *path, EXPOSURE_STATE *exposure, int max_age)
+{
+   FILE *cache_file;
+   char line[128];
+   int fields = 0;
+
+   memset(exposure, 0, sizeof(*exposure));
+
+   cache_file = fopen(path, "r");
+   if (!cache_file)
+      return -1;
+
+   while (fgets(line, sizeof(line), cache_file))
+   {
+      char key[32];
+      double value;
+
+      if (line[0] == '#' || sscanf(line, "%31[^=]=%lf", key, &value) != 2)
+         continue;
+
+      if (!strcmp(key, "saved"))
+         exposure->saved_at = (int64_t)value, fields++;
+      else if (!strcmp(key, "exposure"))
+         exposure->exposure = (uint32_t)value, fields++;
+      else if (!strcmp(key, "analog_gain"))
+         exposure->analog_gain = (float)value, fields++;
+      else if (!strcmp(key, "digital_gain"))
+         exposure->digital_gain = (float)value, fields++;
+      else if (!strcmp(key, "awb_red_gain"))
+         exposure->awb_red_gain = (float)value, fields++;
+      else if (!strcmp(key, "awb_blue_gain"))
+         exposure->awb_blue_gain = (float)value, fields++;
+   }
+
+   fclose(cache_file);
+
+   if (fields != 6 || !exposure->exposure ||
+         exposure->analog_gain <= 0 || exposure->digital_gain <= 0 ||
+         exposure->awb_red_gain <= 0 || exposure->awb_blue_gain <= 0)
+      return -1;
+
+   if (max_age && (int64_t)time(NULL) - exposure->saved_at > max_age)
+      return -1;
+
+   exposure->valid = 1;
+   return 0;
+}
+
+/**
+ * Write the exposure state out so the next run can start from it.
+ *
+ * Same temp~ then rename trick as the photos so a crash mid write never
+ * leaves a half written cache behind.
+ *
+ * @param path Cache file to write
+ * @param exposure Values to save, must be valid
+ * @return 0 on success, -1 on failure
+ */
+int exposure_cache_save(const char *path, const EXPOSURE_STATE *exposure)
+{
+   char temp_path[256];
+   FILE *cache_file;
+   int ok;
+
+   if (!exposure->valid)
+      return -1;
+
+   if (snprintf(temp_path, sizeof(temp_path), "%s~", path) >= (int)sizeof(temp_path))
+      return -1;
+
+   cache_file = fopen(temp_path, "w");
+   if (!cache_file)
+      return -1;
+
+   fprintf(cache_file, "# converged camera exposure, restored on startup\n");
+   fprintf(cache_file, "saved=%lld\n", (long long)time(NULL));
+   fprintf(cache_file, "exposure=%u\n", exposure->exposure);
+   fprintf(cache_file, "analog_gain=%f\n", exposure->analog_gain);
+   fprintf(cache_file, "digital_gain=%f\n", exposure->digital_gain);
+   fprintf(cache_file, "awb_red_gain=%f\n", exposure->awb_red_gain);
+   fprintf(cache_file, "awb_blue_gain=%f\n", exposure->awb_blue_gain);
+
+   ok = !ferror(cache_file);
+   if (fclose(cache_file) != 0)
+      ok = 0;
+
+   if (!ok || rename(temp_path, path) != 0)
+   {
+      remove(temp_path);
+      return -1;
+   }
+   return 0;
+}
+
+static int within_tolerance(double previous, double current)
+{
+   if (previous == current)
+      return 1;
+   if (previous <= 0)
+      return 0;
+   return fabs(current - previous) * 100.0 <= previous * EXPOSURE_CONVERGE_TOLERANCE;
+}
+
+/**
+ * Check whether two consecutive camera settings reports are close enough
+ * that the AGC/AWB loops can be considered settled.
+ *
+ * @return 1 if every value moved less than EXPOSURE_CONVERGE_TOLERANCE percent
+ */
+int exposure_state_settled(const EXPOSURE_STATE *previous, const EXPOSURE_STATE *current)
+{
+   if (!previous->valid || !current->valid)
+      return 0;
+
+   return within_tolerance(previous->exposure, current->exposure) &&
+          within_tolerance(previous->analog_gain, current->analog_gain) &&
+          within_tolerance(previous->digital_gain, current->digital_gain) &&
+          within_tolerance(previous->awb_red_gain, current->awb_red_gain) &&
+          within_tolerance(previous->awb_blue_gain, current->awb_blue_gain);
+}
@@ -0,0 +1,34 @@
+#ifndef EXPOSURE_CACHE_H_
+#define EXPOSURE_CACHE_H_
+
+#include <stdint.h>
+
+/// Cached values older than this (seconds) are ignored, the light has
+/// probably changed too much for them to be a useful starting point.
+#define EXPOSURE_CACHE_MAX_AGE 3600
+
+/// Relative change (percent) between two reports below which the AGC/AWB
+/// is treated as settled
+#define EXPOSURE_CONVERGE_TOLERANCE 2
+
+/// Number of consecutive settled reports before the values are worth saving
+#define EXPOSURE_CONVERGE_COUNT 3
+
+/** Snapshot of the exposure/white balance the camera has converged to
+ */
+typedef struct
+{
+   int valid;                 /// Non zero once the fields below hold real values
+   uint32_t exposure;         /// Shutter time in microseconds
+   float analog_gain;         /// Analog gain (1.0 == unity)
+   float digital_gain;        /// Digital gain (1.0 == unity)
+   float awb_red_gain;        /// AWB red gain
+   float awb_blue_gain;       /// AWB blue gain
+   int64_t saved_at;          /// Wall clock time (seconds) the values were written
+} EXPOSURE_STATE;
+
+int exposure_cache_load(const char *path, EXPOSURE_STATE *exposure, int max_age);
+int exposure_cache_save(const char *path, const EXPOSURE_STATE *exposure);
+int exposure_state_settled(const EXPOSURE_STATE *previous, const EXPOSURE_STATE *current);
+
+#endif /* EXPOSURE_CACHE_H_ */
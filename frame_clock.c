@@ -0,0 +1,235 @@
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "frame_clock.h"
+
+void frame_clock_init(FRAME_CLOCK *clock)
+{
+   memset(clock, 0, sizeof(*clock));
+   pthread_mutex_init(&clock->lock, NULL);
+}
+
+void frame_clock_destroy(FRAME_CLOCK *clock)
+{
+   pthread_mutex_destroy(&clock->lock);
+}
+
+/**
+ * Forget the reference points, the sensor clock is starting over.
+ * The drift belongs to the crystal rather than the run so it is kept.
+ */
+void frame_clock_reset(FRAME_CLOCK *clock)
+{
+   pthread_mutex_lock(&clock->lock);
+   clock->synced = 0;
+   clock->history_count = 0;
+   clock->history_next = 0;
+   clock->window_reads = 0;
+   __atomic_store_n(&clock->last_sync, 0, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&clock->lock);
+}
+
+/**
+ * Whether the caller should read the sensor clock now. Only one caller
+ * at a time is told to, and it must follow up with frame_clock_sync.
+ *
+ * @param now CLOCK_MONOTONIC (us)
+ * @return 1 if the caller is to read the sensor clock
+ */
+int frame_clock_sync_due(FRAME_CLOCK *clock, int64_t now)
+{
+   if (__atomic_load_n(&clock->syncing, __ATOMIC_RELAXED))
+      return 0;
+   if (__atomic_load_n(&clock->last_sync, __ATOMIC_RELAXED) &&
+       now - __atomic_load_n(&clock->last_sync, __ATOMIC_RELAXED) < FRAME_CLOCK_SYNC_INTERVAL)
+      return 0;
+   return !__atomic_exchange_n(&clock->syncing, 1, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Take a new reference point and measure the drift from the oldest one
+ * still in the history
+ *
+ * @param replace The current reference point was a poor read, this one
+ *                takes its place in the history rather than following it
+ */
+static void take_reference(FRAME_CLOCK *clock, int64_t sensor, int64_t host, int64_t error, int replace)
+{
+   if (replace && clock->history_count)
+   {
+      clock->history_next = (clock->history_next - 1 + FRAME_CLOCK_HISTORY) % FRAME_CLOCK_HISTORY;
+      clock->history_count--;
+   }
+
+   clock->base_sensor = sensor;
+   clock->base_host = host;
+   clock->error = error;
+   clock->synced = 1;
+   clock->syncs++;
+
+   if (clock->history_count)
+   {
+      int oldest = (clock->history_next - clock->history_count + FRAME_CLOCK_HISTORY) % FRAME_CLOCK_HISTORY;
+      int64_t span = sensor - clock->history_sensor[oldest];
+
+      if (span > 0)
+      {
+         double drift = (double)(host - clock->history_host[oldest]) / span - 1;
+         double limit = FRAME_CLOCK_MAX_DRIFT / 1e6;
+
+         clock->drift = drift < -limit ? -limit : drift > limit ? limit : drift;
+      }
+   }
+
+   clock->history_sensor[clock->history_next] = sensor;
+   clock->history_host[clock->history_next] = host;
+   clock->history_next = (clock->history_next + 1) % FRAME_CLOCK_HISTORY;
+   if (clock->history_count < FRAME_CLOCK_HISTORY)
+      clock->history_count++;
+}
+
+/**
+ * Hand over a read of the sensor clock, after frame_clock_sync_due said to
+ * take one. The first read after a reset is used straight away, after that
+ * the best of each window becomes the next reference point, unless a read
+ * is so much tighter than the current one it replaces it. A sensor time
+ * before the reference point's means the sensor clock started over.
+ *
+ * @param sensor Sensor clock (us), negative if it couldn't be read
+ * @param before CLOCK_MONOTONIC just before the read (us)
+ * @param after CLOCK_MONOTONIC just after it
+ */
+void frame_clock_sync(FRAME_CLOCK *clock, int64_t sensor, int64_t before, int64_t after)
+{
+   int64_t host = before + (after - before) / 2, error = (after - before + 1) / 2;
+
+   pthread_mutex_lock(&clock->lock);
+   __atomic_store_n(&clock->last_sync, after, __ATOMIC_RELAXED);
+
+   if (sensor >= 0 && after >= before)
+   {
+      if (clock->synced && sensor < clock->base_sensor)
+      {
+         clock->synced = 0;
+         clock->history_count = 0;
+         clock->resets++;
+      }
+
+      if (!clock->synced)
+      {
+         clock->window_reads = 0;
+         take_reference(clock, sensor, host, error, 0);
+      }
+      else if (error < clock->error / 2)
+      {
+         // The reference point was a read that got held up, don't carry it a whole window
+         clock->window_reads = 0;
+         take_reference(clock, sensor, host, error, 1);
+      }
+      else
+      {
+         if (!clock->window_reads || error < clock->window_error)
+         {
+            clock->window_sensor = sensor;
+            clock->window_host = host;
+            clock->window_error = error;
+         }
+         if (++clock->window_reads >= FRAME_CLOCK_WINDOW)
+         {
+            clock->window_reads = 0;
+            take_reference(clock, clock->window_sensor, clock->window_host, clock->window_error, 0);
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&clock->lock);
+   __atomic_store_n(&clock->syncing, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * When a frame was taken, by CLOCK_MONOTONIC.
+ * Never after the frame arrived. A frame without a timestamp, or with one
+ * the mapping can't place near its arrival, gets its arrival less the
+ * usual delay, and the latter has the sensor clock read again.
+ *
+ * @param sensor Frame's timestamp on the sensor clock (us), FRAME_TIME_UNKNOWN if none
+ * @param arrival CLOCK_MONOTONIC when the frame arrived (us)
+ * @return CLOCK_MONOTONIC when the frame was taken (us)
+ */
+int64_t frame_clock_map(FRAME_CLOCK *clock, int64_t sensor, int64_t arrival)
+{
+   int64_t time, since;
+
+   pthread_mutex_lock(&clock->lock);
+
+   if (sensor == FRAME_TIME_UNKNOWN || !clock->synced)
+   {
+      time = arrival - clock->delay;
+      pthread_mutex_unlock(&clock->lock);
+      return time;
+   }
+
+   since = sensor - clock->base_sensor;
+   time = clock->base_host + since + (int64_t)llrint(clock->drift * since);
+
+   if (time - arrival > FRAME_CLOCK_MAX_DELAY || arrival - time > FRAME_CLOCK_MAX_DELAY)
+   {
+      __atomic_store_n(&clock->last_sync, 0, __ATOMIC_RELAXED);
+      time = arrival - clock->delay;
+      pthread_mutex_unlock(&clock->lock);
+      return time;
+   }
+
+   if (time > arrival)
+      time = arrival;
+
+   // Smoothed over a few dozen frames, seeded by the first
+   clock->delay = clock->delay ? clock->delay + (arrival - time - clock->delay) / 32 : arrival - time;
+
+   pthread_mutex_unlock(&clock->lock);
+   return time;
+}
+
+/**
+ * @return Sensor clock drift against CLOCK_MONOTONIC (ppm), positive if the sensor clock runs fast
+ */
+double frame_clock_drift(FRAME_CLOCK *clock)
+{
+   double drift;
+
+   pthread_mutex_lock(&clock->lock);
+   drift = (1 / (1 + clock->drift) - 1) * 1e6;
+   pthread_mutex_unlock(&clock->lock);
+   return drift;
+}
+
+/**
+ * @return Uncertainty of the current reference point (us), -1 before the first
+ */
+int64_t frame_clock_error(FRAME_CLOCK *clock)
+{
+   int64_t error;
+
+   pthread_mutex_lock(&clock->lock);
+   error = clock->synced ? clock->error : -1;
+   pthread_mutex_unlock(&clock->lock);
+   return error;
+}
+
+/**
+ * Convert a CLOCK_MONOTONIC time to wall clock time, by how far apart the
+ * two clocks are now rather than when the time was taken, so NTP steps
+ * in between move it along with the wall clock
+ *
+ * @param monotonic CLOCK_MONOTONIC (us)
+ * @return CLOCK_REALTIME (us since the epoch)
+ */
+int64_t frame_clock_realtime(int64_t monotonic)
+{
+   struct timespec mono, real;
+
+   clock_gettime(CLOCK_MONOTONIC, &mono);
+   clock_gettime(CLOCK_REALTIME, &real);
+   return monotonic + ((int64_t)real.tv_sec - mono.tv_sec) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+}
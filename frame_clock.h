@@ -0,0 +1,69 @@
+#ifndef FRAME_CLOCK_H_
+#define FRAME_CLOCK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/// Sensor time of a buffer that has none, the same value as MMAL_TIME_UNKNOWN
+#define FRAME_TIME_UNKNOWN INT64_MIN
+
+/// Time between reads of the sensor clock (us)
+#define FRAME_CLOCK_SYNC_INTERVAL 500000
+
+/// Reads each reference point is the best of, the most tightly bracketed wins
+#define FRAME_CLOCK_WINDOW 4
+
+/// Reference points the drift is measured across, about a minute of them
+#define FRAME_CLOCK_HISTORY 32
+
+/// Largest drift believed (ppm), far beyond any crystal, so one bad read can't wreck the mapping
+#define FRAME_CLOCK_MAX_DRIFT 500
+
+/// Furthest a mapped frame may be from its arrival before the mapping is taken as stale (us)
+#define FRAME_CLOCK_MAX_DELAY 5000000
+
+/** Maps a camera's sensor clock, the time base of its frame timestamps,
+ *  onto CLOCK_MONOTONIC. The sensor clock is read every sync interval
+ *  between two host clock reads, and every few reads the most tightly
+ *  bracketed one becomes the reference point the mapping runs from, or
+ *  straight away if it is much tighter than the current one. Drift
+ *  is measured across the last minute of reference points, long enough
+ *  for the read jitter to average out, so frames between reference points
+ *  land within a few tens of microseconds. Frames with no timestamp are
+ *  put as far before their arrival as frames with one have been arriving.
+ *  Safe from any thread, the backend's callbacks all map through it.
+ */
+typedef struct
+{
+   pthread_mutex_t lock;
+   int synced;                      /// base_sensor/base_host hold a reference point
+   int64_t base_sensor;             /// Sensor time of the reference point (us)
+   int64_t base_host;               /// CLOCK_MONOTONIC at that sensor time (us)
+   int64_t error;                   /// Half the bracket around the reference point's read (us)
+   double drift;                    /// Host microseconds per sensor microsecond, less one
+   int64_t history_sensor[FRAME_CLOCK_HISTORY]; /// Past reference points, drift is measured across them
+   int64_t history_host[FRAME_CLOCK_HISTORY];
+   int history_count;
+   int history_next;                /// Slot the next reference point goes in
+   int64_t last_sync;               /// When the sensor clock was last read (us, atomic)
+   int syncing;                     /// A read is in progress (atomic)
+   int window_reads;                /// Reads so far towards the next reference point
+   int64_t window_sensor;           /// Best read so far this window
+   int64_t window_host;
+   int64_t window_error;
+   int64_t delay;                   /// Sensor time to arrival, smoothed (us)
+   uint64_t syncs;                  /// Reference points taken
+   uint64_t resets;                 /// Times the sensor clock started over
+} FRAME_CLOCK;
+
+void frame_clock_init(FRAME_CLOCK *clock);
+void frame_clock_destroy(FRAME_CLOCK *clock);
+void frame_clock_reset(FRAME_CLOCK *clock);
+int frame_clock_sync_due(FRAME_CLOCK *clock, int64_t now);
+void frame_clock_sync(FRAME_CLOCK *clock, int64_t sensor, int64_t before, int64_t after);
+int64_t frame_clock_map(FRAME_CLOCK *clock, int64_t sensor, int64_t arrival);
+double frame_clock_drift(FRAME_CLOCK *clock);
+int64_t frame_clock_error(FRAME_CLOCK *clock);
+int64_t frame_clock_realtime(int64_t monotonic);
+
+#endif /* FRAME_CLOCK_H_ */
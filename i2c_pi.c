@@ -1,55 +1,67 @@
-#include <bcm2835.h>
-#include <stdlib.h>
-#include <stdio.h>
-
-#define MAX_LEN 32
-
-int initialize_i2c()
-{
-    if(!bcm2835_init())
-    {
-        fprintf(stdout, "bcm2835 init failed");
-        return 1;
-    }
-    if (!bcm2835_i2c_begin())
-    {
-        fprintf(stdout, "I2c begin failed");
-        return 1;
-    }
-
-    bcm2835_i2c_setSlaveAddress(slave_address);
-    bcm2835_i2c_setClockDivider(clk_div);
-    fprintf(stderr, "Clock divider set to: %d\n", clk_div);
-    fprintf(stderr, "len set to: %d\n", len);
-    fprintf(stderr, "Slave address set to: %d\n", slave_address);   
-}
-
-void stop_i2c()
-{
-    bcm2835_i2c_end();
-    bcm2835_close();
-}
-
-int read_slave(int buf_len)
-{
-    //need to specify length of buffer data first
-    char buf[MAX_LEN];
-    for (int i=0; i<MAX_LEN; i++)
-    {
-        buf[i] = 'n';
-        data = bcm2835_i2c_read(buf, buf_len);
-    }
-
-
-}
-
-int write_slave()
-{   char write_buf[MAX_LEN];
-    bcm2835_i2c_write(write_buf, len(write_buf));
-}
-
-int main()
-{
-
-
-}
\ No newline at end of file
+/**
+ * Servo controller link check: sends one position command over I2C.
+ *
+ * Uses the same bcm2835 bus and command frames as the control loop, so a
+ * head that moves here moves for manual_control. With no position given
+ * the head goes to the centre of its travel. A NACK usually means the
+ * controller isn't at that address or isn't powered.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "servo_control.h"
+#include "servo_bus_pi.h"
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-a address] [pan_degrees tilt_degrees]\n", app);
+   fprintf(stderr, "  -a  I2C address of the servo controller (default 0x08, as in servo_code.ino)\n");
+   fprintf(stderr, "  pan and tilt are 0 to %d, default the centre\n", SERVO_POSITION_MAX / 10);
+}
+
+int main(int argc, char **argv)
+{
+   SERVO_PI_BUS pi = { 0, 1, 0 };
+   SERVO_COMMAND command = { 0, 1, SERVO_POSITION_MAX / 2, SERVO_POSITION_MAX / 2 };
+   uint8_t frame[SERVO_COMMAND_LENGTH];
+   int opt, status;
+
+   while ((opt = getopt(argc, argv, "a:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'a' : pi.address = strtol(optarg, NULL, 0); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (argc - optind == 2)
+   {
+      command.pan = atof(argv[optind]) * 10;
+      command.tilt = atof(argv[optind + 1]) * 10;
+   }
+   if ((argc - optind != 0 && argc - optind != 2) || pi.address < 0 || pi.address > 0x7f ||
+       command.pan < 0 || command.pan > SERVO_POSITION_MAX || command.tilt < 0 || command.tilt > SERVO_POSITION_MAX)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (servo_pi_bus.open(&pi) != 0)
+      return 1;
+
+   servo_encode_command(&command, frame);
+   status = servo_pi_bus.write(&pi, frame, sizeof(frame));
+   servo_pi_bus.close(&pi);
+
+   if (status != 0)
+   {
+      fprintf(stderr, "Servo controller didn't take the command, wrong address or not powered?\n");
+      return 1;
+   }
+   fprintf(stderr, "Head sent to pan %.1f tilt %.1f\n", command.pan / 10.0, command.tilt / 10.0);
+   return 0;
+}
@@ -1,80 +1,73 @@
-#include <bcm2835.h>
-#include <stdlib.h>
-#include <stdio.h>
-
-const __uint8_t START = 0x01;
-const __uint8_t END = 0x00;
-
-
-int initialize_spi()
-{
-    // add some logging if succeed or not
-    if(!bcm2835_init())
-    {
-        fprintf(stdout, "bcm2835 init failed");
-        return 1;
-    }
-
-    if (!bcm2835_spi_begin())
-    {
-        fprintf(stdout, "Spi begin failed");
-        return 1;
-    }
-
-    bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-
-    bcm2835_spi_setBitOrder(BCM2835_SPI_CIT_ORDER_MSBFIRST);
-
-    bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_64);
-
-    bcm2835_spi_ChipSelect(BCM2835_SPI_CS0);
-
-    bcm2835_SPI_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
-
-}
-
-
-void stop_spi()
-{
-    bcm2835_spi_end();
-    bcm2835_close();
-}
-
-
-// uint_8_t send_data(uint_8_t send_data)
-// {
-//     uint_8_t received_data = bcm2835_spi_transfer(send_data);
-//     fprintf(stdout, "Sent to SPI: 0x%02X. Read back from SPI: 0x%02X.\n", send_data, received_data);
-
-//     if (send_data != received_data)
-//     {
-//         fprintf(stdout, "MOSI and MISO connected?");
-//     }
-
-//     return received_data;
-// }
-
-
-int read_adc_data(__uint8_t channel)
-{
-    //returns an integer between 0-1023 indicating joystick position
-    char buf[] = {start, (0x08|channel)<<4,end};
-    char readbuf[3];
-    bcm2835_spi_transdernb(bug, readbuf, 3);
-    return ((int)readBuf[1] & 0x03) << 8 | (int) readbuf[2])
-}
-
-
-
-int main()
-{
-    //not sure what address to use
-    unit_8_t  send_data = 0x01;
-    __uint8_t channel = 0x00;
-
-
-
-
-    stop_spi();
-    return 0;
-}
\ No newline at end of file
+/**
+ * Joystick wiring check: prints the raw ADC counts of both stick axes.
+ *
+ * Reads through the same bcm2835 bus the control loop uses, so a stick
+ * that reads right here reads right in manual_control. Move the stick to
+ * each end and let it go, the counts should reach 0 and 1023 and come
+ * back to about the middle. A bad transfer, usually MISO not connected,
+ * is printed as such rather than as a position.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "servo_control.h"
+#include "servo_bus_pi.h"
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-x channel] [-y channel] [-t seconds] [-i interval_ms]\n", app);
+   fprintf(stderr, "  -x  ADC channel of the pan axis (default 0)\n");
+   fprintf(stderr, "  -y  ADC channel of the tilt axis (default 1)\n");
+   fprintf(stderr, "  -t  run time (default 10)\n");
+   fprintf(stderr, "  -i  time between reads (default 100 ms)\n");
+}
+
+int main(int argc, char **argv)
+{
+   SERVO_PI_BUS pi = { 0, 1, 0 };
+   int seconds = 10, interval = 100, reads, failed = 0, opt;
+
+   while ((opt = getopt(argc, argv, "x:y:t:i:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'x' : pi.x_channel = atoi(optarg); break;
+         case 'y' : pi.y_channel = atoi(optarg); break;
+         case 't' : seconds = atoi(optarg); break;
+         case 'i' : interval = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (pi.x_channel < 0 || pi.x_channel > 7 || pi.y_channel < 0 || pi.y_channel > 7 ||
+       seconds < 1 || interval < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (servo_pi_bus.open(&pi) != 0)
+      return 1;
+
+   reads = seconds * 1000 / interval;
+   for (int i = 0; i < reads; i++)
+   {
+      int x, y;
+
+      if (servo_pi_bus.read_stick(&pi, &x, &y) != 0)
+      {
+         printf("bad transfer, x %d y %d, is MISO connected?\n", x, y);
+         failed++;
+      }
+      else
+         printf("x %4d  y %4d\n", x, y);
+      usleep(interval * 1000);
+   }
+
+   servo_pi_bus.close(&pi);
+   fprintf(stderr, "%d reads, %d bad\n", reads, failed);
+   return failed ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/**
+ * Manual pan/tilt control: the joystick drives the servos directly.
+ *
+ * Runs the servo control loop on the bcm2835 SPI/I2C bus, or on the mock
+ * bus with -M so it can be tried without the hardware. Stick deflection
+ * sets pan/tilt speed, the servo controller integrates it, so letting go
+ * of the stick holds the head where it is. Loop timing statistics are
+ * printed every second with -v and at the end.
+ *
+ * With -f, presets are kept in a file: "save NAME" on stdin stores where
+ * the head points, "goto NAME" slews back there, and a tour in the file
+ * runs whenever the stick has been left alone for long enough.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "servo_control.h"
+#include "servo_bus_pi.h"
+#include "patrol.h"
+
+/** What the stdin command thread works on
+ */
+typedef struct
+{
+   PATROL *patrol;
+   const char *path;                /// Presets file saves go to
+} PRESET_COMMANDS;
+
+/**
+ * Reads preset commands from stdin until it closes
+ */
+static void *command_thread(void *arg)
+{
+   PRESET_COMMANDS *commands = (PRESET_COMMANDS *)arg;
+   char line[128];
+
+   while (fgets(line, sizeof(line), stdin))
+   {
+      char verb[8], name[PATROL_NAME_LENGTH];
+      int pan, tilt, count = sscanf(line, "%7s %31s", verb, name);
+
+      if (count == 2 && strcmp(verb, "save") == 0)
+      {
+         servo_control_position(commands->patrol->control, &pan, &tilt);
+         if (patrol_set_preset(commands->patrol, name, pan, tilt) != 0 ||
+             patrol_save(commands->patrol, commands->path) != 0)
+            fprintf(stderr, "Unable to save preset %s\n", name);
+         else
+            fprintf(stderr, "Saved %s at %.1f %.1f\n", name, pan / 10.0, tilt / 10.0);
+      }
+      else if (count == 2 && strcmp(verb, "goto") == 0)
+      {
+         if (patrol_goto(commands->patrol, name) != 0)
+            fprintf(stderr, "No preset %s\n", name);
+      }
+      else if (count > 0)
+         fprintf(stderr, "Commands are save NAME and goto NAME\n");
+   }
+   return NULL;
+}
+
+static void print_stats(SERVO_CONTROL *control)
+{
+   pthread_mutex_lock(&control->stats_lock);
+   fprintf(stderr, "%llu cycles, %llu overruns, %llu bus errors, jitter p50 %lld p99 %lld max %lld us, "
+           "cycle p50 %lld p99 %lld max %lld us\n",
+           (unsigned long long)control->cycles, (unsigned long long)control->overruns,
+           (unsigned long long)control->bus_errors,
+           (long long)servo_stats_percentile(&control->jitter, 50),
+           (long long)servo_stats_percentile(&control->jitter, 99), (long long)control->jitter.max,
+           (long long)servo_stats_percentile(&control->cycle, 50),
+           (long long)servo_stats_percentile(&control->cycle, 99), (long long)control->cycle.max);
+   pthread_mutex_unlock(&control->stats_lock);
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-M] [-p period_us] [-s smoothing_us] [-d deadband] [-S max_speed] [-e expo] [-P priority] [-i] [-t seconds] [-f presets] [-m port] [-v]\n", app);
+   fprintf(stderr, "  -M  mock bus, no hardware\n");
+   fprintf(stderr, "  -p  control loop period (default %d us)\n", SERVO_DEFAULT_PERIOD);
+   fprintf(stderr, "  -s  stick smoothing time constant, 0 for none (default %d us)\n", SERVO_DEFAULT_SMOOTHING);
+   fprintf(stderr, "  -d  stick deadband in ADC counts (default %d)\n", SERVO_DEFAULT_DEADBAND);
+   fprintf(stderr, "  -S  pan/tilt speed at full stick in degrees/s (default %d)\n", SERVO_DEFAULT_MAX_SPEED);
+   fprintf(stderr, "  -e  expo, 0 linear to 1 cubic (default %.1f)\n", SERVO_DEFAULT_EXPO);
+   fprintf(stderr, "  -P  SCHED_FIFO priority, 0 for an ordinary thread (default %d)\n", SERVO_DEFAULT_PRIORITY);
+   fprintf(stderr, "  -i  invert tilt\n");
+   fprintf(stderr, "  -t  run time, 0 until interrupted (default 0)\n");
+   fprintf(stderr, "  -f  presets file, created by the first save, its tour runs while the stick is left alone\n");
+   fprintf(stderr, "  -m  serve Prometheus metrics on http://<host>:port/metrics\n");
+}
+
+int main(int argc, char **argv)
+{
+   SERVO_CONTROL control;
+   SERVO_MOCK_BUS mock;
+   SERVO_PI_BUS pi = { 0, 1, 0 };
+   PATROL patrol;
+   PRESET_COMMANDS commands;
+   pthread_t command_thread_id;
+   const char *presets_path = NULL;
+   int use_mock = 0, period = SERVO_DEFAULT_PERIOD, smoothing = SERVO_DEFAULT_SMOOTHING;
+   int deadband = SERVO_DEFAULT_DEADBAND, max_speed = SERVO_DEFAULT_MAX_SPEED;
+   int priority = SERVO_DEFAULT_PRIORITY, invert = 0, seconds = 0, metrics_port = 0, verbose = 0, opt;
+   float expo = SERVO_DEFAULT_EXPO;
+   struct timespec tick = { 1, 0 };
+   sigset_t waitset;
+   time_t end;
+
+   while ((opt = getopt(argc, argv, "Mp:s:d:S:e:P:it:f:m:vh")) != -1)
+   {
+      switch (opt)
+      {
+         case 'M' : use_mock = 1; break;
+         case 'p' : period = atoi(optarg); break;
+         case 's' : smoothing = atoi(optarg); break;
+         case 'd' : deadband = atoi(optarg); break;
+         case 'S' : max_speed = atoi(optarg); break;
+         case 'e' : expo = atof(optarg); break;
+         case 'P' : priority = atoi(optarg); break;
+         case 'i' : invert = 1; break;
+         case 't' : seconds = atoi(optarg); break;
+         case 'f' : presets_path = optarg; break;
+         case 'm' : metrics_port = atoi(optarg); break;
+         case 'v' : verbose = 1; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (period < 500 || smoothing < 0 || deadband < 0 || max_speed < 1 || expo < 0 || expo > 1 ||
+       priority < 0 || priority > 99 || seconds < 0)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   // Signals are waited for here, the control thread never sees them
+   sigemptyset(&waitset);
+   sigaddset(&waitset, SIGINT);
+   sigaddset(&waitset, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &waitset, NULL);
+
+   if (use_mock)
+      servo_mock_init(&mock);
+   if (servo_control_init(&control, use_mock ? &servo_mock_bus : &servo_pi_bus, use_mock ? (void *)&mock : &pi) != 0)
+      return 1;
+   control.period = period;
+   control.smoothing = smoothing;
+   control.deadband = deadband;
+   control.max_speed = max_speed;
+   control.expo = expo;
+   control.priority = priority;
+   control.invert_tilt = invert;
+
+   patrol_init(&patrol, &control);
+   if (presets_path && access(presets_path, F_OK) == 0 && patrol_load(&patrol, presets_path) != 0)
+   {
+      patrol_destroy(&patrol);
+      servo_control_destroy(&control);
+      return 1;
+   }
+
+   if (metrics_port && metrics_http_start(metrics_port) != 0)
+      fprintf(stderr, "Metrics endpoint not available\n");
+
+   if (servo_control_start(&control) != 0)
+   {
+      fprintf(stderr, "Unable to start the control loop\n");
+      patrol_destroy(&patrol);
+      servo_control_destroy(&control);
+      metrics_http_stop();
+      return 1;
+   }
+
+   // Commands and the tour are extras, the stick works without them
+   if (presets_path)
+   {
+      commands.patrol = &patrol;
+      commands.path = presets_path;
+      if (patrol_start(&patrol) != 0 || pthread_create(&command_thread_id, NULL, command_thread, &commands) != 0)
+      {
+         fprintf(stderr, "Unable to take preset commands\n");
+         presets_path = NULL;
+      }
+   }
+   if (priority && !control.realtime)
+      fprintf(stderr, "No SCHED_FIFO (needs root or an rtprio limit), running as an ordinary thread\n");
+   if (priority && !control.locked)
+      fprintf(stderr, "Memory not locked, page faults may delay the loop\n");
+   if (verbose)
+      fprintf(stderr, "Manual control on the %s bus, %d us period\n", control.bus->name, period);
+
+   end = time(NULL) + seconds;
+   while (!seconds || time(NULL) < end)
+   {
+      if (sigtimedwait(&waitset, NULL, &tick) > 0)
+         break;
+      if (verbose)
+         print_stats(&control);
+   }
+
+   // The command thread is probably sat in fgets()
+   if (presets_path)
+   {
+      pthread_cancel(command_thread_id);
+      pthread_join(command_thread_id, NULL);
+   }
+   patrol_stop(&patrol);
+   servo_control_stop(&control);
+   print_stats(&control);
+   if (patrol.visits || patrol.interruptions)
+      fprintf(stderr, "%llu tour stops, %llu interrupted\n", (unsigned long long)patrol.visits,
+              (unsigned long long)patrol.interruptions);
+   patrol_destroy(&patrol);
+   servo_control_destroy(&control);
+   metrics_http_stop();
+   return 0;
+}
@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory_budget.h"
+
+static const char *stage_names[MEMORY_STAGE_COUNT] = { "frames", "packets", "metadata" };
+
+static MEMORY_STAGE_STATS stages[MEMORY_STAGE_COUNT];
+static BUFFER_POOL *pools[MEMORY_MAX_POOLS];
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double stage_quota(void *userdata)
+{
+   return (double)__atomic_load_n(&((MEMORY_STAGE_STATS *)userdata)->quota, __ATOMIC_RELAXED);
+}
+
+static double stage_used(void *userdata)
+{
+   return (double)__atomic_load_n(&((MEMORY_STAGE_STATS *)userdata)->used, __ATOMIC_RELAXED);
+}
+
+static double stage_high_water(void *userdata)
+{
+   return (double)__atomic_load_n(&((MEMORY_STAGE_STATS *)userdata)->high_water, __ATOMIC_RELAXED);
+}
+
+static double stage_refused(void *userdata)
+{
+   return (double)__atomic_load_n(&((MEMORY_STAGE_STATS *)userdata)->refused, __ATOMIC_RELAXED);
+}
+
+/**
+ * Share out the budget between the stages and start exporting it. Frames
+ * get most, a few seconds of encoded video per camera take far less and
+ * the per frame records next to nothing. Until this is called nothing
+ * has a quota, memory is only counted.
+ *
+ * @param total Bytes, MEMORY_DEFAULT_BUDGET unless there is a reason
+ * @return 0 on success, -1 if the budget is too small to share out
+ */
+int memory_budget_init(size_t total)
+{
+   char labels[32];
+
+   if (total < MEMORY_STAGE_COUNT * 64 * 1024)
+   {
+      fprintf(stderr, "Memory budget of %zu bytes is too small\n", total);
+      return -1;
+   }
+
+   memory_budget_set_quota(MEMORY_STAGE_METADATA, total / 64);
+   memory_budget_set_quota(MEMORY_STAGE_PACKETS, total / 8 * 3);
+   memory_budget_set_quota(MEMORY_STAGE_FRAMES, total - total / 64 - total / 8 * 3);
+
+   for (int i = 0; i < MEMORY_STAGE_COUNT; i++)
+   {
+      snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+      stages[i].metrics[0] = metrics_callback("memory_quota_bytes", "Bytes each stage may hold",
+                                              labels, METRIC_GAUGE, stage_quota, &stages[i]);
+      stages[i].metrics[1] = metrics_callback("memory_used_bytes", "Bytes each stage holds",
+                                              labels, METRIC_GAUGE, stage_used, &stages[i]);
+      stages[i].metrics[2] = metrics_callback("memory_high_water_bytes", "Most bytes each stage has held",
+                                              labels, METRIC_GAUGE, stage_high_water, &stages[i]);
+      stages[i].metrics[3] = metrics_callback("memory_refused_total", "Allocations refused as over quota",
+                                              labels, METRIC_COUNTER, stage_refused, &stages[i]);
+   }
+   return 0;
+}
+
+/**
+ * Change one stage's quota, memory already held is kept even if it is now over
+ *
+ * @param quota Bytes, 0 for no limit
+ */
+void memory_budget_set_quota(MEMORY_STAGE stage, size_t quota)
+{
+   pthread_mutex_lock(&budget_lock);
+   __atomic_store_n(&stages[stage].quota, quota, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&budget_lock);
+}
+
+/**
+ * Stop exporting the budget and lift the quotas, what is still held stays counted
+ */
+void memory_budget_destroy(void)
+{
+   for (int i = 0; i < MEMORY_STAGE_COUNT; i++)
+   {
+      for (int m = 0; m < 4; m++)
+      {
+         metrics_unregister(stages[i].metrics[m]);
+         stages[i].metrics[m] = NULL;
+      }
+      memory_budget_set_quota(i, 0);
+   }
+}
+
+/**
+ * Each stage's quota, use and high-water mark, then each pool's
+ */
+void memory_budget_report(FILE *out)
+{
+   pthread_mutex_lock(&budget_lock);
+
+   fprintf(out, "%-24s %12s %12s %12s %8s\n", "memory", "quota kB", "used kB", "high kB", "refused");
+   for (int i = 0; i < MEMORY_STAGE_COUNT; i++)
+   {
+      if (stages[i].quota)
+         fprintf(out, "%-24s %12zu", stage_names[i], stages[i].quota / 1024);
+      else
+         fprintf(out, "%-24s %12s", stage_names[i], "-");
+      fprintf(out, " %12zu %12zu %8llu\n", stages[i].used / 1024, stages[i].high_water / 1024,
+              (unsigned long long)stages[i].refused);
+   }
+
+   fprintf(out, "%-24s %12s %12s %12s %8s\n", "pool", "blocks", "in use", "high", "empty");
+   for (int i = 0; i < MEMORY_MAX_POOLS; i++)
+   {
+      if (pools[i])
+         fprintf(out, "%-24s %12d %12d %12d %8llu\n", pools[i]->name, pools[i]->blocks,
+                 __atomic_load_n(&pools[i]->in_use, __ATOMIC_RELAXED),
+                 __atomic_load_n(&pools[i]->high_water, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&pools[i]->exhausted, __ATOMIC_RELAXED));
+   }
+
+   pthread_mutex_unlock(&budget_lock);
+}
+
+/**
+ * Count memory against a stage's quota, for memory that comes from
+ * somewhere else such as mmal's port pools
+ *
+ * @return 0 on success, -1 if the stage would go over its quota
+ */
+int memory_reserve(MEMORY_STAGE stage, size_t size)
+{
+   MEMORY_STAGE_STATS *stats = &stages[stage];
+   size_t used;
+
+   pthread_mutex_lock(&budget_lock);
+   used = stats->used + size;
+   if (stats->quota && used > stats->quota)
+   {
+      __atomic_add_fetch(&stats->refused, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&budget_lock);
+      fprintf(stderr, "Memory budget: %zu bytes of %s would go over its %zu byte quota\n",
+              size, stage_names[stage], stats->quota);
+      return -1;
+   }
+   __atomic_store_n(&stats->used, used, __ATOMIC_RELAXED);
+   if (used > stats->high_water)
+      __atomic_store_n(&stats->high_water, used, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&budget_lock);
+   return 0;
+}
+
+void memory_release(MEMORY_STAGE stage, size_t size)
+{
+   MEMORY_STAGE_STATS *stats = &stages[stage];
+
+   pthread_mutex_lock(&budget_lock);
+   __atomic_store_n(&stats->used, stats->used > size ? stats->used - size : 0, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&budget_lock);
+}
+
+size_t memory_used(MEMORY_STAGE stage)
+{
+   return __atomic_load_n(&stages[stage].used, __ATOMIC_RELAXED);
+}
+
+/**
+ * How many buffers of a size the stage has room for, so a pool can be
+ * sized down to the budget rather than refused outright
+ *
+ * @param wanted Buffers wanted, the most returned
+ * @param minimum Fewest that work at all, the least returned even if they won't fit
+ */
+int memory_fit(MEMORY_STAGE stage, size_t size, int wanted, int minimum)
+{
+   MEMORY_STAGE_STATS *stats = &stages[stage];
+   size_t room;
+   int fit = wanted;
+
+   pthread_mutex_lock(&budget_lock);
+   if (stats->quota && size)
+   {
+      room = stats->quota > stats->used ? stats->quota - stats->used : 0;
+      if (room / size < (size_t)wanted)
+         fit = (int)(room / size);
+   }
+   pthread_mutex_unlock(&budget_lock);
+
+   return fit < minimum ? minimum : fit;
+}
+
+/**
+ * Allocate memory counted against a stage. For setup, not per frame, the
+ * hot paths take blocks from a BUFFER_POOL.
+ *
+ * @return The memory, NULL if out of memory or over quota
+ */
+void *memory_alloc(MEMORY_STAGE stage, size_t size)
+{
+   void *memory;
+
+   if (memory_reserve(stage, size) != 0)
+      return NULL;
+   memory = malloc(size);
+   if (!memory)
+      memory_release(stage, size);
+   return memory;
+}
+
+/**
+ * Free memory from memory_alloc
+ *
+ * @param size As it was allocated
+ */
+void memory_free(MEMORY_STAGE stage, void *memory, size_t size)
+{
+   if (!memory)
+      return;
+   free(memory);
+   memory_release(stage, size);
+}
+
+static double pool_in_use(void *userdata)
+{
+   return __atomic_load_n(&((BUFFER_POOL *)userdata)->in_use, __ATOMIC_RELAXED);
+}
+
+static double pool_high_water(void *userdata)
+{
+   return __atomic_load_n(&((BUFFER_POOL *)userdata)->high_water, __ATOMIC_RELAXED);
+}
+
+static double pool_exhausted(void *userdata)
+{
+   return (double)__atomic_load_n(&((BUFFER_POOL *)userdata)->exhausted, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take all of a pool's memory from a stage up front
+ *
+ * @param name Names the pool in the metrics and the report
+ * @param block_size Bytes per block, rounded up to keep blocks aligned
+ * @return 0 on success, -1 if out of memory or over quota
+ */
+int buffer_pool_init(BUFFER_POOL *pool, const char *name, MEMORY_STAGE stage, size_t block_size, int blocks)
+{
+   char labels[64];
+   int registered;
+
+   memset(pool, 0, sizeof(*pool));
+   snprintf(pool->name, sizeof(pool->name), "%s", name);
+   pool->stage = stage;
+   pool->block_size = (block_size + 15) & ~(size_t)15;
+   pool->blocks = blocks;
+
+   if (blocks <= 0 ||
+       !(pool->memory = memory_alloc(stage, pool->block_size * blocks)) ||
+       !(pool->free_blocks = memory_alloc(stage, sizeof(*pool->free_blocks) * blocks)))
+   {
+      memory_free(stage, pool->memory, pool->block_size * blocks);
+      pool->memory = NULL;
+      return -1;
+   }
+
+   // Handed out from the start of the memory first
+   for (int i = 0; i < blocks; i++)
+      pool->free_blocks[i] = pool->memory + pool->block_size * (blocks - 1 - i);
+   pool->num_free = blocks;
+   pthread_mutex_init(&pool->lock, NULL);
+
+   snprintf(labels, sizeof(labels), "pool=\"%s\"", pool->name);
+   pool->metrics[0] = metrics_callback("buffer_pool_in_use", "Blocks handed out",
+                                       labels, METRIC_GAUGE, pool_in_use, pool);
+   pool->metrics[1] = metrics_callback("buffer_pool_high_water", "Most blocks handed out at once",
+                                       labels, METRIC_GAUGE, pool_high_water, pool);
+   pool->metrics[2] = metrics_callback("buffer_pool_exhausted_total", "Blocks wanted with none free",
+                                       labels, METRIC_COUNTER, pool_exhausted, pool);
+
+   pthread_mutex_lock(&budget_lock);
+   for (registered = 0; registered < MEMORY_MAX_POOLS && pools[registered]; registered++)
+      ;
+   if (registered < MEMORY_MAX_POOLS)
+      pools[registered] = pool;
+   pthread_mutex_unlock(&budget_lock);
+
+   // Still works, it just isn't in the report
+   if (registered == MEMORY_MAX_POOLS)
+      fprintf(stderr, "Pool %s left out of the memory report, all %d places taken\n", pool->name, MEMORY_MAX_POOLS);
+   return 0;
+}
+
+/**
+ * @return A block of block_size bytes, NULL if all are out
+ */
+void *buffer_pool_get(BUFFER_POOL *pool)
+{
+   void *block = NULL;
+
+   pthread_mutex_lock(&pool->lock);
+   if (pool->num_free)
+   {
+      int in_use;
+
+      block = pool->free_blocks[--pool->num_free];
+      in_use = pool->blocks - pool->num_free;
+      __atomic_store_n(&pool->in_use, in_use, __ATOMIC_RELAXED);
+      if (in_use > pool->high_water)
+         __atomic_store_n(&pool->high_water, in_use, __ATOMIC_RELAXED);
+   }
+   else
+      __atomic_add_fetch(&pool->exhausted, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&pool->lock);
+
+   return block;
+}
+
+/**
+ * Hand a block back, NULL is ignored. A block from elsewhere, or one put
+ * back while every block is already free, is logged and left alone.
+ */
+void buffer_pool_put(BUFFER_POOL *pool, void *block)
+{
+   uint8_t *start = block;
+
+   if (!block)
+      return;
+
+   if (start < pool->memory || start >= pool->memory + pool->block_size * pool->blocks ||
+       (size_t)(start - pool->memory) % pool->block_size)
+   {
+      fprintf(stderr, "Block %p handed back to pool %s it isn't from\n", block, pool->name);
+      return;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   if (pool->num_free == pool->blocks)
+   {
+      pthread_mutex_unlock(&pool->lock);
+      fprintf(stderr, "Block %p handed back to pool %s twice\n", block, pool->name);
+      return;
+   }
+   pool->free_blocks[pool->num_free++] = block;
+   __atomic_store_n(&pool->in_use, pool->blocks - pool->num_free, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+int buffer_pool_in_use(BUFFER_POOL *pool)
+{
+   return __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+}
+
+/**
+ * Give the pool's memory back to its stage, every block should be back by now
+ */
+void buffer_pool_destroy(BUFFER_POOL *pool)
+{
+   if (!pool->memory)
+      return;
+
+   pthread_mutex_lock(&budget_lock);
+   for (int i = 0; i < MEMORY_MAX_POOLS; i++)
+      if (pools[i] == pool)
+         pools[i] = NULL;
+   pthread_mutex_unlock(&budget_lock);
+
+   for (int i = 0; i < 3; i++)
+   {
+      metrics_unregister(pool->metrics[i]);
+      pool->metrics[i] = NULL;
+   }
+
+   if (pool->num_free != pool->blocks)
+      fprintf(stderr, "Pool %s destroyed with %d of %d blocks out\n", pool->name,
+              pool->blocks - pool->num_free, pool->blocks);
+
+   memory_free(pool->stage, pool->free_blocks, sizeof(*pool->free_blocks) * pool->blocks);
+   memory_free(pool->stage, pool->memory, pool->block_size * pool->blocks);
+   pthread_mutex_destroy(&pool->lock);
+   pool->memory = NULL;
+   pool->free_blocks = NULL;
+}
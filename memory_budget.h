@@ -0,0 +1,77 @@
+#ifndef MEMORY_BUDGET_H_
+#define MEMORY_BUDGET_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+/// Memory the capture pipelines may take between them, leaves room on a
+/// 512 MB Pi once the GPU, the kernel and the rest of the system have theirs
+#define MEMORY_DEFAULT_BUDGET (96 * 1024 * 1024)
+
+/// Pools the report and the metrics can list
+#define MEMORY_MAX_POOLS      16
+
+/** What memory is for, each kind has its own quota
+ */
+typedef enum
+{
+   MEMORY_STAGE_FRAMES,             /// Raw frames, backend and analysis buffers
+   MEMORY_STAGE_PACKETS,            /// Encoded data, encoder output pools and pre-event rings
+   MEMORY_STAGE_METADATA,           /// Small records taken per frame, filenames
+   MEMORY_STAGE_COUNT
+} MEMORY_STAGE;
+
+/** One stage's share of the budget
+ */
+typedef struct
+{
+   size_t quota;                    /// Bytes the stage may hold, 0 for no limit (atomic)
+   size_t used;                     /// Bytes held now (atomic)
+   size_t high_water;               /// Most ever held at once (atomic)
+   uint64_t refused;                /// Requests turned down as over quota (atomic)
+   METRIC *metrics[4];              /// Callback metrics reading the above
+} MEMORY_STAGE_STATS;
+
+/** Fixed size blocks with all the memory taken up front, counted against
+ *  a stage. Getting and putting a block never allocates, so per frame
+ *  records can come from here on the hot path. Safe from any thread.
+ */
+typedef struct
+{
+   char name[32];                   /// Label for the metrics and the report
+   MEMORY_STAGE stage;
+   size_t block_size;
+   int blocks;
+   uint8_t *memory;                 /// blocks * block_size
+   void **free_blocks;              /// Stack of blocks not handed out
+   int num_free;
+   int in_use;                      /// Blocks handed out (atomic)
+   int high_water;                  /// Most blocks out at once (atomic)
+   uint64_t exhausted;              /// Gets that found no block free (atomic)
+   pthread_mutex_t lock;
+   METRIC *metrics[3];
+} BUFFER_POOL;
+
+int memory_budget_init(size_t total);
+void memory_budget_set_quota(MEMORY_STAGE stage, size_t quota);
+void memory_budget_destroy(void);
+void memory_budget_report(FILE *out);
+
+int memory_reserve(MEMORY_STAGE stage, size_t size);
+void memory_release(MEMORY_STAGE stage, size_t size);
+size_t memory_used(MEMORY_STAGE stage);
+int memory_fit(MEMORY_STAGE stage, size_t size, int wanted, int minimum);
+void *memory_alloc(MEMORY_STAGE stage, size_t size);
+void memory_free(MEMORY_STAGE stage, void *memory, size_t size);
+
+int buffer_pool_init(BUFFER_POOL *pool, const char *name, MEMORY_STAGE stage, size_t block_size, int blocks);
+void *buffer_pool_get(BUFFER_POOL *pool);
+void buffer_pool_put(BUFFER_POOL *pool, void *block);
+int buffer_pool_in_use(BUFFER_POOL *pool);
+void buffer_pool_destroy(BUFFER_POOL *pool);
+
+#endif /* MEMORY_BUDGET_H_ */
@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+
+const uint64_t metrics_latency_bounds[METRICS_LATENCY_BOUNDS_NUM] =
+{
+   100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+// Shard major so each shard's slots sit on their own cache lines
+static uint64_t metric_values[METRICS_MAX_SHARDS][METRICS_MAX_SLOTS] __attribute__((aligned(64)));
+
+static METRIC metrics[METRICS_MAX_METRICS];
+static int num_metrics;
+static int num_slots;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned next_shard;
+static __thread int thread_shard = -1;
+
+static inline uint64_t *shard_slots(void)
+{
+   if (thread_shard < 0)
+      thread_shard = (int)(__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_MAX_SHARDS);
+   return metric_values[thread_shard];
+}
+
+/**
+ * Find or add a metric. Registering the same name and labels again hands
+ * back the existing metric, so pipelines can be recreated freely.
+ */
+static METRIC *metrics_register(const char *name, const char *help, const char *labels,
+                                int type, int slots)
+{
+   METRIC *metric = NULL;
+
+   if (!labels)
+      labels = "";
+
+   pthread_mutex_lock(&registry_lock);
+
+   for (int i = 0; i < num_metrics; i++)
+   {
+      if (!strcmp(metrics[i].name, name) && !strcmp(metrics[i].labels, labels))
+      {
+         metric = metrics[i].type == type ? &metrics[i] : NULL;
+         goto done;
+      }
+   }
+
+   if (num_metrics == METRICS_MAX_METRICS || num_slots + slots > METRICS_MAX_SLOTS)
+   {
+      fprintf(stderr, "Metrics registry full, %s not registered\n", name);
+      goto done;
+   }
+
+   metric = &metrics[num_metrics];
+   memset(metric, 0, sizeof(*metric));
+   snprintf(metric->name, sizeof(metric->name), "%s", name);
+   snprintf(metric->help, sizeof(metric->help), "%s", help);
+   snprintf(metric->labels, sizeof(metric->labels), "%s", labels);
+   metric->type = type;
+   metric->slot = slots ? num_slots : -1;
+   num_slots += slots;
+   num_metrics++;
+
+done:
+   if (metric)
+      metric->in_use = 1;
+   pthread_mutex_unlock(&registry_lock);
+   return metric;
+}
+
+/**
+ * Register a counter, safe to call again with the same name and labels
+ *
+ * @return The metric, NULL if the registry is full (updates to NULL are ignored)
+ */
+METRIC *metrics_counter(const char *name, const char *help, const char *labels)
+{
+   return metrics_register(name, help, labels, METRIC_COUNTER, 1);
+}
+
+METRIC *metrics_gauge(const char *name, const char *help, const char *labels)
+{
+   return metrics_register(name, help, labels, METRIC_GAUGE, 1);
+}
+
+/**
+ * Register a histogram with fixed bucket upper bounds (ascending)
+ */
+METRIC *metrics_histogram(const char *name, const char *help, const char *labels,
+                          const uint64_t *bounds, int num_bounds)
+{
+   METRIC *metric;
+
+   if (num_bounds > METRICS_MAX_BUCKETS)
+      num_bounds = METRICS_MAX_BUCKETS;
+
+   // A slot per bucket plus +Inf, count and sum
+   metric = metrics_register(name, help, labels, METRIC_HISTOGRAM, num_bounds + 3);
+   if (metric)
+   {
+      pthread_mutex_lock(&registry_lock);
+      metric->num_bounds = num_bounds;
+      memcpy(metric->bounds, bounds, num_bounds * sizeof(*bounds));
+      pthread_mutex_unlock(&registry_lock);
+   }
+   return metric;
+}
+
+/**
+ * Register a counter or gauge whose value is read through a callback,
+ * for values something else already keeps. Must be unregistered before
+ * userdata goes away.
+ */
+METRIC *metrics_callback(const char *name, const char *help, const char *labels, int type,
+                         double (*fn)(void *userdata), void *userdata)
+{
+   METRIC *metric = metrics_register(name, help, labels, type, 0);
+
+   if (metric)
+   {
+      pthread_mutex_lock(&registry_lock);
+      metric->fn = fn;
+      metric->userdata = userdata;
+      pthread_mutex_unlock(&registry_lock);
+   }
+   return metric;
+}
+
+/**
+ * Stop exporting a metric. Its slots are kept for when it is registered again.
+ */
+void metrics_unregister(METRIC *metric)
+{
+   if (!metric)
+      return;
+
+   pthread_mutex_lock(&registry_lock);
+   metric->in_use = 0;
+   metric->fn = NULL;
+   metric->userdata = NULL;
+   pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * Add to a counter, lock free and uncontended unless threads share a shard
+ */
+void metrics_add(METRIC *metric, uint64_t value)
+{
+   if (!metric || metric->slot < 0)
+      return;
+   __atomic_fetch_add(&shard_slots()[metric->slot], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set a gauge, gauges are not sharded (last writer wins)
+ */
+void metrics_set(METRIC *metric, int64_t value)
+{
+   if (!metric || metric->slot < 0)
+      return;
+   __atomic_store_n(&metric_values[0][metric->slot], (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record a histogram observation
+ */
+void metrics_observe(METRIC *metric, uint64_t value)
+{
+   uint64_t *slots;
+   int bucket = 0;
+
+   if (!metric || metric->slot < 0)
+      return;
+
+   while (bucket < metric->num_bounds && value > metric->bounds[bucket])
+      bucket++;
+
+   slots = shard_slots() + metric->slot;
+   __atomic_fetch_add(&slots[bucket], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&slots[metric->num_bounds + 1], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&slots[metric->num_bounds + 2], value, __ATOMIC_RELAXED);
+}
+
+static uint64_t slot_total(int slot)
+{
+   uint64_t total = 0;
+
+   for (int shard = 0; shard < METRICS_MAX_SHARDS; shard++)
+      total += __atomic_load_n(&metric_values[shard][slot], __ATOMIC_RELAXED);
+   return total;
+}
+
+/**
+ * Current value of a counter or gauge, the observation count for a histogram
+ */
+double metrics_read(const METRIC *metric)
+{
+   if (!metric)
+      return 0;
+   if (metric->fn)
+      return metric->fn(metric->userdata);
+   if (metric->slot < 0)
+      return 0;
+
+   switch (metric->type)
+   {
+      case METRIC_GAUGE :
+         return (double)(int64_t)__atomic_load_n(&metric_values[0][metric->slot], __ATOMIC_RELAXED);
+      case METRIC_HISTOGRAM :
+         return (double)slot_total(metric->slot + metric->num_bounds + 1);
+      default :
+         return (double)slot_total(metric->slot);
+   }
+}
+
+static void write_labels(FILE *out, const char *labels, const char *extra)
+{
+   if (!labels[0] && !extra)
+      return;
+
+   fputc('{', out);
+   fputs(labels, out);
+   if (extra)
+      fprintf(out, "%s%s", labels[0] ? "," : "", extra);
+   fputc('}', out);
+}
+
+static void write_histogram(FILE *out, const METRIC *metric)
+{
+   uint64_t cumulative = 0;
+   char le[40];
+
+   for (int b = 0; b <= metric->num_bounds; b++)
+   {
+      cumulative += slot_total(metric->slot + b);
+
+      if (b < metric->num_bounds)
+         snprintf(le, sizeof(le), "le=\"%llu\"", (unsigned long long)metric->bounds[b]);
+      else
+         snprintf(le, sizeof(le), "le=\"+Inf\"");
+
+      fprintf(out, "%s_bucket", metric->name);
+      write_labels(out, metric->labels, le);
+      fprintf(out, " %llu\n", (unsigned long long)cumulative);
+   }
+
+   fprintf(out, "%s_sum", metric->name);
+   write_labels(out, metric->labels, NULL);
+   fprintf(out, " %llu\n", (unsigned long long)slot_total(metric->slot + metric->num_bounds + 2));
+
+   fprintf(out, "%s_count", metric->name);
+   write_labels(out, metric->labels, NULL);
+   fprintf(out, " %llu\n", (unsigned long long)slot_total(metric->slot + metric->num_bounds + 1));
+}
+
+/**
+ * Write every registered metric in the Prometheus text exposition format.
+ * Shards are summed here, on read, so the writers never synchronise.
+ *
+ * @return 0 on success, -1 on a write error
+ */
+int metrics_write_prometheus(FILE *out)
+{
+   static const char *type_names[] = { "counter", "gauge", "histogram" };
+   char emitted[METRICS_MAX_METRICS] = { 0 };
+
+   pthread_mutex_lock(&registry_lock);
+
+   for (int i = 0; i < num_metrics; i++)
+   {
+      if (emitted[i] || !metrics[i].in_use)
+         continue;
+
+      // One HELP/TYPE per family, then every label set with that name
+      fprintf(out, "# HELP %s %s\n", metrics[i].name, metrics[i].help);
+      fprintf(out, "# TYPE %s %s\n", metrics[i].name, type_names[metrics[i].type]);
+
+      for (int j = i; j < num_metrics; j++)
+      {
+         const METRIC *metric = &metrics[j];
+
+         if (emitted[j] || !metric->in_use || strcmp(metric->name, metrics[i].name))
+            continue;
+         emitted[j] = 1;
+
+         if (metric->type == METRIC_HISTOGRAM)
+         {
+            write_histogram(out, metric);
+         }
+         else
+         {
+            fputs(metric->name, out);
+            write_labels(out, metric->labels, NULL);
+            fprintf(out, " %.15g\n", metrics_read(metric));
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&registry_lock);
+   return ferror(out) ? -1 : 0;
+}
+
+/**
+ * Write a single line summary, counters/gauges as name=value and
+ * histograms as name=count/mean
+ */
+void metrics_write_summary(FILE *out)
+{
+   pthread_mutex_lock(&registry_lock);
+
+   fputs("metrics:", out);
+   for (int i = 0; i < num_metrics; i++)
+   {
+      const METRIC *metric = &metrics[i];
+
+      if (!metric->in_use)
+         continue;
+
+      fprintf(out, " %s", metric->name);
+      write_labels(out, metric->labels, NULL);
+
+      if (metric->type == METRIC_HISTOGRAM)
+      {
+         uint64_t count = slot_total(metric->slot + metric->num_bounds + 1);
+         uint64_t sum = slot_total(metric->slot + metric->num_bounds + 2);
+
+         fprintf(out, "=%llu/%llu", (unsigned long long)count,
+                 (unsigned long long)(count ? sum / count : 0));
+      }
+      else
+      {
+         fprintf(out, "=%.15g", metrics_read(metric));
+      }
+   }
+   fputc('\n', out);
+
+   pthread_mutex_unlock(&registry_lock);
+}
+
+/** Shared state of the background threads, there is only one registry
+ */
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int quit;
+   pthread_t thread;
+   int running;
+   int socket;
+   int interval;
+} http = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, -1, 0 },
+  logger = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, -1, 0 };
+
+static void write_all(int fd, const char *data, size_t length)
+{
+   while (length)
+   {
+      ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+
+      if (written <= 0)
+      {
+         if (written < 0 && errno == EINTR)
+            continue;
+         return;
+      }
+      data += written;
+      length -= written;
+   }
+}
+
+static void serve_client(int client)
+{
+   char request[512];
+   char *body = NULL, *header = NULL;
+   size_t body_length = 0;
+   ssize_t got;
+   int header_length;
+   FILE *out;
+   struct pollfd pfd = { client, POLLIN, 0 };
+
+   // Only the request line matters, don't let a slow client hold us up
+   if (poll(&pfd, 1, 1000) <= 0 || (got = recv(client, request, sizeof(request) - 1, 0)) <= 0)
+      return;
+   request[got] = 0;
+
+   if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?'))
+   {
+      static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      write_all(client, not_found, sizeof(not_found) - 1);
+      return;
+   }
+
+   out = open_memstream(&body, &body_length);
+   if (!out)
+      return;
+   metrics_write_prometheus(out);
+   fclose(out);
+
+   header_length = asprintf(&header, "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", body_length);
+   if (header_length > 0)
+   {
+      write_all(client, header, header_length);
+      write_all(client, body, body_length);
+   }
+
+   free(header);
+   free(body);
+}
+
+static void *http_thread(void *arg)
+{
+   (void)arg;
+
+   for (;;)
+   {
+      struct pollfd pfd = { http.socket, POLLIN, 0 };
+      int quit, client;
+
+      pthread_mutex_lock(&http.lock);
+      quit = http.quit;
+      pthread_mutex_unlock(&http.lock);
+      if (quit)
+         break;
+
+      // Wake up now and again to notice metrics_http_stop
+      if (poll(&pfd, 1, 250) <= 0)
+         continue;
+
+      client = accept(http.socket, NULL, NULL);
+      if (client < 0)
+         continue;
+
+      serve_client(client);
+      close(client);
+   }
+   return NULL;
+}
+
+/**
+ * Serve the registry at http://<host>:port/metrics in Prometheus text format
+ *
+ * @param port TCP port to listen on
+ * @return 0 on success, -1 on failure
+ */
+int metrics_http_start(int port)
+{
+   struct sockaddr_in address;
+   int one = 1;
+
+   if (http.running)
+      return 0;
+
+   http.socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (http.socket < 0)
+      return -1;
+
+   setsockopt(http.socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_ANY);
+   address.sin_port = htons(port);
+
+   if (bind(http.socket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+         listen(http.socket, 4) != 0)
+   {
+      fprintf(stderr, "Unable to listen for metrics on port %d; %s\n", port, strerror(errno));
+      close(http.socket);
+      http.socket = -1;
+      return -1;
+   }
+
+   http.quit = 0;
+   if (pthread_create(&http.thread, NULL, http_thread, NULL) != 0)
+   {
+      close(http.socket);
+      http.socket = -1;
+      return -1;
+   }
+   http.running = 1;
+   return 0;
+}
+
+void metrics_http_stop(void)
+{
+   if (!http.running)
+      return;
+
+   pthread_mutex_lock(&http.lock);
+   http.quit = 1;
+   pthread_mutex_unlock(&http.lock);
+
+   pthread_join(http.thread, NULL);
+   close(http.socket);
+   http.socket = -1;
+   http.running = 0;
+}
+
+static void *log_thread(void *arg)
+{
+   (void)arg;
+
+   pthread_mutex_lock(&logger.lock);
+   while (!logger.quit)
+   {
+      struct timespec wake;
+
+      clock_gettime(CLOCK_REALTIME, &wake);
+      wake.tv_sec += logger.interval;
+
+      if (pthread_cond_timedwait(&logger.cond, &logger.lock, &wake) == ETIMEDOUT && !logger.quit)
+         metrics_write_summary(stderr);
+   }
+   pthread_mutex_unlock(&logger.lock);
+   return NULL;
+}
+
+/**
+ * Write the summary line to stderr every interval seconds
+ *
+ * @return 0 on success, -1 on failure
+ */
+int metrics_log_start(int interval)
+{
+   if (logger.running || interval <= 0)
+      return 0;
+
+   logger.quit = 0;
+   logger.interval = interval;
+   if (pthread_create(&logger.thread, NULL, log_thread, NULL) != 0)
+      return -1;
+   logger.running = 1;
+   return 0;
+}
+
+void metrics_log_stop(void)
+{
+   if (!logger.running)
+      return;
+
+   pthread_mutex_lock(&logger.lock);
+   logger.quit = 1;
+   pthread_cond_broadcast(&logger.cond);
+   pthread_mutex_unlock(&logger.lock);
+
+   pthread_join(logger.thread, NULL);
+   logger.running = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/// Maximum number of registered metrics
+#define METRICS_MAX_METRICS 128
+
+/// Value slots per shard, a counter takes one, a histogram its buckets + 2
+#define METRICS_MAX_SLOTS   1024
+
+/// Threads are spread over this many shards, each shard is written by as
+/// few threads as possible so increments never bounce cache lines around
+#define METRICS_MAX_SHARDS  16
+
+#define METRICS_MAX_BUCKETS 16
+
+enum
+{
+   METRIC_COUNTER,
+   METRIC_GAUGE,
+   METRIC_HISTOGRAM
+};
+
+/** One registered metric. Values live in the sharded slot table, callback
+ *  metrics are read through fn instead.
+ */
+typedef struct
+{
+   char name[64];                   /// Prometheus metric name
+   char help[96];                   /// HELP text
+   char labels[64];                 /// Preformatted labels, e.g. camera="0", may be empty
+   int type;                        /// METRIC_ value
+   int in_use;                      /// Cleared by metrics_unregister
+   int slot;                        /// First value slot, -1 for callback metrics
+   int num_bounds;                  /// Histogram bucket count (excluding +Inf)
+   uint64_t bounds[METRICS_MAX_BUCKETS]; /// Histogram upper bounds
+   double (*fn)(void *userdata);    /// Callback returning the current value
+   void *userdata;
+} METRIC;
+
+/// Bucket bounds for latencies in microseconds
+extern const uint64_t metrics_latency_bounds[];
+#define METRICS_LATENCY_BOUNDS_NUM 13
+
+METRIC *metrics_counter(const char *name, const char *help, const char *labels);
+METRIC *metrics_gauge(const char *name, const char *help, const char *labels);
+METRIC *metrics_histogram(const char *name, const char *help, const char *labels,
+                          const uint64_t *bounds, int num_bounds);
+METRIC *metrics_callback(const char *name, const char *help, const char *labels, int type,
+                         double (*fn)(void *userdata), void *userdata);
+void metrics_unregister(METRIC *metric);
+
+void metrics_add(METRIC *metric, uint64_t value);
+void metrics_set(METRIC *metric, int64_t value);
+void metrics_observe(METRIC *metric, uint64_t value);
+double metrics_read(const METRIC *metric);
+
+int metrics_write_prometheus(FILE *out);
+void metrics_write_summary(FILE *out);
+
+int metrics_http_start(int port);
+void metrics_http_stop(void);
+int metrics_log_start(int interval);
+void metrics_log_stop(void);
+
+#endif /* METRICS_H_ */
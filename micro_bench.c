@@ -0,0 +1,773 @@
+/**
+ * Micro-benchmarks for the capture hot paths, with a stored baseline.
+ *
+ * Times each path on its own with synthetic input: what the encoder
+ * buffer callback does with each buffer, the storage writer from open to
+ * rename, filename generation per frame, the motion and ego motion
+ * kernels on analysis frames, packets handed through the recorder's
+ * pre-event ring, frame timestamps mapped to host time, and the servo I2C
+ * and joystick SPI frame codecs.
+ *
+ * Each case is calibrated to run for about the given time, then repeated,
+ * and the fastest repeat counts: noise only ever makes a run slower. The
+ * cases take turns over several rounds and each reports the median of its
+ * rounds, so a busy spell on the machine costs one round rather than the
+ * case. Results go out as JSON, one case per line, and can be compared
+ * with a baseline written the same way by an earlier run on the same
+ * machine. Any case slower than the baseline by more than its tolerance,
+ * and by more than a few nanoseconds, fails the run.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include "bench_util.h"
+#include "pipeline.h"
+#include "ego_motion.h"
+#include "servo_control.h"
+#include "synthetic_camera.h"
+
+#define MAX_REPEATS     32
+#define MAX_ROUNDS      16
+#define MAX_BASELINE    64
+
+/// Rounds each case is timed in, the median round counts
+#define DEFAULT_ROUNDS  5
+
+/// Times a case over the tolerance is run again before it counts as a regression
+#define REGRESSION_RETRIES 3
+
+/// Slowdown that never counts as a regression (ns per op). The cases that
+/// take a few nanoseconds move by this much with the caches and the clock
+/// frequency alone, which is far past any percentage tolerance
+#define REGRESSION_FLOOR_NS 10
+
+/// Encoder output buffers as the stills encoder sizes them, and how full a typical one is
+#define ENCODER_BUFFER_SIZE   (80 * 1024)
+#define ENCODER_BUFFER_FILL   (60 * 1024)
+
+/// Buffers written to one file before the callback case starts another
+#define ENCODER_FILE_BUFFERS  256
+
+/// One file through the storage writer, in buffers of ENCODER_BUFFER_FILL
+#define STORAGE_FILE_BUFFERS  16
+
+/// Analysis stream frame, as camera.c sets it up
+#define ANALYSIS_WIDTH  320
+#define ANALYSIS_HEIGHT 240
+
+/// Frames rendered for the motion case to cycle through
+#define MOTION_CLIP     16
+
+/// Scene the ego motion case pans across, each frame a few pixels further on
+#define EGO_MARGIN      32
+#define EGO_STEP        3
+
+/// Packets through the ring, a keyframe each second at 30fps
+#define RING_GOP        30
+#define RING_KEYFRAME   (48 * 1024)
+#define RING_PFRAME     (6 * 1024)
+#define RING_PERIOD     33333
+
+typedef struct
+{
+   const char *directory;           /// Where the storage cases write
+   uint8_t *buffer;                 /// ENCODER_BUFFER_SIZE of encoded looking data
+   uint8_t *clip[MOTION_CLIP];
+   uint8_t *scene;                  /// Ego motion scene, EGO_MARGIN wider and taller than a frame
+   CAMERA_PIPELINE pipeline;
+   STORAGE_MANAGER storage;
+   int watch;
+   RECORDER recorder;
+   int64_t ring_time;
+   long ring_packet;
+   uint64_t ring_written;
+   FRAME_CLOCK clock;
+   int64_t sensor;                  /// Frame clock case's sensor time
+   MOTION_DETECTOR motion;
+   EGO_MOTION ego;
+   long frame;
+   volatile uint32_t sink;          /// Keeps the codec loops from being optimised away
+} BENCH_STATE;
+
+typedef struct
+{
+   const char *name;
+   const char *description;
+   size_t bytes;                    /// Bytes each op moves, 0 if throughput means nothing
+   int (*setup)(BENCH_STATE *state);
+   void (*run)(BENCH_STATE *state, long ops);
+   void (*teardown)(BENCH_STATE *state);
+   int tolerance;                   /// Slowdown that fails (%), 0 for the -T default
+} MICRO_BENCH;
+
+typedef struct
+{
+   long ops;                        /// Ops per repeat
+   double best;                     /// Fastest repeat, ns per op
+   double median;                   /// ns per op
+} BENCH_RESULT;
+
+typedef struct
+{
+   char name[64];
+   double ns_per_op;
+} BASELINE_ENTRY;
+
+/* Encoder buffer callback. The mmal callback itself can't run off the Pi,
+ * this is everything it does with a buffer between taking it and
+ * releasing it back to the pool.
+ */
+
+/// Stands in for the backend the buffers come from, one without frame timestamps
+static const PIPELINE_BACKEND bench_backend = { "micro_bench" };
+
+static int encoder_setup(BENCH_STATE *state)
+{
+   if (storage_init(&state->storage, state->directory, "micro_bench_%d_%d") != 0 ||
+       pipeline_init(&state->pipeline, 0, &bench_backend, NULL, &state->storage, NULL) != 0)
+      return -1;
+   state->watch = watchdog_add_port(&state->pipeline.watchdog, "encoder output");
+   return storage_writer_open(&state->pipeline.writer, 0, 0, "jpg");
+}
+
+static void encoder_run(BENCH_STATE *state, long ops)
+{
+   CAMERA_PIPELINE *pipeline = &state->pipeline;
+
+   for (long i = 0; i < ops; i++)
+   {
+      // Keep the file from growing without bound, the page cache is what's being timed
+      if (pipeline->writer.bytes >= (size_t)ENCODER_FILE_BUFFERS * ENCODER_BUFFER_FILL)
+         storage_writer_open(&pipeline->writer, 0, 0, "jpg");
+
+      watchdog_kick(&pipeline->watchdog, state->watch);
+      pipeline_count_buffer(pipeline, ENCODER_BUFFER_FILL, ENCODER_BUFFER_SIZE);
+      if (pipeline_write(pipeline, state->buffer, ENCODER_BUFFER_FILL, FRAME_TIME_UNKNOWN) != ENCODER_BUFFER_FILL)
+         state->sink++;
+   }
+}
+
+static void encoder_teardown(BENCH_STATE *state)
+{
+   storage_writer_close(&state->pipeline.writer, 0);
+   pipeline_destroy(&state->pipeline);
+   storage_destroy(&state->storage);
+}
+
+/* Storage writer, a whole file from naming it to renaming it into place.
+ * Every op writes the same frame so the files replace each other.
+ */
+
+static int storage_setup(BENCH_STATE *state)
+{
+   return storage_init(&state->storage, state->directory, "micro_bench_%d_%d");
+}
+
+static void storage_run(BENCH_STATE *state, long ops)
+{
+   STORAGE_WRITER writer;
+
+   storage_writer_init(&writer, &state->storage);
+   for (long i = 0; i < ops; i++)
+   {
+      if (storage_writer_open(&writer, 1, 0, "jpg") != 0)
+      {
+         state->sink++;
+         continue;
+      }
+      for (int b = 0; b < STORAGE_FILE_BUFFERS; b++)
+         storage_writer_write(&writer, state->buffer, ENCODER_BUFFER_FILL);
+      storage_writer_close(&writer, 1);
+   }
+}
+
+static void storage_teardown(BENCH_STATE *state)
+{
+   char final_name[STORAGE_NAME_MAX], temp_name[STORAGE_NAME_MAX];
+
+   if (storage_name_file(&state->storage, 1, 0, "jpg", final_name, temp_name, STORAGE_NAME_MAX) == 0)
+      remove(final_name);
+   storage_destroy(&state->storage);
+}
+
+/* Filenames, worked out for every frame
+ */
+
+static int name_setup(BENCH_STATE *state)
+{
+   return storage_init(&state->storage, state->directory, NULL);
+}
+
+static void name_run(BENCH_STATE *state, long ops)
+{
+   for (long i = 0; i < ops; i++)
+   {
+      char final_name[STORAGE_NAME_MAX], temp_name[STORAGE_NAME_MAX];
+
+      if (storage_name_file(&state->storage, 0, (int)(i & 0xffff), "jpg", final_name, temp_name,
+                            STORAGE_NAME_MAX) != 0)
+      {
+         state->sink++;
+         continue;
+      }
+      state->sink += (uint8_t)final_name[0];
+   }
+}
+
+static void name_teardown(BENCH_STATE *state)
+{
+   storage_destroy(&state->storage);
+}
+
+/* Motion gate over a rendered clip, a frame per op
+ */
+
+static int motion_setup(BENCH_STATE *state)
+{
+   for (int i = 0; i < MOTION_CLIP; i++)
+   {
+      state->clip[i] = malloc((size_t)ANALYSIS_WIDTH * ANALYSIS_HEIGHT);
+      if (!state->clip[i])
+         return -1;
+      synthetic_render_luma(state->clip[i], ANALYSIS_WIDTH, ANALYSIS_HEIGHT, ANALYSIS_WIDTH, i);
+   }
+   motion_init(&state->motion);
+
+   // First frame only sets the reference
+   motion_process(&state->motion, state->clip[0], ANALYSIS_WIDTH, ANALYSIS_HEIGHT, ANALYSIS_WIDTH);
+   state->frame = 1;
+   return 0;
+}
+
+static void motion_run(BENCH_STATE *state, long ops)
+{
+   for (long i = 0; i < ops; i++, state->frame++)
+      state->sink += motion_process(&state->motion, state->clip[state->frame % MOTION_CLIP], ANALYSIS_WIDTH,
+                                    ANALYSIS_HEIGHT, ANALYSIS_WIDTH);
+}
+
+static void motion_teardown(BENCH_STATE *state)
+{
+   motion_destroy(&state->motion);
+   for (int i = 0; i < MOTION_CLIP; i++)
+   {
+      free(state->clip[i]);
+      state->clip[i] = NULL;
+   }
+}
+
+/* Ego motion, a frame per op panning across a still scene
+ */
+
+static int ego_setup(BENCH_STATE *state)
+{
+   int width = ANALYSIS_WIDTH + EGO_MARGIN, height = ANALYSIS_HEIGHT + EGO_MARGIN;
+
+   state->scene = malloc((size_t)width * height);
+   if (!state->scene)
+      return -1;
+   synthetic_render_luma(state->scene, width, height, width, 0);
+   ego_motion_init(&state->ego);
+   state->frame = 0;
+   return 0;
+}
+
+static void ego_run(BENCH_STATE *state, long ops)
+{
+   int stride = ANALYSIS_WIDTH + EGO_MARGIN;
+
+   for (long i = 0; i < ops; i++, state->frame++)
+   {
+      // Back and forth across the margin so the shift never runs out
+      int x = (int)(state->frame * EGO_STEP % (2 * EGO_MARGIN));
+      int dx, dy;
+
+      if (x >= EGO_MARGIN)
+         x = 2 * EGO_MARGIN - 1 - x;
+      ego_motion_estimate(&state->ego, state->scene + (size_t)(EGO_MARGIN / 2) * stride + x, ANALYSIS_WIDTH,
+                          ANALYSIS_HEIGHT, stride, &dx, &dy);
+      state->sink += (uint32_t)dx;
+   }
+}
+
+static void ego_teardown(BENCH_STATE *state)
+{
+   ego_motion_destroy(&state->ego);
+   free(state->scene);
+   state->scene = NULL;
+}
+
+/* Recorder's pre-event ring. Nothing triggers, so every packet goes into
+ * the ring and whole GOPs age out of it, keyframes only now and then
+ * written.
+ */
+
+static int ring_open(void *userdata, int segment, int64_t time)
+{
+   (void)userdata;
+   (void)segment;
+   (void)time;
+   return 0;
+}
+
+static size_t ring_write(void *userdata, const void *data, size_t length)
+{
+   (void)data;
+   ((BENCH_STATE *)userdata)->ring_written += length;
+   return length;
+}
+
+static int ring_close(void *userdata)
+{
+   (void)userdata;
+   return 0;
+}
+
+static const RECORDER_OUTPUT ring_output = { ring_open, ring_write, ring_close };
+
+static int ring_setup(BENCH_STATE *state)
+{
+   state->ring_time = 0;
+   state->ring_packet = 0;
+   return recorder_init(&state->recorder, RECORDER_DEFAULT_RING_SIZE, RECORDER_DEFAULT_RING_PACKETS,
+                        &ring_output, state);
+}
+
+static void ring_run(BENCH_STATE *state, long ops)
+{
+   for (long i = 0; i < ops; i++, state->ring_packet++)
+   {
+      int keyframe = state->ring_packet % RING_GOP == 0;
+
+      state->ring_time += RING_PERIOD;
+      recorder_packet(&state->recorder, state->buffer, keyframe ? RING_KEYFRAME : RING_PFRAME,
+                      RECORDER_FLAG_FRAME_END | (keyframe ? RECORDER_FLAG_KEYFRAME : 0), state->ring_time);
+   }
+}
+
+static void ring_teardown(BENCH_STATE *state)
+{
+   recorder_close(&state->recorder);
+   recorder_destroy(&state->recorder);
+}
+
+/* Frame timestamps mapped to CLOCK_MONOTONIC as every buffer callback
+ * does, with the sensor clock read at the usual interval. The sensor
+ * clock is simulated, the mapping is what's being timed.
+ */
+
+static int clock_setup(BENCH_STATE *state)
+{
+   frame_clock_init(&state->clock);
+   state->sensor = 0;
+   return 0;
+}
+
+static void clock_run(BENCH_STATE *state, long ops)
+{
+   for (long i = 0; i < ops; i++)
+   {
+      int64_t arrival = state->sensor + RING_PERIOD;
+
+      if (frame_clock_sync_due(&state->clock, arrival))
+         frame_clock_sync(&state->clock, arrival, arrival - 20, arrival + 20);
+      state->sink += (uint32_t)frame_clock_map(&state->clock, state->sensor, arrival);
+      state->sensor += RING_PERIOD;
+   }
+}
+
+static void clock_teardown(BENCH_STATE *state)
+{
+   frame_clock_destroy(&state->clock);
+}
+
+/* Servo controller frames over I2C, packed and checked as the controller
+ * unpacks them
+ */
+
+static void servo_codec_run(BENCH_STATE *state, long ops)
+{
+   uint8_t frame[SERVO_COMMAND_LENGTH];
+   SERVO_COMMAND command, decoded;
+
+   memset(&command, 0, sizeof(command));
+   for (long i = 0; i < ops; i++)
+   {
+      command.sequence = (uint8_t)i;
+      command.pan = (int16_t)(i % SERVO_POSITION_MAX);
+      command.tilt = (int16_t)(SERVO_POSITION_MAX - i % SERVO_POSITION_MAX);
+      servo_encode_command(&command, frame);
+      if (servo_decode_command(frame, sizeof(frame), &decoded) == 0)
+         state->sink += (uint32_t)decoded.pan;
+   }
+}
+
+/* Joystick ADC reads over SPI, the request and the reply it gets back
+ */
+
+static void adc_codec_run(BENCH_STATE *state, long ops)
+{
+   uint8_t request[SERVO_ADC_FRAME_LENGTH], reply[SERVO_ADC_FRAME_LENGTH];
+
+   for (long i = 0; i < ops; i++)
+   {
+      int value = (int)(i & SERVO_ADC_MAX);
+
+      servo_encode_adc_request((int)(i & 1), request);
+      reply[0] = request[0];
+      reply[1] = (uint8_t)(value >> 8);
+      reply[2] = (uint8_t)value;
+      state->sink += (uint32_t)servo_decode_adc_reply(reply);
+   }
+}
+
+static const MICRO_BENCH benches[] =
+{
+   { "encoder_callback", "encoder buffer callback, 60 KiB of 80 KiB", ENCODER_BUFFER_FILL,
+     encoder_setup, encoder_run, encoder_teardown },
+   { "storage_file", "storage writer, open to rename of a 960 KiB file",
+     (size_t)STORAGE_FILE_BUFFERS * ENCODER_BUFFER_FILL, storage_setup, storage_run, storage_teardown,
+     // The filesystem's writeback, not the writer, sets most of this one
+     50 },
+   { "name_file", "filenames for a frame", 0, name_setup, name_run, name_teardown },
+   { "motion_process", "motion gate, 320x240 analysis frame", (size_t)ANALYSIS_WIDTH * ANALYSIS_HEIGHT,
+     motion_setup, motion_run, motion_teardown },
+   { "ego_motion", "ego motion estimate, 320x240 analysis frame", (size_t)ANALYSIS_WIDTH * ANALYSIS_HEIGHT,
+     ego_setup, ego_run, ego_teardown },
+   { "recorder_ring", "packet into the pre-event ring", 0, ring_setup, ring_run, ring_teardown },
+   { "frame_clock", "frame timestamp to host time", 0, clock_setup, clock_run, clock_teardown },
+   { "servo_codec", "I2C servo command encode and decode", SERVO_COMMAND_LENGTH, NULL, servo_codec_run, NULL },
+   { "adc_codec", "SPI joystick ADC request and reply", SERVO_ADC_FRAME_LENGTH, NULL, adc_codec_run, NULL },
+};
+
+#define NUM_BENCHES ((int)(sizeof(benches) / sizeof(benches[0])))
+
+static int compare_double(const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/**
+ * Calibrate, then time a number of repeats
+ *
+ * @param run_ns Time each repeat should take
+ * @return 0 on success, -1 if the case could not be set up
+ */
+static int run_bench(const MICRO_BENCH *bench, BENCH_STATE *state, int64_t run_ns, int repeats, BENCH_RESULT *result)
+{
+   double times[MAX_REPEATS];
+   long ops = 1;
+   int64_t elapsed;
+
+   if (bench->setup && bench->setup(state) != 0)
+   {
+      if (bench->teardown)
+         bench->teardown(state);
+      return -1;
+   }
+
+   // Double until a run is long enough to scale from, which also warms up
+   for (;;)
+   {
+      int64_t start = bench_now_ns();
+
+      bench->run(state, ops);
+      elapsed = bench_now_ns() - start;
+      if (elapsed >= run_ns / 8 || ops >= (1L << 30))
+         break;
+      ops *= 2;
+   }
+   if (elapsed > 0 && elapsed < run_ns)
+      ops = (long)((double)ops * run_ns / elapsed);
+
+   for (int r = 0; r < repeats; r++)
+   {
+      int64_t start = bench_now_ns();
+
+      bench->run(state, ops);
+      times[r] = (double)(bench_now_ns() - start) / ops;
+   }
+
+   if (bench->teardown)
+      bench->teardown(state);
+
+   qsort(times, repeats, sizeof(times[0]), compare_double);
+   result->ops = ops;
+   result->best = times[0];
+   result->median = times[repeats / 2];
+   return 0;
+}
+
+/**
+ * Put rounds of a case together, the median round counts
+ */
+static void combine_rounds(BENCH_RESULT *rounds, int count, BENCH_RESULT *result)
+{
+   double best[MAX_ROUNDS], median[MAX_ROUNDS];
+
+   for (int r = 0; r < count; r++)
+   {
+      best[r] = rounds[r].best;
+      median[r] = rounds[r].median;
+   }
+   qsort(best, count, sizeof(best[0]), compare_double);
+   qsort(median, count, sizeof(median[0]), compare_double);
+   result->ops = rounds[0].ops;
+   result->best = best[count / 2];
+   result->median = median[count / 2];
+}
+
+/**
+ * Whether a case is slower than its baseline by more than its tolerance,
+ * and by more than the floor
+ *
+ * @param tolerance Slowdown that fails (%) for cases without their own
+ */
+static int regressed(const MICRO_BENCH *bench, const BENCH_RESULT *result, const BASELINE_ENTRY *base, int tolerance)
+{
+   int limit = bench->tolerance ? bench->tolerance : tolerance;
+
+   return base && result->best > base->ns_per_op * (100 + limit) / 100 &&
+          result->best > base->ns_per_op + REGRESSION_FLOOR_NS;
+}
+
+/**
+ * Time a case over all its rounds in one go, for a retry
+ *
+ * @return 0 on success, -1 if the case could not be set up
+ */
+static int run_rounds(const MICRO_BENCH *bench, BENCH_STATE *state, int64_t run_ns, int repeats, int rounds,
+                      BENCH_RESULT *result)
+{
+   BENCH_RESULT each[MAX_ROUNDS];
+
+   for (int r = 0; r < rounds; r++)
+      if (run_bench(bench, state, run_ns, repeats, &each[r]) != 0)
+         return -1;
+   combine_rounds(each, rounds, result);
+   return 0;
+}
+
+/**
+ * Read back a file written by write_json
+ *
+ * @return Entries read, -1 if the file can't be opened
+ */
+static int read_baseline(const char *path, BASELINE_ENTRY *entries, int max_entries)
+{
+   FILE *file = fopen(path, "r");
+   char line[512];
+   int count = 0;
+
+   if (!file)
+      return -1;
+
+   while (count < max_entries && fgets(line, sizeof(line), file))
+   {
+      const char *name = strstr(line, "\"name\": \""), *value = strstr(line, "\"ns_per_op\": ");
+
+      if (!name || !value)
+         continue;
+      if (sscanf(name + 9, "%63[^\"]", entries[count].name) == 1 &&
+          sscanf(value + 13, "%lf", &entries[count].ns_per_op) == 1 && entries[count].ns_per_op > 0)
+         count++;
+   }
+
+   fclose(file);
+   return count;
+}
+
+static void write_json(FILE *file, const BENCH_RESULT *results, const int *ran, int run_ms, int repeats, int rounds)
+{
+   struct utsname host;
+
+   if (uname(&host) != 0)
+      strcpy(host.machine, "unknown");
+
+   fprintf(file, "{\n");
+   fprintf(file, "  \"bench\": \"micro_bench\",\n");
+   fprintf(file, "  \"machine\": \"%s\",\n", host.machine);
+   fprintf(file, "  \"run_ms\": %d,\n", run_ms);
+   fprintf(file, "  \"repeats\": %d,\n", repeats);
+   fprintf(file, "  \"rounds\": %d,\n", rounds);
+   fprintf(file, "  \"results\": [\n");
+   for (int i = 0, first = 1; i < NUM_BENCHES; i++)
+   {
+      double mb_per_s = benches[i].bytes ? benches[i].bytes * 1000.0 / results[i].best : 0;
+
+      if (!ran[i])
+         continue;
+      fprintf(file, "%s    { \"name\": \"%s\", \"description\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, "
+              "\"median_ns_per_op\": %.1f, \"mb_per_s\": %.1f }", first ? "" : ",\n", benches[i].name,
+              benches[i].description, results[i].ops, results[i].best, results[i].median, mb_per_s);
+      first = 0;
+   }
+   fprintf(file, "\n  ]\n}\n");
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-t ms] [-r repeats] [-R rounds] [-n name] [-o dir] [-j json] [-b baseline] [-T percent]\n", app);
+   fprintf(stderr, "  -t  time each repeat takes, default 200ms\n");
+   fprintf(stderr, "  -r  repeats, the fastest counts, default 5\n");
+   fprintf(stderr, "  -R  rounds of every case, the median counts, default %d\n", DEFAULT_ROUNDS);
+   fprintf(stderr, "  -n  only the cases whose name contains this\n");
+   fprintf(stderr, "  -o  directory the storage cases write to, default /tmp\n");
+   fprintf(stderr, "  -j  write the results as JSON here\n");
+   fprintf(stderr, "  -b  compare with a baseline written by -j\n");
+   fprintf(stderr, "  -T  slowdown over the baseline that fails, default 25%% for cases without their own\n");
+}
+
+int main(int argc, char **argv)
+{
+   int run_ms = 200, repeats = 5, rounds = DEFAULT_ROUNDS, tolerance = 25, opt, failed = 0, num_baseline = 0;
+   const char *filter = NULL, *json_path = NULL, *baseline_path = NULL;
+   BENCH_STATE *state;
+   BENCH_RESULT results[NUM_BENCHES], each[NUM_BENCHES][MAX_ROUNDS];
+   int ran[NUM_BENCHES];
+   BASELINE_ENTRY baseline[MAX_BASELINE];
+   const BASELINE_ENTRY *bases[NUM_BENCHES];
+   uint32_t seed = 3;
+
+   state = calloc(1, sizeof(*state));
+   if (!state)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   state->directory = "/tmp";
+
+   while ((opt = getopt(argc, argv, "t:r:R:n:o:j:b:T:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 't' : run_ms = atoi(optarg); break;
+         case 'r' : repeats = atoi(optarg); break;
+         case 'R' : rounds = atoi(optarg); break;
+         case 'n' : filter = optarg; break;
+         case 'o' : state->directory = optarg; break;
+         case 'j' : json_path = optarg; break;
+         case 'b' : baseline_path = optarg; break;
+         case 'T' : tolerance = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (run_ms < 1 || repeats < 1 || repeats > MAX_REPEATS || rounds < 1 || rounds > MAX_ROUNDS || tolerance < 0)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (baseline_path)
+   {
+      num_baseline = read_baseline(baseline_path, baseline, MAX_BASELINE);
+      if (num_baseline < 0)
+      {
+         fprintf(stderr, "Can't read baseline %s, write one with -j\n", baseline_path);
+         return 1;
+      }
+   }
+
+   // Random bytes, encoded data doesn't compress either
+   state->buffer = malloc(ENCODER_BUFFER_SIZE);
+   if (!state->buffer)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   for (int i = 0; i < ENCODER_BUFFER_SIZE; i++)
+      state->buffer[i] = (uint8_t)bench_random(&seed);
+
+   for (int i = 0; i < NUM_BENCHES; i++)
+      ran[i] = !filter || strstr(benches[i].name, filter);
+
+   // Cases take turns, so something else running for a while slows one round of each
+   for (int r = 0; r < rounds; r++)
+      for (int i = 0; i < NUM_BENCHES; i++)
+         if (ran[i] && run_bench(&benches[i], state, (int64_t)run_ms * 1000000, repeats, &each[i][r]) != 0)
+         {
+            printf("%-18s could not be set up\n", benches[i].name);
+            ran[i] = 0;
+            failed = 1;
+         }
+
+   for (int i = 0; i < NUM_BENCHES; i++)
+   {
+      bases[i] = NULL;
+      if (!ran[i])
+         continue;
+      combine_rounds(each[i], rounds, &results[i]);
+      for (int b = 0; b < num_baseline; b++)
+         if (!strcmp(baseline[b].name, benches[i].name))
+            bases[i] = &baseline[b];
+   }
+
+   // A busy machine only ever slows a case down, so a slow case gets another
+   // go once the rest are done, by when a busy spell has had time to pass
+   for (int retry = 0; retry < REGRESSION_RETRIES; retry++)
+      for (int i = 0; i < NUM_BENCHES; i++)
+      {
+         BENCH_RESULT again;
+
+         if (ran[i] && regressed(&benches[i], &results[i], bases[i], tolerance) &&
+             run_rounds(&benches[i], state, (int64_t)run_ms * 1000000, repeats, rounds, &again) == 0 &&
+             again.best < results[i].best)
+            results[i] = again;
+      }
+
+   printf("%-18s %12s %12s %10s %12s %8s\n", "case", "ns/op", "median", "MB/s", "baseline", "change");
+   for (int i = 0; i < NUM_BENCHES; i++)
+   {
+      const BASELINE_ENTRY *base = bases[i];
+      double mb_per_s;
+
+      if (!ran[i])
+         continue;
+
+      mb_per_s = benches[i].bytes ? benches[i].bytes * 1000.0 / results[i].best : 0;
+      printf("%-18s %12.1f %12.1f", benches[i].name, results[i].best, results[i].median);
+      if (mb_per_s)
+         printf(" %10.1f", mb_per_s);
+      else
+         printf(" %10s", "-");
+      if (base)
+      {
+         double change = (results[i].best / base->ns_per_op - 1) * 100;
+         int slower = regressed(&benches[i], &results[i], base, tolerance);
+
+         printf(" %12.1f %+7.1f%%%s\n", base->ns_per_op, change, slower ? "  REGRESSION" : "");
+         failed |= slower;
+      }
+      else
+         printf(" %12s\n", baseline_path ? "new" : "-");
+   }
+
+   if (json_path)
+   {
+      FILE *file = fopen(json_path, "w");
+
+      if (!file)
+      {
+         fprintf(stderr, "Can't write %s\n", json_path);
+         failed = 1;
+      }
+      else
+      {
+         write_json(file, results, ran, run_ms, repeats, rounds);
+         fclose(file);
+      }
+   }
+
+   free(state->buffer);
+   free(state);
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
@@ -0,0 +1,713 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "motion.h"
+
+/// Tile map value for tiles in frame_zone
+#define FRAME_ZONE MOTION_MAX_ZONES
+
+/// Differences are compared in quarter luma steps, small enough that the
+/// squares of a whole tile fit 32 bits
+#define DIFF_SHIFT         (MOTION_MEAN_SHIFT - 2)
+
+/// Background learning rates as shifts, pixels seen as moving are taken
+/// into the background much more slowly so a loiterer isn't absorbed.
+/// Each row learns every other frame, so per frame these are halved.
+#define LEARN_SHIFT        3
+#define FOREGROUND_SHIFT   6
+
+/// Noise variance learning rate, while quiet and while settling
+#define NOISE_SHIFT        4
+#define SETTLE_NOISE_SHIFT 1
+
+/// Fewest frames a new background settles for, each row is learnt 4 times
+#define SETTLE_MIN_FRAMES  8
+
+/// Starting noise, a standard deviation of 2 luma steps, and the floor
+#define NOISE_INITIAL      (4 << 4)
+#define NOISE_MIN          (1 << 4)
+
+/// Standard deviations of noise a pixel has to move by to count
+#define NOISE_MARGIN       4
+
+/// A tile whose difference varies less than this many times its noise
+/// has only changed brightness
+#define UNIFORM_MARGIN     4
+
+/**
+ * Assign the default thresholds, no memory is allocated until the first frame
+ */
+void motion_init(MOTION_DETECTOR *motion)
+{
+   memset(motion, 0, sizeof(*motion));
+   motion->threshold = MOTION_DEFAULT_THRESHOLD;
+   motion->min_area = MOTION_DEFAULT_MIN_AREA;
+   motion_set_frame_rate(motion, MOTION_DEFAULT_FPS);
+   ego_motion_init(&motion->ego);
+}
+
+/**
+ * Tell the detector how often frames arrive, so a new background settles
+ * for about the same time however slow the camera is running
+ *
+ * @param fps Frame rate in thousandths of a frame per second
+ */
+void motion_set_frame_rate(MOTION_DETECTOR *motion, int fps)
+{
+   motion->settle_frames = (int)((int64_t)MOTION_SETTLE_TIME * fps / 1000000);
+   if (motion->settle_frames < SETTLE_MIN_FRAMES)
+      motion->settle_frames = SETTLE_MIN_FRAMES;
+}
+
+/**
+ * Forget the background so the next frame starts afresh, e.g. after the
+ * camera has been rebuilt and exposure may have jumped
+ */
+void motion_reset(MOTION_DETECTOR *motion)
+{
+   free(motion->background);
+   free(motion->tile_map);
+   free(motion->tiles);
+   motion->background = NULL;
+   motion->tile_map = NULL;
+   motion->tiles = NULL;
+   motion->width = motion->height = 0;
+   motion->offset = 0;
+   motion->settling = 0;
+   ego_motion_reset(&motion->ego);
+}
+
+void motion_destroy(MOTION_DETECTOR *motion)
+{
+   motion_reset(motion);
+   ego_motion_destroy(&motion->ego);
+}
+
+/**
+ * Say how far the head should have moved the scene by the next frame, so
+ * the ego motion search only has to look near there
+ *
+ * @param dx, dy Pixels of the analysis frame, positive is right/down
+ */
+void motion_seed_shift(MOTION_DETECTOR *motion, int dx, int dy)
+{
+   ego_motion_seed(&motion->ego, dx, dy);
+}
+
+/**
+ * Add a zone, later zones take the tiles they share with earlier ones and
+ * masks always win. Takes effect from the next frame.
+ *
+ * @param exclude Non zero for a mask
+ * @param threshold Luma difference for a changed pixel, 0 for the detector's
+ * @param min_area Thousandths of the zone that must change, 0 for the detector's
+ * @param points Polygon as fractions of the frame size
+ * @return 0 on success, -1 if there are too many zones or points
+ */
+int motion_add_zone(MOTION_DETECTOR *motion, int exclude, int threshold, int min_area,
+                    const MOTION_POINT *points, int num_points)
+{
+   MOTION_ZONE *zone;
+
+   if (motion->num_zones >= MOTION_MAX_ZONES || num_points < 3 || num_points > MOTION_MAX_POINTS)
+      return -1;
+
+   zone = &motion->zones[motion->num_zones++];
+   memset(zone, 0, sizeof(*zone));
+   zone->exclude = exclude;
+   zone->threshold = threshold;
+   zone->min_area = min_area;
+   zone->num_points = num_points;
+   memcpy(zone->points, points, num_points * sizeof(*points));
+
+   // Rebuilt along with the tile map on the next frame
+   motion_reset(motion);
+   return 0;
+}
+
+/**
+ * Load zones from a file, one per line:
+ *   zone <threshold> <min_area> x,y x,y x,y ...
+ *   mask x,y x,y x,y ...
+ * with points as fractions of the frame, # starts a comment.
+ *
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int motion_load_zones(MOTION_DETECTOR *motion, const char *path)
+{
+   FILE *file = fopen(path, "r");
+   char line[512];
+   int line_num = 0;
+
+   if (!file)
+   {
+      fprintf(stderr, "%s: unable to open zones\n", path);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), file))
+   {
+      MOTION_POINT points[MOTION_MAX_POINTS];
+      int threshold = 0, min_area = 0, exclude, num_points, used;
+      char kind[8];
+      char *p = line;
+
+      line_num++;
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+      p = line;
+
+      if (sscanf(p, "%7s%n", kind, &used) != 1)
+         continue;
+      p += used;
+
+      exclude = strcmp(kind, "mask") == 0;
+      if (!exclude && strcmp(kind, "zone") != 0)
+         goto error;
+
+      if (!exclude)
+      {
+         if (sscanf(p, "%d %d%n", &threshold, &min_area, &used) != 2)
+            goto error;
+         p += used;
+      }
+
+      if ((num_points = polygon_parse(p, points, MOTION_MAX_POINTS)) < 0 ||
+          motion_add_zone(motion, exclude, threshold, min_area, points, num_points) != 0)
+         goto error;
+   }
+
+   fclose(file);
+   return 0;
+
+error:
+   fprintf(stderr, "%s:%d: bad zone\n", path, line_num);
+   fclose(file);
+   return -1;
+}
+
+static MOTION_ZONE *tile_zone(MOTION_DETECTOR *motion, int value)
+{
+   return value == FRAME_ZONE ? &motion->frame_zone : &motion->zones[value];
+}
+
+static int isqrt(int32_t value)
+{
+   int32_t root = 0, bit = 1 << 30;
+
+   while (bit > value)
+      bit >>= 2;
+   while (bit)
+   {
+      if (value >= root + bit)
+      {
+         value -= root + bit;
+         root = (root >> 1) + bit;
+      }
+      else
+         root >>= 1;
+      bit >>= 2;
+   }
+   return root;
+}
+
+/**
+ * Work out the difference that counts as changed in a tile, a few standard
+ * deviations of its noise but never under its zone's threshold
+ */
+static void tile_limit(MOTION_DETECTOR *motion, MOTION_TILE *tile, int value)
+{
+   int limit = NOISE_MARGIN * isqrt(tile->noise);
+   int threshold = tile_zone(motion, value)->threshold << 2;
+
+   if (limit < threshold)
+      limit = threshold;
+   if (limit > 255 << 2)
+      limit = 255 << 2;
+   tile->limit = (int16_t)limit;
+}
+
+/**
+ * Rasterise the zones into the tile map, each tile goes to whichever zone
+ * contains its centre
+ */
+static int build_tile_map(MOTION_DETECTOR *motion)
+{
+   int include = 0;
+
+   motion->tiles_x = (motion->width + MOTION_TILE_SIZE - 1) / MOTION_TILE_SIZE;
+   motion->tiles_y = (motion->height + MOTION_TILE_SIZE - 1) / MOTION_TILE_SIZE;
+   motion->tile_map = malloc((size_t)motion->tiles_x * motion->tiles_y);
+   motion->tiles = calloc((size_t)motion->tiles_x * motion->tiles_y, sizeof(*motion->tiles));
+   if (!motion->tile_map || !motion->tiles)
+      return -1;
+
+
+   memset(&motion->frame_zone, 0, sizeof(motion->frame_zone));
+   motion->frame_zone.threshold = motion->threshold;
+   motion->frame_zone.min_area = motion->min_area;
+
+   for (int z = 0; z < motion->num_zones; z++)
+   {
+      MOTION_ZONE *zone = &motion->zones[z];
+
+      zone->pixels = 0;
+      if (!zone->threshold)
+         zone->threshold = motion->threshold;
+      if (!zone->min_area)
+         zone->min_area = motion->min_area;
+      if (!zone->exclude)
+         include = 1;
+   }
+
+   motion->active_tiles = 0;
+
+   for (int ty = 0; ty < motion->tiles_y; ty++)
+   {
+      int y0 = ty * MOTION_TILE_SIZE;
+      int h = motion->height - y0 < MOTION_TILE_SIZE ? motion->height - y0 : MOTION_TILE_SIZE;
+      float cy = (y0 + h * 0.5f) / motion->height;
+
+      for (int tx = 0; tx < motion->tiles_x; tx++)
+      {
+         int x0 = tx * MOTION_TILE_SIZE;
+         int w = motion->width - x0 < MOTION_TILE_SIZE ? motion->width - x0 : MOTION_TILE_SIZE;
+         float cx = (x0 + w * 0.5f) / motion->width;
+         int value = include ? MOTION_TILE_MASKED : FRAME_ZONE;
+
+         for (int z = 0; z < motion->num_zones; z++)
+         {
+            if (!polygon_contains(motion->zones[z].points, motion->zones[z].num_points, cx, cy))
+               continue;
+            if (motion->zones[z].exclude)
+            {
+               value = MOTION_TILE_MASKED;
+               break;
+            }
+            value = z;
+         }
+
+         motion->tile_map[ty * motion->tiles_x + tx] = (uint8_t)value;
+         if (value != MOTION_TILE_MASKED)
+         {
+            MOTION_TILE *tile = &motion->tiles[ty * motion->tiles_x + tx];
+
+            tile->noise = NOISE_INITIAL;
+            tile_limit(motion, tile, value);
+            tile_zone(motion, value)->pixels += w * h;
+            motion->active_tiles++;
+         }
+      }
+   }
+   return 0;
+}
+
+/**
+ * Count the pixels of a tile that differ from the background by more than
+ * the limit once the offset is taken out. Every other row is also learnt
+ * into the background, slowly where it changed, and summed along with its
+ * square for the offset and noise of the next frame. The other rows take
+ * their turn next frame, which halves the cost of learning and the tile is
+ * still only read once.
+ *
+ * @param offset Illumination offset in quarter luma steps
+ * @param limit Difference that counts as changed, in quarter luma steps
+ * @param slow Learning shift for changed pixels
+ * @param phase Rows to learn, 0 for even and 1 for odd
+ * @param sum Returns the sum of the differences in the learnt rows
+ * @param sum_squares Returns the sum of their squares
+ * @return Number of changed pixels
+ */
+static int tile_update(const uint8_t *luma, int stride, int16_t *mean, int mean_stride,
+                       int width, int height, int offset, int limit, int slow, int phase,
+                       int32_t *sum, int32_t *sum_squares)
+{
+   int32_t s = 0, s2 = 0;
+   int changed = 0;
+
+#if defined(__ARM_NEON)
+   if (width == MOTION_TILE_SIZE)
+   {
+      int16x8_t offsets = vdupq_n_s16((int16_t)offset), limits = vdupq_n_s16((int16_t)limit);
+      int16x8_t learn_shift = vdupq_n_s16(-LEARN_SHIFT), slow_shift = vdupq_n_s16((int16_t)-slow);
+      int32x4_t sums = vdupq_n_s32(0), squares = vdupq_n_s32(0);
+      uint16x8_t count = vdupq_n_u16(0);
+
+      for (int y = 0; y < height; y++, luma += stride, mean += mean_stride)
+      {
+         uint8x16_t current = vld1q_u8(luma);
+         int learning = (y & 1) == phase;
+
+         for (int half = 0; half < 2; half++)
+         {
+            uint8x8_t pixels = half ? vget_high_u8(current) : vget_low_u8(current);
+            int16x8_t background = vld1q_s16(mean + half * 8);
+            int16x8_t raw = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(pixels, MOTION_MEAN_SHIFT)), background);
+            int16x8_t diff = vshrq_n_s16(raw, DIFF_SHIFT);
+            uint16x8_t moved = vcgtq_s16(vabsq_s16(vsubq_s16(diff, offsets)), limits);
+
+            count = vsubq_u16(count, moved);
+            if (!learning)
+               continue;
+
+            sums = vpadalq_s16(sums, diff);
+            squares = vmlal_s16(squares, vget_low_s16(diff), vget_low_s16(diff));
+            squares = vmlal_s16(squares, vget_high_s16(diff), vget_high_s16(diff));
+            background = vaddq_s16(background, vshlq_s16(raw, vbslq_s16(moved, slow_shift, learn_shift)));
+            vst1q_s16(mean + half * 8, background);
+         }
+      }
+#if defined(__aarch64__)
+      *sum = vaddvq_s32(sums);
+      *sum_squares = vaddvq_s32(squares);
+      return vaddvq_u16(count);
+#else
+      *sum = vgetq_lane_s32(sums, 0) + vgetq_lane_s32(sums, 1) + vgetq_lane_s32(sums, 2) + vgetq_lane_s32(sums, 3);
+      *sum_squares = vgetq_lane_s32(squares, 0) + vgetq_lane_s32(squares, 1) +
+                     vgetq_lane_s32(squares, 2) + vgetq_lane_s32(squares, 3);
+      uint64x2_t total = vpaddlq_u32(vpaddlq_u16(count));
+      return (int)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+#endif
+   }
+#elif defined(__SSE2__)
+   if (width == MOTION_TILE_SIZE)
+   {
+      __m128i zero = _mm_setzero_si128(), sign = _mm_set1_epi16((short)0x8000);
+      // Unchanged pixels land in [0, 2 * limit] once offset - limit is taken
+      // away, one signed compare with the sign bit flipped finds the rest
+      __m128i lower = _mm_set1_epi16((short)(offset - limit));
+      __m128i range = _mm_set1_epi16((short)((2 * limit) ^ 0x8000));
+      // The learning shifts as multipliers, so a mask picks between them
+      __m128i learn = _mm_set1_epi16(1 << (16 - LEARN_SHIFT));
+      __m128i foreground = _mm_set1_epi16((short)((1 << (16 - slow)) - (1 << (16 - LEARN_SHIFT))));
+      __m128i sums = zero, squares = zero, count = zero;
+      int32_t lanes[4];
+      int16_t totals[8];
+
+      for (int y = 0; y < height; y++, luma += stride, mean += mean_stride)
+      {
+         __m128i current = _mm_loadu_si128((const __m128i *)luma);
+         int learning = (y & 1) == phase;
+
+         for (int half = 0; half < 2; half++)
+         {
+            __m128i pixels = half ? _mm_unpackhi_epi8(current, zero) : _mm_unpacklo_epi8(current, zero);
+            __m128i background = _mm_loadu_si128((const __m128i *)(mean + half * 8));
+            __m128i raw = _mm_sub_epi16(_mm_slli_epi16(pixels, MOTION_MEAN_SHIFT), background);
+            __m128i diff = _mm_srai_epi16(raw, DIFF_SHIFT);
+            __m128i moved = _mm_cmpgt_epi16(_mm_xor_si128(_mm_sub_epi16(diff, lower), sign), range);
+            __m128i rate;
+
+            count = _mm_sub_epi16(count, moved);
+            if (!learning)
+               continue;
+
+            // A tile learns at most 16 differences of 1020 per lane, within 16 bits
+            sums = _mm_add_epi16(sums, diff);
+            squares = _mm_add_epi32(squares, _mm_madd_epi16(diff, diff));
+            rate = _mm_add_epi16(learn, _mm_and_si128(moved, foreground));
+            _mm_storeu_si128((__m128i *)(mean + half * 8), _mm_add_epi16(background, _mm_mulhi_epi16(raw, rate)));
+         }
+      }
+
+      _mm_storeu_si128((__m128i *)totals, sums);
+      for (int i = 0; i < 8; i++)
+         s += totals[i];
+      *sum = s;
+      _mm_storeu_si128((__m128i *)lanes, squares);
+      *sum_squares = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+      _mm_storeu_si128((__m128i *)totals, count);
+      for (int i = 0; i < 8; i++)
+         changed += totals[i];
+      return changed;
+   }
+#endif
+
+   // Part tiles at the right edge, and everything without SIMD
+   for (int y = 0; y < height; y++, luma += stride, mean += mean_stride)
+   {
+      int learning = (y & 1) == phase;
+
+      for (int x = 0; x < width; x++)
+      {
+         int raw = (int16_t)((luma[x] << MOTION_MEAN_SHIFT) - mean[x]);
+         int diff = raw >> DIFF_SHIFT;
+         int moved = diff - offset > limit || diff - offset < -limit;
+
+         changed += moved;
+         if (!learning)
+            continue;
+
+         s += diff;
+         s2 += diff * diff;
+         mean[x] = (int16_t)(mean[x] + (raw >> (moved ? slow : LEARN_SHIFT)));
+      }
+   }
+   *sum = s;
+   *sum_squares = s2;
+   return changed;
+}
+
+/**
+ * Compare one tile with the background and decide the offset it takes out
+ * next time: its own mean difference if every pixel moved alike, otherwise
+ * the mean over the frame so a dark object in a brightening scene still
+ * shows up. Lighting drifts slowly enough for a frame's lag not to matter,
+ * sudden steps are caught by learn_noise.
+ */
+static void process_tile(MOTION_DETECTOR *motion, MOTION_TILE *tile, const uint8_t *luma, int stride,
+                         int16_t *mean, int width, int height)
+{
+   int phase = motion->frames & 1;
+   int pixels = width * ((height + 1 - phase) / 2);
+   int32_t sum, sum_squares;
+
+   tile->changed = (uint16_t)tile_update(luma, stride, mean, motion->width, width, height, tile->offset, tile->limit,
+                                         motion->settling ? LEARN_SHIFT : FOREGROUND_SHIFT, phase, &sum, &sum_squares);
+
+   // Full tiles divide by shifting, a divide per tile shows up in the budget
+   if (pixels == MOTION_TILE_SIZE * MOTION_TILE_SIZE / 2)
+   {
+      tile->average = (int16_t)(sum >> 7);
+      tile->variance = (sum_squares >> 7) - tile->average * tile->average;
+   }
+   else if (pixels)
+   {
+      tile->average = (int16_t)(sum / pixels);
+      tile->variance = sum_squares / pixels - tile->average * tile->average;
+   }
+   tile->offset = (int16_t)(tile->variance <= UNIFORM_MARGIN * tile->noise ? tile->average : motion->offset);
+}
+
+/**
+ * Start the background afresh from a frame and let it settle
+ */
+static void learn_frame(MOTION_DETECTOR *motion, const uint8_t *luma, int stride)
+{
+   for (int y = 0; y < motion->height; y++)
+   {
+      int16_t *mean = motion->background + (size_t)y * motion->width;
+
+      for (int x = 0; x < motion->width; x++)
+         mean[x] = (int16_t)(luma[(size_t)y * stride + x] << MOTION_MEAN_SHIFT);
+   }
+
+   for (int i = 0; i < motion->tiles_x * motion->tiles_y; i++)
+      motion->tiles[i].offset = motion->tiles[i].average = 0;
+   motion->offset = 0;
+   motion->settling = motion->settle_frames;
+}
+
+/**
+ * Move the background with the scene, pixel (x, y) takes the mean from
+ * (x - dx, y - dy). Rows are walked away from the direction of the shift
+ * so each source row is read before it is overwritten. Whatever came into
+ * view has no history, it starts from the frame itself.
+ */
+static void shift_background(MOTION_DETECTOR *motion, const uint8_t *luma, int stride, int dx, int dy)
+{
+   int width = motion->width, height = motion->height;
+   int keep = width - abs(dx), from = dx > 0 ? 0 : -dx, to = dx > 0 ? dx : 0;
+
+   for (int i = 0; i < height; i++)
+   {
+      int y = dy > 0 ? height - 1 - i : i, source = y - dy;
+      int16_t *mean = motion->background + (size_t)y * width;
+      const uint8_t *pixels = luma + (size_t)y * stride;
+      int x0 = 0, x1 = width;
+
+      if (source >= 0 && source < height && keep > 0)
+      {
+         memmove(mean + to, motion->background + (size_t)source * width + from, (size_t)keep * sizeof(*mean));
+         x0 = dx > 0 ? 0 : keep;
+         x1 = dx > 0 ? dx : width;
+      }
+      for (int x = x0; x < x1; x++)
+         mean[x] = (int16_t)(pixels[x] << MOTION_MEAN_SHIFT);
+   }
+   motion->shifted_frames++;
+}
+
+/**
+ * Update the tile noise estimates and decide whether the frame changed
+ * everywhere at once
+ *
+ * @return 1 if the frame is a lighting change rather than motion
+ */
+static int learn_noise(MOTION_DETECTOR *motion)
+{
+   int tiles = motion->tiles_x * motion->tiles_y;
+   int busy = 0, offsets = 0, lighting;
+
+   for (int i = 0; i < tiles; i++)
+   {
+      if (motion->tile_map[i] == MOTION_TILE_MASKED)
+         continue;
+      offsets += motion->tiles[i].average;
+      if (motion->tiles[i].changed * 16 > MOTION_TILE_SIZE * MOTION_TILE_SIZE)
+         busy++;
+   }
+
+   motion->offset = motion->active_tiles ? offsets / motion->active_tiles : 0;
+   lighting = !motion->settling && busy * 2 > motion->active_tiles;
+
+   // Quiet tiles keep their noise current. While settling every tile
+   // catches up quickly in case the light brought more grain, and if
+   // the grain alone keeps every tile busy the next lighting change
+   // relearns it from a clean start.
+   for (int i = 0; i < tiles; i++)
+   {
+      MOTION_TILE *tile = &motion->tiles[i];
+
+      if (motion->tile_map[i] == MOTION_TILE_MASKED)
+         continue;
+      if (motion->settling)
+         tile->noise += (tile->variance - tile->noise) >> SETTLE_NOISE_SHIFT;
+      else if (tile->changed * 64 <= MOTION_TILE_SIZE * MOTION_TILE_SIZE)
+         tile->noise += (tile->variance - tile->noise) >> NOISE_SHIFT;
+      if (tile->noise < NOISE_MIN)
+         tile->noise = NOISE_MIN;
+      tile_limit(motion, tile, motion->tile_map[i]);
+   }
+   return lighting;
+}
+
+/**
+ * Compare a frame with the background, tile by tile, skipping masked tiles
+ *
+ * @param luma Luma plane of the analysis frame
+ * @param width Width in pixels
+ * @param height Height in pixels
+ * @param stride Bytes per row
+ * @return 1 if any zone saw motion, 0 if not (or this is the first frame)
+ */
+int motion_process(MOTION_DETECTOR *motion, const uint8_t *luma, int width, int height, int stride)
+{
+   int min_x = width, min_y = height, max_x = -1, max_y = -1;
+   int triggered = 0, dx, dy;
+
+   if (!motion->background || motion->width != width || motion->height != height)
+   {
+      motion_reset(motion);
+      motion->width = width;
+      motion->height = height;
+      motion->background = malloc((size_t)width * height * sizeof(*motion->background));
+      if (!motion->background || build_tile_map(motion) != 0)
+      {
+         motion_reset(motion);
+         return 0;
+      }
+
+      learn_frame(motion, luma, stride);
+      motion->changed = 0;
+
+      // The estimator keeps its own copy to compare the next frame with
+      if (motion->ego_motion)
+         ego_motion_estimate(&motion->ego, luma, width, height, stride, &dx, &dy);
+      return 0;
+   }
+
+   if (motion->ego_motion && ego_motion_estimate(&motion->ego, luma, width, height, stride, &dx, &dy) == 0 &&
+       (dx || dy))
+      shift_background(motion, luma, stride, dx, dy);
+
+   motion->frame_zone.changed = 0;
+   for (int z = 0; z < motion->num_zones; z++)
+      motion->zones[z].changed = 0;
+
+   for (int ty = 0; ty < motion->tiles_y; ty++)
+   {
+      const uint8_t *map = motion->tile_map + ty * motion->tiles_x;
+      MOTION_TILE *tiles = motion->tiles + ty * motion->tiles_x;
+      int y0 = ty * MOTION_TILE_SIZE;
+      int h = height - y0 < MOTION_TILE_SIZE ? height - y0 : MOTION_TILE_SIZE;
+
+      for (int tx = 0; tx < motion->tiles_x; tx++)
+      {
+         int x0 = tx * MOTION_TILE_SIZE;
+         int w = width - x0 < MOTION_TILE_SIZE ? width - x0 : MOTION_TILE_SIZE;
+         MOTION_ZONE *zone;
+
+         if (map[tx] == MOTION_TILE_MASKED)
+            continue;
+
+         zone = tile_zone(motion, map[tx]);
+         process_tile(motion, &tiles[tx], luma + (size_t)y0 * stride + x0, stride,
+                      motion->background + (size_t)y0 * width + x0, w, h);
+         zone->changed += tiles[tx].changed;
+      }
+   }
+   motion->frames++;
+
+   if (learn_noise(motion))
+   {
+      motion->lighting_changes++;
+      learn_frame(motion, luma, stride);
+   }
+
+   if (motion->settling)
+   {
+      motion->settling--;
+      motion->changed = 0;
+      motion->frame_zone.changed = motion->frame_zone.triggered = 0;
+      for (int z = 0; z < motion->num_zones; z++)
+         motion->zones[z].changed = motion->zones[z].triggered = 0;
+      return 0;
+   }
+
+   motion->changed = motion->frame_zone.changed;
+   motion->frame_zone.triggered = motion->frame_zone.changed &&
+      (int64_t)motion->frame_zone.changed * 1000 >= (int64_t)motion->frame_zone.min_area * motion->frame_zone.pixels;
+   triggered = motion->frame_zone.triggered;
+
+   for (int z = 0; z < motion->num_zones; z++)
+   {
+      MOTION_ZONE *zone = &motion->zones[z];
+
+      motion->changed += zone->changed;
+      zone->triggered = !zone->exclude && zone->changed &&
+                        (int64_t)zone->changed * 1000 >= (int64_t)zone->min_area * zone->pixels;
+      triggered |= zone->triggered;
+   }
+
+   if (!triggered)
+      return 0;
+
+   // Box around the changed tiles of the zones that triggered
+   for (int ty = 0; ty < motion->tiles_y; ty++)
+   {
+      const uint8_t *map = motion->tile_map + ty * motion->tiles_x;
+      const MOTION_TILE *tiles = motion->tiles + ty * motion->tiles_x;
+
+      for (int tx = 0; tx < motion->tiles_x; tx++)
+      {
+         if (map[tx] == MOTION_TILE_MASKED || !tiles[tx].changed || !tile_zone(motion, map[tx])->triggered)
+            continue;
+
+         if (tx < min_x)
+            min_x = tx;
+         if (tx > max_x)
+            max_x = tx;
+         if (ty < min_y)
+            min_y = ty;
+         max_y = ty;
+      }
+   }
+
+   motion->box_x = min_x * MOTION_TILE_SIZE;
+   motion->box_y = min_y * MOTION_TILE_SIZE;
+   motion->box_width = (max_x + 1) * MOTION_TILE_SIZE - motion->box_x;
+   motion->box_height = (max_y + 1) * MOTION_TILE_SIZE - motion->box_y;
+   if (motion->box_x + motion->box_width > width)
+      motion->box_width = width - motion->box_x;
+   if (motion->box_y + motion->box_height > height)
+      motion->box_height = height - motion->box_y;
+   return 1;
+}
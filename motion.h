@@ -0,0 +1,122 @@
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <stdint.h>
+
+#include "ego_motion.h"
+#include "polygon.h"
+
+/// Luma difference that counts a pixel as changed
+#define MOTION_DEFAULT_THRESHOLD 24
+
+/// Changed pixels needed for motion, in thousandths of the frame (or zone)
+#define MOTION_DEFAULT_MIN_AREA  5
+
+/// Frames are compared in square tiles of this many pixels, one vector wide
+#define MOTION_TILE_SIZE         16
+
+/// Background means are kept in 1/128ths of a luma step
+#define MOTION_MEAN_SHIFT        7
+
+/// Time a new background learns quickly before motion is reported (ms)
+#define MOTION_SETTLE_TIME       1600
+
+/// Frame rate assumed until told otherwise, thousandths of a frame per second
+#define MOTION_DEFAULT_FPS       10000
+
+#define MOTION_MAX_ZONES         8
+#define MOTION_MAX_POINTS        16
+
+/// Tile map value for tiles nobody is watching
+#define MOTION_TILE_MASKED       0xff
+
+/** Point of a zone polygon, a zone fits whatever resolution the analysis
+ *  stream runs at
+ */
+typedef POLYGON_POINT MOTION_POINT;
+
+/** Polygon with its own sensitivity, or a mask to ignore
+ */
+typedef struct
+{
+   int exclude;                     /// Mask, tiles inside are never looked at
+   int threshold;                   /// Luma difference that counts a pixel as changed
+   int min_area;                    /// Changed pixels needed, in thousandths of the zone
+   int num_points;
+   MOTION_POINT points[MOTION_MAX_POINTS];
+
+   int pixels;                      /// Pixels in the zone's tiles at the current size
+   int changed;                     /// Pixels changed in the last frame
+   int triggered;                   /// Zone saw motion in the last frame
+} MOTION_ZONE;
+
+/** Background statistics of one tile. Differences are in quarter luma
+ *  steps, so variances are in 1/16ths of a squared luma step
+ */
+typedef struct
+{
+   int32_t noise;                   /// Running variance of the tile while nothing moves
+   int32_t variance;                /// Variance of the difference in the last frame
+   int16_t average;                 /// Mean difference in the last frame
+   int16_t offset;                  /// Illumination offset to take out in the next frame
+   int16_t limit;                   /// Difference that counts as changed, from noise and threshold
+   uint16_t changed;                /// Pixels changed in the last frame
+} MOTION_TILE;
+
+/** Motion gate on the low resolution analysis stream.
+ *  Compares each frame with a running background and reports motion when
+ *  enough pixels in a zone differ from it, along with the box around them.
+ *  Each tile takes out the brightness shift common to its pixels before
+ *  they are compared, and raises its threshold with its own noise, so
+ *  clouds and night time grain don't count as motion. A frame where most
+ *  tiles change at once is taken as a lighting change, the background
+ *  restarts from it and settles for a moment before motion is reported.
+ *  Zones are rasterised into a tile map once per frame size and masked
+ *  tiles are skipped by the kernels altogether. With no zones the whole
+ *  frame is one zone using threshold and min_area.
+ *  With ego_motion set, the translation of the whole scene since the last
+ *  frame is estimated first and the background shifted to match, so a
+ *  panning camera still only sees what moves in the scene. Background
+ *  the pan uncovers is learnt straight from the frame.
+ */
+typedef struct
+{
+   int threshold;                   /// MOTION_DEFAULT_THRESHOLD
+   int min_area;                    /// MOTION_DEFAULT_MIN_AREA
+   int ego_motion;                  /// Take out the camera's own movement before comparing
+   MOTION_ZONE zones[MOTION_MAX_ZONES];
+   int num_zones;
+
+   int width;                       /// Size of the background
+   int height;
+   int16_t *background;             /// Running mean of each pixel, NULL until the first frame
+   int tiles_x, tiles_y;
+   uint8_t *tile_map;               /// Zone of each tile, MOTION_TILE_MASKED to skip
+   MOTION_TILE *tiles;
+   int active_tiles;                /// Tiles not masked
+   MOTION_ZONE frame_zone;          /// Used when no zones are set
+
+   int offset;                      /// Mean illumination offset over the last frame
+   unsigned int frames;             /// Frames compared, picks the rows learnt
+   int settle_frames;               /// MOTION_SETTLE_TIME in frames at the current frame rate
+   int settling;                    /// Frames left learning a new background before reporting motion
+   int lighting_changes;            /// Frames put down to lighting rather than motion
+   int changed;                     /// Pixels changed in the last frame
+   int box_x, box_y;                /// Bounding box of the changed tiles in triggered zones
+   int box_width, box_height;
+
+   EGO_MOTION ego;                  /// Translation estimate for ego_motion
+   unsigned int shifted_frames;     /// Frames the background was shifted for
+} MOTION_DETECTOR;
+
+void motion_init(MOTION_DETECTOR *motion);
+void motion_set_frame_rate(MOTION_DETECTOR *motion, int fps);
+int motion_add_zone(MOTION_DETECTOR *motion, int exclude, int threshold, int min_area,
+                    const MOTION_POINT *points, int num_points);
+int motion_load_zones(MOTION_DETECTOR *motion, const char *path);
+int motion_process(MOTION_DETECTOR *motion, const uint8_t *luma, int width, int height, int stride);
+void motion_seed_shift(MOTION_DETECTOR *motion, int dx, int dy);
+void motion_reset(MOTION_DETECTOR *motion);
+void motion_destroy(MOTION_DETECTOR *motion);
+
+#endif /* MOTION_H_ */
@@ -0,0 +1,234 @@
+/**
+ * Benchmark for the motion gate with masks.
+ *
+ * Masks an increasing share of the frame and times motion_process over a
+ * rendered clip at each step. Masked tiles are skipped by the background
+ * kernels rather than computed and thrown away, so the time per frame
+ * should fall in line with the masked share.
+ *
+ * Then plays scenes where nothing moves but the light and the sensor
+ * noise, and counts the frames reported as motion. Only the walker scene
+ * should trigger.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "motion.h"
+#include "synthetic_camera.h"
+
+#define CLIP_FRAMES 16
+
+/// Scenes run at the analysis stream's 10fps, so this is 30 seconds
+#define SCENE_FRAMES 300
+
+typedef enum
+{
+   SCENE_QUIET,                     /// Daylight sensor noise
+   SCENE_NIGHT,                     /// Dark and grainy, as with a long shutter and high gain
+   SCENE_CLOUD,                     /// Brightness drifting down and back up
+   SCENE_LIGHTS,                    /// Exposure stepping between two levels
+   SCENE_WALKER,                    /// Something actually moving
+   SCENE_COUNT
+} SCENE;
+
+static const char *scene_names[SCENE_COUNT] = { "quiet", "night", "cloud", "lights", "walker" };
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-W width] [-H height] [-n frames] [-z zones_file]\n", app);
+   fprintf(stderr, "  -z  also time the zones in this file\n");
+}
+
+/**
+ * Time the detector over the clip
+ *
+ * @return Microseconds per frame
+ */
+static double time_motion(MOTION_DETECTOR *motion, uint8_t *const *clip, int width, int height,
+                          int frames, int *detections)
+{
+   int64_t start;
+
+   *detections = 0;
+
+   // First frame just sets the reference and builds the tile map
+   motion_process(motion, clip[0], width, height, width);
+
+   start = bench_now();
+   for (int i = 1; i <= frames; i++)
+      *detections += motion_process(motion, clip[i % CLIP_FRAMES], width, height, width);
+   return (double)(bench_now() - start) / frames;
+}
+
+/**
+ * Render frame i of a scene from the still background
+ */
+static void render_scene(SCENE scene, uint8_t *frame, const uint8_t *still, int width, int height,
+                         int i, uint32_t *seed)
+{
+   int gain = 256, offset = 0, noise = 3;
+
+   switch (scene)
+   {
+      case SCENE_NIGHT : gain = 90; noise = 16; break;
+      case SCENE_CLOUD : offset = -(i % 240 < 120 ? i % 240 : 240 - i % 240) / 2; break;
+      case SCENE_LIGHTS : gain = (i / 100) & 1 ? 160 : 256; break;
+      case SCENE_WALKER : synthetic_render_luma(frame, width, height, width, i * 2); still = frame; break;
+      default : break;
+   }
+
+   for (int p = 0; p < width * height; p++)
+   {
+      int value;
+
+      value = ((still[p] * gain) >> 8) + offset + (int)((bench_random(seed) >> 8) % (2 * noise + 1)) - noise;
+      frame[p] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+   }
+}
+
+/**
+ * Count the frames of a scene reported as motion
+ *
+ * @return Microseconds per frame
+ */
+static double play_scene(SCENE scene, const uint8_t *still, uint8_t *frame, int width, int height,
+                         int *detections)
+{
+   MOTION_DETECTOR motion;
+   uint32_t seed = 1;
+   int64_t elapsed = 0;
+
+   *detections = 0;
+   motion_init(&motion);
+   for (int i = 0; i < SCENE_FRAMES; i++)
+   {
+      int64_t start;
+
+      render_scene(scene, frame, still, width, height, i, &seed);
+      start = bench_now();
+      *detections += motion_process(&motion, frame, width, height, width);
+      elapsed += bench_now() - start;
+   }
+   motion_destroy(&motion);
+   return (double)elapsed / SCENE_FRAMES;
+}
+
+static void report(const char *name, const MOTION_DETECTOR *motion, double per_frame, double baseline,
+                   int width, int height, int detections, int frames)
+{
+   int tiles = motion->tiles_x * motion->tiles_y;
+
+   printf("%-12s %6.1f%% %9.1f %9.1f %8.2fx %7d/%d\n", name,
+          100.0 * (tiles - motion->active_tiles) / tiles, per_frame,
+          (double)width * height / per_frame, baseline / per_frame, detections, frames);
+}
+
+int main(int argc, char **argv)
+{
+   static const int masked_percent[] = { 0, 25, 50, 75, 90 };
+   uint8_t *clip[CLIP_FRAMES], *still, *frame;
+   const char *zones_path = NULL;
+   int width = 640, height = 480, frames = 2000, opt;
+   double baseline = 0;
+
+   while ((opt = getopt(argc, argv, "W:H:n:z:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'W' : width = atoi(optarg); break;
+         case 'H' : height = atoi(optarg); break;
+         case 'n' : frames = atoi(optarg); break;
+         case 'z' : zones_path = optarg; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (width < MOTION_TILE_SIZE || height < MOTION_TILE_SIZE || frames < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   for (int i = 0; i < CLIP_FRAMES; i++)
+   {
+      clip[i] = malloc((size_t)width * height);
+      if (!clip[i])
+      {
+         fprintf(stderr, "Out of memory\n");
+         return 1;
+      }
+      // Big steps so the square really moves between frames
+      synthetic_render_luma(clip[i], width, height, width, i * 8);
+   }
+
+   printf("%dx%d, %d frames, %d pixel tiles\n", width, height, frames, MOTION_TILE_SIZE);
+   printf("%-12s %7s %9s %9s %9s %9s\n", "mask", "masked", "us/frame", "Mpix/s", "speedup", "motion");
+
+   // Mask a growing strip down the left, the moving square crosses all of it
+   for (size_t m = 0; m < sizeof(masked_percent) / sizeof(masked_percent[0]); m++)
+   {
+      MOTION_DETECTOR motion;
+      float edge = masked_percent[m] / 100.0f;
+      MOTION_POINT strip[4] = { { 0, 0 }, { edge, 0 }, { edge, 1 }, { 0, 1 } };
+      char name[16];
+      double per_frame;
+      int detections;
+
+      motion_init(&motion);
+      if (masked_percent[m])
+         motion_add_zone(&motion, 1, 0, 0, strip, 4);
+
+      per_frame = time_motion(&motion, clip, width, height, frames, &detections);
+      if (!masked_percent[m])
+         baseline = per_frame;
+
+      snprintf(name, sizeof(name), "left %d%%", masked_percent[m]);
+      report(name, &motion, per_frame, baseline, width, height, detections, frames);
+      motion_destroy(&motion);
+   }
+
+   if (zones_path)
+   {
+      MOTION_DETECTOR motion;
+      double per_frame;
+      int detections;
+
+      motion_init(&motion);
+      if (motion_load_zones(&motion, zones_path) != 0)
+         return 1;
+
+      per_frame = time_motion(&motion, clip, width, height, frames, &detections);
+      report("zones file", &motion, per_frame, baseline, width, height, detections, frames);
+      motion_destroy(&motion);
+   }
+
+   // Park the square in the corner so the still scene has nothing moving
+   still = malloc((size_t)width * height);
+   frame = malloc((size_t)width * height);
+   if (!still || !frame)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   synthetic_render_luma(still, width, height, width, 0);
+
+   printf("\n%-12s %9s %9s\n", "scene", "us/frame", "motion");
+   for (int s = 0; s < SCENE_COUNT; s++)
+   {
+      int detections;
+      double per_frame = play_scene((SCENE)s, still, frame, width, height, &detections);
+
+      printf("%-12s %9.1f %5d/%d\n", scene_names[s], per_frame, detections, SCENE_FRAMES);
+   }
+
+   free(still);
+   free(frame);
+   for (int i = 0; i < CLIP_FRAMES; i++)
+      free(clip[i]);
+   return 0;
+}
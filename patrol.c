@@ -0,0 +1,381 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "patrol.h"
+#include "clock_now.h"
+
+/**
+ * Set up presets and the tour for a head, the tour doesn't run until patrol_start
+ *
+ * @return 0 on success
+ */
+int patrol_init(PATROL *patrol, SERVO_CONTROL *control)
+{
+   pthread_condattr_t attr;
+
+   memset(patrol, 0, sizeof(*patrol));
+   patrol->control = control;
+   patrol->resume_after = PATROL_DEFAULT_RESUME;
+
+   pthread_mutex_init(&patrol->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&patrol->cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   patrol->visits_metric = metrics_counter("patrol_visits_total", "Tour stops the head dwelt at", NULL);
+   patrol->interruptions_metric = metrics_counter("patrol_interruptions_total",
+                                                  "Tour moves and dwells cut short by hand", NULL);
+   return 0;
+}
+
+/**
+ * Names go in the presets file between spaces and before a tour's colon
+ */
+static int valid_name(const char *name)
+{
+   if (!*name || strlen(name) >= PATROL_NAME_LENGTH)
+      return 0;
+   for (; *name; name++)
+      if (isspace((unsigned char)*name) || *name == ':' || *name == '#')
+         return 0;
+   return 1;
+}
+
+static int find_preset(const PATROL_PRESET *presets, int num_presets, const char *name)
+{
+   for (int i = 0; i < num_presets; i++)
+      if (strcmp(presets[i].name, name) == 0)
+         return i;
+   return -1;
+}
+
+static int clamp_position(float degrees)
+{
+   int tenths = (int)(degrees * 10 + (degrees < 0 ? -0.5f : 0.5f));
+
+   return tenths < 0 ? 0 : tenths > SERVO_POSITION_MAX ? SERVO_POSITION_MAX : tenths;
+}
+
+/**
+ * Add a preset to a list, or move the one with the same name
+ *
+ * @return 0 on success, -1 if the name is bad or the list is full
+ */
+static int put_preset(PATROL_PRESET *presets, int *num_presets, const char *name, int pan, int tilt)
+{
+   int index;
+
+   if (!valid_name(name))
+      return -1;
+   if ((index = find_preset(presets, *num_presets, name)) < 0)
+   {
+      if (*num_presets >= PATROL_MAX_PRESETS)
+         return -1;
+      index = (*num_presets)++;
+      strcpy(presets[index].name, name);
+   }
+   presets[index].pan = pan < 0 ? 0 : pan > SERVO_POSITION_MAX ? SERVO_POSITION_MAX : pan;
+   presets[index].tilt = tilt < 0 ? 0 : tilt > SERVO_POSITION_MAX ? SERVO_POSITION_MAX : tilt;
+   return 0;
+}
+
+/**
+ * Load presets and the tour from a file, one per line:
+ *   preset <name> <pan> <tilt>
+ *   tour <name>:<dwell> <name>:<dwell> ...
+ * with pan/tilt in degrees and dwells in seconds, # starts a comment.
+ * A tour can only name presets above it, tour lines add to the one tour.
+ * Nothing changes if the file is bad.
+ *
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int patrol_load(PATROL *patrol, const char *path)
+{
+   PATROL_PRESET presets[PATROL_MAX_PRESETS];
+   PATROL_STOP stops[PATROL_MAX_STOPS];
+   int num_presets = 0, num_stops = 0, line_num = 0;
+   FILE *file = fopen(path, "r");
+   char line[512];
+
+   if (!file)
+   {
+      fprintf(stderr, "%s: unable to open presets\n", path);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), file))
+   {
+      char kind[8], name[PATROL_NAME_LENGTH], rest;
+      float pan, tilt, dwell;
+      int used, stops_before = num_stops;
+      char *p;
+
+      line_num++;
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+      p = line;
+
+      if (sscanf(p, "%7s%n", kind, &used) != 1)
+         continue;
+      p += used;
+
+      if (strcmp(kind, "preset") == 0)
+      {
+         if (sscanf(p, " %31s %f %f%n", name, &pan, &tilt, &used) != 3 ||
+             put_preset(presets, &num_presets, name, clamp_position(pan), clamp_position(tilt)) != 0)
+            goto error;
+         p += used;
+      }
+      else if (strcmp(kind, "tour") == 0)
+      {
+         while (sscanf(p, " %31[^: \t\r\n]:%f%n", name, &dwell, &used) == 2)
+         {
+            int preset = find_preset(presets, num_presets, name);
+
+            if (preset < 0 || dwell < 0 || num_stops >= PATROL_MAX_STOPS)
+               goto error;
+            stops[num_stops].preset = preset;
+            stops[num_stops].dwell = (int)(dwell * 1000);
+            num_stops++;
+            p += used;
+         }
+         if (num_stops == stops_before)
+            goto error;
+      }
+      else
+         goto error;
+
+      if (sscanf(p, " %c", &rest) == 1)
+         goto error;
+   }
+   fclose(file);
+
+   pthread_mutex_lock(&patrol->lock);
+   memcpy(patrol->presets, presets, sizeof(presets[0]) * num_presets);
+   patrol->num_presets = num_presets;
+   memcpy(patrol->stops, stops, sizeof(stops[0]) * num_stops);
+   patrol->num_stops = num_stops;
+   patrol->current = 0;
+   pthread_cond_broadcast(&patrol->cond);
+   pthread_mutex_unlock(&patrol->lock);
+   return 0;
+
+error:
+   fprintf(stderr, "%s:%d: bad preset or tour\n", path, line_num);
+   fclose(file);
+   return -1;
+}
+
+/**
+ * Write the presets and tour out in the form patrol_load reads.
+ * Same temp~ then rename as the exposure cache, so a crash mid write
+ * never loses the presets.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int patrol_save(PATROL *patrol, const char *path)
+{
+   char temp_path[256];
+   FILE *file;
+   int ok;
+
+   if (snprintf(temp_path, sizeof(temp_path), "%s~", path) >= (int)sizeof(temp_path))
+      return -1;
+
+   file = fopen(temp_path, "w");
+   if (!file)
+      return -1;
+
+   pthread_mutex_lock(&patrol->lock);
+   fprintf(file, "# pan/tilt presets in degrees, tour dwells in seconds\n");
+   for (int i = 0; i < patrol->num_presets; i++)
+      fprintf(file, "preset %s %.1f %.1f\n", patrol->presets[i].name,
+              patrol->presets[i].pan / 10.0, patrol->presets[i].tilt / 10.0);
+   if (patrol->num_stops)
+   {
+      fprintf(file, "tour");
+      for (int i = 0; i < patrol->num_stops; i++)
+         fprintf(file, " %s:%g", patrol->presets[patrol->stops[i].preset].name, patrol->stops[i].dwell / 1000.0);
+      fprintf(file, "\n");
+   }
+   pthread_mutex_unlock(&patrol->lock);
+
+   ok = !ferror(file);
+   if (fclose(file) != 0)
+      ok = 0;
+
+   if (!ok || rename(temp_path, path) != 0)
+   {
+      remove(temp_path);
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * Add a preset, or move an existing one
+ *
+ * @param pan, tilt Tenths of a degree
+ * @return 0 on success, -1 if the name can't go in the file or there are too many presets
+ */
+int patrol_set_preset(PATROL *patrol, const char *name, int pan, int tilt)
+{
+   int status;
+
+   pthread_mutex_lock(&patrol->lock);
+   status = put_preset(patrol->presets, &patrol->num_presets, name, pan, tilt);
+   pthread_mutex_unlock(&patrol->lock);
+   return status;
+}
+
+/**
+ * Send the head to a preset by hand, holding the tour as the stick does
+ *
+ * @return 0 on success, -1 if there is no such preset
+ */
+int patrol_goto(PATROL *patrol, const char *name)
+{
+   int index;
+
+   pthread_mutex_lock(&patrol->lock);
+   if ((index = find_preset(patrol->presets, patrol->num_presets, name)) >= 0)
+   {
+      servo_control_goto(patrol->control, patrol->presets[index].pan, patrol->presets[index].tilt);
+      patrol->held_at = clock_now_us();
+      pthread_cond_broadcast(&patrol->cond);
+   }
+   pthread_mutex_unlock(&patrol->lock);
+   return index < 0 ? -1 : 0;
+}
+
+static void wait_until(PATROL *patrol, int64_t when)
+{
+   struct timespec ts = { when / 1000000, (when % 1000000) * 1000 };
+
+   pthread_cond_timedwait(&patrol->cond, &patrol->lock, &ts);
+}
+
+/**
+ * @return 1 if the stick or a preset sent by hand has moved the head since a time
+ */
+static int interrupted(PATROL *patrol, int64_t since)
+{
+   return servo_control_last_manual(patrol->control) > since || patrol->held_at > since;
+}
+
+/**
+ * @return when the tour may move the head again, 0 if it may now
+ */
+static int64_t held_until(PATROL *patrol, int64_t now)
+{
+   int64_t last = servo_control_last_manual(patrol->control), until;
+
+   if (patrol->held_at > last)
+      last = patrol->held_at;
+   until = last ? last + (int64_t)patrol->resume_after * 1000000 : 0;
+   return until > now ? until : 0;
+}
+
+static void *patrol_thread(void *arg)
+{
+   PATROL *patrol = (PATROL *)arg;
+
+   pthread_mutex_lock(&patrol->lock);
+   while (!patrol->quit)
+   {
+      int64_t start = clock_now_us(), until = held_until(patrol, start), end;
+      PATROL_PRESET preset;
+      PATROL_STOP stop;
+
+      if (!patrol->num_stops)
+      {
+         pthread_cond_wait(&patrol->cond, &patrol->lock);
+         continue;
+      }
+      if (until)
+      {
+         wait_until(patrol, until);
+         continue;
+      }
+
+      // Copies, the presets may be reloaded while the lock is let go
+      stop = patrol->stops[patrol->current % patrol->num_stops];
+      preset = patrol->presets[stop.preset];
+      servo_control_goto(patrol->control, preset.pan, preset.tilt);
+
+      // Until the head has been still at the preset for its settle time
+      while (!patrol->quit && !interrupted(patrol, start) && !servo_control_settled(patrol->control))
+         wait_until(patrol, clock_now_us() + PATROL_POLL_INTERVAL * 1000);
+
+      end = clock_now_us() + (int64_t)stop.dwell * 1000;
+      while (!patrol->quit && !interrupted(patrol, start))
+      {
+         int64_t now = clock_now_us();
+
+         if (now >= end)
+            break;
+         wait_until(patrol, now + PATROL_POLL_INTERVAL * 1000 < end ? now + PATROL_POLL_INTERVAL * 1000 : end);
+      }
+
+      if (patrol->quit)
+         break;
+      if (interrupted(patrol, start))
+      {
+         // The same stop again once the hold is over
+         patrol->interruptions++;
+         metrics_add(patrol->interruptions_metric, 1);
+         continue;
+      }
+
+      patrol->visits++;
+      metrics_add(patrol->visits_metric, 1);
+      if (patrol->num_stops)
+         patrol->current = (patrol->current + 1) % patrol->num_stops;
+   }
+   pthread_mutex_unlock(&patrol->lock);
+   return NULL;
+}
+
+/**
+ * Start the tour thread. It idles until there is a tour, and the servo
+ * control loop must be running for the head to get anywhere.
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int patrol_start(PATROL *patrol)
+{
+   patrol->quit = 0;
+   if (pthread_create(&patrol->thread, NULL, patrol_thread, patrol) != 0)
+      return -1;
+   patrol->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Stop the tour, the head stays where it got to
+ */
+void patrol_stop(PATROL *patrol)
+{
+   if (!patrol->thread_running)
+      return;
+
+   pthread_mutex_lock(&patrol->lock);
+   patrol->quit = 1;
+   pthread_cond_broadcast(&patrol->cond);
+   pthread_mutex_unlock(&patrol->lock);
+   pthread_join(patrol->thread, NULL);
+   patrol->thread_running = 0;
+}
+
+void patrol_destroy(PATROL *patrol)
+{
+   patrol_stop(patrol);
+   pthread_cond_destroy(&patrol->cond);
+   pthread_mutex_destroy(&patrol->lock);
+}
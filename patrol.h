@@ -0,0 +1,78 @@
+#ifndef PATROL_H_
+#define PATROL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "servo_control.h"
+#include "metrics.h"
+
+#define PATROL_MAX_PRESETS     32
+#define PATROL_MAX_STOPS       32
+#define PATROL_NAME_LENGTH     32
+
+/// Time the stick must be left alone before a tour carries on, in seconds
+#define PATROL_DEFAULT_RESUME  30
+
+/// How often a move or dwell checks for the stick, in milliseconds
+#define PATROL_POLL_INTERVAL   20
+
+/** A named head position
+ */
+typedef struct
+{
+   char name[PATROL_NAME_LENGTH];
+   int pan;                         /// Tenths of a degree
+   int tilt;                        /// Tenths of a degree
+} PATROL_PRESET;
+
+/** One stop on a tour
+ */
+typedef struct
+{
+   int preset;                      /// Index into the presets
+   int dwell;                       /// Time spent there once settled, in milliseconds
+} PATROL_STOP;
+
+/** Presets and the tour between them.
+ *  The tour thread moves the head to each stop in turn, waits for it to
+ *  settle and stays there for the stop's dwell. Moving the stick, or
+ *  sending the head to a preset by hand, holds the tour for resume_after
+ *  seconds after the last of it, then the tour goes back to the stop it
+ *  was on.
+ */
+typedef struct
+{
+   SERVO_CONTROL *control;
+   int resume_after;                /// PATROL_DEFAULT_RESUME
+
+   pthread_mutex_t lock;            /// Guards everything below
+   pthread_cond_t cond;
+   PATROL_PRESET presets[PATROL_MAX_PRESETS];
+   int num_presets;
+   PATROL_STOP stops[PATROL_MAX_STOPS];
+   int num_stops;
+   int current;                     /// Stop the tour is on
+   int64_t held_at;                 /// Last preset sent by hand (us)
+   int quit;
+
+   uint64_t visits;                 /// Stops the tour dwelt at
+   uint64_t interruptions;          /// Moves or dwells cut short by the stick or a preset
+
+   pthread_t thread;
+   int thread_running;
+
+   METRIC *visits_metric;
+   METRIC *interruptions_metric;
+} PATROL;
+
+int patrol_init(PATROL *patrol, SERVO_CONTROL *control);
+int patrol_load(PATROL *patrol, const char *path);
+int patrol_save(PATROL *patrol, const char *path);
+int patrol_set_preset(PATROL *patrol, const char *name, int pan, int tilt);
+int patrol_goto(PATROL *patrol, const char *name);
+int patrol_start(PATROL *patrol);
+void patrol_stop(PATROL *patrol);
+void patrol_destroy(PATROL *patrol);
+
+#endif /* PATROL_H_ */
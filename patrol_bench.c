@@ -0,0 +1,302 @@
+/**
+ * Preset tour against a running pipeline.
+ *
+ * Runs the servo control loop on the mock bus with a tour between three
+ * presets, its move callback wired to a synthetic pipeline taking a
+ * timelapse with the analysis stream on, as camera.c -H wires camera 0.
+ * Every move is checked: the head settles on the preset, settle_time after
+ * it stopped, and the pipeline neither analyses nor captures in between,
+ * bar the one frame each that was already under way when the move began.
+ * Halfway through the stick is pushed, the tour must give way to it and
+ * pick up again once the stick has been left alone.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bench_util.h"
+#include "servo_control.h"
+#include "patrol.h"
+#include "pipeline.h"
+#include "synthetic_camera.h"
+
+#define MAX_MOVES 1000
+
+/// Seconds the bench holds the tour for after the stick
+#define RESUME_AFTER 1
+
+/** What the move callback saw
+ */
+typedef struct
+{
+   pthread_mutex_t lock;
+   CAMERA_PIPELINE *pipeline;
+   SERVO_CONTROL *control;
+   double analysed_start;           /// Frames the pipeline had analysed when the move began
+   double captured_start;           /// Frames it had captured
+   int64_t moved_at;                /// When the move began (us)
+   int num_moves;
+   int64_t move_time[MAX_MOVES];    /// Start of move to settled (us)
+   int64_t settle_lag[MAX_MOVES];   /// Settled callback after settle_time without a change (us)
+   int off_target;                  /// Preset moves that settled somewhere else
+   int worst_analysed;              /// Most frames analysed during one move
+   int worst_captured;              /// Most frames captured during one move
+} HEAD_WATCH;
+
+static double analysed(CAMERA_PIPELINE *pipeline)
+{
+   return metrics_read(pipeline->analysis_metric) - metrics_read(pipeline->moving_frames_metric);
+}
+
+/**
+ * Move callback, on the control thread. The pipeline is told first when
+ * the head starts and last when it settles, so anything counted in
+ * between went through while the pipeline knew the head was moving.
+ */
+static void on_move(void *userdata, int moving)
+{
+   HEAD_WATCH *watch = (HEAD_WATCH *)userdata;
+   SERVO_CONTROL *control = watch->control;
+   int64_t now = bench_now();
+
+   if (moving)
+      pipeline_set_head_moving(watch->pipeline, 1);
+
+   pthread_mutex_lock(&watch->lock);
+   if (moving)
+   {
+      watch->moved_at = now;
+      watch->analysed_start = analysed(watch->pipeline);
+      watch->captured_start = metrics_read(watch->pipeline->frames_metric);
+   }
+   else
+   {
+      int frames = (int)(analysed(watch->pipeline) - watch->analysed_start);
+      int captures = (int)(metrics_read(watch->pipeline->frames_metric) - watch->captured_start);
+      int pan, tilt;
+
+      if (frames > watch->worst_analysed)
+         watch->worst_analysed = frames;
+      if (captures > watch->worst_captured)
+         watch->worst_captured = captures;
+
+      servo_control_position(control, &pan, &tilt);
+      if (__atomic_load_n(&control->mode, __ATOMIC_ACQUIRE) == SERVO_MODE_POSITION &&
+          (pan != __atomic_load_n(&control->target[0], __ATOMIC_ACQUIRE) ||
+           tilt != __atomic_load_n(&control->target[1], __ATOMIC_ACQUIRE)))
+         watch->off_target++;
+
+      // last_move belongs to the control thread, which this is
+      if (watch->num_moves < MAX_MOVES)
+      {
+         watch->move_time[watch->num_moves] = now - watch->moved_at;
+         watch->settle_lag[watch->num_moves] = now - control->last_move - (int64_t)control->settle_time * 1000;
+         watch->num_moves++;
+      }
+   }
+   pthread_mutex_unlock(&watch->lock);
+
+   if (!moving)
+      pipeline_set_head_moving(watch->pipeline, 0);
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-t seconds] [-l interval_ms] [-d dwell_ms] [-S slew_speed] [-o directory]\n", app);
+   fprintf(stderr, "  -l  timelapse interval of the pipeline (default 100)\n");
+   fprintf(stderr, "  -d  dwell at each preset (default 500)\n");
+   fprintf(stderr, "  -S  preset move speed in degrees/s (default %d)\n", SERVO_DEFAULT_SLEW_SPEED);
+   fprintf(stderr, "  -o  where the captures go, they are removed at the end (default /tmp)\n");
+}
+
+int main(int argc, char **argv)
+{
+   static const struct { const char *name; int pan, tilt; } presets[3] =
+   {
+      { "gate", 600, 900 }, { "drive", 900, 800 }, { "garden", 1200, 950 }
+   };
+   int seconds = 10, interval = 100, dwell = 500, slew = SERVO_DEFAULT_SLEW_SPEED, opt, failed = 0;
+   const char *directory = "/tmp";
+   static HEAD_WATCH watch;
+   CAMERA_PIPELINE pipeline;
+   SYNTHETIC_CAMERA camera;
+   STORAGE_MANAGER storage;
+   CAPTURE_SCHEDULER scheduler;
+   SERVO_CONTROL control;
+   SERVO_MOCK_BUS mock;
+   PATROL patrol;
+   uint64_t visits_before, interruptions_before;
+   int64_t pushed_at, tour_back = 0;
+
+   while ((opt = getopt(argc, argv, "t:l:d:S:o:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 't' : seconds = atoi(optarg); break;
+         case 'l' : interval = atoi(optarg); break;
+         case 'd' : dwell = atoi(optarg); break;
+         case 'S' : slew = atoi(optarg); break;
+         case 'o' : directory = optarg; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (seconds < 8 || interval < 10 || dwell < 0 || slew < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (storage_init(&storage, directory, "patrol%d_%04d") != 0 ||
+       scheduler_init(&scheduler, FRAME_NEXT_TIMELAPSE, interval, 0) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   synthetic_camera_set_defaults(&camera);
+   camera.width = 160;
+   camera.height = 120;
+   camera.buffer_size = 4096;
+   camera.analysis_interval = 20000;
+   if (pipeline_init(&pipeline, 0, &synthetic_backend, &camera, &storage, &scheduler) != 0)
+   {
+      fprintf(stderr, "Unable to create pipeline\n");
+      return 1;
+   }
+   pipeline.analysis = 1;
+
+   servo_mock_init(&mock);
+   mock.noise = 6;
+   if (servo_control_init(&control, &servo_mock_bus, &mock) != 0)
+      return 1;
+   control.slew_speed = slew;
+   control.priority = 0;
+   control.on_move = on_move;
+   control.move_userdata = &watch;
+
+   pthread_mutex_init(&watch.lock, NULL);
+   watch.pipeline = &pipeline;
+   watch.control = &control;
+
+   patrol_init(&patrol, &control);
+   patrol.resume_after = RESUME_AFTER;
+   for (int i = 0; i < 3; i++)
+   {
+      patrol_set_preset(&patrol, presets[i].name, presets[i].pan, presets[i].tilt);
+      patrol.stops[i].preset = i;
+      patrol.stops[i].dwell = dwell;
+   }
+   patrol.num_stops = 3;
+
+   if (pipeline_start(&pipeline) != 0 || scheduler_start(&scheduler) != 0 ||
+       servo_control_start(&control) != 0 || patrol_start(&patrol) != 0)
+   {
+      fprintf(stderr, "Unable to start\n");
+      return 1;
+   }
+
+   printf("3 presets, %d ms dwell, %d deg/s, %d ms settle, timelapse every %d ms\n\n", dwell, slew,
+          control.settle_time, interval);
+
+   // Tour on its own for the first half, then the stick takes over for a moment
+   sleep(seconds / 2);
+   pthread_mutex_lock(&patrol.lock);
+   visits_before = patrol.visits;
+   interruptions_before = patrol.interruptions;
+   pthread_mutex_unlock(&patrol.lock);
+
+   __atomic_store_n(&mock.x, SERVO_ADC_MAX, __ATOMIC_RELEASE);
+   pushed_at = bench_now();
+   usleep(300000);
+   __atomic_store_n(&mock.x, (SERVO_ADC_MAX + 1) / 2, __ATOMIC_RELEASE);
+   if (__atomic_load_n(&control.mode, __ATOMIC_ACQUIRE) != SERVO_MODE_MANUAL)
+   {
+      printf("stick didn't take the head off the tour\n");
+      failed = 1;
+   }
+
+   // The tour must move the head again once the hold is over
+   while (bench_now() - pushed_at < (int64_t)(seconds - seconds / 2) * 1000000)
+   {
+      if (!tour_back && __atomic_load_n(&control.mode, __ATOMIC_ACQUIRE) == SERVO_MODE_POSITION)
+         tour_back = bench_now();
+      usleep(10000);
+   }
+
+   patrol_stop(&patrol);
+   servo_control_stop(&control);
+   scheduler_stop(&scheduler);
+   pipeline_join(&pipeline);
+
+   printf("%llu tour stops, %llu interrupted, %d moves, %llu frames captured, %.0f deferred, %.0f analysis frames skipped\n",
+          (unsigned long long)patrol.visits, (unsigned long long)patrol.interruptions, watch.num_moves,
+          (unsigned long long)pipeline.frames_captured, metrics_read(pipeline.deferred_metric),
+          metrics_read(pipeline.moving_frames_metric));
+   printf("move to settled  p50 %6lld ms  max %6lld ms\n",
+          (long long)bench_percentile(watch.move_time, watch.num_moves, 50) / 1000,
+          (long long)bench_percentile(watch.move_time, watch.num_moves, 100) / 1000);
+   printf("settle lag       p50 %6lld us  max %6lld us  (after %d ms still)\n",
+          (long long)bench_percentile(watch.settle_lag, watch.num_moves, 50),
+          (long long)bench_percentile(watch.settle_lag, watch.num_moves, 100), control.settle_time);
+   printf("during a move    at most %d frames analysed, %d captured\n", watch.worst_analysed, watch.worst_captured);
+   printf("tour back        %lld ms after the stick was let go\n",
+          tour_back ? (long long)(tour_back - pushed_at - 300000) / 1000 : -1LL);
+
+   if (patrol.visits < 3 || visits_before < 1)
+   {
+      printf("tour didn't get round\n");
+      failed = 1;
+   }
+   if (watch.off_target)
+   {
+      printf("%d moves settled off their preset\n", watch.off_target);
+      failed = 1;
+   }
+   if (bench_percentile(watch.settle_lag, watch.num_moves, 0) < 0 ||
+       bench_percentile(watch.settle_lag, watch.num_moves, 100) > 2 * control.period)
+   {
+      printf("settled outside one cycle of the settle time\n");
+      failed = 1;
+   }
+   if (watch.worst_analysed > 1 || watch.worst_captured > 1)
+   {
+      printf("pipeline worked on frames while the head moved\n");
+      failed = 1;
+   }
+   if (patrol.interruptions <= interruptions_before || !tour_back ||
+       tour_back - pushed_at - 300000 < RESUME_AFTER * 1000000LL ||
+       tour_back - pushed_at - 300000 > RESUME_AFTER * 1000000LL + 100000)
+   {
+      printf("tour didn't give way to the stick and come back %d s later\n", RESUME_AFTER);
+      failed = 1;
+   }
+   if (!pipeline.frames_captured)
+   {
+      printf("nothing captured\n");
+      failed = 1;
+   }
+
+   for (int frame = 0; frame < pipeline.frame; frame++)
+   {
+      char final_name[STORAGE_NAME_MAX], temp_name[STORAGE_NAME_MAX];
+
+      if (storage_name_file(&storage, 0, frame, synthetic_backend.extension, final_name, temp_name,
+                            STORAGE_NAME_MAX) == 0)
+         remove(final_name);
+   }
+
+   patrol_destroy(&patrol);
+   servo_control_destroy(&control);
+   pipeline_destroy(&pipeline);
+   scheduler_destroy(&scheduler);
+   storage_destroy(&storage);
+   pthread_mutex_destroy(&watch.lock);
+
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
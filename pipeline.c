@@ -0,0 +1,842 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+/**
+ * Called on the watchdog thread when one of the pipeline's ports stalls
+ */
+static void pipeline_stalled(void *userdata, int port)
+{
+   CAMERA_PIPELINE *pipeline = (CAMERA_PIPELINE *)userdata;
+
+   pipeline->stalled_since = watchdog_stalled_since(&pipeline->watchdog, port);
+
+   if (pipeline->backend->abort_capture)
+      pipeline->backend->abort_capture(pipeline);
+}
+
+static const uint64_t fill_bounds[] = { 10, 25, 50, 75, 90, 100 };
+
+static double watchdog_stalls(void *userdata)
+{
+   return (double)((CAMERA_PIPELINE *)userdata)->watchdog.stalls;
+}
+
+static double watchdog_recoveries(void *userdata)
+{
+   return (double)((CAMERA_PIPELINE *)userdata)->watchdog.recoveries;
+}
+
+static double watchdog_recovery_failures(void *userdata)
+{
+   return (double)((CAMERA_PIPELINE *)userdata)->watchdog.recovery_failures;
+}
+
+static double watchdog_downtime(void *userdata)
+{
+   return ((CAMERA_PIPELINE *)userdata)->watchdog.downtime / 1e6;
+}
+
+static double full_rebuilds(void *userdata)
+{
+   return (double)((CAMERA_PIPELINE *)userdata)->full_rebuilds;
+}
+
+static double record_bytes(void *userdata)
+{
+   return (double)__atomic_load_n(&((CAMERA_PIPELINE *)userdata)->recorder.bytes_written, __ATOMIC_RELAXED);
+}
+
+static double record_segments(void *userdata)
+{
+   return (double)__atomic_load_n(&((CAMERA_PIPELINE *)userdata)->recorder.segments, __ATOMIC_RELAXED);
+}
+
+static double record_active(void *userdata)
+{
+   return recorder_is_active(&((CAMERA_PIPELINE *)userdata)->recorder, watchdog_now());
+}
+
+static double clock_drift(void *userdata)
+{
+   return frame_clock_drift(&((CAMERA_PIPELINE *)userdata)->clock);
+}
+
+static double clock_error(void *userdata)
+{
+   return (double)frame_clock_error(&((CAMERA_PIPELINE *)userdata)->clock);
+}
+
+static void register_metrics(CAMERA_PIPELINE *pipeline)
+{
+   char labels[32];
+
+   snprintf(labels, sizeof(labels), "camera=\"%d\"", pipeline->camera_num);
+
+   pipeline->frames_metric = metrics_counter("capture_frames_total", "Frames captured and written", labels);
+   pipeline->errors_metric = metrics_counter("capture_errors_total", "Captures that failed", labels);
+   pipeline->dropped_metric = metrics_counter("capture_dropped_total", "Frames captured with no file to write them to", labels);
+   pipeline->latency_metric = metrics_histogram("capture_latency_us", "Capture request to frame end in microseconds",
+                                                labels, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   pipeline->buffers_metric = metrics_counter("encoder_buffers_total", "Encoder output buffers handled", labels);
+   pipeline->buffer_fill_metric = metrics_histogram("encoder_buffer_fill_percent", "Encoder output buffer utilisation",
+                                                    labels, fill_bounds, sizeof(fill_bounds) / sizeof(fill_bounds[0]));
+
+   pipeline->watchdog_metrics[0] = metrics_callback("pipeline_stalls_total", "Stalls detected by the watchdog",
+                                                    labels, METRIC_COUNTER, watchdog_stalls, pipeline);
+   pipeline->watchdog_metrics[1] = metrics_callback("pipeline_recoveries_total", "Stalls recovered from",
+                                                    labels, METRIC_COUNTER, watchdog_recoveries, pipeline);
+   pipeline->watchdog_metrics[2] = metrics_callback("pipeline_recovery_failures_total", "Recoveries that failed",
+                                                    labels, METRIC_COUNTER, watchdog_recovery_failures, pipeline);
+   pipeline->watchdog_metrics[3] = metrics_callback("pipeline_downtime_seconds_total", "Time from last buffer to recovery",
+                                                    labels, METRIC_COUNTER, watchdog_downtime, pipeline);
+   pipeline->watchdog_metrics[4] = metrics_callback("pipeline_full_rebuilds_total", "Recoveries that rebuilt the whole pipeline",
+                                                    labels, METRIC_COUNTER, full_rebuilds, pipeline);
+
+   pipeline->analysis_metric = metrics_counter("analysis_frames_total", "Analysis frames seen", labels);
+   pipeline->motion_metric = metrics_counter("motion_frames_total", "Analysis frames with motion", labels);
+   pipeline->events_metric = metrics_counter("events_total", "Events promoted to a capture", labels);
+   pipeline->frame_period_metric = metrics_gauge("camera_frame_period_us", "Longest frame period the camera may run at",
+                                                 labels);
+   pipeline->idle_metric = metrics_gauge("camera_idle", "Camera slowed down for a static scene", labels);
+   pipeline->head_moving_metric = metrics_gauge("head_moving", "Pan/tilt head moving or settling", labels);
+   pipeline->moving_frames_metric = metrics_counter("analysis_moving_frames_total",
+                                                    "Analysis frames skipped while the head moved", labels);
+   pipeline->deferred_metric = metrics_counter("capture_deferred_total", "Captures held back until the head settled",
+                                               labels);
+   pipeline->privacy_metric = metrics_histogram("privacy_mask_us", "Time masking a frame before encoding in microseconds",
+                                                labels, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+
+   pipeline->record_metrics[0] = metrics_callback("record_bytes_total", "Recorded video written to segments",
+                                                  labels, METRIC_COUNTER, record_bytes, pipeline);
+   pipeline->record_metrics[1] = metrics_callback("record_segments_total", "Recorded segments committed",
+                                                  labels, METRIC_COUNTER, record_segments, pipeline);
+   pipeline->record_metrics[2] = metrics_callback("record_active", "Recording at full rate after motion",
+                                                  labels, METRIC_GAUGE, record_active, pipeline);
+
+   pipeline->frame_delay_metric = metrics_histogram("frame_delay_us", "Frame taken to frame handed over in microseconds",
+                                                    labels, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   pipeline->clock_metrics[0] = metrics_callback("frame_clock_drift_ppm", "Sensor clock drift against the host clock",
+                                                 labels, METRIC_GAUGE, clock_drift, pipeline);
+   pipeline->clock_metrics[1] = metrics_callback("frame_clock_error_us", "Uncertainty of the sensor clock mapping, -1 unsynced",
+                                                 labels, METRIC_GAUGE, clock_error, pipeline);
+}
+
+static int record_open(void *userdata, int segment, int64_t time)
+{
+   CAMERA_PIPELINE *pipeline = (CAMERA_PIPELINE *)userdata;
+
+   if (storage_writer_open(&pipeline->record_writer, pipeline->camera_num, segment,
+                           pipeline->backend->record_extension) != 0)
+      return -1;
+   storage_writer_stamp(&pipeline->record_writer, time);
+   return 0;
+}
+
+static size_t record_write(void *userdata, const void *data, size_t length)
+{
+   return storage_writer_write(&((CAMERA_PIPELINE *)userdata)->record_writer, data, length);
+}
+
+static int record_close(void *userdata)
+{
+   return storage_writer_close(&((CAMERA_PIPELINE *)userdata)->record_writer, 1);
+}
+
+static const RECORDER_OUTPUT record_output =
+{
+   record_open,
+   record_write,
+   record_close
+};
+
+/**
+ * Set up a pipeline, the watchdog deadline can be changed before it is started
+ *
+ * @return 0 on success, -1 on failure
+ */
+int pipeline_init(CAMERA_PIPELINE *pipeline, int camera_num, const PIPELINE_BACKEND *backend,
+                  void *backend_state, STORAGE_MANAGER *storage, CAPTURE_SCHEDULER *scheduler)
+{
+   memset(pipeline, 0, sizeof(*pipeline));
+   pipeline->camera_num = camera_num;
+   pipeline->backend = backend;
+   pipeline->backend_state = backend_state;
+   pipeline->storage = storage;
+   pipeline->scheduler = scheduler;
+   pipeline->event_holdoff = PIPELINE_DEFAULT_EVENT_HOLDOFF;
+   pipeline->field_of_view = PIPELINE_DEFAULT_FIELD_OF_VIEW;
+   pipeline->idle_time = PIPELINE_DEFAULT_IDLE_TIME;
+   storage_writer_init(&pipeline->writer, storage);
+   storage_writer_init(&pipeline->record_writer, storage);
+   pthread_mutex_init(&pipeline->push_lock, NULL);
+
+   if (recorder_init(&pipeline->recorder, RECORDER_DEFAULT_RING_SIZE, RECORDER_DEFAULT_RING_PACKETS,
+                     &record_output, pipeline) != 0)
+      return -1;
+
+   motion_init(&pipeline->motion);
+   privacy_mask_init(&pipeline->privacy);
+   frame_clock_init(&pipeline->clock);
+   register_metrics(pipeline);
+
+   return watchdog_init(&pipeline->watchdog, WATCHDOG_DEFAULT_DEADLINE, pipeline_stalled, pipeline);
+}
+
+void pipeline_destroy(CAMERA_PIPELINE *pipeline)
+{
+   pipeline_teardown(pipeline);
+
+   // The callbacks read this pipeline, the plain counters live on in the registry
+   for (int i = 0; i < (int)(sizeof(pipeline->watchdog_metrics) / sizeof(pipeline->watchdog_metrics[0])); i++)
+      metrics_unregister(pipeline->watchdog_metrics[i]);
+   for (int i = 0; i < (int)(sizeof(pipeline->record_metrics) / sizeof(pipeline->record_metrics[0])); i++)
+      metrics_unregister(pipeline->record_metrics[i]);
+   for (int i = 0; i < (int)(sizeof(pipeline->clock_metrics) / sizeof(pipeline->clock_metrics[0])); i++)
+      metrics_unregister(pipeline->clock_metrics[i]);
+
+   recorder_destroy(&pipeline->recorder);
+   frame_clock_destroy(&pipeline->clock);
+   motion_destroy(&pipeline->motion);
+   watchdog_destroy(&pipeline->watchdog);
+   pthread_mutex_destroy(&pipeline->push_lock);
+}
+
+/**
+ * Build the backend's components, buffer pools etc.
+ * Split from the thread body so a pipeline can be cycled without one.
+ *
+ * @return 0 on success, -1 if the backend could not be created
+ */
+int pipeline_setup(CAMERA_PIPELINE *pipeline)
+{
+   if (pipeline->backend_created)
+      return 0;
+
+   // New components may start their sensor clock over
+   frame_clock_reset(&pipeline->clock);
+
+   if (pipeline->backend->create(pipeline) != 0)
+   {
+      fprintf(stderr, "Camera %d: failed to create %s pipeline\n", pipeline->camera_num,
+              pipeline->backend->name);
+      watchdog_clear_ports(&pipeline->watchdog);
+      return -1;
+   }
+   pipeline->backend_created = 1;
+
+   if (watchdog_start(&pipeline->watchdog) != 0)
+      fprintf(stderr, "Camera %d: unable to start watchdog, stalls will not be detected\n",
+              pipeline->camera_num);
+   return 0;
+}
+
+/**
+ * Get a stalled pipeline running again.
+ * The backend rebuilds just the components that stalled if it can, the
+ * whole pipeline is only rebuilt if that fails.
+ */
+static void pipeline_recover(CAMERA_PIPELINE *pipeline)
+{
+   const PIPELINE_BACKEND *backend = pipeline->backend;
+   int recovered = 0;
+
+   if (backend->recover)
+      recovered = backend->recover(pipeline) == 0;
+
+   if (!recovered)
+   {
+      fprintf(stderr, "Camera %d: rebuilding whole pipeline\n", pipeline->camera_num);
+      pipeline_teardown(pipeline);
+      recovered = pipeline_setup(pipeline) == 0;
+      pipeline->full_rebuilds++;
+   }
+
+   watchdog_recovered(&pipeline->watchdog, pipeline->stalled_since, recovered);
+
+   if (pipeline->verbose)
+      fprintf(stderr, "Camera %d: %s after %lld ms\n", pipeline->camera_num,
+              recovered ? "recovered" : "recovery failed",
+              (long long)pipeline->watchdog.last_downtime / 1000);
+}
+
+/**
+ * Capture one frame into a new file
+ *
+ * @return 0 if the frame was written and committed, -1 otherwise
+ */
+int pipeline_capture_frame(CAMERA_PIPELINE *pipeline)
+{
+   const PIPELINE_BACKEND *backend = pipeline->backend;
+   int64_t start;
+   int status;
+
+   // A failed recovery leaves no backend, keep trying rather than giving up on the camera
+   if (!pipeline->backend_created && pipeline_setup(pipeline) != 0)
+   {
+      pipeline->capture_errors++;
+      metrics_add(pipeline->errors_metric, 1);
+      pipeline->frame++;
+      return -1;
+   }
+
+   // A failed open still captures, the buffers are just discarded
+   if (storage_writer_open(&pipeline->writer, pipeline->camera_num, pipeline->frame, backend->extension) != 0)
+      metrics_add(pipeline->dropped_metric, 1);
+
+   start = watchdog_now();
+   status = backend->capture(pipeline);
+   metrics_observe(pipeline->latency_metric, (uint64_t)(watchdog_now() - start));
+
+   if (storage_writer_close(&pipeline->writer, status == 0) != 0)
+      status = -1;
+
+   if (status == 0)
+   {
+      pipeline->frames_captured++;
+      metrics_add(pipeline->frames_metric, 1);
+      if (pipeline->verbose)
+         fprintf(stderr, "Camera %d: finished capture %d\n", pipeline->camera_num, pipeline->frame);
+   }
+   else
+   {
+      pipeline->capture_errors++;
+      metrics_add(pipeline->errors_metric, 1);
+   }
+
+   pipeline->frame++;
+
+   if (status == PIPELINE_CAPTURE_STALLED)
+      pipeline_recover(pipeline);
+
+   return status;
+}
+
+/**
+ * Tear the backend down, the capture in progress has already drained by the
+ * time this is called since captures block until their frame end.
+ */
+void pipeline_teardown(CAMERA_PIPELINE *pipeline)
+{
+   // Never leave a half written file behind
+   storage_writer_close(&pipeline->writer, 0);
+
+   // No stall reports while the components go away
+   watchdog_stop(&pipeline->watchdog);
+
+   if (pipeline->backend_created)
+      pipeline->backend->destroy(pipeline);
+   pipeline->backend_created = 0;
+
+   // No more packets, the new components' stream starts over at a keyframe
+   recorder_close(&pipeline->recorder);
+
+   watchdog_clear_ports(&pipeline->watchdog);
+
+   // No more analysis frames, make sure no detections arrive for the old components
+   if (pipeline->detector)
+      detector_cancel(pipeline->detector, pipeline);
+   motion_reset(&pipeline->motion);
+}
+
+/**
+ * Take the capture a trigger asked for while the head was moving, once the
+ * scheduler has stopped and no wakeup will come to say it settled. Waits
+ * for the head up to PIPELINE_HEAD_SETTLE_TIMEOUT, a smeared last frame
+ * beats none at all.
+ */
+static void capture_deferred(CAMERA_PIPELINE *pipeline)
+{
+   int64_t give_up = watchdog_now() + (int64_t)PIPELINE_HEAD_SETTLE_TIMEOUT * 1000;
+
+   while (__atomic_load_n(&pipeline->head_moving, __ATOMIC_ACQUIRE) && watchdog_now() < give_up)
+      usleep(PIPELINE_HEAD_POLL_INTERVAL * 1000);
+
+   if (pipeline->scheduler->frameNextMethod == FRAME_NEXT_EVENT &&
+       !__atomic_exchange_n(&pipeline->event_pending, 0, __ATOMIC_ACQ_REL))
+      return;
+
+   pipeline_capture_frame(pipeline);
+}
+
+/**
+ * Body of a pipeline thread.
+ * Builds the backend, captures one frame per scheduler trigger into its own
+ * file and tears the backend down once the scheduler stops.
+ */
+static void *pipeline_thread(void *arg)
+{
+   CAMERA_PIPELINE *pipeline = (CAMERA_PIPELINE *)arg;
+   unsigned generation = 0, captured = 0, wakeup = 0;
+
+   if (pipeline_setup(pipeline) != 0)
+   {
+      pipeline->result = -1;
+      return NULL;
+   }
+
+   while (scheduler_wait(pipeline->scheduler, &generation, &wakeup))
+   {
+      // Settings first so a capture on the same wakeup already has them
+      if (__atomic_exchange_n(&pipeline->settings_pending, 0, __ATOMIC_ACQ_REL) &&
+          pipeline->backend_created && pipeline->backend->apply_settings)
+         pipeline->backend->apply_settings(pipeline);
+      if (__atomic_exchange_n(&pipeline->keyframe_pending, 0, __ATOMIC_ACQ_REL) &&
+          pipeline->backend_created && pipeline->backend->request_keyframe)
+         pipeline->backend->request_keyframe(pipeline);
+
+      if (generation == captured)
+         continue;
+
+      // A frame taken mid move is a smear, it waits for the head to settle
+      // and the wakeup that comes with that
+      if (__atomic_load_n(&pipeline->head_moving, __ATOMIC_ACQUIRE))
+      {
+         metrics_add(pipeline->deferred_metric, 1);
+
+         // Back to back modes never wait for a trigger, don't spin on them
+         if (pipeline->scheduler->frameNextMethod == FRAME_NEXT_FOREVER ||
+             pipeline->scheduler->frameNextMethod == FRAME_NEXT_IMMEDIATELY)
+            usleep(PIPELINE_HEAD_POLL_INTERVAL * 1000);
+         continue;
+      }
+      captured = generation;
+
+      // Event triggers are for whichever pipeline saw the event
+      if (pipeline->scheduler->frameNextMethod == FRAME_NEXT_EVENT &&
+          !__atomic_exchange_n(&pipeline->event_pending, 0, __ATOMIC_ACQ_REL))
+         continue;
+
+      pipeline_capture_frame(pipeline);
+   }
+
+   // The last trigger may still be waiting on the head
+   if (generation != captured)
+      capture_deferred(pipeline);
+
+   pipeline_teardown(pipeline);
+   return NULL;
+}
+
+/**
+ * Start the pipeline on its own thread
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int pipeline_start(CAMERA_PIPELINE *pipeline)
+{
+   if (pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline) != 0)
+      return -1;
+   pipeline->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Wait for the pipeline thread to finish
+ *
+ * @return The pipeline's result, 0 if it ran cleanly
+ */
+int pipeline_join(CAMERA_PIPELINE *pipeline)
+{
+   if (pipeline->thread_running)
+   {
+      pthread_join(pipeline->thread, NULL);
+      pipeline->thread_running = 0;
+   }
+   return pipeline->result;
+}
+
+/**
+ * When a frame the backend is handing over was taken, by CLOCK_MONOTONIC.
+ * Reads the backend's sensor clock every so often to keep the mapping
+ * from frame timestamps in step. Called from the backend's callbacks.
+ *
+ * @param pts Frame's timestamp on the sensor clock (us), FRAME_TIME_UNKNOWN if it has none
+ * @return CLOCK_MONOTONIC when the frame was taken (us)
+ */
+int64_t pipeline_frame_time(CAMERA_PIPELINE *pipeline, int64_t pts)
+{
+   int64_t now = watchdog_now(), time;
+
+   if (!pipeline->backend->sensor_time)
+      return now;
+
+   if (frame_clock_sync_due(&pipeline->clock, now))
+   {
+      int64_t before = watchdog_now(), sensor = pipeline->backend->sensor_time(pipeline);
+
+      frame_clock_sync(&pipeline->clock, sensor, before, watchdog_now());
+   }
+
+   time = frame_clock_map(&pipeline->clock, pts, now);
+   if (pts != FRAME_TIME_UNKNOWN)
+      metrics_observe(pipeline->frame_delay_metric, (uint64_t)(now - time));
+   return time;
+}
+
+/**
+ * Called by the backend's buffer callbacks with encoded data. The first
+ * buffer of a file stamps it with when its frame was taken.
+ *
+ * @param pts Timestamp of the frame the data belongs to, as pipeline_frame_time
+ * @return Bytes written, a short count means storage has run out
+ */
+size_t pipeline_write(CAMERA_PIPELINE *pipeline, const void *data, size_t length, int64_t pts)
+{
+   if (!pipeline->writer.time)
+      storage_writer_stamp(&pipeline->writer, pipeline_frame_time(pipeline, pts));
+   return storage_writer_write(&pipeline->writer, data, length);
+}
+
+/**
+ * Called by the backend's buffer callbacks for every encoder output buffer
+ *
+ * @param pipeline Pipeline the buffer belongs to
+ * @param length Bytes of data in the buffer
+ * @param alloc_size Size of the buffer
+ */
+void pipeline_count_buffer(CAMERA_PIPELINE *pipeline, size_t length, size_t alloc_size)
+{
+   metrics_add(pipeline->buffers_metric, 1);
+   if (alloc_size)
+      metrics_observe(pipeline->buffer_fill_metric, (uint64_t)(length * 100 / alloc_size));
+}
+
+/**
+ * Called by the backend with every frame on its way to an encoder, masks
+ * it in place. A frame the masks can't be rasterised for is blacked out
+ * whole rather than let through.
+ * Runs on the backend's callback threads, each stream with its own filter.
+ *
+ * @param filter Stream's filter, set up on pipeline->privacy
+ * @param u, v Chroma planes, NULL for a luma only frame
+ */
+void pipeline_mask_frame(CAMERA_PIPELINE *pipeline, PRIVACY_FILTER *filter, uint8_t *luma, uint8_t *u, uint8_t *v,
+                         int width, int height, int luma_stride, int chroma_stride)
+{
+   int64_t start;
+
+   if (!pipeline->privacy.num_masks)
+      return;
+
+   start = watchdog_now();
+   if (privacy_filter_apply(filter, luma, u, v, width, height, luma_stride, chroma_stride) != 0)
+   {
+      for (int y = 0; y < height; y++)
+         memset(luma + (size_t)y * luma_stride, PRIVACY_BLACK_LUMA, width);
+      for (int y = 0; y < (height + 1) / 2; y++)
+      {
+         if (u)
+            memset(u + (size_t)y * chroma_stride, PRIVACY_BLACK_CHROMA, (width + 1) / 2);
+         if (v)
+            memset(v + (size_t)y * chroma_stride, PRIVACY_BLACK_CHROMA, (width + 1) / 2);
+      }
+   }
+   metrics_observe(pipeline->privacy_metric, (uint64_t)(watchdog_now() - start));
+}
+
+/**
+ * Hand an event to the push channel with the last motion frame's thumbnail
+ *
+ * @param detection Best detection in the frame, NULL for motion alone
+ */
+static void push_event(CAMERA_PIPELINE *pipeline, const CNN_DETECTION *detection)
+{
+   EVENT_PUSH_EVENT event;
+
+   pthread_mutex_lock(&pipeline->push_lock);
+   event = pipeline->push_frame;
+   pthread_mutex_unlock(&pipeline->push_lock);
+
+   // Stamped with when the frame was taken, now only if there was no frame to keep
+   event.camera = pipeline->camera_num;
+   if (!event.time)
+      event.time = frame_clock_realtime(watchdog_now());
+
+   if (detection)
+   {
+      snprintf(event.label, sizeof(event.label), "%s", pipeline->detector->model.class_names[detection->class_id]);
+      event.score = detection->score;
+      event.x = detection->x;
+      event.y = detection->y;
+      event.width = detection->width;
+      event.height = detection->height;
+   }
+   else
+   {
+      strcpy(event.label, "motion");
+      event.score = 0;
+   }
+
+   event_push_submit(pipeline->push, &event);
+}
+
+/**
+ * Promote an event to a stored capture on this pipeline, at most one per holdoff
+ *
+ * @param detection Best detection behind the event, NULL for motion alone
+ */
+static void pipeline_event(CAMERA_PIPELINE *pipeline, const CNN_DETECTION *detection)
+{
+   int64_t now = watchdog_now();
+   int64_t last = __atomic_load_n(&pipeline->last_event, __ATOMIC_RELAXED);
+
+   if (last && now - last < (int64_t)pipeline->event_holdoff * 1000)
+      return;
+   __atomic_store_n(&pipeline->last_event, now, __ATOMIC_RELAXED);
+
+   metrics_add(pipeline->events_metric, 1);
+   __atomic_store_n(&pipeline->event_pending, 1, __ATOMIC_RELEASE);
+   scheduler_trigger(pipeline->scheduler, 0);
+
+   if (pipeline->push)
+      push_event(pipeline, detection);
+}
+
+/**
+ * Turn the head's movement since the last analysis frame into the shift
+ * it should have caused, so the ego motion search only looks near there
+ *
+ * @param width Width of the analysis frame in pixels
+ */
+static void seed_head_shift(CAMERA_PIPELINE *pipeline, int width)
+{
+   float pixels = width / (pipeline->field_of_view * 10);
+   int pan, tilt;
+
+   pipeline->head_position(pipeline->head_userdata, &pan, &tilt);
+
+   // Panning right moves the scene left, tilting up moves it down
+   if (pipeline->head_known)
+      motion_seed_shift(&pipeline->motion, -(int)lrintf((pan - pipeline->head_pan) * pixels),
+                        (int)lrintf((tilt - pipeline->head_tilt) * pixels));
+   pipeline->head_pan = pan;
+   pipeline->head_tilt = tilt;
+   pipeline->head_known = 1;
+}
+
+/**
+ * Called by the backend with every frame of the low resolution analysis
+ * stream. Runs the motion gate, then either hands the frame to the detector
+ * or, without one, treats the motion itself as the event.
+ * Runs on the backend's callback thread so must never block.
+ *
+ * @param luma Luma plane of the frame
+ * @param width Width in pixels
+ * @param height Height in pixels
+ * @param stride Bytes per row
+ * @param pts Frame's timestamp, as pipeline_frame_time
+ */
+void pipeline_analyse(CAMERA_PIPELINE *pipeline, const uint8_t *luma, int width, int height, int stride,
+                      int64_t pts)
+{
+   int64_t now = pipeline_frame_time(pipeline, pts);
+
+   metrics_add(pipeline->analysis_metric, 1);
+
+   // The motion gate belongs to this thread, so it restarts here rather
+   // than from whoever changed the frame rate
+   if (__atomic_exchange_n(&pipeline->motion_restart, 0, __ATOMIC_ACQ_REL))
+   {
+      motion_reset(&pipeline->motion);
+      motion_set_frame_rate(&pipeline->motion, __atomic_load_n(&pipeline->frame_rate, __ATOMIC_RELAXED));
+   }
+
+   // Everything changes while the head moves, none of it is motion unless
+   // the gate takes the head's movement out. Nor is it a static scene to
+   // slow down for.
+   if (__atomic_load_n(&pipeline->head_moving, __ATOMIC_ACQUIRE) && !pipeline->motion.ego_motion)
+   {
+      metrics_add(pipeline->moving_frames_metric, 1);
+      pipeline->last_motion = now;
+      return;
+   }
+
+   if (pipeline->motion.ego_motion && pipeline->head_position)
+      seed_head_shift(pipeline, width);
+
+   if (!pipeline->last_motion)
+      pipeline->last_motion = now;
+
+   if (!motion_process(&pipeline->motion, luma, width, height, stride))
+   {
+      if (pipeline->idle_time && !__atomic_load_n(&pipeline->idle, __ATOMIC_RELAXED) &&
+          now - pipeline->last_motion >= (int64_t)pipeline->idle_time * 1000)
+      {
+         __atomic_store_n(&pipeline->idle, 1, __ATOMIC_RELAXED);
+         metrics_set(pipeline->idle_metric, 1);
+         pipeline_request_settings(pipeline);
+      }
+      return;
+   }
+
+   metrics_add(pipeline->motion_metric, 1);
+   pipeline->last_motion = now;
+   if (__atomic_exchange_n(&pipeline->idle, 0, __ATOMIC_RELAXED))
+   {
+      metrics_set(pipeline->idle_metric, 0);
+      pipeline_request_settings(pipeline);
+   }
+
+   // Keep what the event would show, unless the detector thread is busy
+   // reading the last one, this thread can't wait for it
+   if (pipeline->push && pthread_mutex_trylock(&pipeline->push_lock) == 0)
+   {
+      EVENT_PUSH_EVENT *frame = &pipeline->push_frame;
+
+      frame->x = pipeline->motion.box_x;
+      frame->y = pipeline->motion.box_y;
+      frame->width = pipeline->motion.box_width;
+      frame->height = pipeline->motion.box_height;
+      frame->time = frame_clock_realtime(now);
+      event_push_thumbnail(frame, luma, width, height, stride);
+      pthread_mutex_unlock(&pipeline->push_lock);
+   }
+
+   // Recording goes full rate on any motion, it has the pre-event ring
+   // to fall back on and costs nothing if it turns out to be nothing
+   if (pipeline->recording)
+      recorder_trigger(&pipeline->recorder, now);
+
+   // Analysis may only be running for the recording
+   if (pipeline->scheduler->frameNextMethod != FRAME_NEXT_EVENT)
+      return;
+
+   if (pipeline->detector)
+      detector_submit(pipeline->detector, pipeline, luma, width, height, stride);
+   else
+      pipeline_event(pipeline, NULL);
+}
+
+/**
+ * Called by the backend's video encoder callback with every packet, on
+ * the same thread each time. Segments are written from here just as
+ * stills are from pipeline_write, and RTSP clients are sent the same
+ * packets, both timed by when the frame was taken.
+ *
+ * @param data Encoded data
+ * @param length Bytes of data
+ * @param flags RECORDER_FLAG_ values
+ * @param pts Timestamp of the frame the data belongs to, as pipeline_frame_time
+ */
+void pipeline_record(CAMERA_PIPELINE *pipeline, const void *data, size_t length, int flags, int64_t pts)
+{
+   int64_t now = pipeline_frame_time(pipeline, pts);
+
+   if (pipeline->recording)
+      recorder_packet(&pipeline->recorder, data, length, flags, now);
+   if (pipeline->stream)
+      rtsp_stream_packet(pipeline->rtsp, pipeline->stream, data, length,
+                         flags & RECORDER_FLAG_FRAME_END ? RTSP_FLAG_FRAME_END : 0, now);
+}
+
+/**
+ * Detector callback, a person/vehicle etc. in one of this pipeline's frames
+ */
+void pipeline_detected(void *source, const CNN_DETECTION *detections, int count)
+{
+   CAMERA_PIPELINE *pipeline = (CAMERA_PIPELINE *)source;
+   const CNN_DETECTION *best = detections;
+
+   for (int i = 1; i < count; i++)
+      if (detections[i].score > best->score)
+         best = &detections[i];
+
+   if (pipeline->verbose)
+      fprintf(stderr, "Camera %d: %s %.2f at %d,%d %dx%d\n", pipeline->camera_num,
+              pipeline->detector->model.class_names[best->class_id], best->score,
+              best->x, best->y, best->width, best->height);
+
+   pipeline_event(pipeline, best);
+}
+
+/**
+ * Ask for the backend's apply_settings on the pipeline thread, from
+ * callbacks that can't change camera settings themselves.
+ * Never blocks for long, the pipeline picks it up when it next wakes.
+ */
+void pipeline_request_settings(CAMERA_PIPELINE *pipeline)
+{
+   __atomic_store_n(&pipeline->settings_pending, 1, __ATOMIC_RELEASE);
+   scheduler_wake(pipeline->scheduler);
+}
+
+/**
+ * Ask for an IDR from the video encoder on the pipeline thread, the RTSP
+ * stream's keyframe callback. Never blocks.
+ *
+ * @param userdata The pipeline
+ */
+void pipeline_request_keyframe(void *userdata)
+{
+   CAMERA_PIPELINE *pipeline = (CAMERA_PIPELINE *)userdata;
+
+   __atomic_store_n(&pipeline->keyframe_pending, 1, __ATOMIC_RELEASE);
+   scheduler_wake(pipeline->scheduler);
+}
+
+/**
+ * Tell the pipeline its camera's pan/tilt head started moving or settled,
+ * the servo control's move callback. While it moves, captures wait and
+ * analysis frames are skipped, unless the motion gate takes out the
+ * head's movement itself. Once it settles any capture held back is taken,
+ * and a gate that skipped frames learns the new view from scratch.
+ * Never blocks for long.
+ *
+ * @param moving 1 when the head starts moving, 0 once it has settled
+ */
+void pipeline_set_head_moving(CAMERA_PIPELINE *pipeline, int moving)
+{
+   __atomic_store_n(&pipeline->head_moving, moving, __ATOMIC_RELEASE);
+   metrics_set(pipeline->head_moving_metric, moving);
+
+   if (!moving)
+   {
+      if (pipeline->analysis && !pipeline->motion.ego_motion)
+         __atomic_store_n(&pipeline->motion_restart, 1, __ATOMIC_RELEASE);
+      scheduler_wake(pipeline->scheduler);
+   }
+}
+
+/**
+ * Tell the stages after the camera the slowest rate frames may now arrive
+ * at. The watchdog gives captures a few frame periods, and the motion gate
+ * restarts since the exposure will have jumped.
+ *
+ * @param fps Frame rate in thousandths of a frame per second
+ */
+void pipeline_set_frame_rate(CAMERA_PIPELINE *pipeline, int fps)
+{
+   int64_t period;
+
+   if (fps <= 0 || fps == pipeline->frame_rate)
+      return;
+
+   // Whatever was configured before the first rate is the full rate deadline
+   if (!pipeline->frame_rate)
+      pipeline->deadline = pipeline->watchdog.deadline;
+
+   period = 1000000000LL / fps;
+   __atomic_store_n(&pipeline->frame_rate, fps, __ATOMIC_RELAXED);
+   metrics_set(pipeline->frame_period_metric, period);
+
+   if (pipeline->deadline)
+   {
+      int64_t deadline = period * PIPELINE_DEADLINE_FRAMES / 1000;
+
+      watchdog_set_deadline(&pipeline->watchdog,
+                            deadline > pipeline->deadline ? (int)deadline : pipeline->deadline);
+   }
+
+   if (pipeline->analysis)
+      __atomic_store_n(&pipeline->motion_restart, 1, __ATOMIC_RELEASE);
+
+   if (pipeline->verbose)
+      fprintf(stderr, "Camera %d: frames may now take up to %lld ms\n", pipeline->camera_num,
+              (long long)period / 1000);
+}
@@ -0,0 +1,169 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "storage.h"
+#include "scheduler.h"
+#include "watchdog.h"
+#include "metrics.h"
+#include "motion.h"
+#include "detector.h"
+#include "recorder.h"
+#include "event_push.h"
+#include "rtsp_server.h"
+#include "privacy_mask.h"
+#include "memory_budget.h"
+#include "frame_clock.h"
+
+/// Returned by a backend capture the watchdog had to abort
+#define PIPELINE_CAPTURE_STALLED -2
+
+/// Minimum time between captures promoted from analysis events, in milliseconds
+#define PIPELINE_DEFAULT_EVENT_HOLDOFF 1000
+
+/// Time without motion before the camera may slow down, in milliseconds
+#define PIPELINE_DEFAULT_IDLE_TIME 30000
+
+/// How often back to back captures look again while the pan/tilt head moves, in milliseconds
+#define PIPELINE_HEAD_POLL_INTERVAL 10
+
+/// Longest a capture still waiting on the head when the scheduler stops
+/// waits for it to settle before it is taken anyway, in milliseconds
+#define PIPELINE_HEAD_SETTLE_TIMEOUT 3000
+
+/// Horizontal field of view of the Pi camera v2, turns head moves into analysis pixels
+#define PIPELINE_DEFAULT_FIELD_OF_VIEW 62.2f
+
+/// Frame periods a capture may take before the watchdog calls it a stall,
+/// so slow night time frame rates stretch the deadline
+#define PIPELINE_DEADLINE_FRAMES 8
+
+typedef struct CAMERA_PIPELINE CAMERA_PIPELINE;
+
+/** Operations a capture backend provides to a pipeline.
+ *  All are called on the pipeline's own thread except abort_capture,
+ *  which the watchdog calls from its thread, and sensor_time, which is
+ *  called from whichever of the backend's threads is handing over a frame.
+ */
+typedef struct
+{
+   const char *name;
+   const char *extension;                          /// File extension of the encoded output
+   int (*create)(CAMERA_PIPELINE *pipeline);       /// Build components, buffer pools etc.
+   int (*capture)(CAMERA_PIPELINE *pipeline);      /// Capture one frame, blocks until the frame end
+   void (*destroy)(CAMERA_PIPELINE *pipeline);     /// Tear down everything create built
+   void (*abort_capture)(CAMERA_PIPELINE *pipeline); /// Wake a stalled capture, it returns PIPELINE_CAPTURE_STALLED
+   int (*recover)(CAMERA_PIPELINE *pipeline);      /// Rebuild only the stalled components, NULL for a full rebuild
+   void (*apply_settings)(CAMERA_PIPELINE *pipeline); /// Apply settings changed while running, NULL if none can be
+   const char *record_extension;                   /// File extension of recorded video, NULL if the backend can't record
+   void (*request_keyframe)(CAMERA_PIPELINE *pipeline); /// Make the video encoder's next frame an IDR, NULL if it can't
+   int64_t (*sensor_time)(CAMERA_PIPELINE *pipeline); /// Sensor clock now (us), the frames' time base, -1 if unreadable. NULL if frames have no timestamps
+} PIPELINE_BACKEND;
+
+/** One camera, its components and its writer.
+ *  Pipelines only share the storage manager and scheduler.
+ */
+struct CAMERA_PIPELINE
+{
+   int camera_num;                     /// Camera this pipeline drives
+   int verbose;
+   const PIPELINE_BACKEND *backend;    /// Backend the components come from
+   void *backend_state;                /// Backend's own state (RASPISTILL_STATE for mmal)
+
+   STORAGE_MANAGER *storage;           /// Shared storage
+   CAPTURE_SCHEDULER *scheduler;       /// Shared trigger source
+   STORAGE_WRITER writer;              /// This pipeline's output file
+
+   int frame;                          /// Next frame number
+   uint64_t frames_captured;           /// Frames written successfully
+   uint64_t capture_errors;            /// Captures that failed
+
+   int backend_created;                /// backend->create succeeded and destroy is owed
+
+   WATCHDOG watchdog;                  /// Buffer flow through this pipeline's ports
+   int64_t stalled_since;              /// Last buffer before the current stall
+   uint64_t full_rebuilds;             /// Recoveries that needed the whole pipeline rebuilt
+
+   int analysis;                       /// Backend delivers low resolution frames to pipeline_analyse
+   MOTION_DETECTOR motion;             /// Motion gate on the analysis frames
+   DETECTOR *detector;                 /// Shared detection stage behind the gate, NULL to capture on motion
+   int event_holdoff;                  /// PIPELINE_DEFAULT_EVENT_HOLDOFF
+   int64_t last_event;                 /// When the last event was promoted to a capture
+   int event_pending;                  /// An event is waiting for this pipeline to capture
+   EVENT_PUSH *push;                   /// Shared outbound event channel, NULL to keep events local
+   EVENT_PUSH_EVENT push_frame;        /// Box and thumbnail of the last motion frame, for pushed events
+   pthread_mutex_t push_lock;          /// Guards push_frame between the analysis and detector threads
+
+   int frame_rate;                     /// Slowest the camera may run, thousandths of a frame per second, 0 unknown
+   int deadline;                       /// Watchdog deadline at full frame rate, taken when the rate is first set
+   int settings_pending;               /// apply_settings is owed on the pipeline thread (atomic)
+   int idle_time;                      /// PIPELINE_DEFAULT_IDLE_TIME, 0 never idles
+   int idle;                           /// No motion for idle_time, the camera may slow down (atomic)
+   int64_t last_motion;                /// When the motion gate last passed a frame
+   int motion_restart;                 /// Frame rate changed, restart the motion gate (atomic)
+   int head_moving;                    /// Pan/tilt head moving or not yet settled, captures and analysis wait (atomic)
+   void (*head_position)(void *userdata, int *pan, int *tilt); /// Where the head points in tenths of a degree, seeds ego motion, may be NULL
+   void *head_userdata;
+   float field_of_view;                /// PIPELINE_DEFAULT_FIELD_OF_VIEW, degrees across the frame
+   int head_pan, head_tilt;            /// Head position at the last analysis frame
+   int head_known;                     /// head_pan/head_tilt have been read
+
+   int recording;                      /// Backend delivers encoded video to pipeline_record, needs analysis
+   RECORDER recorder;                  /// Full rate video around motion, sparse keyframes otherwise
+   STORAGE_WRITER record_writer;       /// Recorder's current segment
+   RTSP_SERVER *rtsp;                  /// Server the encoded video is also streamed from, NULL for none
+   RTSP_STREAM *stream;                /// This camera's stream on it
+   int keyframe_pending;               /// request_keyframe is owed on the pipeline thread (atomic)
+   PRIVACY_MASK privacy;               /// Parts of the view the backend masks before anything is encoded
+   FRAME_CLOCK clock;                  /// Frame timestamps to CLOCK_MONOTONIC
+
+   METRIC *frames_metric;              /// Frames written
+   METRIC *errors_metric;              /// Captures that failed
+   METRIC *dropped_metric;             /// Frames captured with nowhere to write them
+   METRIC *latency_metric;             /// Capture request to frame end (us)
+   METRIC *buffers_metric;             /// Encoder output buffers handled
+   METRIC *buffer_fill_metric;         /// How full each encoder output buffer was (percent)
+   METRIC *watchdog_metrics[5];        /// Callback metrics reading the watchdog stats
+   METRIC *analysis_metric;            /// Analysis frames seen
+   METRIC *motion_metric;              /// Analysis frames the motion gate passed
+   METRIC *events_metric;              /// Events promoted to a capture
+   METRIC *frame_period_metric;        /// Longest frame period the camera may run at (us)
+   METRIC *idle_metric;                /// 1 while idle
+   METRIC *head_moving_metric;         /// 1 while the head moves
+   METRIC *moving_frames_metric;       /// Analysis frames skipped while the head moved
+   METRIC *deferred_metric;            /// Captures held back until the head settled
+   METRIC *record_metrics[3];          /// Callback metrics reading the recorder stats
+   METRIC *privacy_metric;             /// Time taken masking each frame (us)
+   METRIC *frame_delay_metric;         /// Frame taken to frame handed over by the backend (us)
+   METRIC *clock_metrics[2];           /// Callback metrics reading the frame clock
+
+   pthread_t thread;
+   int thread_running;
+   int result;                         /// 0 if the pipeline ran cleanly
+};
+
+int pipeline_init(CAMERA_PIPELINE *pipeline, int camera_num, const PIPELINE_BACKEND *backend,
+                  void *backend_state, STORAGE_MANAGER *storage, CAPTURE_SCHEDULER *scheduler);
+void pipeline_destroy(CAMERA_PIPELINE *pipeline);
+int pipeline_setup(CAMERA_PIPELINE *pipeline);
+int pipeline_capture_frame(CAMERA_PIPELINE *pipeline);
+void pipeline_teardown(CAMERA_PIPELINE *pipeline);
+int pipeline_start(CAMERA_PIPELINE *pipeline);
+int pipeline_join(CAMERA_PIPELINE *pipeline);
+int64_t pipeline_frame_time(CAMERA_PIPELINE *pipeline, int64_t pts);
+size_t pipeline_write(CAMERA_PIPELINE *pipeline, const void *data, size_t length, int64_t pts);
+void pipeline_count_buffer(CAMERA_PIPELINE *pipeline, size_t length, size_t alloc_size);
+void pipeline_mask_frame(CAMERA_PIPELINE *pipeline, PRIVACY_FILTER *filter, uint8_t *luma, uint8_t *u, uint8_t *v,
+                         int width, int height, int luma_stride, int chroma_stride);
+void pipeline_analyse(CAMERA_PIPELINE *pipeline, const uint8_t *luma, int width, int height, int stride,
+                      int64_t pts);
+void pipeline_detected(void *source, const CNN_DETECTION *detections, int count);
+void pipeline_record(CAMERA_PIPELINE *pipeline, const void *data, size_t length, int flags, int64_t pts);
+void pipeline_request_settings(CAMERA_PIPELINE *pipeline);
+void pipeline_request_keyframe(void *userdata);
+void pipeline_set_frame_rate(CAMERA_PIPELINE *pipeline, int fps);
+void pipeline_set_head_moving(CAMERA_PIPELINE *pipeline, int moving);
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "polygon.h"
+
+/**
+ * Read the points of a polygon from the rest of a line of a zones or masks
+ * file, x,y pairs as fractions of the frame separated by spaces. Anything
+ * that isn't a point fails the whole line rather than leaving the polygon
+ * short, a shrunken mask would show what it was meant to hide.
+ *
+ * @return Points read, -1 if there are more than max_points or anything else is left
+ */
+int polygon_parse(const char *text, POLYGON_POINT *points, int max_points)
+{
+   POLYGON_POINT point;
+   int num_points = 0, used;
+   char rest;
+
+   while (sscanf(text, " %f,%f%n", &point.x, &point.y, &used) == 2)
+   {
+      if (num_points >= max_points || !isfinite(point.x) || !isfinite(point.y))
+         return -1;
+      points[num_points++] = point;
+      text += used;
+   }
+
+   if (sscanf(text, " %c", &rest) == 1)
+      return -1;
+   return num_points;
+}
+
+/**
+ * Where a polygon's edges cross a horizontal line, left to right
+ *
+ * @param xs Room for num_points crossings
+ * @return Crossings, always even
+ */
+int polygon_crossings(const POLYGON_POINT *points, int num_points, float y, float *xs)
+{
+   int count = 0;
+
+   for (int i = 0, j = num_points - 1; i < num_points; j = i++)
+   {
+      const POLYGON_POINT *a = &points[i], *b = &points[j];
+
+      if ((a->y > y) != (b->y > y))
+      {
+         float x = (b->x - a->x) * (y - a->y) / (b->y - a->y) + a->x;
+         int k = count++;
+
+         for (; k > 0 && xs[k - 1] > x; k--)
+            xs[k] = xs[k - 1];
+         xs[k] = x;
+      }
+   }
+   return count;
+}
+
+/**
+ * Even-odd test
+ */
+int polygon_contains(const POLYGON_POINT *points, int num_points, float x, float y)
+{
+   int inside = 0;
+
+   for (int i = 0, j = num_points - 1; i < num_points; j = i++)
+   {
+      const POLYGON_POINT *a = &points[i], *b = &points[j];
+
+      if ((a->y > y) != (b->y > y) && x < (b->x - a->x) * (y - a->y) / (b->y - a->y) + a->x)
+         inside = !inside;
+   }
+   return inside;
+}
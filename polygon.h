@@ -0,0 +1,17 @@
+#ifndef POLYGON_H_
+#define POLYGON_H_
+
+/** Point of a polygon as a fraction of the frame size, so the same polygon
+ *  covers the same part of the scene whatever size the frame is
+ */
+typedef struct
+{
+   float x;
+   float y;
+} POLYGON_POINT;
+
+int polygon_parse(const char *text, POLYGON_POINT *points, int max_points);
+int polygon_crossings(const POLYGON_POINT *points, int num_points, float y, float *xs);
+int polygon_contains(const POLYGON_POINT *points, int num_points, float x, float y);
+
+#endif /* POLYGON_H_ */
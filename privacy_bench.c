@@ -0,0 +1,279 @@
+/**
+ * Benchmark for the privacy masks at full sensor resolution.
+ *
+ * Masks a textured I420 frame the size the stills port delivers with a
+ * blacked out window, a blurred doorway and a black mask overlapping the
+ * blur, and times privacy_filter_apply against copying the frame once,
+ * the least any tap between the camera and the encoder could cost. Small
+ * frames copy from cache while the masks still cost a call per span, so
+ * the comparison only means something at full size.
+ *
+ * Then checks the result pixel by pixel: black inside black masks, one
+ * value per block inside blurred ones, and nothing changed away from the
+ * masks or in the padding beyond the crop.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "privacy_mask.h"
+
+/// Pixels a mask edge may round outwards by before the check calls it a leak
+#define EDGE_SLACK 3
+
+typedef struct
+{
+   PRIVACY_FILL fill;
+   int num_points;
+   PRIVACY_POINT points[6];
+} BENCH_MASK;
+
+static const BENCH_MASK bench_masks[] =
+{
+   { PRIVACY_FILL_BLACK, 4, { { 0.10f, 0.12f }, { 0.32f, 0.12f }, { 0.32f, 0.40f }, { 0.10f, 0.40f } } },
+   { PRIVACY_FILL_BLUR, 5, { { 0.55f, 0.30f }, { 0.80f, 0.25f }, { 0.85f, 0.90f }, { 0.60f, 0.95f }, { 0.52f, 0.60f } } },
+   { PRIVACY_FILL_BLACK, 3, { { 0.70f, 0.55f }, { 0.95f, 0.70f }, { 0.75f, 0.85f } } },
+};
+
+#define NUM_MASKS ((int)(sizeof(bench_masks) / sizeof(bench_masks[0])))
+
+/**
+ * Which mask, if any, covers a luma position, black winning over blur as in the filter
+ *
+ * @return Mask index, -1 for none
+ */
+static int covering_mask(int width, int height, float x, float y)
+{
+   int found = -1;
+
+   for (int m = 0; m < NUM_MASKS; m++)
+   {
+      if (!polygon_contains(bench_masks[m].points, bench_masks[m].num_points, x / width, y / height))
+         continue;
+      if (found < 0 || bench_masks[m].fill == PRIVACY_FILL_BLACK)
+         found = m;
+   }
+   return found;
+}
+
+/**
+ * @return 1 if a luma position is within slack pixels of any mask's bounding box
+ */
+static int near_bounds(int width, int height, float x, float y, int slack)
+{
+   for (int m = 0; m < NUM_MASKS; m++)
+   {
+      float left = 1, right = 0, top = 1, bottom = 0;
+
+      for (int i = 0; i < bench_masks[m].num_points; i++)
+      {
+         const PRIVACY_POINT *point = &bench_masks[m].points[i];
+
+         left = point->x < left ? point->x : left;
+         right = point->x > right ? point->x : right;
+         top = point->y < top ? point->y : top;
+         bottom = point->y > bottom ? point->y : bottom;
+      }
+      if (x >= left * width - slack && x <= right * width + slack && y >= top * height - slack &&
+          y <= bottom * height + slack)
+         return 1;
+   }
+   return 0;
+}
+
+/**
+ * @return 1 if any mask covers somewhere within slack pixels of a luma position
+ */
+static int near_mask(int width, int height, float x, float y, int slack)
+{
+   if (!near_bounds(width, height, x, y, slack))
+      return 0;
+   for (int dy = -slack; dy <= slack; dy++)
+      for (int dx = -slack; dx <= slack; dx++)
+         if (covering_mask(width, height, x + dx, y + dy) >= 0)
+            return 1;
+   return 0;
+}
+
+/**
+ * @return 1 if a black mask covers somewhere within slack pixels, blur can't be checked there
+ */
+static int near_black(int width, int height, float x, float y, int slack)
+{
+   for (int dy = -slack; dy <= slack; dy++)
+      for (int dx = -slack; dx <= slack; dx++)
+      {
+         int m = covering_mask(width, height, x + dx, y + dy);
+
+         if (m >= 0 && bench_masks[m].fill == PRIVACY_FILL_BLACK)
+            return 1;
+      }
+   return 0;
+}
+
+/**
+ * Check one plane of the masked frame against the original
+ *
+ * @param scale 1 for luma, 2 for chroma
+ * @return Pixels wrong
+ */
+static long check_plane(const uint8_t *masked, const uint8_t *original, int stride, int width, int height,
+                        int scale, uint8_t black, int luma_width, int luma_height, long *covered)
+{
+   int block = PRIVACY_BLUR_BLOCK / scale, blocks_x = (width + block - 1) / block;
+   int *block_values = malloc(sizeof(int) * blocks_x * ((height + block - 1) / block));
+   long wrong = 0;
+
+   for (int i = 0; i < blocks_x * ((height + block - 1) / block); i++)
+      block_values[i] = -1;
+
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < stride; x++)
+      {
+         size_t p = (size_t)y * stride + x;
+         float lx = (x + 0.5f) * scale, ly = (y + 0.5f) * scale;
+         int m;
+
+         // Padding beyond the crop belongs to nobody
+         if (x >= width)
+         {
+            wrong += masked[p] != original[p];
+            continue;
+         }
+
+         m = covering_mask(luma_width, luma_height, lx, ly);
+         if (m >= 0 && bench_masks[m].fill == PRIVACY_FILL_BLACK)
+         {
+            wrong += masked[p] != black;
+            (*covered)++;
+         }
+         else if (m >= 0)
+         {
+            int *value = &block_values[(y / block) * blocks_x + x / block];
+
+            (*covered)++;
+            if (near_black(luma_width, luma_height, lx, ly, EDGE_SLACK * scale))
+               continue;
+            if (*value < 0)
+               *value = masked[p];
+            wrong += masked[p] != *value;
+         }
+         else if (!near_mask(luma_width, luma_height, lx, ly, EDGE_SLACK * scale))
+            wrong += masked[p] != original[p];
+      }
+   }
+
+   free(block_values);
+   return wrong;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-W width] [-H height] [-f frames]\n", app);
+   fprintf(stderr, "  default 3280x2464, the Pi camera v2's full resolution\n");
+}
+
+int main(int argc, char **argv)
+{
+   int width = 3280, height = 2464, frames = 50, opt, failed = 0;
+   int stride, slice, chroma_stride;
+   size_t luma_size, frame_size;
+   uint8_t *original, *frame;
+   PRIVACY_MASK mask;
+   PRIVACY_FILTER filter;
+   int64_t start, first, copy_time = 0, mask_time = 0;
+   long wrong[3], covered[3] = { 0, 0, 0 };
+   uint32_t seed = 11;
+
+   while ((opt = getopt(argc, argv, "W:H:f:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'W' : width = atoi(optarg); break;
+         case 'H' : height = atoi(optarg); break;
+         case 'f' : frames = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (width < 64 || height < 64 || width > 4096 || height > 4096 || frames < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   // Padded as the camera port pads it
+   stride = (width + 31) & ~31;
+   slice = (height + 15) & ~15;
+   chroma_stride = stride / 2;
+   luma_size = (size_t)stride * slice;
+   frame_size = luma_size * 3 / 2;
+
+   original = malloc(frame_size);
+   frame = malloc(frame_size);
+   if (!original || !frame)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   for (size_t i = 0; i < frame_size; i++)
+      original[i] = (uint8_t)(40 + bench_random(&seed) % 180);
+
+   privacy_mask_init(&mask);
+   for (int m = 0; m < NUM_MASKS; m++)
+      privacy_mask_add(&mask, bench_masks[m].fill, bench_masks[m].points, bench_masks[m].num_points);
+   privacy_filter_init(&filter, &mask);
+
+   // The first frame rasterises the masks as well
+   memcpy(frame, original, frame_size);
+   start = bench_now();
+   privacy_filter_apply(&filter, frame, frame + luma_size, frame + luma_size * 5 / 4, width, height, stride,
+                        chroma_stride);
+   first = bench_now() - start;
+
+   for (int f = 0; f < frames; f++)
+   {
+      start = bench_now();
+      memcpy(frame, original, frame_size);
+      copy_time += bench_now() - start;
+
+      start = bench_now();
+      privacy_filter_apply(&filter, frame, frame + luma_size, frame + luma_size * 5 / 4, width, height, stride,
+                           chroma_stride);
+      mask_time += bench_now() - start;
+   }
+
+   wrong[0] = check_plane(frame, original, stride, width, height, 1, PRIVACY_BLACK_LUMA, width, height, &covered[0]);
+   for (int plane = 0; plane < 2; plane++)
+   {
+      size_t offset = luma_size + plane * luma_size / 4;
+
+      wrong[1 + plane] = check_plane(frame + offset, original + offset, chroma_stride, (width + 1) / 2,
+                                     (height + 1) / 2, 2, PRIVACY_BLACK_CHROMA, width, height, &covered[1 + plane]);
+   }
+
+   printf("%dx%d I420, %d masks over %.1f%% of the frame, %d frames\n\n", width, height, NUM_MASKS,
+          100.0 * covered[0] / ((double)width * height), frames);
+   printf("%-28s %10.1f us\n", "first frame (rasterising)", (double)first);
+   printf("%-28s %10.1f us\n", "mask per frame", (double)mask_time / frames);
+   printf("%-28s %10.1f us\n", "copy per frame", (double)copy_time / frames);
+   printf("%-28s %10.2f\n", "mask/copy", copy_time ? (double)mask_time / copy_time : 0);
+   printf("%-28s %10ld %ld %ld\n", "wrong pixels (y u v)", wrong[0], wrong[1], wrong[2]);
+
+   if (wrong[0] || wrong[1] || wrong[2])
+   {
+      printf("masked frame wrong\n");
+      failed = 1;
+   }
+
+   privacy_filter_destroy(&filter);
+   free(original);
+   free(frame);
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
@@ -0,0 +1,448 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "privacy_mask.h"
+
+/// Most runs one fill can have in a row, every mask edge crossing it twice over
+#define MAX_INTERVALS (PRIVACY_MAX_MASKS * PRIVACY_MAX_POINTS)
+
+typedef struct
+{
+   int start, end;
+} INTERVAL;
+
+void privacy_mask_init(PRIVACY_MASK *mask)
+{
+   memset(mask, 0, sizeof(*mask));
+}
+
+/**
+ * Add a mask. Filters pick it up the next time their frame size changes,
+ * so masks are meant to be added before any frames are filtered.
+ *
+ * @param points Polygon as fractions of the frame size
+ * @return 0 on success, -1 if there are too many masks or points
+ */
+int privacy_mask_add(PRIVACY_MASK *mask, PRIVACY_FILL fill, const PRIVACY_POINT *points, int num_points)
+{
+   PRIVACY_REGION *region;
+
+   if (mask->num_masks >= PRIVACY_MAX_MASKS || num_points < 3 || num_points > PRIVACY_MAX_POINTS ||
+       fill < 0 || fill >= PRIVACY_FILL_COUNT)
+      return -1;
+
+   region = &mask->masks[mask->num_masks++];
+   region->fill = fill;
+   region->num_points = num_points;
+   memcpy(region->points, points, num_points * sizeof(*points));
+   return 0;
+}
+
+/**
+ * Load masks from a file, one per line:
+ *   black x,y x,y x,y ...
+ *   blur x,y x,y x,y ...
+ * with points as fractions of the frame, # starts a comment.
+ *
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+int privacy_mask_load(PRIVACY_MASK *mask, const char *path)
+{
+   FILE *file = fopen(path, "r");
+   char line[512];
+   int line_num = 0;
+
+   if (!file)
+   {
+      fprintf(stderr, "%s: unable to open privacy masks\n", path);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), file))
+   {
+      PRIVACY_POINT points[PRIVACY_MAX_POINTS];
+      PRIVACY_FILL fill;
+      int num_points, used;
+      char kind[8];
+      char *p;
+
+      line_num++;
+      if ((p = strchr(line, '#')) != NULL)
+         *p = '\0';
+      p = line;
+
+      if (sscanf(p, "%7s%n", kind, &used) != 1)
+         continue;
+      p += used;
+
+      if (strcmp(kind, "black") == 0)
+         fill = PRIVACY_FILL_BLACK;
+      else if (strcmp(kind, "blur") == 0)
+         fill = PRIVACY_FILL_BLUR;
+      else
+         goto error;
+
+      if ((num_points = polygon_parse(p, points, PRIVACY_MAX_POINTS)) < 0 ||
+          privacy_mask_add(mask, fill, points, num_points) != 0)
+         goto error;
+   }
+
+   fclose(file);
+   return 0;
+
+error:
+   fprintf(stderr, "%s:%d: bad privacy mask\n", path, line_num);
+   fclose(file);
+   return -1;
+}
+
+void privacy_filter_init(PRIVACY_FILTER *filter, const PRIVACY_MASK *mask)
+{
+   memset(filter, 0, sizeof(*filter));
+   filter->mask = mask;
+}
+
+static void free_spans(PRIVACY_FILTER *filter)
+{
+   for (int plane = 0; plane < 2; plane++)
+   {
+      free(filter->spans[plane]);
+      free(filter->rows[plane]);
+      filter->spans[plane] = NULL;
+      filter->rows[plane] = NULL;
+   }
+   free(filter->pattern);
+   filter->pattern = NULL;
+   filter->width = filter->height = 0;
+   filter->blur = 0;
+}
+
+void privacy_filter_destroy(PRIVACY_FILTER *filter)
+{
+   free_spans(filter);
+}
+
+/**
+ * Sort by start and join the intervals that overlap or touch
+ *
+ * @return Intervals left
+ */
+static int merge_intervals(INTERVAL *intervals, int count)
+{
+   int merged = 0;
+
+   for (int i = 1; i < count; i++)
+   {
+      INTERVAL key = intervals[i];
+      int j = i - 1;
+
+      for (; j >= 0 && intervals[j].start > key.start; j--)
+         intervals[j + 1] = intervals[j];
+      intervals[j + 1] = key;
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      if (intervals[i].start >= intervals[i].end)
+         continue;
+      if (merged && intervals[i].start <= intervals[merged - 1].end)
+      {
+         if (intervals[i].end > intervals[merged - 1].end)
+            intervals[merged - 1].end = intervals[i].end;
+      }
+      else
+         intervals[merged++] = intervals[i];
+   }
+   return merged;
+}
+
+static int append_spans(PRIVACY_FILTER *filter, int plane, int *count, int *size,
+                        const INTERVAL *intervals, int num_intervals, PRIVACY_FILL fill)
+{
+   if (*count + num_intervals > *size)
+   {
+      int new_size = *size ? *size * 2 : 256;
+      PRIVACY_SPAN *spans;
+
+      while (new_size < *count + num_intervals)
+         new_size *= 2;
+      if (!(spans = realloc(filter->spans[plane], (size_t)new_size * sizeof(*spans))))
+         return -1;
+      filter->spans[plane] = spans;
+      *size = new_size;
+   }
+
+   for (int i = 0; i < num_intervals; i++)
+   {
+      PRIVACY_SPAN *span = &filter->spans[plane][(*count)++];
+
+      span->start = (uint16_t)intervals[i].start;
+      span->end = (uint16_t)intervals[i].end;
+      span->fill = (uint8_t)fill;
+   }
+   return 0;
+}
+
+/**
+ * Rasterise the masks for a frame size. A luma row takes everything the
+ * polygon covers between its top and bottom edges, and a chroma row both
+ * the luma rows it sits over, so nothing at a mask's edge shows through.
+ */
+static int build_spans(PRIVACY_FILTER *filter, int width, int height)
+{
+   const PRIVACY_MASK *mask = filter->mask;
+   int chroma_height = (height + 1) / 2;
+   int counts[2] = { 0, 0 }, sizes[2] = { 0, 0 };
+
+   free_spans(filter);
+   if (width > UINT16_MAX)
+      return -1;
+
+   filter->rows[0] = malloc(((size_t)height + 1) * sizeof(int));
+   filter->rows[1] = malloc(((size_t)chroma_height + 1) * sizeof(int));
+   filter->pattern = malloc(width);
+   if (!filter->rows[0] || !filter->rows[1] || !filter->pattern)
+      goto error;
+
+   for (int y = 0; y < height; y++)
+   {
+      filter->rows[0][y] = counts[0];
+      for (int fill = 0; fill < PRIVACY_FILL_COUNT; fill++)
+      {
+         INTERVAL intervals[MAX_INTERVALS];
+         int num_intervals = 0;
+
+         for (int m = 0; m < mask->num_masks; m++)
+         {
+            const PRIVACY_REGION *region = &mask->masks[m];
+
+            if ((int)region->fill != fill)
+               continue;
+
+            // Just inside the top and bottom of the row
+            for (int edge = 0; edge < 2; edge++)
+            {
+               float xs[PRIVACY_MAX_POINTS];
+               int crossings = polygon_crossings(region->points, region->num_points, (y + (edge ? 0.999f : 0.001f)) / height, xs);
+
+               for (int i = 0; i + 1 < crossings && num_intervals < MAX_INTERVALS; i += 2)
+               {
+                  int start = (int)floorf(xs[i] * width), end = (int)ceilf(xs[i + 1] * width);
+
+                  intervals[num_intervals].start = start < 0 ? 0 : start > width ? width : start;
+                  intervals[num_intervals].end = end < 0 ? 0 : end > width ? width : end;
+                  num_intervals++;
+               }
+            }
+         }
+
+         num_intervals = merge_intervals(intervals, num_intervals);
+         if (append_spans(filter, 0, &counts[0], &sizes[0], intervals, num_intervals, fill) != 0)
+            goto error;
+         filter->blur |= fill == PRIVACY_FILL_BLUR && num_intervals;
+      }
+   }
+   filter->rows[0][height] = counts[0];
+
+   for (int y = 0; y < chroma_height; y++)
+   {
+      filter->rows[1][y] = counts[1];
+      for (int fill = 0; fill < PRIVACY_FILL_COUNT; fill++)
+      {
+         INTERVAL intervals[MAX_INTERVALS * 2];
+         int num_intervals = 0;
+
+         for (int row = 2 * y; row < 2 * y + 2 && row < height; row++)
+         {
+            for (int s = filter->rows[0][row]; s < filter->rows[0][row + 1]; s++)
+            {
+               const PRIVACY_SPAN *span = &filter->spans[0][s];
+
+               if (span->fill != fill)
+                  continue;
+               intervals[num_intervals].start = span->start / 2;
+               intervals[num_intervals].end = (span->end + 1) / 2;
+               num_intervals++;
+            }
+         }
+
+         num_intervals = merge_intervals(intervals, num_intervals);
+         if (append_spans(filter, 1, &counts[1], &sizes[1], intervals, num_intervals, fill) != 0)
+            goto error;
+      }
+   }
+   filter->rows[1][chroma_height] = counts[1];
+
+   filter->width = width;
+   filter->height = height;
+   return 0;
+
+error:
+   free_spans(filter);
+   return -1;
+}
+
+/**
+ * Sum of a block of pixels
+ */
+static uint32_t block_sum(const uint8_t *p, int stride, int width, int height)
+{
+   uint32_t sum = 0;
+
+#if defined(__ARM_NEON)
+   if (width == 16)
+   {
+      // 16 rows of two pixels a lane can't overflow 16 bits
+      uint16x8_t total = vdupq_n_u16(0);
+
+      for (int y = 0; y < height; y++, p += stride)
+         total = vpadalq_u8(total, vld1q_u8(p));
+#if defined(__aarch64__)
+      return vaddlvq_u16(total);
+#else
+      uint64x2_t wide = vpaddlq_u32(vpaddlq_u16(total));
+      return (uint32_t)(vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1));
+#endif
+   }
+   if (width == 8)
+   {
+      uint16x4_t total = vdup_n_u16(0);
+
+      for (int y = 0; y < height; y++, p += stride)
+         total = vpadal_u8(total, vld1_u8(p));
+      uint64x1_t wide = vpaddl_u32(vpaddl_u16(total));
+      return (uint32_t)vget_lane_u64(wide, 0);
+   }
+#elif defined(__SSE2__)
+   if (width == 16 || width == 8)
+   {
+      // SAD against zero sums each half of the register
+      __m128i zero = _mm_setzero_si128(), total = zero;
+
+      for (int y = 0; y < height; y++, p += stride)
+         total = _mm_add_epi64(total, _mm_sad_epu8(width == 16 ? _mm_loadu_si128((const __m128i *)p) :
+                                                                 _mm_loadl_epi64((const __m128i *)p), zero));
+      return (uint32_t)(_mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total, 8)));
+   }
+#endif
+
+   for (int y = 0; y < height; y++, p += stride)
+      for (int x = 0; x < width; x++)
+         sum += p[x];
+   return sum;
+}
+
+/**
+ * Replace the blurred spans of a plane with the average of their block.
+ * Blocks sit on a fixed grid, so a mask blurs the same way every frame.
+ */
+static void blur_plane(PRIVACY_FILTER *filter, int plane, uint8_t *data, int stride, int width, int height, int block)
+{
+   const PRIVACY_SPAN *spans = filter->spans[plane];
+   const int *rows = filter->rows[plane];
+   uint8_t *pattern = filter->pattern;
+
+   for (int by = 0; by < height; by += block)
+   {
+      int block_height = height - by < block ? height - by : block;
+      int first = width, last = 0;
+
+      // Only the blocks some row of this band wants
+      for (int s = rows[by]; s < rows[by + block_height]; s++)
+      {
+         if (spans[s].fill != PRIVACY_FILL_BLUR)
+            continue;
+         if (spans[s].start < first)
+            first = spans[s].start;
+         if (spans[s].end > last)
+            last = spans[s].end;
+      }
+      if (first >= last)
+         continue;
+
+      // The band's row of block averages, copied into each row's spans
+      for (int bx = first / block; bx * block < last; bx++)
+      {
+         int block_width = width - bx * block < block ? width - bx * block : block;
+         int pixels = block_width * block_height;
+
+         memset(pattern + bx * block, (block_sum(data + (size_t)by * stride + bx * block, stride, block_width,
+                                                 block_height) + pixels / 2) / pixels, block_width);
+      }
+
+      for (int y = by; y < by + block_height; y++)
+      {
+         uint8_t *row = data + (size_t)y * stride;
+
+         for (int s = rows[y]; s < rows[y + 1]; s++)
+            if (spans[s].fill == PRIVACY_FILL_BLUR)
+               memcpy(row + spans[s].start, pattern + spans[s].start, spans[s].end - spans[s].start);
+      }
+   }
+}
+
+/**
+ * Fill the blacked out spans of a plane, memset is already as wide as the
+ * machine goes
+ */
+static void black_plane(PRIVACY_FILTER *filter, int plane, uint8_t *data, int stride, int height, uint8_t value)
+{
+   const PRIVACY_SPAN *spans = filter->spans[plane];
+   const int *rows = filter->rows[plane];
+
+   for (int y = 0; y < height; y++)
+   {
+      uint8_t *row = data + (size_t)y * stride;
+
+      for (int s = rows[y]; s < rows[y + 1]; s++)
+         if (spans[s].fill == PRIVACY_FILL_BLACK)
+            memset(row + spans[s].start, value, spans[s].end - spans[s].start);
+   }
+}
+
+/**
+ * Mask a frame in place. The planes are I420's, a half size chroma plane
+ * for each of u and v.
+ *
+ * @param u, v Chroma planes, NULL for a luma only frame
+ * @return 0 on success, -1 if the masks couldn't be rasterised for this size
+ */
+int privacy_filter_apply(PRIVACY_FILTER *filter, uint8_t *luma, uint8_t *u, uint8_t *v,
+                         int width, int height, int luma_stride, int chroma_stride)
+{
+   int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+
+   if (!filter->mask->num_masks)
+      return 0;
+   if (width != filter->width || height != filter->height || !filter->rows[0])
+   {
+      if (build_spans(filter, width, height) != 0)
+         return -1;
+   }
+
+   if (filter->blur)
+   {
+      blur_plane(filter, 0, luma, luma_stride, width, height, PRIVACY_BLUR_BLOCK);
+      if (u)
+         blur_plane(filter, 1, u, chroma_stride, chroma_width, chroma_height, PRIVACY_BLUR_BLOCK / 2);
+      if (v)
+         blur_plane(filter, 1, v, chroma_stride, chroma_width, chroma_height, PRIVACY_BLUR_BLOCK / 2);
+   }
+
+   black_plane(filter, 0, luma, luma_stride, height, PRIVACY_BLACK_LUMA);
+   if (u)
+      black_plane(filter, 1, u, chroma_stride, chroma_height, PRIVACY_BLACK_CHROMA);
+   if (v)
+      black_plane(filter, 1, v, chroma_stride, chroma_height, PRIVACY_BLACK_CHROMA);
+
+   filter->frames++;
+   return 0;
+}
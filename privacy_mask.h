@@ -0,0 +1,80 @@
+#ifndef PRIVACY_MASK_H_
+#define PRIVACY_MASK_H_
+
+#include <stdint.h>
+
+#include "polygon.h"
+
+#define PRIVACY_MAX_MASKS        8
+#define PRIVACY_MAX_POINTS       16
+
+/// Luma pixels across a blurred block, chroma blocks are half this
+#define PRIVACY_BLUR_BLOCK       16
+
+/// Black in limited range YUV
+#define PRIVACY_BLACK_LUMA       16
+#define PRIVACY_BLACK_CHROMA     128
+
+typedef enum
+{
+   PRIVACY_FILL_BLUR,               /// Each block of the mask takes its average, applied first
+   PRIVACY_FILL_BLACK,              /// Blacked out, wins over blur where they overlap
+   PRIVACY_FILL_COUNT
+} PRIVACY_FILL;
+
+/** Point of a mask polygon, the same mask covers the same part of the
+ *  scene in every stream
+ */
+typedef POLYGON_POINT PRIVACY_POINT;
+
+typedef struct
+{
+   PRIVACY_FILL fill;
+   int num_points;
+   PRIVACY_POINT points[PRIVACY_MAX_POINTS];
+} PRIVACY_REGION;
+
+/** Parts of a camera's view that are never to be recorded.
+ *  Read only once the masks are loaded, any number of filters share it.
+ */
+typedef struct
+{
+   PRIVACY_REGION masks[PRIVACY_MAX_MASKS];
+   int num_masks;
+} PRIVACY_MASK;
+
+/** Run of pixels in one row covered by one kind of fill
+ */
+typedef struct
+{
+   uint16_t start;                  /// First pixel
+   uint16_t end;                    /// One past the last
+   uint8_t fill;                    /// PRIVACY_FILL
+} PRIVACY_SPAN;
+
+/** The masks rasterised for one stream's frame size.
+ *  Each row's spans are worked out once per frame size, so a frame only
+ *  costs the fills. Edges round outwards rather than to the nearest pixel.
+ *  Not thread safe, each stream wants its own.
+ */
+typedef struct
+{
+   const PRIVACY_MASK *mask;
+   int width, height;               /// Frame size the spans are for
+   PRIVACY_SPAN *spans[2];          /// Luma and chroma spans, row by row
+   int *rows[2];                    /// Index of each row's first span, one more entry than rows
+   uint8_t *pattern;                /// Row of block averages for the band being blurred
+   int blur;                        /// Some spans want blurring
+   uint64_t frames;                 /// Frames masked
+} PRIVACY_FILTER;
+
+void privacy_mask_init(PRIVACY_MASK *mask);
+int privacy_mask_add(PRIVACY_MASK *mask, PRIVACY_FILL fill, const PRIVACY_POINT *points, int num_points);
+int privacy_mask_load(PRIVACY_MASK *mask, const char *path);
+
+void privacy_filter_init(PRIVACY_FILTER *filter, const PRIVACY_MASK *mask);
+int privacy_filter_apply(PRIVACY_FILTER *filter, uint8_t *luma, uint8_t *u, uint8_t *v,
+                         int width, int height, int luma_stride, int chroma_stride);
+void privacy_filter_destroy(PRIVACY_FILTER *filter);
+
+#endif /* PRIVACY_MASK_H_ */
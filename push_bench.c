@@ -0,0 +1,503 @@
+/**
+ * Sustained event rate through the push channel with a slow consumer.
+ *
+ * Runs a stand-in HTTP endpoint in process that takes its time over every
+ * POST, and can be taken down for a while to force events through the
+ * outbox. Events with thumbnails are submitted at a steady rate while a
+ * capture writer streams to storage alongside, and the writer's latency
+ * is compared with a run of it alone, so uploads can be seen not to take
+ * its bandwidth.
+ *
+ * The endpoint checks every event arrives exactly once and in order,
+ * however long it spent in the outbox. Events dropped because the load is
+ * beyond the rate budget or the consumer are reported, not failed: past
+ * that point something has to give, and it mustn't be the captures.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "bench_util.h"
+#include "event_push.h"
+#include "storage.h"
+#include "synthetic_camera.h"
+
+#define MAX_EVENTS   200000
+#define MAX_WRITES   200000
+
+/// Capture writer chunk, about an encoder output buffer
+#define WRITE_CHUNK  (64 * 1024)
+
+/** In process stand-in for the event endpoint
+ */
+typedef struct
+{
+   int listener;
+   int port;
+   int delay;                       /// Time taken over each POST (ms)
+   int down;                        /// Refusing connections (atomic)
+   int quit;                        /// (atomic)
+   pthread_t thread;
+
+   pthread_mutex_t lock;
+   uint64_t base_id;                /// First id the channel hands out
+   uint8_t *seen;                   /// Per event, received yet
+   uint64_t requests;
+   uint64_t received;               /// Distinct events received
+   uint64_t duplicates;
+   uint64_t out_of_order;           /// Events with a lower id than one already received
+   uint64_t stale;                  /// Ids that were never submitted
+   uint64_t last_id;
+   uint64_t bytes;
+   int64_t *latencies;              /// Event to receipt of each event (us)
+} STAND_IN;
+
+/** Capture writer streaming alongside the channel
+ */
+typedef struct
+{
+   STORAGE_MANAGER *storage;
+   int rate;                        /// Bytes per second
+   int quit;                        /// (atomic)
+   pthread_t thread;
+   int64_t *latencies;              /// Per write (us)
+   int writes;
+   uint64_t bytes;
+   int64_t elapsed;
+} CAPTURE_WRITER;
+
+static int64_t wall_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int open_listener(int port)
+{
+   struct sockaddr_in address;
+   int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), one = 1;
+
+   if (fd < 0)
+      return -1;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   address.sin_port = htons(port);
+   if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 8) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/**
+ * Tick off the events in a batch
+ */
+static void receive_batch(STAND_IN *server, const char *body)
+{
+   int64_t now = wall_us();
+   const char *p = body;
+
+   pthread_mutex_lock(&server->lock);
+   server->requests++;
+   while ((p = strstr(p, "{\"id\":")) != NULL)
+   {
+      uint64_t id = strtoull(p + 6, (char **)&p, 10), index = id - server->base_id;
+      const char *time = strstr(p, "\"time\":");
+
+      if (id < server->base_id || index >= MAX_EVENTS)
+      {
+         server->stale++;
+         continue;
+      }
+      if (server->seen[index])
+      {
+         server->duplicates++;
+         continue;
+      }
+      if (server->received && id < server->last_id)
+         server->out_of_order++;
+
+      server->seen[index] = 1;
+      server->last_id = id;
+      if (time)
+         server->latencies[server->received] = now - (int64_t)(strtod(time + 7, NULL) * 1e6);
+      server->received++;
+   }
+   pthread_mutex_unlock(&server->lock);
+}
+
+static void serve_request(STAND_IN *server, int client)
+{
+   static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+   struct timeval timeout = { 5, 0 };
+   size_t size = 65536, got = 0, body = 0, body_length = 0;
+   char *buffer = malloc(size + 1), *end, *field;
+
+   setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+   while (buffer)
+   {
+      ssize_t n;
+
+      if (got == size)
+      {
+         char *grown = realloc(buffer, size * 2 + 1);
+
+         if (!grown)
+            break;
+         buffer = grown;
+         size *= 2;
+      }
+      n = recv(client, buffer + got, size - got, 0);
+      if (n <= 0)
+         break;
+      got += n;
+      buffer[got] = 0;
+
+      // Offsets rather than pointers, the buffer moves as it grows
+      if (!body && (end = strstr(buffer, "\r\n\r\n")) != NULL)
+      {
+         body = end + 4 - buffer;
+         field = strcasestr(buffer, "Content-Length:");
+         body_length = field ? strtoul(field + 15, NULL, 10) : 0;
+      }
+      if (body && got - body >= body_length)
+      {
+         // The consumer is slow, but doesn't lose anything it has said it took
+         usleep(server->delay * 1000);
+         receive_batch(server, buffer + body);
+         __atomic_add_fetch(&server->bytes, got, __ATOMIC_RELAXED);
+         send(client, ok, sizeof(ok) - 1, MSG_NOSIGNAL);
+         break;
+      }
+   }
+   free(buffer);
+}
+
+static void *server_thread(void *arg)
+{
+   STAND_IN *server = (STAND_IN *)arg;
+
+   while (!__atomic_load_n(&server->quit, __ATOMIC_ACQUIRE))
+   {
+      int down = __atomic_load_n(&server->down, __ATOMIC_ACQUIRE);
+      struct pollfd pfd;
+      int client;
+
+      // Down means connections are refused, not just unanswered
+      if (down && server->listener >= 0)
+      {
+         close(server->listener);
+         server->listener = -1;
+      }
+      else if (!down && server->listener < 0)
+         server->listener = open_listener(server->port);
+
+      pfd.fd = server->listener;
+      pfd.events = POLLIN;
+      if (server->listener < 0 || poll(&pfd, 1, 50) <= 0)
+      {
+         if (server->listener < 0)
+            usleep(50000);
+         continue;
+      }
+
+      client = accept(server->listener, NULL, NULL);
+      if (client < 0)
+         continue;
+      serve_request(server, client);
+      close(client);
+   }
+   return NULL;
+}
+
+static int server_start(STAND_IN *server, int delay)
+{
+   struct sockaddr_in address;
+   socklen_t length = sizeof(address);
+
+   memset(server, 0, sizeof(*server));
+   server->delay = delay;
+   pthread_mutex_init(&server->lock, NULL);
+   server->seen = calloc(MAX_EVENTS, 1);
+   server->latencies = malloc(MAX_EVENTS * sizeof(*server->latencies));
+   server->listener = open_listener(0);
+
+   if (!server->seen || !server->latencies || server->listener < 0 ||
+       getsockname(server->listener, (struct sockaddr *)&address, &length) != 0)
+      return -1;
+   server->port = ntohs(address.sin_port);
+
+   return pthread_create(&server->thread, NULL, server_thread, server);
+}
+
+static void server_stop(STAND_IN *server)
+{
+   __atomic_store_n(&server->quit, 1, __ATOMIC_RELEASE);
+   pthread_join(server->thread, NULL);
+   if (server->listener >= 0)
+      close(server->listener);
+}
+
+static void *writer_thread(void *arg)
+{
+   CAPTURE_WRITER *writer = (CAPTURE_WRITER *)arg;
+   STORAGE_WRITER file;
+   static uint8_t chunk[WRITE_CHUNK];
+   int64_t start = bench_now();
+   int frame = 0;
+
+   memset(chunk, 0x5a, sizeof(chunk));
+   storage_writer_init(&file, writer->storage);
+
+   while (!__atomic_load_n(&writer->quit, __ATOMIC_ACQUIRE))
+   {
+      int64_t before;
+
+      // A megabyte a file, thrown away as soon as it's done
+      if (!file.file_handle)
+         storage_writer_open(&file, 0, frame++, "bin");
+
+      before = bench_now();
+      storage_writer_write(&file, chunk, sizeof(chunk));
+      fflush(file.file_handle);
+      if (writer->writes < MAX_WRITES)
+         writer->latencies[writer->writes++] = bench_now() - before;
+      writer->bytes += sizeof(chunk);
+
+      if (file.bytes >= 1024 * 1024)
+         storage_writer_close(&file, 0);
+
+      bench_sleep_until(start + (int64_t)(writer->bytes * 1000000 / writer->rate));
+   }
+
+   storage_writer_close(&file, 0);
+   writer->elapsed = bench_now() - start;
+   return NULL;
+}
+
+static int writer_start(CAPTURE_WRITER *writer, STORAGE_MANAGER *storage, int rate)
+{
+   memset(writer, 0, sizeof(*writer));
+   writer->storage = storage;
+   writer->rate = rate;
+   writer->latencies = malloc(MAX_WRITES * sizeof(*writer->latencies));
+   if (!writer->latencies)
+      return -1;
+   return pthread_create(&writer->thread, NULL, writer_thread, writer);
+}
+
+static void writer_stop(CAPTURE_WRITER *writer, const char *name)
+{
+   __atomic_store_n(&writer->quit, 1, __ATOMIC_RELEASE);
+   pthread_join(writer->thread, NULL);
+
+   printf("%-22s %8.2f MB/s  write p50 %6lld us  p99 %6lld us  max %6lld us\n", name,
+          writer->elapsed ? writer->bytes / (writer->elapsed / 1e6) / 1e6 : 0.0,
+          (long long)bench_percentile(writer->latencies, writer->writes, 50),
+          (long long)bench_percentile(writer->latencies, writer->writes, 99),
+          (long long)bench_percentile(writer->latencies, writer->writes, 100));
+   free(writer->latencies);
+}
+
+static void remove_outbox(const char *path)
+{
+   DIR *dir = opendir(path);
+   struct dirent *entry;
+
+   if (!dir)
+      return;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      char *name;
+
+      if (entry->d_name[0] != '.' && asprintf(&name, "%s/%s", path, entry->d_name) >= 0)
+      {
+         remove(name);
+         free(name);
+      }
+   }
+   closedir(dir);
+   rmdir(path);
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-t seconds] [-r events_per_s] [-d consumer_delay_ms] [-D down_at_s,down_for_s]\n"
+                   "          [-R push_bytes_per_s] [-W capture_bytes_per_s] [-w drain_s] [-n] [-o directory]\n", app);
+   fprintf(stderr, "  -n  no outbox, events are dropped while the endpoint is down or behind\n");
+}
+
+int main(int argc, char **argv)
+{
+   static uint8_t luma[SYNTHETIC_DEFAULT_ANALYSIS_WIDTH * SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT];
+   const char *directory = ".";
+   int seconds = 10, rate = 20, delay = 200, down_at = -1, down_for = 0, drain = 30, use_outbox = 1;
+   int push_rate = EVENT_PUSH_DEFAULT_RATE, capture_rate = 4 * 1024 * 1024, opt;
+   char *url = NULL, *outbox = NULL;
+   STORAGE_MANAGER storage;
+   CAPTURE_WRITER writer;
+   STAND_IN server;
+   EVENT_PUSH push;
+   EVENT_PUSH_EVENT event;
+   uint64_t submitted = 0, expected;
+   size_t peak_outbox = 0;
+   int64_t start, end, drained;
+   int failed;
+
+   while ((opt = getopt(argc, argv, "t:r:d:D:R:W:w:no:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 't' : seconds = atoi(optarg); break;
+         case 'r' : rate = atoi(optarg); break;
+         case 'd' : delay = atoi(optarg); break;
+         case 'D' : if (sscanf(optarg, "%d,%d", &down_at, &down_for) != 2) down_at = -1; break;
+         case 'R' : push_rate = atoi(optarg); break;
+         case 'W' : capture_rate = atoi(optarg); break;
+         case 'w' : drain = atoi(optarg); break;
+         case 'n' : use_outbox = 0; break;
+         case 'o' : directory = optarg; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (seconds < 1 || rate < 1 || delay < 0 || push_rate < 0 || capture_rate < WRITE_CHUNK ||
+       (int64_t)seconds * rate > MAX_EVENTS)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (storage_init(&storage, directory, "bench%d_%04d") != 0 || server_start(&server, delay) != 0 ||
+       asprintf(&url, "http://127.0.0.1:%d/events", server.port) < 0 ||
+       asprintf(&outbox, "%s/outbox.%d", directory, (int)getpid()) < 0)
+   {
+      fprintf(stderr, "Unable to set up the bench\n");
+      return 1;
+   }
+   synthetic_render_luma(luma, SYNTHETIC_DEFAULT_ANALYSIS_WIDTH, SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT,
+                         SYNTHETIC_DEFAULT_ANALYSIS_WIDTH, 0);
+
+   printf("%d events/s for %d s, consumer takes %d ms a POST, push budget %d B/s, capture %d B/s\n",
+          rate, seconds, delay, push_rate, capture_rate);
+   if (down_at >= 0)
+      printf("endpoint down from %d s for %d s\n", down_at, down_for);
+   printf("\n");
+
+   // The capture writer alone first, for comparison
+   if (writer_start(&writer, &storage, capture_rate) != 0)
+      return 1;
+   sleep(seconds < 5 ? seconds : 5);
+   writer_stop(&writer, "capture alone");
+
+   if (event_push_init(&push, url, use_outbox ? outbox : NULL) != 0)
+      return 1;
+   push.rate = push_rate;
+   server.base_id = push.next_id;
+   if (event_push_start(&push) != 0 || writer_start(&writer, &storage, capture_rate) != 0)
+      return 1;
+
+   memset(&event, 0, sizeof(event));
+   strcpy(event.label, "motion");
+   event.width = event.height = 32;
+   event_push_thumbnail(&event, luma, SYNTHETIC_DEFAULT_ANALYSIS_WIDTH, SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT,
+                        SYNTHETIC_DEFAULT_ANALYSIS_WIDTH);
+
+   start = bench_now();
+   end = start + (int64_t)seconds * 1000000;
+   for (int64_t next = start; next < end; next = start + (int64_t)(submitted * 1000000 / rate))
+   {
+      int64_t elapsed;
+      size_t bytes;
+
+      bench_sleep_until(next);
+      elapsed = bench_now() - start;
+      __atomic_store_n(&server.down, down_at >= 0 && elapsed >= (int64_t)down_at * 1000000 &&
+                       elapsed < (int64_t)(down_at + down_for) * 1000000, __ATOMIC_RELEASE);
+
+      event.camera = (int)(submitted % 4);
+      event.time = wall_us();
+      event_push_submit(&push, &event);
+      submitted++;
+
+      bytes = __atomic_load_n(&push.outbox_bytes, __ATOMIC_RELAXED);
+      if (bytes > peak_outbox)
+         peak_outbox = bytes;
+   }
+   __atomic_store_n(&server.down, 0, __ATOMIC_RELEASE);
+
+   // Let the backlog drain, everything not dropped has to turn up
+   drained = bench_now();
+   for (;;)
+   {
+      uint64_t received, dropped;
+
+      pthread_mutex_lock(&server.lock);
+      received = server.received;
+      pthread_mutex_unlock(&server.lock);
+      pthread_mutex_lock(&push.lock);
+      dropped = push.dropped;
+      pthread_mutex_unlock(&push.lock);
+
+      if (received + dropped >= submitted || bench_now() - drained > (int64_t)drain * 1000000)
+         break;
+      usleep(100000);
+   }
+   drained = bench_now() - drained;
+
+   writer_stop(&writer, "capture while pushing");
+   event_push_stop(&push);
+   server_stop(&server);
+
+   expected = submitted - push.dropped;
+   printf("\n%llu events submitted, %llu received in %llu POSTs (%.1f events a POST), %llu dropped\n",
+          (unsigned long long)submitted, (unsigned long long)server.received,
+          (unsigned long long)server.requests, server.requests ? (double)server.received / server.requests : 0.0,
+          (unsigned long long)push.dropped);
+   printf("sustained %.1f events/s (%.1f KB/s), backlog drained %.1f s after the last event\n",
+          server.received / ((end - start + drained) / 1e6), server.bytes / ((end - start + drained) / 1e3),
+          drained / 1e6);
+   printf("latency p50 %.2f s  p99 %.2f s  max %.2f s\n",
+          bench_percentile(server.latencies, (int)server.received, 50) / 1e6,
+          bench_percentile(server.latencies, (int)server.received, 99) / 1e6,
+          bench_percentile(server.latencies, (int)server.received, 100) / 1e6);
+   printf("%llu failed POSTs, %llu batches via the outbox, outbox peak %zu KB\n",
+          (unsigned long long)push.failures, (unsigned long long)push.outbox_written, peak_outbox / 1024);
+   printf("%llu duplicates, %llu out of order, %llu unknown ids\n", (unsigned long long)server.duplicates,
+          (unsigned long long)server.out_of_order, (unsigned long long)server.stale);
+
+   failed = server.received != expected || server.duplicates || server.out_of_order || server.stale;
+
+   event_push_destroy(&push);
+   free(server.seen);
+   free(server.latencies);
+   pthread_mutex_destroy(&server.lock);
+   remove_outbox(outbox);
+   storage_destroy(&storage);
+   free(url);
+   free(outbox);
+
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
@@ -0,0 +1,310 @@
+/**
+ * Storage saved by activity adaptive recording over a replayed day.
+ *
+ * Plays a day of encoder packets through the recorder, once recording
+ * everything and once adaptively, and compares the bytes written per hour.
+ * Activity comes from a file of "start_seconds duration_seconds" lines, or
+ * a built-in day of comings and goings. Packet sizes follow an H.264
+ * stream: big keyframes every GOP, small P-frames for a static scene and
+ * bigger ones while something moves. The motion gate triggers the recorder
+ * on every active frame, as pipeline_analyse does.
+ *
+ * Each packet carries its frame number so the written stream can be
+ * checked: segments start on keyframes, no P-frame is written without the
+ * one before it, and every active frame is written.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "recorder.h"
+
+#define DAY_SECONDS   86400
+#define MAX_ACTIVITY  1024
+
+/// Biggest packet the model makes, keyframes plus their jitter
+#define MAX_PACKET    (512 * 1024)
+
+typedef struct
+{
+   int start;                       /// Seconds into the day
+   int duration;
+} ACTIVITY;
+
+/** What a run wrote, checked as it is written
+ */
+typedef struct
+{
+   int open;
+   long last_frame;                 /// Frame written last in this segment, -1 at its start
+   uint64_t bytes;
+   uint64_t segments;
+   uint64_t active_written;         /// Frames during activity that were written
+   uint64_t broken;                 /// Packets a decoder couldn't use
+} BENCH_OUTPUT;
+
+/** Packet header the model writes, so the output can tell what it got
+ */
+typedef struct
+{
+   uint32_t frame;
+   uint32_t keyframe;
+   uint32_t active;
+} BENCH_PACKET;
+
+static int bench_open(void *userdata, int segment, int64_t time)
+{
+   BENCH_OUTPUT *output = (BENCH_OUTPUT *)userdata;
+
+   (void)segment;
+   (void)time;
+   output->open = 1;
+   output->last_frame = -1;
+   return 0;
+}
+
+static size_t bench_write(void *userdata, const void *data, size_t length)
+{
+   BENCH_OUTPUT *output = (BENCH_OUTPUT *)userdata;
+   BENCH_PACKET packet;
+
+   memcpy(&packet, data, sizeof(packet));
+
+   // A P-frame is only any use straight after the frame it refers to
+   if (!output->open || (!packet.keyframe && (long)packet.frame != output->last_frame + 1))
+      output->broken++;
+
+   output->last_frame = packet.frame;
+   output->bytes += length;
+   if (packet.active)
+      output->active_written++;
+   return length;
+}
+
+static int bench_close(void *userdata)
+{
+   BENCH_OUTPUT *output = (BENCH_OUTPUT *)userdata;
+
+   output->open = 0;
+   output->segments++;
+   return 0;
+}
+
+static const RECORDER_OUTPUT bench_output =
+{
+   bench_open,
+   bench_write,
+   bench_close
+};
+
+/**
+ * A day of deliveries, school runs and the odd passer by
+ */
+static int default_day(ACTIVITY *activity)
+{
+   static const ACTIVITY fixed[] =
+   {
+      { 7 * 3600 + 30 * 60, 300 },  // leaving for work
+      { 8 * 3600 + 40 * 60, 120 },  // school run
+      { 10 * 3600 + 15 * 60, 90 },  // post
+      { 13 * 3600, 60 },            // delivery
+      { 15 * 3600 + 30 * 60, 180 }, // school run
+      { 18 * 3600, 600 },           // coming home
+      { 22 * 3600 + 10 * 60, 45 },  // putting the bins out
+   };
+   uint32_t seed = 1;
+   int count = 0;
+
+   for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+      activity[count++] = fixed[i];
+
+   // Passers by, 15-45s each through the day
+   for (int i = 0; i < 60; i++)
+   {
+      activity[count].start = (int)(bench_random(&seed) % DAY_SECONDS);
+      activity[count].duration = 15 + (int)(bench_random(&seed) % 31);
+      count++;
+   }
+   return count;
+}
+
+static int load_activity(const char *path, ACTIVITY *activity)
+{
+   FILE *file = fopen(path, "r");
+   char line[128];
+   int count = 0;
+
+   if (!file)
+   {
+      perror(path);
+      return -1;
+   }
+
+   while (fgets(line, sizeof(line), file) && count < MAX_ACTIVITY)
+   {
+      if (line[0] == '#' || sscanf(line, "%d %d", &activity[count].start, &activity[count].duration) != 2)
+         continue;
+      count++;
+   }
+   fclose(file);
+   return count;
+}
+
+/**
+ * Mark the seconds of the day something is moving
+ */
+static void fill_activity(uint8_t *active, const ACTIVITY *activity, int count)
+{
+   memset(active, 0, DAY_SECONDS);
+   for (int i = 0; i < count; i++)
+      for (int s = activity[i].start; s < activity[i].start + activity[i].duration && s < DAY_SECONDS; s++)
+         if (s >= 0)
+            active[s] = 1;
+}
+
+/**
+ * Replay the day through a recorder
+ *
+ * @param adaptive Record adaptively, otherwise everything
+ * @return Microseconds of recorder time per packet
+ */
+static double play_day(RECORDER *recorder, BENCH_OUTPUT *output, const uint8_t *active, int adaptive,
+                       int fps, int gop, int keyframe_bytes, int static_bytes, int active_bytes,
+                       uint64_t *active_frames)
+{
+   static uint8_t data[MAX_PACKET];
+   uint32_t seed = 7;
+   int64_t elapsed = 0;
+   uint32_t frames = (uint32_t)DAY_SECONDS * fps;
+
+   memset(output, 0, sizeof(*output));
+   recorder->adaptive = adaptive;
+   *active_frames = 0;
+
+   for (uint32_t frame = 0; frame < frames; frame++)
+   {
+      int64_t now = (int64_t)frame * 1000000 / fps;
+      BENCH_PACKET packet = { frame, frame % gop == 0, active[frame / fps] };
+      int size = packet.keyframe ? keyframe_bytes : packet.active ? active_bytes : static_bytes;
+      int64_t start;
+
+      // Encoders never make exactly the same size twice
+      size += (int)(bench_random(&seed) % (size / 5 + 1)) - size / 10;
+      if (size < (int)sizeof(packet))
+         size = sizeof(packet);
+      memcpy(data, &packet, sizeof(packet));
+
+      // The motion gate only sees a frame after the encoder has had it
+      start = bench_now();
+      recorder_packet(recorder, data, size, packet.keyframe ? RECORDER_FLAG_KEYFRAME : 0, now);
+      if (packet.active)
+      {
+         recorder_trigger(recorder, now);
+         (*active_frames)++;
+      }
+      elapsed += bench_now() - start;
+   }
+
+   recorder_close(recorder);
+   return (double)elapsed / frames;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-a activity_file] [-f fps] [-g gop] [-I keyframe_bytes] [-P static_bytes]\n"
+                   "          [-A active_bytes] [-i idle_keyframe_ms]\n", app);
+   fprintf(stderr, "  -a  lines of \"start_seconds duration_seconds\", default a built-in day\n");
+}
+
+int main(int argc, char **argv)
+{
+   static ACTIVITY activity[MAX_ACTIVITY];
+   static uint8_t active[DAY_SECONDS];
+   const char *activity_path = NULL;
+   int fps = 10, gop = 10, keyframe_bytes = 60000, static_bytes = 1500, active_bytes = 12000;
+   int idle_interval = RECORDER_DEFAULT_IDLE_INTERVAL;
+   int count, active_seconds = 0, opt;
+   BENCH_OUTPUT constant, adaptive;
+   RECORDER recorder;
+   uint64_t active_frames;
+   double constant_cost, adaptive_cost;
+
+   while ((opt = getopt(argc, argv, "a:f:g:I:P:A:i:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'a' : activity_path = optarg; break;
+         case 'f' : fps = atoi(optarg); break;
+         case 'g' : gop = atoi(optarg); break;
+         case 'I' : keyframe_bytes = atoi(optarg); break;
+         case 'P' : static_bytes = atoi(optarg); break;
+         case 'A' : active_bytes = atoi(optarg); break;
+         case 'i' : idle_interval = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (fps < 1 || gop < 1 || keyframe_bytes < 1 || keyframe_bytes > MAX_PACKET * 5 / 6 ||
+       static_bytes < 1 || active_bytes < 1 || active_bytes > MAX_PACKET * 5 / 6)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   count = activity_path ? load_activity(activity_path, activity) : default_day(activity);
+   if (count < 0)
+      return 1;
+   fill_activity(active, activity, count);
+   for (int s = 0; s < DAY_SECONDS; s++)
+      active_seconds += active[s];
+
+   if (recorder_init(&recorder, RECORDER_DEFAULT_RING_SIZE, RECORDER_DEFAULT_RING_PACKETS,
+                     &bench_output, &constant) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   recorder.idle_interval = idle_interval;
+
+   printf("%d activity periods, %d s active (%.1f%% of the day), %d fps, GOP %d\n", count, active_seconds,
+          100.0 * active_seconds / DAY_SECONDS, fps, gop);
+
+   constant_cost = play_day(&recorder, &constant, active, 0, fps, gop, keyframe_bytes, static_bytes,
+                            active_bytes, &active_frames);
+
+   recorder.userdata = &adaptive;
+   recorder.events = 0;
+   adaptive_cost = play_day(&recorder, &adaptive, active, 1, fps, gop, keyframe_bytes, static_bytes,
+                            active_bytes, &active_frames);
+
+   printf("\n%-10s %12s %10s %9s %9s %8s %10s\n", "mode", "MB/hour", "saved", "segments", "broken",
+          "active", "us/packet");
+   printf("%-10s %12.1f %10s %9llu %9llu %7.1f%% %10.3f\n", "constant", constant.bytes / 24 / 1e6, "-",
+          (unsigned long long)constant.segments, (unsigned long long)constant.broken,
+          100.0 * constant.active_written / active_frames, constant_cost);
+   printf("%-10s %12.1f %9.1f%% %9llu %9llu %7.1f%% %10.3f\n", "adaptive", adaptive.bytes / 24 / 1e6,
+          100.0 - 100.0 * adaptive.bytes / constant.bytes,
+          (unsigned long long)adaptive.segments, (unsigned long long)adaptive.broken,
+          100.0 * adaptive.active_written / active_frames, adaptive_cost);
+
+   printf("\n%llu events, trigger to full rate at most %.1f ms (frame interval %.1f ms)\n",
+          (unsigned long long)recorder.events, recorder.max_ramp / 1000.0, 1000.0 / fps);
+   printf("run up before a trigger at least %.1f s (pre-event %.1f s), %llu ring overflows\n",
+          recorder.min_pre_event / 1e6, recorder.pre_event / 1000.0, (unsigned long long)recorder.overflows);
+
+   recorder_destroy(&recorder);
+
+   // Adaptive recording must not lose anything while something is happening
+   if (adaptive.broken || constant.broken || adaptive.active_written != active_frames ||
+       recorder.max_ramp > 1000000 / fps)
+   {
+      printf("FAIL\n");
+      return 1;
+   }
+   printf("PASS\n");
+   return 0;
+}
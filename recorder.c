@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "recorder.h"
+#include "memory_budget.h"
+
+/**
+ * Set up a recorder, idle until the first trigger
+ *
+ * @param ring_size Bytes of pre-event video, RECORDER_DEFAULT_RING_SIZE
+ * @param ring_packets Packets of pre-event video, RECORDER_DEFAULT_RING_PACKETS
+ * @param output Where segments go
+ * @param userdata Passed to the output functions
+ * @return 0 on success, -1 if out of memory or over the packets quota
+ */
+int recorder_init(RECORDER *recorder, size_t ring_size, int ring_packets,
+                  const RECORDER_OUTPUT *output, void *userdata)
+{
+   memset(recorder, 0, sizeof(*recorder));
+   recorder->adaptive = 1;
+   recorder->pre_event = RECORDER_DEFAULT_PRE_EVENT;
+   recorder->post_event = RECORDER_DEFAULT_POST_EVENT;
+   recorder->segment_time = RECORDER_DEFAULT_SEGMENT_TIME;
+   recorder->idle_interval = RECORDER_DEFAULT_IDLE_INTERVAL;
+   recorder->output = output;
+   recorder->userdata = userdata;
+   recorder->skip_to_keyframe = 1;
+   recorder->last_keyframe = -1;
+   recorder->full_rate_since = -1;
+   recorder->min_pre_event = -1;
+
+   recorder->ring_size = ring_size;
+   if (ring_packets <= 0)
+      return -1;
+
+   // Counted against the encoded packets' share of the memory budget
+   recorder->ring = memory_alloc(MEMORY_STAGE_PACKETS, ring_size);
+   recorder->packet_slots = ring_packets;
+   recorder->packets = memory_alloc(MEMORY_STAGE_PACKETS, ring_packets * sizeof(*recorder->packets));
+
+   if (!recorder->ring || !recorder->packets)
+   {
+      recorder_destroy(recorder);
+      return -1;
+   }
+   memset(recorder->packets, 0, ring_packets * sizeof(*recorder->packets));
+   return 0;
+}
+
+void recorder_destroy(RECORDER *recorder)
+{
+   memory_free(MEMORY_STAGE_PACKETS, recorder->ring, recorder->ring_size);
+   memory_free(MEMORY_STAGE_PACKETS, recorder->packets, recorder->packet_slots * sizeof(*recorder->packets));
+   recorder->ring = NULL;
+   recorder->packets = NULL;
+}
+
+static RECORDER_PACKET *ring_packet(RECORDER *recorder, int index)
+{
+   return &recorder->packets[(recorder->packet_first + index) % recorder->packet_slots];
+}
+
+/**
+ * Copy a packet onto the end of the ring
+ *
+ * @return 0 on success, -1 if there isn't room
+ */
+static int ring_store(RECORDER *recorder, const void *data, size_t length, int flags, int64_t time)
+{
+   RECORDER_PACKET *packet;
+   size_t offset;
+
+   if (recorder->packet_count == recorder->packet_slots || length > recorder->ring_size)
+      return -1;
+
+   if (!recorder->packet_count)
+      recorder->ring_head = recorder->ring_tail = 0;
+
+   // Packets are never split, one that won't fit before the end goes back
+   // to the start. Strictly less than head so tail never catches it up.
+   if (recorder->ring_tail >= recorder->ring_head)
+   {
+      if (recorder->ring_size - recorder->ring_tail >= length)
+         offset = recorder->ring_tail;
+      else if (recorder->ring_head > length)
+         offset = 0;
+      else
+         return -1;
+   }
+   else if (recorder->ring_head - recorder->ring_tail > length)
+      offset = recorder->ring_tail;
+   else
+      return -1;
+
+   packet = ring_packet(recorder, recorder->packet_count);
+   packet->offset = offset;
+   packet->length = length;
+   packet->time = time;
+   packet->flags = flags;
+   memcpy(recorder->ring + offset, data, length);
+   recorder->ring_tail = offset + length;
+   if (recorder->full_rate_since < 0)
+      recorder->full_rate_since = time;
+
+   if ((flags & RECORDER_FLAG_KEYFRAME) && recorder->packet_count && !recorder->next_gop)
+      recorder->next_gop = recorder->packet_count;
+   recorder->packet_count++;
+   return 0;
+}
+
+static void ring_drop_oldest(RECORDER *recorder)
+{
+   recorder->packet_first = (recorder->packet_first + 1) % recorder->packet_slots;
+   recorder->packet_count--;
+
+   if (recorder->packet_count)
+      recorder->ring_head = ring_packet(recorder, 0)->offset;
+   else
+      recorder->ring_head = recorder->ring_tail = 0;
+}
+
+static void close_segment(RECORDER *recorder)
+{
+   if (!recorder->segment_open)
+      return;
+
+   if (recorder->output->close(recorder->userdata) != 0)
+      recorder->write_errors++;
+   else
+      __atomic_add_fetch(&recorder->segments, 1, __ATOMIC_RELAXED);
+
+   recorder->segment_open = 0;
+   recorder->segment++;
+}
+
+/**
+ * Append a packet to the current segment, starting a new one at a keyframe
+ * once it has run for segment_time
+ */
+static void write_packet(RECORDER *recorder, const void *data, size_t length, int flags, int64_t time)
+{
+   int keyframe = flags & RECORDER_FLAG_KEYFRAME;
+   size_t written;
+
+   if (recorder->segment_open && keyframe &&
+       time - recorder->segment_start >= (int64_t)recorder->segment_time * 1000)
+      close_segment(recorder);
+
+   if (!recorder->segment_open)
+   {
+      // A segment has to start where decoding can
+      if (!keyframe)
+         return;
+
+      // A failed open is still a segment, the output discards what it can't write
+      if (recorder->output->open(recorder->userdata, recorder->segment, time) != 0)
+         recorder->write_errors++;
+      recorder->segment_open = 1;
+      recorder->segment_start = time;
+   }
+
+   written = recorder->output->write(recorder->userdata, data, length);
+   __atomic_add_fetch(&recorder->bytes_written, written, __ATOMIC_RELAXED);
+   recorder->packets_written++;
+   if (written != length)
+      recorder->write_errors++;
+
+   if (keyframe)
+      recorder->last_keyframe = time;
+}
+
+/**
+ * Take the oldest GOP out of the ring. Idle scenes only keep its keyframe,
+ * and only if idle_interval has passed since the last one written.
+ */
+static void evict_gop(RECORDER *recorder)
+{
+   RECORDER_PACKET *first = ring_packet(recorder, 0);
+   int count = recorder->next_gop ? recorder->next_gop : recorder->packet_count;
+
+   if ((first->flags & RECORDER_FLAG_KEYFRAME) &&
+       (recorder->last_keyframe < 0 ||
+        first->time - recorder->last_keyframe >= (int64_t)recorder->idle_interval * 1000))
+      write_packet(recorder, recorder->ring + first->offset, first->length, first->flags, first->time);
+
+   while (count--)
+      ring_drop_oldest(recorder);
+   recorder->full_rate_since = recorder->packet_count ? ring_packet(recorder, 0)->time : -1;
+
+   // Only the GOP that just moved up has to be searched for the next one
+   recorder->next_gop = 0;
+   for (int i = 1; i < recorder->packet_count; i++)
+   {
+      if (ring_packet(recorder, i)->flags & RECORDER_FLAG_KEYFRAME)
+      {
+         recorder->next_gop = i;
+         break;
+      }
+   }
+}
+
+/**
+ * Idle packet, hold it in the ring dropping GOPs older than pre_event
+ */
+static void buffer_packet(RECORDER *recorder, const void *data, size_t length, int flags, int64_t now)
+{
+   int64_t horizon = now - (int64_t)recorder->pre_event * 1000;
+
+   // Oldest GOP goes once the one after it alone covers pre_event
+   while (recorder->next_gop && ring_packet(recorder, recorder->next_gop)->time <= horizon)
+      evict_gop(recorder);
+
+   while (ring_store(recorder, data, length, flags, now) != 0)
+   {
+      // Run out of room before pre_event, older GOPs make way first
+      if (recorder->next_gop)
+      {
+         evict_gop(recorder);
+         continue;
+      }
+
+      // The GOP being built doesn't fit on its own, a keyframe ends it
+      // cleanly but anything else leaves the rest of it undecodable
+      if (recorder->packet_count)
+         evict_gop(recorder);
+      if (!(flags & RECORDER_FLAG_KEYFRAME) || ring_store(recorder, data, length, flags, now) != 0)
+      {
+         recorder->overflows++;
+         recorder->skip_to_keyframe = 1;
+         recorder->full_rate_since = -1;
+      }
+      return;
+   }
+}
+
+/**
+ * First packet after a trigger, write out the pre-event ring at full rate
+ */
+static void start_event(RECORDER *recorder, int64_t now)
+{
+   int64_t trigger = __atomic_load_n(&recorder->trigger_time, __ATOMIC_ACQUIRE);
+
+   recorder->active = 1;
+   recorder->events++;
+
+   if (trigger)
+   {
+      int64_t pre_event = recorder->full_rate_since >= 0 ? trigger - recorder->full_rate_since : 0;
+
+      if (now - trigger > recorder->max_ramp)
+         recorder->max_ramp = now - trigger;
+      if (recorder->min_pre_event < 0 || pre_event < recorder->min_pre_event)
+         recorder->min_pre_event = pre_event;
+   }
+
+   // The ring always starts on a keyframe, so the file switches rate cleanly
+   while (recorder->packet_count)
+   {
+      RECORDER_PACKET *packet = ring_packet(recorder, 0);
+
+      write_packet(recorder, recorder->ring + packet->offset, packet->length, packet->flags, packet->time);
+      ring_drop_oldest(recorder);
+   }
+   recorder->next_gop = 0;
+}
+
+/**
+ * Hand the recorder the next encoded packet, always from the same thread
+ *
+ * @param data Encoded data, copied if it has to wait in the ring
+ * @param length Bytes of data
+ * @param flags RECORDER_FLAG_ values
+ * @param now Arrival time in microseconds, same clock as recorder_trigger
+ */
+void recorder_packet(RECORDER *recorder, const void *data, size_t length, int flags, int64_t now)
+{
+   int keyframe = flags & RECORDER_FLAG_KEYFRAME;
+
+   recorder->packets_in++;
+   recorder->bytes_in += length;
+
+   if (recorder->skip_to_keyframe)
+   {
+      if (!keyframe)
+         return;
+      recorder->skip_to_keyframe = 0;
+   }
+
+   if (!recorder->adaptive)
+   {
+      write_packet(recorder, data, length, flags, now);
+      return;
+   }
+
+   if (recorder_is_active(recorder, now))
+   {
+      if (!recorder->active)
+         start_event(recorder, now);
+      write_packet(recorder, data, length, flags, now);
+      return;
+   }
+
+   // The ring has to start on a keyframe, until the next one the GOP
+   // carries on at full rate
+   if (recorder->active)
+   {
+      if (!keyframe)
+      {
+         write_packet(recorder, data, length, flags, now);
+         return;
+      }
+      recorder->active = 0;
+   }
+
+   buffer_packet(recorder, data, length, flags, now);
+}
+
+/**
+ * Something is happening, record at full rate from the next packet until
+ * post_event after the last trigger. Never blocks, safe from any thread.
+ *
+ * @param now Time in microseconds, same clock as recorder_packet
+ */
+void recorder_trigger(RECORDER *recorder, int64_t now)
+{
+   int64_t until = now + (int64_t)recorder->post_event * 1000;
+
+   if (__atomic_exchange_n(&recorder->active_until, until, __ATOMIC_ACQ_REL) <= now)
+      __atomic_store_n(&recorder->trigger_time, now, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return Non zero while triggers are keeping the recorder at full rate
+ */
+int recorder_is_active(RECORDER *recorder, int64_t now)
+{
+   return now < __atomic_load_n(&recorder->active_until, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * End of the stream, write what an idle recorder would keep of the ring
+ * and finish the segment. The next stream has to start on a keyframe.
+ */
+void recorder_close(RECORDER *recorder)
+{
+   while (recorder->packet_count)
+      evict_gop(recorder);
+   close_segment(recorder);
+
+   recorder->active = 0;
+   recorder->skip_to_keyframe = 1;
+   recorder->full_rate_since = -1;
+   __atomic_store_n(&recorder->active_until, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&recorder->trigger_time, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,111 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Video kept from before the trigger that started a recording, in milliseconds
+#define RECORDER_DEFAULT_PRE_EVENT    5000
+
+/// Time full rate recording carries on after the last trigger, in milliseconds
+#define RECORDER_DEFAULT_POST_EVENT   10000
+
+/// Length of each segment file, a new one starts at the next keyframe after this (ms)
+#define RECORDER_DEFAULT_SEGMENT_TIME 60000
+
+/// Time between the keyframes kept while nothing is happening, in milliseconds
+#define RECORDER_DEFAULT_IDLE_INTERVAL 10000
+
+/// Bytes of encoded video the pre-event ring can hold
+#define RECORDER_DEFAULT_RING_SIZE    (4 * 1024 * 1024)
+
+/// Packets the pre-event ring can hold, a little over 30s at 30fps
+#define RECORDER_DEFAULT_RING_PACKETS 1024
+
+/// Packet starts a keyframe, decoding can begin here
+#define RECORDER_FLAG_KEYFRAME        (1 << 0)
+
+/// Packet ends a frame
+#define RECORDER_FLAG_FRAME_END       (1 << 1)
+
+/** Where the recorder's segments go. Called on whichever thread feeds the
+ *  recorder packets.
+ */
+typedef struct
+{
+   int (*open)(void *userdata, int segment, int64_t time);            /// Start a segment file at a packet of that time, 0 on success
+   size_t (*write)(void *userdata, const void *data, size_t length);  /// Append to it, returns bytes written
+   int (*close)(void *userdata);                                      /// Finish and commit it, 0 on success
+} RECORDER_OUTPUT;
+
+/** One packet waiting in the pre-event ring
+ */
+typedef struct
+{
+   size_t offset;                   /// Start of the data in the ring
+   size_t length;
+   int64_t time;                    /// When it arrived (us)
+   int flags;                       /// RECORDER_FLAG_ values
+} RECORDER_PACKET;
+
+/** Recording stage after the video encoder.
+ *  While triggers keep coming every packet is written. Otherwise packets
+ *  wait in a ring holding at least pre_event worth of whole GOPs, and as
+ *  each GOP ages out only its keyframe is written, and only one every
+ *  idle_interval. A trigger flushes the ring at full rate on the next
+ *  packet, so the file switches rate at a keyframe and the event keeps
+ *  its run up. Segments always start on a keyframe.
+ *  Packets come from one thread, triggers may come from any.
+ */
+typedef struct
+{
+   int adaptive;                    /// Idle scenes keep keyframes only, 0 records every packet
+   int pre_event;                   /// RECORDER_DEFAULT_PRE_EVENT
+   int post_event;                  /// RECORDER_DEFAULT_POST_EVENT
+   int segment_time;                /// RECORDER_DEFAULT_SEGMENT_TIME
+   int idle_interval;               /// RECORDER_DEFAULT_IDLE_INTERVAL
+
+   const RECORDER_OUTPUT *output;
+   void *userdata;
+
+   uint8_t *ring;                   /// Pre-event packet data
+   size_t ring_size;
+   size_t ring_head;                /// Start of the oldest packet's data
+   size_t ring_tail;                /// Where the next packet's data goes
+   RECORDER_PACKET *packets;        /// Pre-event packets, oldest first from packet_first
+   int packet_slots;
+   int packet_first;
+   int packet_count;
+   int next_gop;                    /// Packets before the second keyframe in the ring, 0 if there isn't one
+
+   int64_t active_until;            /// Full rate until then (us, atomic)
+   int64_t trigger_time;            /// First trigger of the current event, 0 if none (atomic)
+   int active;                      /// Writing every packet
+   int skip_to_keyframe;            /// Packets are undecodable until the next keyframe
+   int64_t last_keyframe;           /// Time of the last keyframe written, -1 if none yet
+   int64_t full_rate_since;         /// Every packet since then is in the ring or written, -1 if none
+   int segment_open;
+   int64_t segment_start;
+   int segment;                     /// Number of the current/next segment
+
+   uint64_t packets_in;             /// Packets handed to the recorder
+   uint64_t bytes_in;
+   uint64_t packets_written;
+   uint64_t bytes_written;          /// Bytes that made it into segments (atomic)
+   uint64_t segments;               /// Segments completed (atomic)
+   uint64_t events;                 /// Switches to full rate
+   uint64_t overflows;              /// GOPs too big for the ring, dropped to the next keyframe
+   uint64_t write_errors;
+   int64_t max_ramp;                /// Longest trigger to full rate delay (us)
+   int64_t min_pre_event;           /// Shortest run up kept before a trigger (us), -1 until an event
+} RECORDER;
+
+int recorder_init(RECORDER *recorder, size_t ring_size, int ring_packets,
+                  const RECORDER_OUTPUT *output, void *userdata);
+void recorder_destroy(RECORDER *recorder);
+void recorder_packet(RECORDER *recorder, const void *data, size_t length, int flags, int64_t now);
+void recorder_trigger(RECORDER *recorder, int64_t now);
+int recorder_is_active(RECORDER *recorder, int64_t now);
+void recorder_close(RECORDER *recorder);
+
+#endif /* RECORDER_H_ */
@@ -0,0 +1,790 @@
+/**
+ * Reruns the analysis pipeline over archived footage.
+ *
+ * Each argument is a recorded segment, or a directory of them: synthetic
+ * video (.syv) is decoded here, H.264 (.h264) through an external decoder
+ * that writes raw 8 bit gray frames to its stdout, and a directory of PGM
+ * stills is taken as one segment in name order. Every frame goes through
+ * the same motion gate as the live pipeline, with the same zones, and with
+ * a model (-D) motion frames go on to the detector. Events are held off
+ * like pipeline_analyse does, by footage time rather than wall time.
+ *
+ * Segments are shared between worker threads by work stealing. Each
+ * worker starts with a contiguous run of segments, takes the newest of its
+ * own and, once it runs out, the oldest of somebody else's, so one long
+ * segment at the end of a run doesn't leave the other cores idle.
+ * Segments are analysed independently, the background settles again at
+ * the start of each, so the results don't depend on which worker ran them.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "motion.h"
+#include "cnn.h"
+#include "detector.h"
+#include "pipeline.h"
+#include "synthetic_camera.h"
+#include "clock_now.h"
+
+#define MAX_WORKERS 64
+
+/// Frame rate of the recordings, frames per second
+#define REPLAY_DEFAULT_FPS     10
+
+/// %s is the segment, then the width and height to scale to
+#define REPLAY_DEFAULT_DECODER "ffmpeg -v error -i '%s' -vf scale=%d:%d -f rawvideo -pix_fmt gray -"
+
+typedef enum
+{
+   SEGMENT_SYNTHETIC,               /// .syv, decoded here
+   SEGMENT_H264,                    /// .h264 through the decoder command
+   SEGMENT_STILLS                   /// Directory of .pgm frames
+} SEGMENT_TYPE;
+
+/** Something worth looking at in a segment
+ */
+typedef struct
+{
+   int frame;
+   int class_id;                    /// -1 for motion alone
+   float score;
+} REPLAY_EVENT;
+
+typedef struct
+{
+   char *path;
+   SEGMENT_TYPE type;
+
+   int failed;                      /// Stopped early on a decode error
+   int frames;
+   int motion_frames;
+   int worker;                      /// Who analysed it
+   REPLAY_EVENT *events;
+   int num_events;
+} REPLAY_SEGMENT;
+
+/** Segments a worker has yet to analyse. The owner takes from the tail,
+ *  thieves from the head.
+ */
+typedef struct
+{
+   pthread_mutex_t lock;
+   int *items;
+   int head;
+   int tail;
+} REPLAY_DEQUE;
+
+struct REPLAY_S;
+
+typedef struct
+{
+   struct REPLAY_S *replay;
+   int id;
+   pthread_t thread;
+   REPLAY_DEQUE deque;
+
+   CNN_SCRATCH scratch;
+   int8_t *input;
+
+   uint64_t frames;
+   int segments;
+   int steals;                      /// Segments taken from other workers
+   int64_t busy;                    /// Time spent analysing (us)
+} REPLAY_WORKER;
+
+typedef struct REPLAY_S
+{
+   MOTION_DETECTOR motion;          /// Zones and sensitivity every segment starts from
+   int fps;
+   int event_holdoff;               /// PIPELINE_DEFAULT_EVENT_HOLDOFF
+   CNN_MODEL *model;                /// NULL for motion alone
+   float threshold;
+   const char *decoder;             /// REPLAY_DEFAULT_DECODER
+   int decode_width;                /// Size H.264 is scaled to for analysis
+   int decode_height;
+
+   REPLAY_SEGMENT *segments;
+   int num_segments;
+   REPLAY_WORKER workers[MAX_WORKERS];
+   int num_workers;
+} REPLAY;
+
+/** Frames of one segment as they are decoded
+ */
+typedef struct
+{
+   REPLAY_SEGMENT *segment;
+   uint8_t *luma;
+   size_t luma_size;
+   int width;
+   int height;
+
+   uint8_t *data;                   /// Whole synthetic video file
+   size_t length;
+   size_t offset;
+
+   FILE *pipe;                      /// Decoder output
+
+   char **names;                    /// Stills in frame order
+   int count;
+   int next;
+} FRAME_SOURCE;
+
+static int compare_names(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int has_extension(const char *name, const char *extension)
+{
+   size_t length = strlen(name), extension_length = strlen(extension);
+
+   return length > extension_length && strcmp(name + length - extension_length, extension) == 0;
+}
+
+/**
+ * Names in a directory ending in extension, in name order
+ *
+ * @return Number of names, -1 if it can't be read
+ */
+static int list_directory(const char *path, const char *extension, char ***names)
+{
+   DIR *dir = opendir(path);
+   struct dirent *entry;
+   int count = 0;
+
+   *names = NULL;
+   if (!dir)
+      return -1;
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      char **grown;
+
+      if (!has_extension(entry->d_name, extension))
+         continue;
+
+      grown = realloc(*names, (count + 1) * sizeof(**names));
+      if (!grown)
+         break;
+      *names = grown;
+      if (asprintf(&(*names)[count], "%s/%s", path, entry->d_name) < 0)
+         break;
+      count++;
+   }
+   closedir(dir);
+
+   qsort(*names, count, sizeof(**names), compare_names);
+   return count;
+}
+
+static void free_names(char **names, int count)
+{
+   for (int i = 0; i < count; i++)
+      free(names[i]);
+   free(names);
+}
+
+/**
+ * Read the next number from a PGM header, skipping whitespace and comments
+ */
+static int read_header_value(FILE *file)
+{
+   int ch, value;
+
+   while ((ch = fgetc(file)) != EOF)
+   {
+      if (ch == '#')
+         while ((ch = fgetc(file)) != EOF && ch != '\n')
+            ;
+      else if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+         break;
+   }
+   if (ch == EOF)
+      return -1;
+
+   ungetc(ch, file);
+   return fscanf(file, "%d", &value) == 1 ? value : -1;
+}
+
+/**
+ * Make sure the frame buffer holds width x height
+ */
+static int frame_size(FRAME_SOURCE *source, int width, int height)
+{
+   size_t size = (size_t)width * height;
+
+   if (size > source->luma_size)
+   {
+      uint8_t *luma = realloc(source->luma, size);
+
+      if (!luma)
+         return -1;
+      source->luma = luma;
+      source->luma_size = size;
+   }
+   return 0;
+}
+
+static int load_pgm(FRAME_SOURCE *source, const char *path)
+{
+   FILE *file = fopen(path, "rb");
+   int width, height, maxval;
+
+   if (!file)
+      return -1;
+
+   if (fgetc(file) != 'P' || fgetc(file) != '5')
+      goto error;
+
+   width = read_header_value(file);
+   height = read_header_value(file);
+   maxval = read_header_value(file);
+   if (width <= 0 || height <= 0 || maxval != 255 || frame_size(source, width, height) != 0)
+      goto error;
+   fgetc(file);
+
+   if (fread(source->luma, (size_t)width * height, 1, file) != 1)
+      goto error;
+
+   source->width = width;
+   source->height = height;
+   fclose(file);
+   return 0;
+
+error:
+   fprintf(stderr, "%s: not a binary PGM\n", path);
+   fclose(file);
+   return -1;
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *length)
+{
+   FILE *file = fopen(path, "rb");
+   struct stat st;
+
+   *data = NULL;
+   *length = 0;
+   if (!file)
+      return -1;
+
+   if (fstat(fileno(file), &st) != 0 || (st.st_size && !(*data = malloc(st.st_size))) ||
+       fread(*data, 1, st.st_size, file) != (size_t)st.st_size)
+   {
+      free(*data);
+      *data = NULL;
+      fclose(file);
+      return -1;
+   }
+   *length = st.st_size;
+   fclose(file);
+   return 0;
+}
+
+static int source_open(FRAME_SOURCE *source, REPLAY_SEGMENT *segment, const REPLAY *replay)
+{
+   char *command;
+
+   memset(source, 0, sizeof(*source));
+   source->segment = segment;
+
+   switch (segment->type)
+   {
+      case SEGMENT_SYNTHETIC :
+         return read_file(segment->path, &source->data, &source->length);
+
+      case SEGMENT_H264 :
+         if (frame_size(source, replay->decode_width, replay->decode_height) != 0 ||
+             asprintf(&command, replay->decoder, segment->path, replay->decode_width, replay->decode_height) < 0)
+            return -1;
+         source->pipe = popen(command, "r");
+         free(command);
+         source->width = replay->decode_width;
+         source->height = replay->decode_height;
+         return source->pipe ? 0 : -1;
+
+      case SEGMENT_STILLS :
+         source->count = list_directory(segment->path, ".pgm", &source->names);
+         return source->count < 0 ? -1 : 0;
+   }
+   return -1;
+}
+
+/**
+ * Decode the next frame into source->luma
+ *
+ * @return 1 for a frame, 0 at the end of the segment, -1 on a decode error
+ */
+static int source_next(FRAME_SOURCE *source)
+{
+   switch (source->segment->type)
+   {
+      case SEGMENT_SYNTHETIC :
+      {
+         SYNTHETIC_VIDEO_HEADER header;
+         long used;
+
+         if (source->offset == source->length)
+            return 0;
+
+         // Keyframes say how big the frame is before it has to be there
+         if (source->length - source->offset >= sizeof(header))
+         {
+            memcpy(&header, source->data + source->offset, sizeof(header));
+            if (header.keyframe && frame_size(source, header.width, header.height) != 0)
+               return -1;
+         }
+         if (!source->luma)
+            return -1;
+
+         used = synthetic_decode_video(source->data + source->offset, source->length - source->offset,
+                                       source->luma, &source->width, &source->height);
+         if (used <= 0)
+            return -1;
+         source->offset += used;
+         return 1;
+      }
+
+      case SEGMENT_H264 :
+      {
+         size_t size = (size_t)source->width * source->height;
+         size_t got = fread(source->luma, 1, size, source->pipe);
+
+         if (got == size)
+            return 1;
+         return got ? -1 : 0;
+      }
+
+      case SEGMENT_STILLS :
+         if (source->next == source->count)
+            return 0;
+         return load_pgm(source, source->names[source->next++]) == 0 ? 1 : -1;
+   }
+   return -1;
+}
+
+/**
+ * @return 0, or -1 if a decoder exited with an error
+ */
+static int source_close(FRAME_SOURCE *source)
+{
+   int status = 0;
+
+   if (source->pipe && pclose(source->pipe) != 0)
+      status = -1;
+   free_names(source->names, source->count > 0 ? source->count : 0);
+   free(source->data);
+   free(source->luma);
+   return status;
+}
+
+static void add_event(REPLAY_SEGMENT *segment, int frame, int class_id, float score)
+{
+   REPLAY_EVENT *events = realloc(segment->events, (segment->num_events + 1) * sizeof(*events));
+
+   if (!events)
+      return;
+   segment->events = events;
+   segment->events[segment->num_events].frame = frame;
+   segment->events[segment->num_events].class_id = class_id;
+   segment->events[segment->num_events].score = score;
+   segment->num_events++;
+}
+
+/**
+ * Run one segment through the motion gate and, on motion, the detector
+ */
+static void replay_segment(REPLAY *replay, REPLAY_WORKER *worker, REPLAY_SEGMENT *segment)
+{
+   MOTION_DETECTOR motion = replay->motion;
+   FRAME_SOURCE source;
+   int64_t last_event = -1;
+   int status;
+
+   segment->worker = worker->id;
+   motion_set_frame_rate(&motion, replay->fps * 1000);
+
+   if (source_open(&source, segment, replay) != 0)
+   {
+      fprintf(stderr, "%s: can't open segment\n", segment->path);
+      segment->failed = 1;
+      source_close(&source);
+      return;
+   }
+
+   while ((status = source_next(&source)) > 0)
+   {
+      int64_t time = (int64_t)segment->frames * 1000000 / replay->fps;
+      CNN_DETECTION detections[DETECTOR_MAX_DETECTIONS];
+      int frame = segment->frames++, count, best = 0;
+
+      if (!motion_process(&motion, source.luma, source.width, source.height, source.width))
+         continue;
+      segment->motion_frames++;
+
+      if (replay->model)
+      {
+         const int8_t *output;
+
+         cnn_prepare_input(replay->model, source.luma, source.width, source.height, source.width,
+                           worker->input);
+         output = cnn_run_batch(replay->model, &worker->scratch, (const int8_t *const *)&worker->input, 1);
+         count = cnn_decode(replay->model, output, replay->threshold, detections, DETECTOR_MAX_DETECTIONS);
+         if (!count)
+            continue;
+         for (int i = 1; i < count; i++)
+            if (detections[i].score > detections[best].score)
+               best = i;
+      }
+
+      if (last_event >= 0 && time - last_event < (int64_t)replay->event_holdoff * 1000)
+         continue;
+      last_event = time;
+
+      if (replay->model)
+         add_event(segment, frame, detections[best].class_id, detections[best].score);
+      else
+         add_event(segment, frame, -1, 0);
+   }
+
+   if (source_close(&source) != 0 || status < 0)
+   {
+      fprintf(stderr, "%s: decode error after %d frames\n", segment->path, segment->frames);
+      segment->failed = 1;
+   }
+   motion_destroy(&motion);
+}
+
+/**
+ * Next segment for a worker, its own newest first, then the oldest of
+ * whoever has one
+ *
+ * @return Segment index, -1 once every deque is empty
+ */
+static int next_segment(REPLAY *replay, REPLAY_WORKER *worker)
+{
+   REPLAY_DEQUE *deque = &worker->deque;
+   int item = -1;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->tail > deque->head)
+      item = deque->items[--deque->tail];
+   pthread_mutex_unlock(&deque->lock);
+   if (item >= 0)
+      return item;
+
+   // Nothing is ever added, so one empty pass means the work is done
+   for (int i = 1; i < replay->num_workers && item < 0; i++)
+   {
+      REPLAY_DEQUE *victim = &replay->workers[(worker->id + i) % replay->num_workers].deque;
+
+      pthread_mutex_lock(&victim->lock);
+      if (victim->tail > victim->head)
+         item = victim->items[victim->head++];
+      pthread_mutex_unlock(&victim->lock);
+   }
+   if (item >= 0)
+      worker->steals++;
+   return item;
+}
+
+static void *worker_thread(void *arg)
+{
+   REPLAY_WORKER *worker = (REPLAY_WORKER *)arg;
+   REPLAY *replay = worker->replay;
+   int item;
+
+   while ((item = next_segment(replay, worker)) >= 0)
+   {
+      REPLAY_SEGMENT *segment = &replay->segments[item];
+      int64_t start = clock_now_us();
+
+      replay_segment(replay, worker, segment);
+      worker->busy += clock_now_us() - start;
+      worker->frames += segment->frames;
+      worker->segments++;
+   }
+   return NULL;
+}
+
+static int add_segment(REPLAY *replay, const char *path, SEGMENT_TYPE type)
+{
+   REPLAY_SEGMENT *segments = realloc(replay->segments, (replay->num_segments + 1) * sizeof(*segments));
+
+   if (!segments)
+      return -1;
+   replay->segments = segments;
+   memset(&segments[replay->num_segments], 0, sizeof(*segments));
+   segments[replay->num_segments].path = strdup(path);
+   segments[replay->num_segments].type = type;
+   replay->num_segments++;
+   return 0;
+}
+
+/**
+ * Queue a segment file, or every segment in a directory. A directory with
+ * PGM stills in it is a segment itself.
+ */
+static int add_path(REPLAY *replay, const char *path)
+{
+   static const struct { const char *extension; SEGMENT_TYPE type; } types[] =
+   {
+      { ".syv", SEGMENT_SYNTHETIC },
+      { ".h264", SEGMENT_H264 }
+   };
+   struct stat st;
+   char **names;
+   int count, found = 0;
+
+   if (stat(path, &st) != 0)
+   {
+      perror(path);
+      return -1;
+   }
+
+   if (!S_ISDIR(st.st_mode))
+   {
+      for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+         if (has_extension(path, types[i].extension))
+            return add_segment(replay, path, types[i].type);
+      fprintf(stderr, "%s: not a segment this can decode\n", path);
+      return -1;
+   }
+
+   count = list_directory(path, ".pgm", &names);
+   free_names(names, count > 0 ? count : 0);
+   if (count > 0)
+      return add_segment(replay, path, SEGMENT_STILLS);
+
+   for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+   {
+      count = list_directory(path, types[i].extension, &names);
+      for (int n = 0; n < count; n++)
+         if (add_segment(replay, names[n], types[i].type) == 0)
+            found++;
+      free_names(names, count > 0 ? count : 0);
+   }
+
+   if (!found)
+      fprintf(stderr, "%s: no segments\n", path);
+   return found ? 0 : -1;
+}
+
+/**
+ * Deal the segments out in contiguous runs and wait for the workers to
+ * share them out between themselves
+ */
+static int run_workers(REPLAY *replay)
+{
+   int started = 0;
+
+   for (int w = 0; w < replay->num_workers; w++)
+   {
+      REPLAY_WORKER *worker = &replay->workers[w];
+      int first = (int)((int64_t)replay->num_segments * w / replay->num_workers);
+      int last = (int)((int64_t)replay->num_segments * (w + 1) / replay->num_workers);
+
+      worker->replay = replay;
+      worker->id = w;
+      pthread_mutex_init(&worker->deque.lock, NULL);
+      worker->deque.items = malloc((replay->num_segments + 1) * sizeof(int));
+      if (!worker->deque.items)
+         return -1;
+
+      // Owner pops from the tail, so the run goes in backwards and the
+      // oldest segment is analysed first
+      for (int i = last - 1; i >= first; i--)
+         worker->deque.items[worker->deque.tail++] = i;
+
+      if (replay->model)
+      {
+         worker->input = malloc((size_t)replay->model->input_width * replay->model->input_height);
+         if (!worker->input || cnn_scratch_init(&worker->scratch, replay->model, 1) != 0)
+            return -1;
+      }
+   }
+
+   for (int w = 0; w < replay->num_workers; w++)
+   {
+      if (pthread_create(&replay->workers[w].thread, NULL, worker_thread, &replay->workers[w]) != 0)
+         break;
+      started++;
+   }
+
+   // Whatever didn't start is stolen by those that did
+   if (!started)
+      worker_thread(&replay->workers[0]);
+   for (int w = 0; w < started; w++)
+      pthread_join(replay->workers[w].thread, NULL);
+   return 0;
+}
+
+static void print_report(const REPLAY *replay, int64_t elapsed)
+{
+   uint64_t frames = 0, motion_frames = 0;
+   int events = 0, failed = 0, steals = 0;
+
+   for (int s = 0; s < replay->num_segments; s++)
+   {
+      const REPLAY_SEGMENT *segment = &replay->segments[s];
+
+      printf("%s: %d frames, %d with motion, %d events%s\n", segment->path, segment->frames,
+             segment->motion_frames, segment->num_events, segment->failed ? ", FAILED" : "");
+
+      for (int e = 0; e < segment->num_events; e++)
+      {
+         const REPLAY_EVENT *event = &segment->events[e];
+         double seconds = (double)event->frame / replay->fps;
+
+         if (event->class_id < 0)
+            printf("   %8.1fs  frame %d  motion\n", seconds, event->frame);
+         else
+            printf("   %8.1fs  frame %d  %s %.2f\n", seconds, event->frame,
+                   replay->model->class_names[event->class_id], event->score);
+      }
+
+      frames += segment->frames;
+      motion_frames += segment->motion_frames;
+      events += segment->num_events;
+      failed += segment->failed;
+   }
+
+   printf("\n%-8s %9s %10s %8s %10s\n", "worker", "segments", "frames", "steals", "frames/s");
+   for (int w = 0; w < replay->num_workers; w++)
+   {
+      const REPLAY_WORKER *worker = &replay->workers[w];
+
+      printf("%-8d %9d %10llu %8d %10.1f\n", w, worker->segments, (unsigned long long)worker->frames,
+             worker->steals, worker->busy ? worker->frames * 1e6 / worker->busy : 0.0);
+      steals += worker->steals;
+   }
+
+   printf("\n%d segments (%d failed), %llu frames, %llu with motion, %d events, %d steals\n",
+          replay->num_segments, failed, (unsigned long long)frames, (unsigned long long)motion_frames,
+          events, steals);
+   printf("%.2f s, %.1f frames/s over %d workers, %.1f frames/s per worker, %.1fx real time\n",
+          elapsed / 1e6, elapsed ? frames * 1e6 / elapsed : 0.0, replay->num_workers,
+          elapsed ? frames * 1e6 / elapsed / replay->num_workers : 0.0,
+          elapsed ? (double)frames / replay->fps * 1e6 / elapsed : 0.0);
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-j threads] [-f fps] [-Z zones_file] [-D model] [-t threshold]\n"
+                   "          [-e event_holdoff_ms] [-d decoder_command] [-W width] [-H height] segment|dir...\n", app);
+   fprintf(stderr, "  Segments are .syv, .h264 or directories of .pgm stills\n");
+   fprintf(stderr, "  -d  printf format given the segment, width and height, writing gray frames to stdout\n");
+   fprintf(stderr, "      default \"%s\"\n", REPLAY_DEFAULT_DECODER);
+}
+
+int main(int argc, char **argv)
+{
+   static REPLAY replay;
+   CNN_MODEL model;
+   const char *zones_path = NULL, *model_path = NULL;
+   int64_t start, elapsed;
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   int status = 0, failed = 0, opt;
+
+   motion_init(&replay.motion);
+   replay.fps = REPLAY_DEFAULT_FPS;
+   replay.event_holdoff = PIPELINE_DEFAULT_EVENT_HOLDOFF;
+   replay.threshold = DETECTOR_DEFAULT_THRESHOLD;
+   replay.decoder = REPLAY_DEFAULT_DECODER;
+   replay.decode_width = SYNTHETIC_DEFAULT_ANALYSIS_WIDTH;
+   replay.decode_height = SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT;
+   replay.num_workers = cores > 0 ? (cores < MAX_WORKERS ? (int)cores : MAX_WORKERS) : 1;
+
+   while ((opt = getopt(argc, argv, "j:f:Z:D:t:e:d:W:H:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'j' : replay.num_workers = atoi(optarg); break;
+         case 'f' : replay.fps = atoi(optarg); break;
+         case 'Z' : zones_path = optarg; break;
+         case 'D' : model_path = optarg; break;
+         case 't' : replay.threshold = (float)atof(optarg); break;
+         case 'e' : replay.event_holdoff = atoi(optarg); break;
+         case 'd' : replay.decoder = optarg; break;
+         case 'W' : replay.decode_width = atoi(optarg); break;
+         case 'H' : replay.decode_height = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (optind == argc || replay.num_workers < 1 || replay.num_workers > MAX_WORKERS || replay.fps < 1 ||
+       replay.event_holdoff < 0 || replay.decode_width < 1 || replay.decode_height < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (zones_path && motion_load_zones(&replay.motion, zones_path) != 0)
+      return 1;
+
+   if (model_path)
+   {
+      if (cnn_model_load(&model, model_path) != 0)
+      {
+         fprintf(stderr, "%s: can't load model\n", model_path);
+         return 1;
+      }
+      replay.model = &model;
+   }
+
+   for (int i = optind; i < argc; i++)
+      if (add_path(&replay, argv[i]) != 0)
+         status = 1;
+   if (!replay.num_segments)
+      return 1;
+
+   // No point in more workers than segments
+   if (replay.num_workers > replay.num_segments)
+      replay.num_workers = replay.num_segments;
+
+   printf("%d segments, %d workers on %ld cores, %d fps, %s\n\n", replay.num_segments, replay.num_workers,
+          cores, replay.fps, replay.model ? "motion and detection" : "motion");
+
+   start = clock_now_us();
+   if (run_workers(&replay) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+   elapsed = clock_now_us() - start;
+
+   print_report(&replay, elapsed);
+
+   for (int s = 0; s < replay.num_segments; s++)
+   {
+      failed += replay.segments[s].failed;
+      free(replay.segments[s].path);
+      free(replay.segments[s].events);
+   }
+   free(replay.segments);
+
+   for (int w = 0; w < replay.num_workers; w++)
+   {
+      REPLAY_WORKER *worker = &replay.workers[w];
+
+      if (replay.model)
+         cnn_scratch_destroy(&worker->scratch);
+      free(worker->input);
+      free(worker->deque.items);
+      pthread_mutex_destroy(&worker->deque.lock);
+   }
+   if (replay.model)
+      cnn_model_destroy(&model);
+   motion_destroy(&replay.motion);
+
+   return status || failed ? 1 : 0;
+}
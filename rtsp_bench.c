@@ -0,0 +1,537 @@
+/**
+ * Live streaming cost and latency through the RTSP server.
+ *
+ * Feeds the server an H.264 like elementary stream at the encoder's frame
+ * rate and bitrate, split into encoder sized buffers, while a growing
+ * number of local test clients do the RTSP handshake and take the RTP.
+ * Every NAL unit carries the time it was handed over and a known fill, so
+ * the clients can check each one they reassemble and time it end to end.
+ *
+ * The feeding thread is where packetising and sending happen, as it is
+ * the encoder callback in the camera, so its CPU time with each number
+ * of clients gives the cost of one more. Clients join at a keyframe the
+ * server asks the encoder for, and the time that takes is reported too.
+ * Packets lost on the way are reported, not failed, it is UDP; a NAL unit
+ * that arrives different from what was sent, or a client that never gets
+ * a picture, fails the run.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bench_util.h"
+#include "rtsp_server.h"
+
+#define MAX_LATENCIES 100000
+
+/// Largest NAL unit the clients reassemble
+#define MAX_NAL       (1024 * 1024)
+
+/// Time and length written at the start of each slice, as hex so no zero bytes
+#define STAMP_LENGTH  24
+
+static const uint8_t sps[] = { 0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe8 };
+static const uint8_t pps[] = { 0x68, 0xce, 0x3c, 0x80 };
+
+/** A local RTSP client taking one stream over UDP
+ */
+typedef struct
+{
+   int port;                        /// Server's RTSP port
+   int quit;                        /// (atomic)
+   pthread_t thread;
+
+   int joined;                      /// Handshake done
+   int64_t play_time;               /// When PLAY was answered
+   int64_t join_time;               /// PLAY to the first whole NAL unit (us), -1 until then
+   uint64_t packets;
+   uint64_t bytes;
+   uint64_t lost;                   /// Sequence numbers skipped
+   uint64_t nals;
+   uint64_t corrupt;                /// NAL units different from what was sent
+   uint16_t last_sequence;
+   int have_sequence;
+
+   uint8_t *nal;                    /// NAL unit being reassembled from FU-A
+   size_t nal_length;
+   int in_fragment;
+
+   int64_t *latencies;              /// Handover to reassembly of each slice (us)
+   int num_latencies;
+} TEST_CLIENT;
+
+static int keyframe_requested;      /// Server asked for an IDR (atomic)
+
+static int64_t thread_cpu_us(void)
+{
+   struct rusage usage;
+
+   getrusage(RUSAGE_THREAD, &usage);
+   return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+          usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void request_keyframe(void *userdata)
+{
+   (void)userdata;
+   __atomic_store_n(&keyframe_requested, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Fill a slice's body: when it was handed over, its length, then a
+ * pattern that depends on both and never has a zero byte
+ */
+static void fill_slice(uint8_t *body, size_t length, int64_t time)
+{
+   char stamp[STAMP_LENGTH + 1];
+
+   snprintf(stamp, sizeof(stamp), "%016llx%08x", (unsigned long long)time, (unsigned)length);
+   memcpy(body, stamp, STAMP_LENGTH);
+   for (size_t i = STAMP_LENGTH; i < length; i++)
+      body[i] = 1 + (uint8_t)((time + i * 7) % 255);
+}
+
+/**
+ * Check a reassembled slice against what fill_slice wrote
+ *
+ * @param time Set to when it was handed over
+ * @return 0 if it is intact
+ */
+static int check_slice(const uint8_t *body, size_t length, int64_t *time)
+{
+   char stamp[STAMP_LENGTH + 1];
+   unsigned long long sent;
+   unsigned expected;
+
+   if (length < STAMP_LENGTH)
+      return -1;
+   memcpy(stamp, body, STAMP_LENGTH);
+   stamp[STAMP_LENGTH] = 0;
+   if (sscanf(stamp, "%16llx%8x", &sent, &expected) != 2 || expected != length)
+      return -1;
+   for (size_t i = STAMP_LENGTH; i < length; i++)
+      if (body[i] != 1 + (uint8_t)((sent + i * 7) % 255))
+         return -1;
+   *time = (int64_t)sent;
+   return 0;
+}
+
+/**
+ * Send a request and read the reply
+ *
+ * @param reply Buffer for the reply headers and body
+ * @return the status code, -1 if the connection failed
+ */
+static int rtsp_request(int fd, const char *request, char *reply, size_t size)
+{
+   size_t length = 0;
+   char *end;
+
+   if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0)
+      return -1;
+
+   for (;;)
+   {
+      ssize_t got = recv(fd, reply + length, size - 1 - length, 0);
+      const char *content_length;
+
+      if (got <= 0)
+         return -1;
+      length += got;
+      reply[length] = 0;
+      if (!(end = strstr(reply, "\r\n\r\n")))
+         continue;
+      content_length = strcasestr(reply, "Content-Length:");
+      if (!content_length || content_length > end ||
+          length >= (size_t)(end + 4 - reply) + strtoul(content_length + 15, NULL, 10))
+         break;
+   }
+   return strncmp(reply, "RTSP/1.0 ", 9) == 0 ? atoi(reply + 9) : -1;
+}
+
+/**
+ * A NAL unit has been reassembled, check it and time it
+ */
+static void client_nal(TEST_CLIENT *client, const uint8_t *nal, size_t length)
+{
+   int type = nal[0] & 0x1f;
+   int64_t now = bench_now(), sent;
+
+   client->nals++;
+   if (client->join_time < 0)
+      client->join_time = now - client->play_time;
+
+   if (type == 7 || type == 8)
+   {
+      if ((type == 7 && (length != sizeof(sps) || memcmp(nal, sps, length))) ||
+          (type == 8 && (length != sizeof(pps) || memcmp(nal, pps, length))))
+         client->corrupt++;
+      return;
+   }
+
+   if (check_slice(nal + 1, length - 1, &sent) != 0)
+   {
+      client->corrupt++;
+      return;
+   }
+   if (client->num_latencies < MAX_LATENCIES)
+      client->latencies[client->num_latencies++] = now - sent;
+}
+
+/**
+ * One RTP packet, single NAL unit or FU-A
+ */
+static void client_packet(TEST_CLIENT *client, const uint8_t *packet, size_t length)
+{
+   const uint8_t *payload = packet + 12;
+   size_t payload_length;
+   uint16_t sequence;
+
+   if (length < 14 || (packet[0] & 0xc0) != 0x80)
+      return;
+   payload_length = length - 12;
+   sequence = (uint16_t)(packet[2] << 8 | packet[3]);
+
+   client->packets++;
+   client->bytes += length;
+   if (client->have_sequence && sequence != (uint16_t)(client->last_sequence + 1))
+   {
+      client->lost += (uint16_t)(sequence - client->last_sequence - 1);
+      client->in_fragment = 0;
+   }
+   client->last_sequence = sequence;
+   client->have_sequence = 1;
+
+   if ((payload[0] & 0x1f) != 28)
+   {
+      client_nal(client, payload, payload_length);
+      return;
+   }
+
+   if (payload[1] & 0x80)
+   {
+      client->nal[0] = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+      client->nal_length = 1;
+      client->in_fragment = 1;
+   }
+   if (!client->in_fragment)
+      return;
+   if (client->nal_length + payload_length - 2 > MAX_NAL)
+   {
+      client->corrupt++;
+      client->in_fragment = 0;
+      return;
+   }
+   memcpy(client->nal + client->nal_length, payload + 2, payload_length - 2);
+   client->nal_length += payload_length - 2;
+   if (payload[1] & 0x40)
+   {
+      client_nal(client, client->nal, client->nal_length);
+      client->in_fragment = 0;
+   }
+}
+
+static void *client_thread(void *arg)
+{
+   TEST_CLIENT *client = (TEST_CLIENT *)arg;
+   struct sockaddr_in address;
+   socklen_t address_length = sizeof(address);
+   struct timeval timeout = { 0, 100000 };
+   char request[512], reply[4096], session[64] = "";
+   uint8_t packet[2048];
+   int control, rtp, rcvbuf = 1024 * 1024, rtp_port, cseq = 1;
+   const char *found;
+
+   control = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   rtp = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (control < 0 || rtp < 0 || bind(rtp, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+       getsockname(rtp, (struct sockaddr *)&address, &address_length) != 0)
+      goto done;
+   rtp_port = ntohs(address.sin_port);
+   setsockopt(rtp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   setsockopt(rtp, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+   address.sin_port = htons(client->port);
+   if (connect(control, (struct sockaddr *)&address, sizeof(address)) != 0)
+      goto done;
+
+   snprintf(request, sizeof(request), "DESCRIBE rtsp://127.0.0.1:%d/cam0 RTSP/1.0\r\nCSeq: %d\r\n"
+            "Accept: application/sdp\r\n\r\n", client->port, cseq++);
+   if (rtsp_request(control, request, reply, sizeof(reply)) != 200 || !strstr(reply, "H264/90000"))
+      goto done;
+
+   snprintf(request, sizeof(request), "SETUP rtsp://127.0.0.1:%d/cam0/track0 RTSP/1.0\r\nCSeq: %d\r\n"
+            "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n\r\n", client->port, cseq++, rtp_port, rtp_port + 1);
+   if (rtsp_request(control, request, reply, sizeof(reply)) != 200 || !(found = strcasestr(reply, "Session:")))
+      goto done;
+   sscanf(found + 8, " %63[^;\r]", session);
+
+   snprintf(request, sizeof(request), "PLAY rtsp://127.0.0.1:%d/cam0/ RTSP/1.0\r\nCSeq: %d\r\nSession: %s\r\n\r\n",
+            client->port, cseq++, session);
+   if (rtsp_request(control, request, reply, sizeof(reply)) != 200)
+      goto done;
+   client->play_time = bench_now();
+   client->joined = 1;
+
+   while (!__atomic_load_n(&client->quit, __ATOMIC_ACQUIRE))
+   {
+      ssize_t got = recv(rtp, packet, sizeof(packet), 0);
+
+      if (got > 0)
+         client_packet(client, packet, got);
+   }
+
+   snprintf(request, sizeof(request), "TEARDOWN rtsp://127.0.0.1:%d/cam0/ RTSP/1.0\r\nCSeq: %d\r\nSession: %s\r\n\r\n",
+            client->port, cseq++, session);
+   rtsp_request(control, request, reply, sizeof(reply));
+
+done:
+   if (control >= 0)
+      close(control);
+   if (rtp >= 0)
+      close(rtp);
+   return NULL;
+}
+
+/** Encoder stand-in feeding the stream
+ */
+typedef struct
+{
+   RTSP_SERVER *server;
+   RTSP_STREAM *stream;
+   int fps;
+   int gop;                         /// Frames between scheduled IDRs
+   size_t p_size;                   /// P slice bytes, an IDR is 8 times this
+   size_t chunk;                    /// Encoder output buffer size
+   uint8_t *buffer;
+   int frame;
+   uint64_t idrs;
+   uint64_t requested_idrs;         /// IDRs made because the server asked
+} FEEDER;
+
+/**
+ * Hand one NAL unit over the way the encoder does, in buffers of at most
+ * chunk bytes, only the first starting with a start code
+ */
+static void feed_nal(FEEDER *feeder, const uint8_t *nal, size_t length, int frame_end)
+{
+   static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+   int64_t now = bench_now();
+   size_t pos = 0;
+
+   memcpy(feeder->buffer, start_code, 4);
+   while (pos < length)
+   {
+      size_t offset = pos ? 0 : 4;
+      size_t take = length - pos < feeder->chunk - offset ? length - pos : feeder->chunk - offset;
+      int last = pos + take == length;
+
+      memcpy(feeder->buffer + offset, nal + pos, take);
+      rtsp_stream_packet(feeder->server, feeder->stream, feeder->buffer, offset + take,
+                         last && frame_end ? RTSP_FLAG_FRAME_END : 0, now);
+      pos += take;
+   }
+}
+
+static void feed_frame(FEEDER *feeder, uint8_t *slice)
+{
+   int keyframe = feeder->frame % feeder->gop == 0;
+   size_t length;
+
+   if (__atomic_exchange_n(&keyframe_requested, 0, __ATOMIC_ACQ_REL) && !keyframe)
+   {
+      keyframe = 1;
+      feeder->requested_idrs++;
+   }
+
+   if (keyframe)
+   {
+      // Inline headers, as the camera asks of its encoder
+      feed_nal(feeder, sps, sizeof(sps), 0);
+      feed_nal(feeder, pps, sizeof(pps), 0);
+      feeder->idrs++;
+   }
+
+   length = keyframe ? feeder->p_size * 8 : feeder->p_size;
+   slice[0] = keyframe ? 0x65 : 0x41;
+   fill_slice(slice + 1, length - 1, bench_now());
+   feed_nal(feeder, slice, length, 1);
+   feeder->frame++;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-c max_clients] [-t seconds] [-f fps] [-b bitrate] [-g gop] [-B buffer_size] [-p port]\n", app);
+   fprintf(stderr, "  -c  clients in the last step, steps double from 1 (default 16, max %d)\n", RTSP_MAX_CLIENTS);
+   fprintf(stderr, "  -b  stream bitrate in bits/s (default 4000000)\n");
+   fprintf(stderr, "  -g  frames between scheduled IDRs (default 60)\n");
+   fprintf(stderr, "  -B  encoder output buffer size, larger frames are split across buffers (default 65536)\n");
+}
+
+int main(int argc, char **argv)
+{
+   int max_clients = 16, seconds = 3, fps = 30, bitrate = 4000000, gop = 60, port = 18554, opt;
+   size_t chunk = 65536;
+   int64_t base_cpu = -1, cpu_per_second[RTSP_MAX_CLIENTS + 1];
+   int steps[16], num_steps = 0, failed = 0;
+   RTSP_SERVER server;
+   FEEDER feeder;
+   uint8_t *slice;
+
+   while ((opt = getopt(argc, argv, "c:t:f:b:g:B:p:h")) != -1)
+   {
+      switch (opt)
+      {
+         case 'c' : max_clients = atoi(optarg); break;
+         case 't' : seconds = atoi(optarg); break;
+         case 'f' : fps = atoi(optarg); break;
+         case 'b' : bitrate = atoi(optarg); break;
+         case 'g' : gop = atoi(optarg); break;
+         case 'B' : chunk = strtoul(optarg, NULL, 10); break;
+         case 'p' : port = atoi(optarg); break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (max_clients < 1 || max_clients > RTSP_MAX_CLIENTS || seconds < 1 || fps < 1 || bitrate < 8 * fps * 100 ||
+       gop < 1 || chunk < 256)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   memset(&feeder, 0, sizeof(feeder));
+   feeder.fps = fps;
+   feeder.gop = gop;
+   feeder.chunk = chunk;
+   feeder.p_size = (size_t)bitrate / 8 / fps * gop / (gop + 7);
+   if (feeder.p_size < STAMP_LENGTH + 2)
+      feeder.p_size = STAMP_LENGTH + 2;
+   feeder.buffer = malloc(chunk);
+   slice = malloc(feeder.p_size * 8);
+
+   if (!feeder.buffer || !slice || rtsp_server_init(&server, port) != 0 ||
+       !(feeder.stream = rtsp_server_add_stream(&server, "cam0", request_keyframe, NULL)) ||
+       rtsp_server_start(&server) != 0)
+   {
+      fprintf(stderr, "Unable to set up the bench\n");
+      return 1;
+   }
+   feeder.server = &server;
+
+   steps[num_steps++] = 0;
+   for (int n = 1; n < max_clients; n *= 2)
+      steps[num_steps++] = n;
+   steps[num_steps++] = max_clients;
+
+   printf("%d fps, %.1f Mbit/s, IDR every %d frames, P %zu B, IDR %zu B, %zu B encoder buffers, %d s a step\n\n",
+          fps, bitrate / 1e6, gop, feeder.p_size, feeder.p_size * 8, chunk, seconds);
+   printf("%7s %9s %8s %9s %9s %9s %9s %9s %7s %7s\n", "clients", "Mbit/s", "cpu %", "us/frame",
+          "join max", "lat p50", "lat p99", "lat max", "lost", "corrupt");
+
+   for (int s = 0; s < num_steps; s++)
+   {
+      int clients = steps[s];
+      TEST_CLIENT *test = calloc(clients ? clients : 1, sizeof(*test));
+      int64_t *latencies = malloc(sizeof(*latencies) * MAX_LATENCIES * (clients ? clients : 1));
+      int64_t start, next, cpu, join_max = 0, elapsed;
+      uint64_t bytes = 0, lost = 0, corrupt = 0;
+      int num_latencies = 0, frames = 0;
+
+      for (int i = 0; i < clients; i++)
+      {
+         test[i].port = port;
+         test[i].join_time = -1;
+         test[i].nal = malloc(MAX_NAL);
+         test[i].latencies = malloc(sizeof(int64_t) * MAX_LATENCIES);
+         pthread_create(&test[i].thread, NULL, client_thread, &test[i]);
+      }
+
+      // Clients join while the stream runs, as an NVR would
+      start = next = bench_now();
+      cpu = thread_cpu_us();
+      while (bench_now() - start < (int64_t)seconds * 1000000)
+      {
+         feed_frame(&feeder, slice);
+         frames++;
+         next += 1000000 / fps;
+         bench_sleep_until(next);
+      }
+      cpu = thread_cpu_us() - cpu;
+      elapsed = bench_now() - start;
+
+      for (int i = 0; i < clients; i++)
+      {
+         __atomic_store_n(&test[i].quit, 1, __ATOMIC_RELEASE);
+         pthread_join(test[i].thread, NULL);
+
+         if (!test[i].joined || test[i].join_time < 0)
+         {
+            fprintf(stderr, "client %d of %d never got a picture\n", i + 1, clients);
+            failed = 1;
+         }
+         if (test[i].join_time > join_max)
+            join_max = test[i].join_time;
+         bytes += test[i].bytes;
+         lost += test[i].lost;
+         corrupt += test[i].corrupt;
+         memcpy(latencies + num_latencies, test[i].latencies, sizeof(int64_t) * test[i].num_latencies);
+         num_latencies += test[i].num_latencies;
+         free(test[i].nal);
+         free(test[i].latencies);
+      }
+      if (corrupt)
+         failed = 1;
+
+      cpu_per_second[s] = cpu * 1000000 / elapsed;
+      if (base_cpu < 0)
+         base_cpu = cpu_per_second[s];
+
+      printf("%7d %9.2f %7.2f%% %9.1f %7.1fms %7lldus %7lldus %7lldus %7llu %7llu\n", clients,
+             bytes * 8.0 / elapsed, cpu * 100.0 / elapsed, (double)cpu / frames, join_max / 1000.0,
+             (long long)bench_percentile(latencies, num_latencies, 50),
+             (long long)bench_percentile(latencies, num_latencies, 99),
+             (long long)bench_percentile(latencies, num_latencies, 100),
+             (unsigned long long)lost, (unsigned long long)corrupt);
+      fflush(stdout);
+
+      free(test);
+      free(latencies);
+
+      // Let the server notice the teardowns before the next step
+      usleep(300000);
+   }
+
+   printf("\nfeeder cpu %.2f ms/s with no clients, %.3f ms/s more per client\n", base_cpu / 1000.0,
+          (cpu_per_second[num_steps - 1] - base_cpu) / 1000.0 / max_clients);
+   printf("%llu RTP packets made, %llu sent (%.2f per packet), %llu dropped\n",
+          (unsigned long long)feeder.stream->packets, (unsigned long long)feeder.stream->sends,
+          feeder.stream->packets ? (double)feeder.stream->sends / feeder.stream->packets : 0.0,
+          (unsigned long long)feeder.stream->dropped);
+   printf("%llu IDRs, %llu of them asked for by the server in %llu requests\n",
+          (unsigned long long)feeder.idrs, (unsigned long long)feeder.requested_idrs,
+          (unsigned long long)feeder.stream->keyframe_requests);
+
+   rtsp_server_destroy(&server);
+   free(feeder.buffer);
+   free(slice);
+
+   printf("%s\n", failed ? "FAIL" : "PASS");
+   return failed;
+}
@@ -0,0 +1,1057 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "rtsp_server.h"
+#include "clock_now.h"
+
+/// First port tried for the server's RTP/RTCP pair
+#define RTSP_RTP_PORT_BASE       6970
+
+/// Dynamic payload type the SDP maps to H.264
+#define RTSP_PAYLOAD_TYPE        96
+
+/// H.264 NAL unit types the packetiser cares about
+#define NAL_TYPE_IDR             5
+#define NAL_TYPE_SPS             7
+#define NAL_TYPE_PPS             8
+#define NAL_TYPE_FU_A            28
+
+/// Most NAL unit bytes carried by one FU-A fragment, after its two header bytes
+#define RTSP_MAX_FRAGMENT        (RTSP_MAX_PAYLOAD - 2)
+
+/// Time the server thread waits in poll, so it notices stop and timeouts (ms)
+#define RTSP_POLL_INTERVAL       250
+
+static double clients_playing(void *userdata)
+{
+   RTSP_SERVER *server = (RTSP_SERVER *)userdata;
+   int playing = 0;
+
+   for (int i = 0; i < server->num_streams; i++)
+      playing += __atomic_load_n(&server->streams[i].num_playing, __ATOMIC_RELAXED);
+   return playing;
+}
+
+static double packets_sent(void *userdata)
+{
+   RTSP_SERVER *server = (RTSP_SERVER *)userdata;
+   uint64_t sends = 0;
+
+   for (int i = 0; i < server->num_streams; i++)
+      sends += __atomic_load_n(&server->streams[i].sends, __ATOMIC_RELAXED);
+   return (double)sends;
+}
+
+static double packets_dropped(void *userdata)
+{
+   RTSP_SERVER *server = (RTSP_SERVER *)userdata;
+   uint64_t dropped = 0;
+
+   for (int i = 0; i < server->num_streams; i++)
+      dropped += __atomic_load_n(&server->streams[i].dropped, __ATOMIC_RELAXED);
+   return (double)dropped;
+}
+
+static double keyframe_requests(void *userdata)
+{
+   RTSP_SERVER *server = (RTSP_SERVER *)userdata;
+   uint64_t requests = 0;
+
+   for (int i = 0; i < server->num_streams; i++)
+      requests += __atomic_load_n(&server->streams[i].keyframe_requests, __ATOMIC_RELAXED);
+   return (double)requests;
+}
+
+static void register_metrics(RTSP_SERVER *server)
+{
+   server->callback_metrics[0] = metrics_callback("rtsp_clients", "RTSP clients playing a stream",
+                                                  NULL, METRIC_GAUGE, clients_playing, server);
+   server->callback_metrics[1] = metrics_callback("rtsp_packets_sent_total", "RTP packets sent, one per client",
+                                                  NULL, METRIC_COUNTER, packets_sent, server);
+   server->callback_metrics[2] = metrics_callback("rtsp_packets_dropped_total", "RTP packets a client's socket had no room for",
+                                                  NULL, METRIC_COUNTER, packets_dropped, server);
+   server->callback_metrics[3] = metrics_callback("rtsp_keyframe_requests_total", "IDRs asked of the encoders for clients",
+                                                  NULL, METRIC_COUNTER, keyframe_requests, server);
+}
+
+/**
+ * Bind a UDP socket to a port on every interface
+ *
+ * @return the socket, or -1 if the port is taken
+ */
+static int bind_udp(int port)
+{
+   struct sockaddr_in address;
+   int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+   if (fd < 0)
+      return -1;
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_ANY);
+   address.sin_port = htons(port);
+   if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/**
+ * Set up the server's sockets. Nothing is answered until rtsp_server_start.
+ *
+ * @param port RTSP port to listen on, RTSP_DEFAULT_PORT usually
+ * @return 0 on success, -1 on failure
+ */
+int rtsp_server_init(RTSP_SERVER *server, int port)
+{
+   struct sockaddr_in address;
+   int one = 1, sndbuf = 1024 * 1024;
+
+   memset(server, 0, sizeof(*server));
+   server->port = port;
+   server->rtp_socket = server->rtcp_socket = -1;
+   server->next_session = 0x10000000 | (rand() & 0x0fffffff);
+   for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+      server->clients[i].fd = -1;
+
+   server->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+   if (server->listener < 0)
+      goto error;
+   setsockopt(server->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_ANY);
+   address.sin_port = htons(port);
+   if (bind(server->listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+       listen(server->listener, RTSP_MAX_CLIENTS) != 0)
+   {
+      fprintf(stderr, "Unable to listen for RTSP on port %d: %s\n", port, strerror(errno));
+      goto error;
+   }
+
+   // RTP on an even port and RTCP on the one after, as clients expect
+   for (int rtp = RTSP_RTP_PORT_BASE; rtp < RTSP_RTP_PORT_BASE + 100; rtp += 2)
+   {
+      if ((server->rtp_socket = bind_udp(rtp)) < 0)
+         continue;
+      if ((server->rtcp_socket = bind_udp(rtp + 1)) >= 0)
+      {
+         server->rtp_port = rtp;
+         break;
+      }
+      close(server->rtp_socket);
+      server->rtp_socket = -1;
+   }
+   if (server->rtp_socket < 0)
+   {
+      fprintf(stderr, "No free UDP port pair for RTP\n");
+      goto error;
+   }
+
+   // Room for an IDR going to several clients at once
+   setsockopt(server->rtp_socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+   register_metrics(server);
+   return 0;
+
+error:
+   if (server->listener >= 0)
+      close(server->listener);
+   if (server->rtp_socket >= 0)
+      close(server->rtp_socket);
+   server->listener = server->rtp_socket = -1;
+   return -1;
+}
+
+/**
+ * Add a camera's stream, served at rtsp://host:port/name
+ *
+ * @param request_keyframe Asks the encoder for an IDR, called from
+ *    rtsp_stream_packet's thread so it must not block
+ * @return the stream to hand packets to, NULL if there are too many
+ */
+RTSP_STREAM *rtsp_server_add_stream(RTSP_SERVER *server, const char *name,
+                                    RTSP_KEYFRAME_CALLBACK request_keyframe, void *userdata)
+{
+   RTSP_STREAM *stream;
+
+   if (server->num_streams == RTSP_MAX_STREAMS || server->thread_running)
+      return NULL;
+
+   stream = &server->streams[server->num_streams];
+   memset(stream, 0, sizeof(*stream));
+   snprintf(stream->name, sizeof(stream->name), "%s", name);
+   stream->request_keyframe = request_keyframe;
+   stream->userdata = userdata;
+   stream->ssrc = (uint32_t)rand() ^ ((uint32_t)server->num_streams << 24);
+   stream->sequence = (uint16_t)rand();
+   stream->frame_start = 1;
+   stream->last_request = -(int64_t)RTSP_KEYFRAME_HOLDOFF * 1000;
+   pthread_mutex_init(&stream->lock, NULL);
+
+   server->num_streams++;
+   return stream;
+}
+
+/**
+ * Ask for an IDR if a client is waiting on one and the encoder wasn't
+ * asked too recently. Stream locked.
+ */
+static void request_keyframe(RTSP_STREAM *stream, int64_t now)
+{
+   if (!__atomic_load_n(&stream->keyframe_wanted, __ATOMIC_ACQUIRE) ||
+       now - stream->last_request < (int64_t)RTSP_KEYFRAME_HOLDOFF * 1000)
+      return;
+
+   stream->last_request = now;
+   __atomic_add_fetch(&stream->keyframe_requests, 1, __ATOMIC_RELAXED);
+   if (stream->request_keyframe)
+      stream->request_keyframe(stream->userdata);
+}
+
+/**
+ * Send one RTP packet to every playing client. The header is built once,
+ * the payload is gathered from wherever it lies.
+ *
+ * @param payload Payload pieces, iov[0] is left for the RTP header
+ * @param count Entries used in payload including iov[0]
+ * @param joinable Packet starts an SPS or IDR, waiting clients may start here
+ * @param marker Last packet of an access unit
+ */
+static void send_packet(RTSP_SERVER *server, RTSP_STREAM *stream, struct iovec *payload, int count,
+                        int joinable, int marker)
+{
+   uint8_t header[12];
+   struct msghdr msg;
+
+   header[0] = 0x80;
+   header[1] = (marker ? 0x80 : 0) | RTSP_PAYLOAD_TYPE;
+   header[2] = stream->sequence >> 8;
+   header[3] = stream->sequence & 0xff;
+   header[4] = stream->timestamp >> 24;
+   header[5] = (stream->timestamp >> 16) & 0xff;
+   header[6] = (stream->timestamp >> 8) & 0xff;
+   header[7] = stream->timestamp & 0xff;
+   header[8] = stream->ssrc >> 24;
+   header[9] = (stream->ssrc >> 16) & 0xff;
+   header[10] = (stream->ssrc >> 8) & 0xff;
+   header[11] = stream->ssrc & 0xff;
+   payload[0].iov_base = header;
+   payload[0].iov_len = sizeof(header);
+
+   stream->sequence++;
+   __atomic_add_fetch(&stream->packets, 1, __ATOMIC_RELAXED);
+
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = payload;
+   msg.msg_iovlen = count;
+
+   for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+   {
+      RTSP_DESTINATION *destination = &stream->destinations[i];
+
+      if (!destination->active)
+         continue;
+      if (destination->waiting_keyframe)
+      {
+         if (!joinable)
+            continue;
+         destination->waiting_keyframe = 0;
+      }
+
+      msg.msg_name = &destination->address;
+      msg.msg_namelen = destination->address_length;
+      if (sendmsg(server->rtp_socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+      {
+         destination->packets++;
+         __atomic_add_fetch(&stream->sends, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      // A gap would smear the picture until the next IDR anyway, so
+      // stop there and ask for the IDR now
+      destination->dropped++;
+      __atomic_add_fetch(&stream->dropped, 1, __ATOMIC_RELAXED);
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      {
+         destination->waiting_keyframe = 1;
+         __atomic_store_n(&stream->keyframe_wanted, 1, __ATOMIC_RELEASE);
+      }
+   }
+}
+
+/**
+ * Keep an SPS or PPS for the SDP
+ */
+static void keep_parameter_set(RTSP_STREAM *stream, const struct iovec *nal, int count)
+{
+   int type = ((const uint8_t *)nal[0].iov_base)[0] & 0x1f;
+   uint8_t *set = type == NAL_TYPE_SPS ? stream->sps : stream->pps;
+   size_t *length = type == NAL_TYPE_SPS ? &stream->sps_length : &stream->pps_length;
+   size_t total = 0;
+
+   for (int i = 0; i < count; i++)
+      total += nal[i].iov_len;
+   if (total > RTSP_MAX_PARAMETER_SET)
+      return;
+
+   total = 0;
+   for (int i = 0; i < count; i++)
+   {
+      memcpy(set + total, nal[i].iov_base, nal[i].iov_len);
+      total += nal[i].iov_len;
+   }
+   *length = total;
+}
+
+/**
+ * Carry the open NAL unit on with more of its bytes. Whole fragments go
+ * out as they fill, straight from the encoder's buffer. What is left over
+ * is either the NAL unit's last packet, if its end is known, or held back
+ * in pending until the next buffer says whether it is.
+ *
+ * @param data NAL unit bytes after its header
+ * @param ends NAL unit ends with these bytes
+ * @param marker Its end is the end of an access unit
+ */
+static void carry_nal(RTSP_SERVER *server, RTSP_STREAM *stream, const uint8_t *data, size_t length,
+                      int ends, int marker)
+{
+   int type = stream->nal_header & 0x1f;
+   int joinable = type == NAL_TYPE_SPS || (type == NAL_TYPE_IDR && stream->nal_first);
+   uint8_t fu[2] = { (stream->nal_header & 0xe0) | NAL_TYPE_FU_A, type };
+   struct iovec iov[4];
+
+   while (stream->pending_length + length > RTSP_MAX_FRAGMENT)
+   {
+      size_t take = RTSP_MAX_FRAGMENT - stream->pending_length;
+      int count = 1;
+
+      fu[1] = type | (stream->nal_sent ? 0 : 0x80);
+      iov[count].iov_base = fu;
+      iov[count++].iov_len = 2;
+      if (stream->pending_length)
+      {
+         iov[count].iov_base = stream->pending;
+         iov[count++].iov_len = stream->pending_length;
+      }
+      iov[count].iov_base = (void *)data;
+      iov[count++].iov_len = take;
+      send_packet(server, stream, iov, count, joinable && !stream->nal_sent, 0);
+
+      stream->nal_sent = 1;
+      stream->pending_length = 0;
+      data += take;
+      length -= take;
+   }
+
+   if (!ends)
+   {
+      memcpy(stream->pending + stream->pending_length, data, length);
+      stream->pending_length += length;
+      return;
+   }
+
+   if (!stream->nal_sent)
+   {
+      // Small enough for a single NAL unit packet
+      int count = 1;
+
+      iov[count].iov_base = &stream->nal_header;
+      iov[count++].iov_len = 1;
+      if (stream->pending_length)
+      {
+         iov[count].iov_base = stream->pending;
+         iov[count++].iov_len = stream->pending_length;
+      }
+      if (length)
+      {
+         iov[count].iov_base = (void *)data;
+         iov[count++].iov_len = length;
+      }
+      if (type == NAL_TYPE_SPS || type == NAL_TYPE_PPS)
+         keep_parameter_set(stream, iov + 1, count - 1);
+      send_packet(server, stream, iov, count, joinable, marker);
+   }
+   else
+   {
+      int count = 1;
+
+      fu[1] = type | 0x40;
+      iov[count].iov_base = fu;
+      iov[count++].iov_len = 2;
+      if (stream->pending_length)
+      {
+         iov[count].iov_base = stream->pending;
+         iov[count++].iov_len = stream->pending_length;
+      }
+      if (length)
+      {
+         iov[count].iov_base = (void *)data;
+         iov[count++].iov_len = length;
+      }
+      send_packet(server, stream, iov, count, 0, marker);
+   }
+
+   stream->nal_open = 0;
+   stream->pending_length = 0;
+}
+
+/**
+ * Find the next Annex B start code
+ *
+ * @param size Set to the start code's length, 3 or 4
+ * @return offset of the start code, or length if there is none
+ */
+static size_t find_start_code(const uint8_t *data, size_t length, size_t from, size_t *size)
+{
+   for (size_t i = from; i + 3 <= length; i++)
+   {
+      if (data[i + 2] > 1)
+      {
+         i += 2;
+         continue;
+      }
+      if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+      {
+         if (i > from && data[i - 1] == 0)
+         {
+            *size = 4;
+            return i - 1;
+         }
+         *size = 3;
+         return i;
+      }
+   }
+   *size = 0;
+   return length;
+}
+
+/**
+ * Hand a buffer of the encoder's Annex B output to the stream's clients.
+ * A buffer either starts with a start code or carries on the NAL unit the
+ * last one ended in, and nothing is copied except the tail of a NAL unit
+ * whose end is still unknown. Call from one thread, the encoder's.
+ *
+ * @param data Encoded data
+ * @param length Bytes of data
+ * @param flags RTSP_FLAG_ values
+ * @param now Time the data was encoded (us), gives the RTP timestamp
+ */
+void rtsp_stream_packet(RTSP_SERVER *server, RTSP_STREAM *stream, const uint8_t *data, size_t length,
+                        int flags, int64_t now)
+{
+   int frame_end = (flags & RTSP_FLAG_FRAME_END) != 0;
+   size_t pos, size, next;
+
+   pthread_mutex_lock(&stream->lock);
+
+   request_keyframe(stream, now);
+
+   pos = find_start_code(data, length, 0, &size);
+   if (stream->nal_open)
+   {
+      // Anything before the first start code belongs to the open NAL unit
+      carry_nal(server, stream, data, pos, pos < length || frame_end, pos == length && frame_end);
+   }
+
+   while (pos < length)
+   {
+      const uint8_t *nal = data + pos + size;
+
+      next = find_start_code(data, length, pos + size, &size);
+      if (nal == data + next)
+      {
+         pos = next;
+         continue;
+      }
+
+      stream->nal_open = 1;
+      stream->nal_header = nal[0];
+      stream->nal_sent = 0;
+      stream->nal_first = stream->frame_start;
+      stream->pending_length = 0;
+      if (stream->frame_start)
+      {
+         // 90kHz clock, all of an access unit's packets share a timestamp
+         stream->timestamp = (uint32_t)(now * 9 / 100);
+         stream->frame_start = 0;
+      }
+      if ((nal[0] & 0x1f) == NAL_TYPE_IDR || (nal[0] & 0x1f) == NAL_TYPE_SPS)
+         __atomic_store_n(&stream->keyframe_wanted, 0, __ATOMIC_RELEASE);
+
+      carry_nal(server, stream, nal + 1, data + next - nal - 1, next < length || frame_end,
+                next == length && frame_end);
+      pos = next;
+   }
+
+   if (frame_end)
+      stream->frame_start = 1;
+
+   pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ * Find the stream a request URL names, rtsp://host[:port]/name[/track]
+ */
+static RTSP_STREAM *find_stream(RTSP_SERVER *server, const char *url)
+{
+   const char *path = url, *end;
+
+   if (strncasecmp(path, "rtsp://", 7) == 0)
+   {
+      path = strchr(path + 7, '/');
+      if (!path)
+         return NULL;
+   }
+   while (*path == '/')
+      path++;
+   end = path + strcspn(path, "/?");
+
+   for (int i = 0; i < server->num_streams; i++)
+      if (strlen(server->streams[i].name) == (size_t)(end - path) &&
+          strncmp(server->streams[i].name, path, end - path) == 0)
+         return &server->streams[i];
+   return NULL;
+}
+
+/**
+ * Value of a request header, NULL if it isn't there
+ *
+ * @param value Buffer for the value
+ */
+static const char *find_header(const char *request, const char *name, char *value, size_t size)
+{
+   size_t name_length = strlen(name);
+   const char *line = strstr(request, "\r\n");
+
+   while (line && line[2] != '\r')
+   {
+      line += 2;
+      if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':')
+      {
+         const char *start = line + name_length + 1, *end = strstr(start, "\r\n");
+
+         while (*start == ' ' || *start == '\t')
+            start++;
+         snprintf(value, size, "%.*s", (int)(end - start), start);
+         return value;
+      }
+      line = strstr(line, "\r\n");
+   }
+   return NULL;
+}
+
+static void write_base64(char *out, const uint8_t *data, size_t length)
+{
+   static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+   for (size_t i = 0; i < length; i += 3)
+   {
+      uint32_t bits = (uint32_t)data[i] << 16;
+
+      if (i + 1 < length)
+         bits |= data[i + 1] << 8;
+      if (i + 2 < length)
+         bits |= data[i + 2];
+      *out++ = digits[(bits >> 18) & 0x3f];
+      *out++ = digits[(bits >> 12) & 0x3f];
+      *out++ = i + 1 < length ? digits[(bits >> 6) & 0x3f] : '=';
+      *out++ = i + 2 < length ? digits[bits & 0x3f] : '=';
+   }
+   *out = 0;
+}
+
+/**
+ * Session description for DESCRIBE. The parameter sets go in the SDP
+ * once the encoder has produced them, clients get them in band anyway.
+ */
+static int format_sdp(RTSP_STREAM *stream, const RTSP_CLIENT *client, char *sdp, size_t size)
+{
+   char host[INET6_ADDRSTRLEN] = "0.0.0.0";
+   char fmtp[256] = "";
+   struct sockaddr_in local;
+   socklen_t local_length = sizeof(local);
+
+   if (getsockname(client->fd, (struct sockaddr *)&local, &local_length) == 0 && local.sin_family == AF_INET)
+      inet_ntop(AF_INET, &local.sin_addr, host, sizeof(host));
+
+   pthread_mutex_lock(&stream->lock);
+   if (stream->sps_length >= 4 && stream->pps_length)
+   {
+      char sps[RTSP_MAX_PARAMETER_SET * 4 / 3 + 4], pps[RTSP_MAX_PARAMETER_SET * 4 / 3 + 4];
+
+      write_base64(sps, stream->sps, stream->sps_length);
+      write_base64(pps, stream->pps, stream->pps_length);
+      snprintf(fmtp, sizeof(fmtp), ";profile-level-id=%02X%02X%02X;sprop-parameter-sets=%s,%s",
+               stream->sps[1], stream->sps[2], stream->sps[3], sps, pps);
+   }
+   pthread_mutex_unlock(&stream->lock);
+
+   return snprintf(sdp, size,
+                   "v=0\r\n"
+                   "o=- %d 1 IN IP4 %s\r\n"
+                   "s=%s\r\n"
+                   "c=IN IP4 0.0.0.0\r\n"
+                   "t=0 0\r\n"
+                   "a=control:*\r\n"
+                   "m=video 0 RTP/AVP %d\r\n"
+                   "a=rtpmap:%d H264/90000\r\n"
+                   "a=fmtp:%d packetization-mode=1%s\r\n"
+                   "a=control:track0\r\n",
+                   (int)(stream->ssrc & 0x7fffffff), host, stream->name,
+                   RTSP_PAYLOAD_TYPE, RTSP_PAYLOAD_TYPE, RTSP_PAYLOAD_TYPE, fmtp);
+}
+
+/**
+ * Start or stop sending a client's stream its RTP
+ */
+static void set_playing(RTSP_CLIENT *client, int playing)
+{
+   RTSP_STREAM *stream = client->stream;
+   RTSP_DESTINATION *destination = NULL;
+
+   if (!stream)
+      return;
+
+   pthread_mutex_lock(&stream->lock);
+   for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+   {
+      if (stream->destinations[i].active && stream->destinations[i].session == client->session)
+      {
+         destination = &stream->destinations[i];
+         break;
+      }
+   }
+
+   if (playing && !destination)
+   {
+      for (int i = 0; i < RTSP_MAX_CLIENTS && !destination; i++)
+         if (!stream->destinations[i].active)
+            destination = &stream->destinations[i];
+
+      if (destination)
+      {
+         memset(destination, 0, sizeof(*destination));
+         destination->active = 1;
+         destination->session = client->session;
+         destination->waiting_keyframe = 1;
+         memcpy(&destination->address, &client->peer, client->peer_length);
+         destination->address_length = client->peer_length;
+         ((struct sockaddr_in *)&destination->address)->sin_port = htons(client->rtp_port);
+         __atomic_add_fetch(&stream->num_playing, 1, __ATOMIC_RELAXED);
+
+         // Joining at the next scheduled IDR could be seconds off
+         __atomic_store_n(&stream->keyframe_wanted, 1, __ATOMIC_RELEASE);
+      }
+   }
+   else if (!playing && destination)
+   {
+      destination->active = 0;
+      __atomic_sub_fetch(&stream->num_playing, 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&stream->lock);
+}
+
+static void close_client(RTSP_CLIENT *client)
+{
+   set_playing(client, 0);
+   close(client->fd);
+   client->fd = -1;
+   client->stream = NULL;
+   client->session = 0;
+}
+
+static void send_response(RTSP_CLIENT *client, int status, const char *reason, const char *cseq,
+                          const char *headers, const char *body)
+{
+   char response[4096];
+   int length;
+
+   length = snprintf(response, sizeof(response), "RTSP/1.0 %d %s\r\nCSeq: %s\r\nServer: camera\r\n%s",
+                     status, reason, cseq ? cseq : "0", headers ? headers : "");
+   if (body)
+      length += snprintf(response + length, sizeof(response) - length,
+                         "Content-Type: application/sdp\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+   else
+      length += snprintf(response + length, sizeof(response) - length, "\r\n");
+
+   // Replies are small and the client is waiting on them, a blocking send is fine
+   if (length > 0 && (size_t)length < sizeof(response))
+      send(client->fd, response, length, MSG_NOSIGNAL);
+}
+
+/**
+ * Answer one request. Only RTP over UDP unicast is offered.
+ */
+static void handle_request(RTSP_SERVER *server, RTSP_CLIENT *client)
+{
+   char method[16], url[256], cseq[16], value[256], headers[512];
+   const char *have_cseq;
+   RTSP_STREAM *stream;
+   int session = 0;
+
+   if (sscanf(client->request, "%15s %255s", method, url) != 2)
+   {
+      send_response(client, 400, "Bad Request", NULL, NULL, NULL);
+      return;
+   }
+   have_cseq = find_header(client->request, "CSeq", cseq, sizeof(cseq));
+   if (find_header(client->request, "Session", value, sizeof(value)))
+      session = (int)strtoul(value, NULL, 16);
+
+   if (strcmp(method, "OPTIONS") == 0)
+   {
+      send_response(client, 200, "OK", have_cseq,
+                    "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n", NULL);
+      return;
+   }
+
+   if (strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0)
+   {
+      // Keepalive
+      send_response(client, 200, "OK", have_cseq, NULL, NULL);
+      return;
+   }
+
+   if (strcmp(method, "DESCRIBE") == 0)
+   {
+      char sdp[1024];
+
+      if (!(stream = find_stream(server, url)))
+      {
+         send_response(client, 404, "Not Found", have_cseq, NULL, NULL);
+         return;
+      }
+      format_sdp(stream, client, sdp, sizeof(sdp));
+      snprintf(headers, sizeof(headers), "Content-Base: %s%s\r\n", url, url[strlen(url) - 1] == '/' ? "" : "/");
+      send_response(client, 200, "OK", have_cseq, headers, sdp);
+      return;
+   }
+
+   if (strcmp(method, "SETUP") == 0)
+   {
+      const char *client_port;
+      int rtp_port;
+
+      if (!(stream = find_stream(server, url)))
+      {
+         send_response(client, 404, "Not Found", have_cseq, NULL, NULL);
+         return;
+      }
+      if (!find_header(client->request, "Transport", value, sizeof(value)) ||
+          strstr(value, "RTP/AVP/TCP") || strstr(value, "multicast") ||
+          !(client_port = strstr(value, "client_port=")) ||
+          (rtp_port = atoi(client_port + 12)) <= 0 || client->peer.ss_family != AF_INET)
+      {
+         send_response(client, 461, "Unsupported Transport", have_cseq, NULL, NULL);
+         return;
+      }
+      if (client->session && session != client->session)
+      {
+         send_response(client, 459, "Aggregate Operation Not Allowed", have_cseq, NULL, NULL);
+         return;
+      }
+
+      set_playing(client, 0);
+      client->stream = stream;
+      client->rtp_port = rtp_port;
+      if (!client->session)
+         client->session = server->next_session++;
+
+      snprintf(headers, sizeof(headers),
+               "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\n"
+               "Session: %08X;timeout=%d\r\n",
+               rtp_port, rtp_port + 1, server->rtp_port, server->rtp_port + 1, stream->ssrc,
+               client->session, RTSP_SESSION_TIMEOUT);
+      send_response(client, 200, "OK", have_cseq, headers, NULL);
+      return;
+   }
+
+   if (strcmp(method, "PLAY") == 0 || strcmp(method, "PAUSE") == 0 || strcmp(method, "TEARDOWN") == 0)
+   {
+      if (!client->session || session != client->session)
+      {
+         send_response(client, 454, "Session Not Found", have_cseq, NULL, NULL);
+         return;
+      }
+
+      if (method[1] == 'L')
+      {
+         uint16_t sequence;
+         uint32_t timestamp;
+         int slash = url[strlen(url) - 1] == '/';
+
+         set_playing(client, 1);
+         pthread_mutex_lock(&client->stream->lock);
+         sequence = client->stream->sequence;
+         timestamp = client->stream->timestamp;
+         pthread_mutex_unlock(&client->stream->lock);
+
+         // PLAY may name the aggregate or the track, RTP-Info names the track
+         snprintf(headers, sizeof(headers),
+                  "Session: %08X;timeout=%d\r\nRange: npt=0.000-\r\nRTP-Info: url=%s%s;seq=%u;rtptime=%u\r\n",
+                  client->session, RTSP_SESSION_TIMEOUT, url,
+                  strstr(url, "/track0") ? "" : slash ? "track0" : "/track0", sequence, timestamp);
+         send_response(client, 200, "OK", have_cseq, headers, NULL);
+      }
+      else
+      {
+         set_playing(client, 0);
+         snprintf(headers, sizeof(headers), "Session: %08X\r\n", client->session);
+         send_response(client, 200, "OK", have_cseq, headers, NULL);
+         if (method[0] == 'T')
+         {
+            client->stream = NULL;
+            client->session = 0;
+         }
+      }
+      return;
+   }
+
+   send_response(client, 501, "Not Implemented", have_cseq, NULL, NULL);
+}
+
+/**
+ * Read what a control connection has sent and answer any whole requests
+ *
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int read_client(RTSP_SERVER *server, RTSP_CLIENT *client, int64_t now)
+{
+   ssize_t got = recv(client->fd, client->request + client->request_length,
+                      sizeof(client->request) - 1 - client->request_length, 0);
+
+   if (got <= 0)
+      return got < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+   client->request_length += got;
+   client->request[client->request_length] = 0;
+   client->last_seen = now;
+
+   for (;;)
+   {
+      char *end = strstr(client->request, "\r\n\r\n"), value[16];
+      size_t length;
+
+      if (!end)
+         break;
+      length = end + 4 - client->request;
+      if (find_header(client->request, "Content-Length", value, sizeof(value)))
+         length += strtoul(value, NULL, 10);
+      if (length > client->request_length)
+         break;
+
+      // Ends the request after its last header line
+      end[2] = 0;
+      handle_request(server, client);
+
+      memmove(client->request, client->request + length, client->request_length - length + 1);
+      client->request_length -= length;
+   }
+
+   // A request that doesn't fit is never going to be answered
+   return client->request_length == sizeof(client->request) - 1 ? -1 : 0;
+}
+
+static void accept_client(RTSP_SERVER *server, int64_t now)
+{
+   struct sockaddr_storage peer;
+   socklen_t peer_length = sizeof(peer);
+   int fd = accept4(server->listener, (struct sockaddr *)&peer, &peer_length, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+   if (fd < 0)
+      return;
+
+   for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+   {
+      RTSP_CLIENT *client = &server->clients[i];
+
+      if (client->fd >= 0)
+         continue;
+      memset(client, 0, sizeof(*client));
+      client->fd = fd;
+      client->peer = peer;
+      client->peer_length = peer_length;
+      client->last_seen = now;
+      return;
+   }
+   close(fd);
+}
+
+/**
+ * Read RTCP from clients. Any report keeps the sender's session alive,
+ * PLI and FIR ask for an IDR.
+ */
+static void read_rtcp(RTSP_SERVER *server, int64_t now)
+{
+   uint8_t packet[1500];
+   struct sockaddr_in from;
+   socklen_t from_length;
+   ssize_t got;
+
+   for (;;)
+   {
+      from_length = sizeof(from);
+      got = recvfrom(server->rtcp_socket, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_length);
+      if (got < 0)
+         break;
+
+      for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+      {
+         RTSP_CLIENT *client = &server->clients[i];
+         const struct sockaddr_in *peer = (const struct sockaddr_in *)&client->peer;
+
+         if (client->fd >= 0 && client->stream && peer->sin_addr.s_addr == from.sin_addr.s_addr &&
+             client->rtp_port + 1 == ntohs(from.sin_port))
+            client->last_seen = now;
+      }
+
+      for (ssize_t pos = 0; pos + 4 <= got; )
+      {
+         size_t length = ((size_t)packet[pos + 2] << 8 | packet[pos + 3]) * 4 + 4;
+         int fmt = packet[pos] & 0x1f;
+
+         if ((packet[pos] & 0xc0) != 0x80 || pos + (ssize_t)length > got)
+            break;
+
+         // Payload specific feedback, PLI or FIR, names the stream's SSRC
+         if (packet[pos + 1] == 206 && (fmt == 1 || fmt == 4) && length >= 12)
+         {
+            uint32_t ssrc = (uint32_t)packet[pos + 8] << 24 | packet[pos + 9] << 16 |
+                            packet[pos + 10] << 8 | packet[pos + 11];
+
+            for (int s = 0; s < server->num_streams; s++)
+               if (server->streams[s].ssrc == ssrc)
+                  __atomic_store_n(&server->streams[s].keyframe_wanted, 1, __ATOMIC_RELEASE);
+         }
+         pos += length;
+      }
+   }
+}
+
+static void *server_thread(void *arg)
+{
+   RTSP_SERVER *server = (RTSP_SERVER *)arg;
+   struct pollfd pfd[3 + RTSP_MAX_CLIENTS];
+   int client_index[RTSP_MAX_CLIENTS];
+
+   while (!__atomic_load_n(&server->quit, __ATOMIC_ACQUIRE))
+   {
+      int num = 3, clients = 0;
+      int64_t now;
+
+      pfd[0].fd = server->listener;
+      pfd[1].fd = server->rtcp_socket;
+      pfd[2].fd = server->rtp_socket;
+      for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+      {
+         if (server->clients[i].fd < 0)
+            continue;
+         client_index[clients++] = i;
+         pfd[num++].fd = server->clients[i].fd;
+      }
+      for (int i = 0; i < num; i++)
+         pfd[i].events = POLLIN;
+
+      if (poll(pfd, num, RTSP_POLL_INTERVAL) < 0 && errno != EINTR)
+         break;
+      now = clock_now_us();
+
+      if (pfd[0].revents & POLLIN)
+         accept_client(server, now);
+      if (pfd[1].revents & POLLIN)
+         read_rtcp(server, now);
+      if (pfd[2].revents & POLLIN)
+      {
+         // Nothing is expected on the RTP port, NAT keepalives are thrown away
+         uint8_t discard[1500];
+
+         while (recv(server->rtp_socket, discard, sizeof(discard), 0) >= 0)
+            ;
+      }
+
+      for (int i = 0; i < clients; i++)
+      {
+         RTSP_CLIENT *client = &server->clients[client_index[i]];
+
+         if ((pfd[3 + i].revents & (POLLIN | POLLHUP | POLLERR)) && read_client(server, client, now) != 0)
+            close_client(client);
+         else if (now - client->last_seen > (int64_t)RTSP_SESSION_TIMEOUT * 1000000)
+            close_client(client);
+      }
+   }
+   return NULL;
+}
+
+/**
+ * Start answering RTSP requests
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int rtsp_server_start(RTSP_SERVER *server)
+{
+   server->quit = 0;
+   if (pthread_create(&server->thread, NULL, server_thread, server) != 0)
+      return -1;
+   server->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Stop answering requests and drop every client. Packets handed over
+ * after this go nowhere.
+ */
+void rtsp_server_stop(RTSP_SERVER *server)
+{
+   if (!server->thread_running)
+      return;
+
+   __atomic_store_n(&server->quit, 1, __ATOMIC_RELEASE);
+   pthread_join(server->thread, NULL);
+   server->thread_running = 0;
+
+   for (int i = 0; i < RTSP_MAX_CLIENTS; i++)
+      if (server->clients[i].fd >= 0)
+         close_client(&server->clients[i]);
+}
+
+void rtsp_server_destroy(RTSP_SERVER *server)
+{
+   rtsp_server_stop(server);
+
+   for (int i = 0; i < (int)(sizeof(server->callback_metrics) / sizeof(server->callback_metrics[0])); i++)
+   {
+      metrics_unregister(server->callback_metrics[i]);
+      server->callback_metrics[i] = NULL;
+   }
+
+   for (int i = 0; i < server->num_streams; i++)
+      pthread_mutex_destroy(&server->streams[i].lock);
+   server->num_streams = 0;
+
+   if (server->listener >= 0)
+      close(server->listener);
+   if (server->rtp_socket >= 0)
+      close(server->rtp_socket);
+   if (server->rtcp_socket >= 0)
+      close(server->rtcp_socket);
+   server->listener = server->rtp_socket = server->rtcp_socket = -1;
+}
@@ -0,0 +1,141 @@
+#ifndef RTSP_SERVER_H_
+#define RTSP_SERVER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+/// Port NVRs usually look for a camera on
+#define RTSP_DEFAULT_PORT        8554
+
+#define RTSP_MAX_STREAMS         4
+#define RTSP_MAX_CLIENTS         16
+
+/// RTP payload per packet, leaves room for IP/UDP/RTP headers in a 1500 byte MTU
+#define RTSP_MAX_PAYLOAD         1400
+
+/// Seconds a client may go without a request or RTCP report before it is dropped
+#define RTSP_SESSION_TIMEOUT     60
+
+/// Shortest time between IDR requests to the encoder, in milliseconds
+#define RTSP_KEYFRAME_HOLDOFF    500
+
+/// Largest SPS/PPS kept for the SDP
+#define RTSP_MAX_PARAMETER_SET   64
+
+/// Packet ends an access unit, the RTP marker bit goes on its last packet
+#define RTSP_FLAG_FRAME_END      (1 << 1)
+
+/** Asks the encoder for an IDR. Called from rtsp_stream_packet with the
+ *  stream locked, so it must only flag the request and return.
+ */
+typedef void (*RTSP_KEYFRAME_CALLBACK)(void *userdata);
+
+/** Where one playing client's RTP goes
+ */
+typedef struct
+{
+   int active;
+   int session;                     /// Client it belongs to
+   struct sockaddr_storage address; /// Client's RTP port
+   socklen_t address_length;
+   int waiting_keyframe;            /// Nothing is sent until the next SPS or IDR
+   uint64_t packets;
+   uint64_t dropped;                /// Packets the socket had no room for
+} RTSP_DESTINATION;
+
+/** One camera's H.264 as an RTSP stream.
+ *  The encoder's Annex B output is packetised once, single NAL or FU-A,
+ *  straight out of the encoder's buffers, and each RTP packet goes to every
+ *  playing client with the same header, so an extra client costs one send
+ *  per packet. Clients join at the next SPS or IDR, and a client that joins
+ *  or loses a packet gets one asked of the encoder.
+ */
+typedef struct
+{
+   char name[16];                   /// rtsp://host:port/name
+   RTSP_KEYFRAME_CALLBACK request_keyframe;
+   void *userdata;
+
+   pthread_mutex_t lock;
+   RTSP_DESTINATION destinations[RTSP_MAX_CLIENTS];
+   int num_playing;
+
+   uint8_t sps[RTSP_MAX_PARAMETER_SET];
+   size_t sps_length;               /// 0 until the encoder has sent one
+   uint8_t pps[RTSP_MAX_PARAMETER_SET];
+   size_t pps_length;
+
+   uint32_t ssrc;
+   uint16_t sequence;               /// Of the next packet
+   uint32_t timestamp;              /// 90kHz time of the current access unit
+   int frame_start;                 /// Next packet starts an access unit
+
+   int nal_open;                    /// A NAL unit continues into the next packet
+   uint8_t nal_header;
+   int nal_first;                   /// Open NAL unit is the first of its access unit
+   int nal_sent;                    /// Some of the open NAL unit has gone out
+   uint8_t pending[RTSP_MAX_PAYLOAD]; /// Unsent end of the open NAL unit, held back in case it is the last fragment
+   size_t pending_length;
+
+   int keyframe_wanted;             /// A client needs an IDR, asked for with the next packet (atomic)
+   int64_t last_request;            /// When the encoder was last asked for one (us)
+
+   uint64_t packets;                /// RTP packets made
+   uint64_t sends;                  /// Packets sent, one per packet per client
+   uint64_t dropped;
+   uint64_t keyframe_requests;
+} RTSP_STREAM;
+
+/** A control connection
+ */
+typedef struct
+{
+   int fd;                          /// -1 if the slot is free
+   int session;                     /// Session id, 0 before SETUP
+   RTSP_STREAM *stream;             /// Stream set up, NULL before SETUP
+   struct sockaddr_storage peer;
+   socklen_t peer_length;
+   int rtp_port;                    /// Client's RTP port, RTCP is the one after
+   char request[2048];
+   size_t request_length;
+   int64_t last_seen;               /// Last request or RTCP report (us)
+} RTSP_CLIENT;
+
+/** Embedded RTSP server, RTP over UDP unicast.
+ *  One thread answers RTSP requests and reads RTCP, the packets
+ *  themselves are sent from whichever thread hands over the encoder output.
+ */
+typedef struct
+{
+   int port;                        /// RTSP_DEFAULT_PORT
+   int listener;
+   int rtp_socket;                  /// Every stream's RTP goes out from here
+   int rtcp_socket;                 /// Port after rtp_socket's, receiver reports and PLI/FIR
+   int rtp_port;
+
+   RTSP_STREAM streams[RTSP_MAX_STREAMS];
+   int num_streams;
+   RTSP_CLIENT clients[RTSP_MAX_CLIENTS];
+   int next_session;
+
+   pthread_t thread;
+   int thread_running;
+   int quit;                        /// (atomic)
+
+   METRIC *callback_metrics[4];     /// Clients, packets, drops and keyframe requests across the streams
+} RTSP_SERVER;
+
+int rtsp_server_init(RTSP_SERVER *server, int port);
+RTSP_STREAM *rtsp_server_add_stream(RTSP_SERVER *server, const char *name,
+                                    RTSP_KEYFRAME_CALLBACK request_keyframe, void *userdata);
+int rtsp_server_start(RTSP_SERVER *server);
+void rtsp_server_stop(RTSP_SERVER *server);
+void rtsp_server_destroy(RTSP_SERVER *server);
+void rtsp_stream_packet(RTSP_SERVER *server, RTSP_STREAM *stream, const uint8_t *data, size_t length,
+                        int flags, int64_t now);
+
+#endif /* RTSP_SERVER_H_ */
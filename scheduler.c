@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+/**
+ * Set up a scheduler, nothing is triggered until scheduler_start
+ *
+ * @param scheduler Scheduler to initialise
+ * @param method One of the FRAME_NEXT_ values
+ * @param interval Timelapse interval in milliseconds
+ * @param timeout Total run time in milliseconds, 0 to run until stopped
+ * @return 0 on success, -1 on failure
+ */
+int scheduler_init(CAPTURE_SCHEDULER *scheduler, int method, int interval, int timeout)
+{
+   pthread_condattr_t attr;
+
+   memset(scheduler, 0, sizeof(*scheduler));
+   scheduler->frameNextMethod = method;
+   scheduler->interval = interval;
+   scheduler->timeout = timeout;
+
+   if (pthread_mutex_init(&scheduler->lock, NULL) != 0)
+      return -1;
+
+   // Timed waits are against the monotonic clock so setting the time doesn't upset a timelapse
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   if (pthread_cond_init(&scheduler->cond, &attr) != 0)
+   {
+      pthread_condattr_destroy(&attr);
+      pthread_mutex_destroy(&scheduler->lock);
+      return -1;
+   }
+   pthread_condattr_destroy(&attr);
+   return 0;
+}
+
+static void add_ms(struct timespec *ts, int ms)
+{
+   ts->tv_sec += ms / 1000;
+   ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+   if (ts->tv_nsec >= 1000000000L)
+   {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000L;
+   }
+}
+
+static int before(const struct timespec *a, const struct timespec *b)
+{
+   return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Thread driving the timed methods. Fires the timelapse triggers and
+ * stops everything once the timeout has expired.
+ */
+static void *timer_thread(void *arg)
+{
+   CAPTURE_SCHEDULER *scheduler = (CAPTURE_SCHEDULER *)arg;
+   struct timespec now, next, end;
+   int timelapse = scheduler->frameNextMethod == FRAME_NEXT_TIMELAPSE;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   end = now;
+   add_ms(&end, scheduler->timeout);
+   next = now;
+
+   pthread_mutex_lock(&scheduler->lock);
+
+   while (!scheduler->stopped)
+   {
+      const struct timespec *wake = &end;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      if (scheduler->timeout && !before(&now, &end))
+      {
+         scheduler->stopped = 1;
+         pthread_cond_broadcast(&scheduler->cond);
+         break;
+      }
+
+      if (timelapse)
+      {
+         if (!before(&now, &next))
+         {
+            scheduler->generation++;
+            pthread_cond_broadcast(&scheduler->cond);
+
+            // Skip any intervals we were too slow for rather than firing a burst
+            while (!before(&now, &next))
+               add_ms(&next, scheduler->interval > 0 ? scheduler->interval : 1);
+         }
+         if (!scheduler->timeout || before(&next, &end))
+            wake = &next;
+      }
+
+      if (!timelapse && !scheduler->timeout)
+         pthread_cond_wait(&scheduler->cond, &scheduler->lock);
+      else
+         pthread_cond_timedwait(&scheduler->cond, &scheduler->lock, wake);
+   }
+
+   pthread_mutex_unlock(&scheduler->lock);
+   return NULL;
+}
+
+/**
+ * Thread for the keypress method, Enter captures, X then Enter captures and exits
+ */
+static void *keypress_thread(void *arg)
+{
+   CAPTURE_SCHEDULER *scheduler = (CAPTURE_SCHEDULER *)arg;
+   int ch;
+
+   for (;;)
+   {
+      if (scheduler->verbose)
+         fprintf(stderr, "Press Enter to capture, X then ENTER to exit\n");
+
+      ch = getchar();
+
+      if (ch == EOF || ch == 'x' || ch == 'X')
+      {
+         scheduler_trigger(scheduler, 1);
+         break;
+      }
+      if (ch == '\n')
+         scheduler_trigger(scheduler, 0);
+   }
+   return NULL;
+}
+
+/**
+ * Start generating triggers for the configured method
+ *
+ * @return 0 on success, -1 if a thread could not be started
+ */
+int scheduler_start(CAPTURE_SCHEDULER *scheduler)
+{
+   void *(*thread_fn)(void *) = NULL;
+
+   switch (scheduler->frameNextMethod)
+   {
+      case FRAME_NEXT_SINGLE :
+         // One capture as soon as the pipelines are ready
+         scheduler_trigger(scheduler, 1);
+         return 0;
+
+      case FRAME_NEXT_GPIO :
+         // Intended for GPIO firing of a capture, not wired up yet
+         scheduler_stop(scheduler);
+         return 0;
+
+      case FRAME_NEXT_KEYPRESS :
+         thread_fn = keypress_thread;
+         break;
+
+      case FRAME_NEXT_TIMELAPSE :
+         thread_fn = timer_thread;
+         break;
+
+      case FRAME_NEXT_FOREVER :
+      case FRAME_NEXT_IMMEDIATELY :
+      case FRAME_NEXT_SIGNAL :
+      case FRAME_NEXT_EVENT :
+         // Triggers come from scheduler_wait/scheduler_trigger, only the timeout needs a thread
+         if (scheduler->timeout)
+            thread_fn = timer_thread;
+         break;
+   }
+
+   if (thread_fn)
+   {
+      if (pthread_create(&scheduler->thread, NULL, thread_fn, scheduler) != 0)
+         return -1;
+      scheduler->thread_running = 1;
+   }
+   return 0;
+}
+
+/**
+ * Wait for the next trigger or wakeup.
+ *
+ * @param scheduler Scheduler to wait on
+ * @param last_generation Generation the caller last captured, updated on return.
+ *                        Left alone if it was only a wakeup.
+ * @param last_wakeup Wakeup the caller last saw, updated on return
+ * @return 1 if there is a trigger or wakeup to handle, 0 once the scheduler is stopped
+ */
+int scheduler_wait(CAPTURE_SCHEDULER *scheduler, unsigned *last_generation, unsigned *last_wakeup)
+{
+   int woken = 0;
+
+   pthread_mutex_lock(&scheduler->lock);
+
+   // Not waiting, just go to next frame
+   if ((scheduler->frameNextMethod == FRAME_NEXT_FOREVER ||
+         scheduler->frameNextMethod == FRAME_NEXT_IMMEDIATELY) && !scheduler->stopped)
+      scheduler->generation++;
+
+   while (scheduler->generation == *last_generation && scheduler->wakeups == *last_wakeup &&
+          !scheduler->stopped)
+      pthread_cond_wait(&scheduler->cond, &scheduler->lock);
+
+   // Once stopped only the outstanding triggers matter
+   if (scheduler->generation != *last_generation)
+   {
+      *last_generation = scheduler->generation;
+      woken = 1;
+   }
+   else if (scheduler->wakeups != *last_wakeup && !scheduler->stopped)
+      woken = 1;
+   *last_wakeup = scheduler->wakeups;
+
+   pthread_mutex_unlock(&scheduler->lock);
+   return woken;
+}
+
+/**
+ * Fire a capture on every pipeline
+ *
+ * @param scheduler Scheduler to trigger
+ * @param last Non zero if this is the final capture
+ */
+void scheduler_trigger(CAPTURE_SCHEDULER *scheduler, int last)
+{
+   pthread_mutex_lock(&scheduler->lock);
+   if (!scheduler->stopped)
+   {
+      scheduler->generation++;
+      if (last)
+         scheduler->stopped = 1;
+   }
+   pthread_cond_broadcast(&scheduler->cond);
+   pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Wake every waiting pipeline without triggering a capture
+ */
+void scheduler_wake(CAPTURE_SCHEDULER *scheduler)
+{
+   pthread_mutex_lock(&scheduler->lock);
+   scheduler->wakeups++;
+   pthread_cond_broadcast(&scheduler->cond);
+   pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Stop triggering, pipelines finish the capture they are on and exit
+ */
+void scheduler_stop(CAPTURE_SCHEDULER *scheduler)
+{
+   pthread_mutex_lock(&scheduler->lock);
+   scheduler->stopped = 1;
+   pthread_cond_broadcast(&scheduler->cond);
+   pthread_mutex_unlock(&scheduler->lock);
+
+   if (scheduler->thread_running && !pthread_equal(scheduler->thread, pthread_self()))
+   {
+      // The keypress thread is probably sat in getchar()
+      if (scheduler->frameNextMethod == FRAME_NEXT_KEYPRESS)
+         pthread_cancel(scheduler->thread);
+      pthread_join(scheduler->thread, NULL);
+      scheduler->thread_running = 0;
+   }
+}
+
+void scheduler_destroy(CAPTURE_SCHEDULER *scheduler)
+{
+   scheduler_stop(scheduler);
+   pthread_cond_destroy(&scheduler->cond);
+   pthread_mutex_destroy(&scheduler->lock);
+}
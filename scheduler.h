@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <pthread.h>
+
+//camera commands
+enum
+{
+   FRAME_NEXT_SINGLE,
+   FRAME_NEXT_TIMELAPSE,
+   FRAME_NEXT_KEYPRESS,
+   FRAME_NEXT_FOREVER,
+   FRAME_NEXT_GPIO,
+   FRAME_NEXT_SIGNAL,
+   FRAME_NEXT_IMMEDIATELY,
+   FRAME_NEXT_EVENT
+};
+
+/** Capture trigger source shared by every camera pipeline.
+ *  Each trigger bumps generation, pipelines remember the last generation
+ *  they captured so every camera takes exactly one frame per trigger.
+ *  Wakeups get the pipelines' attention without a capture, e.g. to apply
+ *  settings changed while they wait.
+ */
+typedef struct
+{
+   int frameNextMethod;             /// Which method to use to advance to next frame
+   int interval;                    /// Timelapse interval in milliseconds
+   int timeout;                     /// Stop after this many milliseconds, 0 runs forever
+   int verbose;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   unsigned generation;             /// Incremented on every trigger
+   unsigned wakeups;                /// Incremented on every scheduler_wake
+   int stopped;                     /// No more triggers after the current generation
+   pthread_t thread;                /// Thread generating timed/keypress triggers
+   int thread_running;
+} CAPTURE_SCHEDULER;
+
+int scheduler_init(CAPTURE_SCHEDULER *scheduler, int method, int interval, int timeout);
+int scheduler_start(CAPTURE_SCHEDULER *scheduler);
+int scheduler_wait(CAPTURE_SCHEDULER *scheduler, unsigned *last_generation, unsigned *last_wakeup);
+void scheduler_trigger(CAPTURE_SCHEDULER *scheduler, int last);
+void scheduler_wake(CAPTURE_SCHEDULER *scheduler);
+void scheduler_stop(CAPTURE_SCHEDULER *scheduler);
+void scheduler_destroy(CAPTURE_SCHEDULER *scheduler);
+
+#endif /* SCHEDULER_H_ */
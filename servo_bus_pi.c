@@ -0,0 +1,108 @@
+#include <bcm2835.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "servo_control.h"
+#include "servo_bus_pi.h"
+
+/// Same as SLAVE_ADDRESS in servo_code.ino
+#define SERVO_SLAVE_ADDRESS  0x08
+
+/// 250MHz core clock / 2500 = 100kHz, standard mode for the arduino
+#define SERVO_I2C_DIVIDER    BCM2835_I2C_CLOCK_DIVIDER_2500
+
+static METRIC *spi_transfers;
+static METRIC *spi_errors;
+static METRIC *i2c_transfers;
+static METRIC *i2c_errors;
+
+static int pi_open(void *state)
+{
+   SERVO_PI_BUS *pi = (SERVO_PI_BUS *)state;
+
+   spi_transfers = metrics_counter("bus_transfers_total", "Peripheral bus transfers", "bus=\"spi\"");
+   spi_errors = metrics_counter("bus_errors_total", "Peripheral bus transfers that failed", "bus=\"spi\"");
+   i2c_transfers = metrics_counter("bus_transfers_total", "Peripheral bus transfers", "bus=\"i2c\"");
+   i2c_errors = metrics_counter("bus_errors_total", "Peripheral bus transfers that failed", "bus=\"i2c\"");
+
+   if (!bcm2835_init())
+   {
+      fprintf(stderr, "bcm2835 init failed\n");
+      return -1;
+   }
+   if (!bcm2835_spi_begin() || !bcm2835_i2c_begin())
+   {
+      fprintf(stderr, "SPI/I2C begin failed, not running as root?\n");
+      bcm2835_close();
+      return -1;
+   }
+
+   bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
+   bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
+   bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_64);
+   bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
+   bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
+
+   bcm2835_i2c_setSlaveAddress(pi->address ? pi->address : SERVO_SLAVE_ADDRESS);
+   bcm2835_i2c_setClockDivider(SERVO_I2C_DIVIDER);
+   return 0;
+}
+
+/**
+ * One ADC channel
+ *
+ * @return 0-1023, -1 on a bad transfer
+ */
+static int read_channel(int channel)
+{
+   uint8_t buf[SERVO_ADC_FRAME_LENGTH];
+   uint8_t readbuf[SERVO_ADC_FRAME_LENGTH];
+   int value;
+
+   servo_encode_adc_request(channel, buf);
+   bcm2835_spi_transfernb((char *)buf, (char *)readbuf, SERVO_ADC_FRAME_LENGTH);
+   metrics_add(spi_transfers, 1);
+
+   value = servo_decode_adc_reply(readbuf);
+   if (value < 0)
+      metrics_add(spi_errors, 1);
+   return value;
+}
+
+static int pi_read_stick(void *state, int *x, int *y)
+{
+   SERVO_PI_BUS *pi = (SERVO_PI_BUS *)state;
+
+   *x = read_channel(pi->x_channel);
+   *y = read_channel(pi->y_channel);
+   return *x < 0 || *y < 0 ? -1 : 0;
+}
+
+static int pi_write(void *state, const uint8_t *data, size_t length)
+{
+   uint8_t reason = bcm2835_i2c_write((const char *)data, length);
+
+   (void)state;
+   metrics_add(i2c_transfers, 1);
+   if (reason == BCM2835_I2C_REASON_OK)
+      return 0;
+   metrics_add(i2c_errors, 1);
+   return -1;
+}
+
+static void pi_close(void *state)
+{
+   (void)state;
+   bcm2835_i2c_end();
+   bcm2835_spi_end();
+   bcm2835_close();
+}
+
+const SERVO_BUS servo_pi_bus =
+{
+   "bcm2835",
+   pi_open,
+   pi_read_stick,
+   pi_write,
+   pi_close
+};
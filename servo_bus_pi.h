@@ -0,0 +1,18 @@
+#ifndef SERVO_BUS_PI_H_
+#define SERVO_BUS_PI_H_
+
+#include "servo_control.h"
+
+/** Joystick on an MCP3008 over SPI, servo controller on I2C, through
+ *  the bcm2835 library. Needs root for /dev/mem.
+ */
+typedef struct
+{
+   int x_channel;                   /// ADC channel of the pan axis
+   int y_channel;                   /// ADC channel of the tilt axis
+   int address;                     /// I2C address of the servo controller, 0 for the default
+} SERVO_PI_BUS;
+
+extern const SERVO_BUS servo_pi_bus;
+
+#endif /* SERVO_BUS_PI_H_ */
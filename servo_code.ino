@@ -7,58 +7,102 @@ Servo servo_y;
 //need to find address of arduino(pin used)
 #define SLAVE_ADDRESS 0x08
 
+//velocity command from the pi, see servo_encode_command in servo_control.c
+#define COMMAND_MAGIC 0x4a
+#define COMMAND_LENGTH 7
+
+//position command from the pi when it moves to a preset, same length, tenths of a degree
+#define POSITION_MAGIC 0x50
+
+//stop if the pi goes quiet, it sends a command every few ms while running
+#define COMMAND_TIMEOUT_MS 100
+
+//servos are moved this often, in ms
+#define UPDATE_INTERVAL_MS 5
+
 int servo_x_pin = 9;
 int servo_y_pin = 10;
 
-int servo_x_position = 0;
-int servo_y_position = 0;
+//positions in ten thousandths of a degree, so slow speeds still add up each update
+#define POSITION_MAX 1800000L
+long servo_x_position = POSITION_MAX / 2;
+long servo_y_position = POSITION_MAX / 2;
 
 int capture_pin = A0;
 byte capture_flag = 0;
 
-//set default value to 512 which should be middle of joystick
-int data_from_pi = 512;
+//speeds from the pi in tenths of a degree per second, written in the i2c interrupt
+volatile int pan_speed = 0;
+volatile int tilt_speed = 0;
+volatile unsigned long last_command_ms = 0;
+
+//position from the pi in tenths of a degree, -1 when there is none to apply
+volatile int pan_position = -1;
+volatile int tilt_position = -1;
+
+unsigned long last_update_ms = 0;
 
 void setup() {
   //setting up logging
   Serial.begin(9600);
   servo_x.attach(servo_x_pin);
   servo_y.attach(servo_y_pin);
+  write_to_servo(servo_x, servo_x_position);
+  write_to_servo(servo_y, servo_y_position);
 
   Wire.begin(SLAVE_ADDRESS);
-  int new_x_pos = 90;
-  int new_y_pos = 90;
   Serial.print("Completed Inititialization");
 
   Wire.onReceive(receive_data);
   Wire.onRequest(send_data);
 
+  last_update_ms = millis();
 }
 
 
-void write_to_servo(Servo servo, int value)
+//no serial printing here, at 9600 baud it would take longer than the control period
+void write_to_servo(Servo &servo, long position)
 {
-  servo.write(value);
-  Serial.print(servo.read());
+  servo.write((int)((position + 5000) / 10000));
 }
 
 
+//runs in the i2c interrupt, keep it short
 void receive_data(int num_bytes)
 {
+  byte frame[COMMAND_LENGTH];
+  byte sum = 0;
+  int length = 0;
+
   while (Wire.available())
   {
-    data_from_pi += Wire.read();
+    byte value = Wire.read();
+    if (length < COMMAND_LENGTH)
+      frame[length] = value;
+    length++;
   }
-  //find way to split byte data? Use array to hold x and y data?
-  int new_x_pos = 0;
-  int new_y_pos = 0;
-  
-  //write x
-  write_to_servo(servo_x, new_x_pos);
 
-  //write to y
-  write_to_servo(servo_y, new_y_pos);
+  //drop anything that isn't a whole command with a good checksum
+  if (length != COMMAND_LENGTH || (frame[0] != COMMAND_MAGIC && frame[0] != POSITION_MAGIC))
+    return;
+  for (int i = 0; i < COMMAND_LENGTH - 1; i++)
+    sum += frame[i];
+  if ((byte)~sum != frame[COMMAND_LENGTH - 1])
+    return;
 
+  if (frame[0] == POSITION_MAGIC)
+  {
+    pan_position = (int)(frame[2] | (frame[3] << 8));
+    tilt_position = (int)(frame[4] | (frame[5] << 8));
+    pan_speed = 0;
+    tilt_speed = 0;
+  }
+  else
+  {
+    pan_speed = (int)(frame[2] | (frame[3] << 8));
+    tilt_speed = (int)(frame[4] | (frame[5] << 8));
+  }
+  last_command_ms = millis();
 }
 
 //read button press and send data to pi
@@ -73,7 +117,50 @@ void send_data()
 }
 
 
+//integrate the commanded speeds into positions, or apply a commanded position
 void loop() {
-  delay(300);
-  //not sure if I can add some more processing here, processing will probably go in send_data function
-}
+  unsigned long now = millis();
+  unsigned long elapsed = now - last_update_ms;
+  int pan, tilt, pan_to, tilt_to;
+
+  if (elapsed < UPDATE_INTERVAL_MS)
+    return;
+  last_update_ms = now;
+
+  noInterrupts();
+  if (now - last_command_ms > COMMAND_TIMEOUT_MS)
+  {
+    pan_speed = 0;
+    tilt_speed = 0;
+  }
+  pan = pan_speed;
+  tilt = tilt_speed;
+  pan_to = pan_position;
+  tilt_to = tilt_position;
+  pan_position = -1;
+  tilt_position = -1;
+  interrupts();
+
+  //the pi steps preset moves itself, so a position goes straight to the servo
+  if (pan_to >= 0)
+  {
+    servo_x_position = constrain((long)pan_to * 1000, 0, POSITION_MAX);
+    write_to_servo(servo_x, servo_x_position);
+  }
+  if (tilt_to >= 0)
+  {
+    servo_y_position = constrain((long)tilt_to * 1000, 0, POSITION_MAX);
+    write_to_servo(servo_y, servo_y_position);
+  }
+
+  if (pan)
+  {
+    servo_x_position = constrain(servo_x_position + (long)pan * elapsed, 0, POSITION_MAX);
+    write_to_servo(servo_x, servo_x_position);
+  }
+  if (tilt)
+  {
+    servo_y_position = constrain(servo_y_position + (long)tilt * elapsed, 0, POSITION_MAX);
+    write_to_servo(servo_y, servo_y_position);
+  }
+}
\ No newline at end of file
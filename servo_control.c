@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "servo_control.h"
+#include "clock_now.h"
+
+/// MCP3008 single ended read, as joystick_test.c frames it
+#define ADC_START            0x01
+#define ADC_SINGLE_ENDED     0x08
+
+/// Stack the control thread touches before its first cycle, so no page faults land mid cycle
+#define SERVO_PREFAULT_STACK (64 * 1024)
+
+/**
+ * Pack a command into the frame the servo controller reads
+ *
+ * @param frame SERVO_COMMAND_LENGTH bytes
+ */
+void servo_encode_command(const SERVO_COMMAND *command, uint8_t *frame)
+{
+   uint8_t sum = 0;
+
+   frame[0] = command->position ? SERVO_POSITION_MAGIC : SERVO_COMMAND_MAGIC;
+   frame[1] = command->sequence;
+   frame[2] = (uint16_t)command->pan & 0xff;
+   frame[3] = (uint16_t)command->pan >> 8;
+   frame[4] = (uint16_t)command->tilt & 0xff;
+   frame[5] = (uint16_t)command->tilt >> 8;
+   for (int i = 0; i < SERVO_COMMAND_LENGTH - 1; i++)
+      sum += frame[i];
+   frame[SERVO_COMMAND_LENGTH - 1] = ~sum;
+}
+
+/**
+ * Unpack a frame, as the servo controller does
+ *
+ * @return 0 if the frame is whole and its checksum matches, -1 otherwise
+ */
+int servo_decode_command(const uint8_t *frame, size_t length, SERVO_COMMAND *command)
+{
+   uint8_t sum = 0;
+
+   if (length != SERVO_COMMAND_LENGTH || (frame[0] != SERVO_COMMAND_MAGIC && frame[0] != SERVO_POSITION_MAGIC))
+      return -1;
+   for (int i = 0; i < SERVO_COMMAND_LENGTH - 1; i++)
+      sum += frame[i];
+   sum = ~sum;
+   if (sum != frame[SERVO_COMMAND_LENGTH - 1])
+      return -1;
+
+   command->sequence = frame[1];
+   command->position = frame[0] == SERVO_POSITION_MAGIC;
+   command->pan = (int16_t)(frame[2] | frame[3] << 8);
+   command->tilt = (int16_t)(frame[4] | frame[5] << 8);
+   return 0;
+}
+
+/**
+ * Frame a single ended read of one joystick ADC channel
+ *
+ * @param frame SERVO_ADC_FRAME_LENGTH bytes
+ */
+void servo_encode_adc_request(int channel, uint8_t *frame)
+{
+   frame[0] = ADC_START;
+   frame[1] = (uint8_t)((ADC_SINGLE_ENDED | channel) << 4);
+   frame[2] = 0;
+}
+
+/**
+ * Pull the reading out of what the ADC sent back
+ *
+ * @param frame SERVO_ADC_FRAME_LENGTH bytes
+ * @return 0-1023, -1 on a bad transfer
+ */
+int servo_decode_adc_reply(const uint8_t *frame)
+{
+   // The ADC drives a null bit low just before the result, if it reads high MISO is floating
+   if (frame[1] & 0x04)
+      return -1;
+   return (frame[1] & 0x03) << 8 | frame[2];
+}
+
+static void register_metrics(SERVO_CONTROL *control)
+{
+   control->jitter_metric = metrics_histogram("servo_jitter_us", "Control loop wakeup after its deadline in microseconds",
+                                              NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   control->cycle_metric = metrics_histogram("servo_cycle_us", "Control loop stick sample to servo command in microseconds",
+                                             NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   control->overruns_metric = metrics_counter("servo_overruns_total", "Control loop cycles that ran past the next one",
+                                              NULL);
+}
+
+/**
+ * Set up manual control on a bus, the loop doesn't run until servo_control_start
+ *
+ * @param bus_state Bus's own state, passed to each of its operations
+ * @return 0 on success, -1 if the bus could not be opened
+ */
+int servo_control_init(SERVO_CONTROL *control, const SERVO_BUS *bus, void *bus_state)
+{
+   pthread_mutexattr_t attr;
+
+   memset(control, 0, sizeof(*control));
+   control->bus = bus;
+   control->bus_state = bus_state;
+   control->period = SERVO_DEFAULT_PERIOD;
+   control->smoothing = SERVO_DEFAULT_SMOOTHING;
+   control->deadband = SERVO_DEFAULT_DEADBAND;
+   control->max_speed = SERVO_DEFAULT_MAX_SPEED;
+   control->expo = SERVO_DEFAULT_EXPO;
+   control->priority = SERVO_DEFAULT_PRIORITY;
+   control->slew_speed = SERVO_DEFAULT_SLEW_SPEED;
+   control->settle_time = SERVO_DEFAULT_SETTLE_TIME;
+
+   // The servo controller starts with the head centred
+   for (int a = 0; a < 2; a++)
+   {
+      control->position[a] = SERVO_POSITION_MAX / 2;
+      control->published[a] = control->target[a] = SERVO_POSITION_MAX / 2;
+   }
+
+   if (bus->open && bus->open(bus_state) != 0)
+   {
+      fprintf(stderr, "Unable to open the %s bus\n", bus->name);
+      return -1;
+   }
+
+   // Readers of the stats mustn't hold up the control thread for long
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+   pthread_mutex_init(&control->stats_lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+
+   register_metrics(control);
+   return 0;
+}
+
+static void stats_add(SERVO_STATS *stats, int64_t value)
+{
+   int64_t bucket = value / SERVO_STATS_RESOLUTION;
+
+   if (bucket < 0)
+      bucket = 0;
+   if (bucket >= SERVO_STATS_BUCKETS)
+      bucket = SERVO_STATS_BUCKETS - 1;
+   stats->buckets[bucket]++;
+   stats->count++;
+   stats->sum += value;
+   if (value > stats->max)
+      stats->max = value;
+}
+
+/**
+ * Time below which a percentage of the values fell, to the stats' resolution
+ */
+int64_t servo_stats_percentile(const SERVO_STATS *stats, int percent)
+{
+   uint64_t wanted = (stats->count * percent + 99) / 100, seen = 0;
+
+   if (!stats->count)
+      return 0;
+   for (int i = 0; i < SERVO_STATS_BUCKETS - 1; i++)
+   {
+      seen += stats->buckets[i];
+      if (seen >= wanted)
+         return (int64_t)(i + 1) * SERVO_STATS_RESOLUTION < stats->max ?
+                (int64_t)(i + 1) * SERVO_STATS_RESOLUTION : stats->max;
+   }
+   return stats->max;
+}
+
+/**
+ * Find the centre of each axis from the stick at rest
+ */
+static void calibrate(SERVO_CONTROL *control)
+{
+   int sum_x = 0, sum_y = 0, good = 0;
+
+   for (int i = 0; i < SERVO_CALIBRATION_SAMPLES; i++)
+   {
+      int x, y;
+
+      if (control->bus->read_stick(control->bus_state, &x, &y) == 0)
+      {
+         sum_x += x;
+         sum_y += y;
+         good++;
+      }
+      usleep(1000);
+   }
+
+   control->axes[0].centre = good ? sum_x / good : (SERVO_ADC_MAX + 1) / 2;
+   control->axes[1].centre = good ? sum_y / good : (SERVO_ADC_MAX + 1) / 2;
+   for (int a = 0; a < 2; a++)
+      for (int i = 0; i < 3; i++)
+         control->axes[a].history[i] = control->axes[a].centre;
+}
+
+static int median3(const int *v)
+{
+   if (v[0] > v[1])
+      return v[1] > v[2] ? v[1] : v[0] > v[2] ? v[2] : v[0];
+   return v[0] > v[2] ? v[0] : v[1] > v[2] ? v[2] : v[1];
+}
+
+/**
+ * Filter one sample of an axis
+ *
+ * @param alpha Smoothing filter coefficient for one period
+ * @return the speed the axis asks for, in tenths of a degree per second
+ */
+static int16_t axis_update(SERVO_CONTROL *control, SERVO_AXIS *axis, int sample, float alpha)
+{
+   int deflection, range;
+   float target, shaped;
+
+   axis->history[0] = axis->history[1];
+   axis->history[1] = axis->history[2];
+   axis->history[2] = sample;
+
+   // A single glitched transfer is outvoted by its neighbours
+   deflection = median3(axis->history) - axis->centre;
+   range = (deflection > 0 ? SERVO_ADC_MAX - axis->centre : axis->centre) - control->deadband;
+   if (abs(deflection) <= control->deadband || range <= 0)
+      target = 0;
+   else
+   {
+      target = (float)(abs(deflection) - control->deadband) / range;
+      if (target > 1)
+         target = 1;
+      if (deflection < 0)
+         target = -target;
+   }
+
+   axis->smoothed += alpha * (target - axis->smoothed);
+   if (target == 0 && fabsf(axis->smoothed) < 0.002f)
+      axis->smoothed = 0;
+
+   shaped = (1 - control->expo) * axis->smoothed + control->expo * axis->smoothed * axis->smoothed * axis->smoothed;
+   return (int16_t)lrintf(shaped * control->max_speed * 10);
+}
+
+static int send_command(SERVO_CONTROL *control)
+{
+   uint8_t frame[SERVO_COMMAND_LENGTH];
+
+   control->command.sequence++;
+   servo_encode_command(&control->command, frame);
+   if (control->bus->write(control->bus_state, frame, sizeof(frame)) == 0)
+      return 0;
+   control->bus_errors++;
+   return -1;
+}
+
+/**
+ * Tell on_move when the head starts moving, and when it has been still
+ * for settle_time
+ */
+static void update_moving(SERVO_CONTROL *control, int moved, int64_t now)
+{
+   if (moved)
+   {
+      control->last_move = now;
+      if (!control->moving)
+      {
+         __atomic_store_n(&control->moving, 1, __ATOMIC_RELEASE);
+         if (control->on_move)
+            control->on_move(control->move_userdata, 1);
+      }
+   }
+   else if (control->moving && now - control->last_move >= (int64_t)control->settle_time * 1000)
+   {
+      __atomic_store_n(&control->moving, 0, __ATOMIC_RELEASE);
+      if (control->on_move)
+         control->on_move(control->move_userdata, 0);
+   }
+}
+
+/**
+ * Move the position model on a cycle, and set the command that takes the
+ * servos there
+ *
+ * @return 1 if the position changed
+ */
+static int update_position(SERVO_CONTROL *control, int64_t now)
+{
+   float seconds = control->period / 1e6f, previous[2] = { control->position[0], control->position[1] };
+   int mode = __atomic_load_n(&control->mode, __ATOMIC_ACQUIRE);
+
+   // The stick always wins over a preset move
+   if (control->speed[0] || control->speed[1])
+   {
+      if (mode != SERVO_MODE_MANUAL)
+         __atomic_store_n(&control->mode, mode = SERVO_MODE_MANUAL, __ATOMIC_RELEASE);
+      __atomic_store_n(&control->last_manual, now, __ATOMIC_RELEASE);
+   }
+
+   if (mode == SERVO_MODE_MANUAL)
+   {
+      // Follows what the controller integrates, near enough to start a preset move from
+      for (int a = 0; a < 2; a++)
+      {
+         control->position[a] += control->speed[a] * seconds;
+         if (control->position[a] < 0)
+            control->position[a] = 0;
+         if (control->position[a] > SERVO_POSITION_MAX)
+            control->position[a] = SERVO_POSITION_MAX;
+      }
+      control->command.position = 0;
+      control->command.pan = control->speed[0];
+      control->command.tilt = control->speed[1];
+   }
+   else
+   {
+      float step = control->slew_speed * 10 * seconds;
+
+      for (int a = 0; a < 2; a++)
+      {
+         float distance = __atomic_load_n(&control->target[a], __ATOMIC_ACQUIRE) - control->position[a];
+
+         control->position[a] += fabsf(distance) <= step ? distance : distance > 0 ? step : -step;
+      }
+      control->command.position = 1;
+      control->command.pan = (int16_t)lrintf(control->position[0]);
+      control->command.tilt = (int16_t)lrintf(control->position[1]);
+   }
+
+   for (int a = 0; a < 2; a++)
+      __atomic_store_n(&control->published[a], (int)lrintf(control->position[a]), __ATOMIC_RELEASE);
+   return control->position[0] != previous[0] || control->position[1] != previous[1];
+}
+
+/**
+ * One cycle: sample, filter, command
+ */
+static void control_cycle(SERVO_CONTROL *control, float alpha, int64_t now)
+{
+   int x, y, moved;
+
+   if (control->bus->read_stick(control->bus_state, &x, &y) == 0)
+   {
+      control->read_errors = 0;
+      control->speed[0] = axis_update(control, &control->axes[0], x, alpha);
+      control->speed[1] = axis_update(control, &control->axes[1], y, alpha);
+      if (control->invert_tilt)
+         control->speed[1] = -control->speed[1];
+   }
+   else
+   {
+      control->bus_errors++;
+
+      // Hold the last command through a glitch, stop if the stick is gone
+      if (++control->read_errors >= SERVO_MAX_READ_ERRORS)
+      {
+         for (int a = 0; a < 2; a++)
+         {
+            control->axes[a].smoothed = 0;
+            for (int i = 0; i < 3; i++)
+               control->axes[a].history[i] = control->axes[a].centre;
+         }
+         control->speed[0] = control->speed[1] = 0;
+      }
+   }
+
+   moved = update_position(control, now);
+   send_command(control);
+   update_moving(control, moved, now);
+}
+
+static void timespec_from_us(struct timespec *ts, int64_t us)
+{
+   ts->tv_sec = us / 1000000;
+   ts->tv_nsec = (us % 1000000) * 1000;
+}
+
+static void *control_thread(void *arg)
+{
+   SERVO_CONTROL *control = (SERVO_CONTROL *)arg;
+   float alpha = control->smoothing > 0 ? 1 - expf(-(float)control->period / control->smoothing) : 1;
+   volatile uint8_t stack[SERVO_PREFAULT_STACK];
+   int64_t deadline;
+
+   memset((void *)stack, 0, sizeof(stack));
+   calibrate(control);
+
+   deadline = clock_now_us() + control->period;
+   while (!__atomic_load_n(&control->quit, __ATOMIC_ACQUIRE))
+   {
+      struct timespec ts;
+      int64_t wake, done;
+
+      timespec_from_us(&ts, deadline);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+         ;
+      wake = clock_now_us();
+
+      control_cycle(control, alpha, wake);
+      done = clock_now_us();
+
+      pthread_mutex_lock(&control->stats_lock);
+      stats_add(&control->jitter, wake - deadline);
+      stats_add(&control->cycle, done - wake);
+      control->cycles++;
+      pthread_mutex_unlock(&control->stats_lock);
+      metrics_observe(control->jitter_metric, wake - deadline);
+      metrics_observe(control->cycle_metric, done - wake);
+
+      // Missed cycles are skipped rather than run back to back late
+      deadline += control->period;
+      if (done >= deadline)
+      {
+         pthread_mutex_lock(&control->stats_lock);
+         control->overruns++;
+         pthread_mutex_unlock(&control->stats_lock);
+         metrics_add(control->overruns_metric, 1);
+         deadline += ((done - deadline) / control->period + 1) * control->period;
+      }
+   }
+
+   // Leave the servos still, where they are
+   control->command.position = 0;
+   control->command.pan = control->command.tilt = 0;
+   send_command(control);
+   return NULL;
+}
+
+/**
+ * Keep the process's pages in memory so the control thread never waits
+ * on a page fault. Future mappings are only locked when there is no limit
+ * on locked memory, otherwise a big allocation elsewhere would fail.
+ *
+ * @return 1 if memory is locked
+ */
+static int lock_memory(void)
+{
+   struct rlimit limit;
+   int flags = MCL_CURRENT;
+
+   if (geteuid() == 0 || (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY))
+      flags |= MCL_FUTURE;
+   return mlockall(flags) == 0;
+}
+
+/**
+ * Start the control loop. It runs SCHED_FIFO at control->priority with
+ * memory locked if the process is allowed to, as an ordinary thread
+ * otherwise.
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int servo_control_start(SERVO_CONTROL *control)
+{
+   control->quit = 0;
+   control->realtime = 0;
+
+   if (control->priority > 0)
+   {
+      pthread_attr_t attr;
+      struct sched_param param;
+
+      control->locked = lock_memory();
+
+      memset(&param, 0, sizeof(param));
+      param.sched_priority = control->priority;
+      pthread_attr_init(&attr);
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&attr, &param);
+      control->realtime = pthread_create(&control->thread, &attr, control_thread, control) == 0;
+      pthread_attr_destroy(&attr);
+   }
+
+   if (!control->realtime && pthread_create(&control->thread, NULL, control_thread, control) != 0)
+      return -1;
+   control->thread_running = 1;
+   return 0;
+}
+
+/**
+ * Stop the loop, the servos are sent a last command to stand still
+ */
+void servo_control_stop(SERVO_CONTROL *control)
+{
+   if (!control->thread_running)
+      return;
+
+   __atomic_store_n(&control->quit, 1, __ATOMIC_RELEASE);
+   pthread_join(control->thread, NULL);
+   control->thread_running = 0;
+}
+
+void servo_control_destroy(SERVO_CONTROL *control)
+{
+   servo_control_stop(control);
+   if (control->bus->close)
+      control->bus->close(control->bus_state);
+   if (control->locked)
+      munlockall();
+   control->locked = 0;
+   pthread_mutex_destroy(&control->stats_lock);
+}
+
+/**
+ * Slew the head to a position at slew_speed, taking over from the stick
+ * until it is moved again
+ *
+ * @param pan, tilt Tenths of a degree, 0 to SERVO_POSITION_MAX
+ */
+void servo_control_goto(SERVO_CONTROL *control, int pan, int tilt)
+{
+   pan = pan < 0 ? 0 : pan > SERVO_POSITION_MAX ? SERVO_POSITION_MAX : pan;
+   tilt = tilt < 0 ? 0 : tilt > SERVO_POSITION_MAX ? SERVO_POSITION_MAX : tilt;
+   __atomic_store_n(&control->target[0], pan, __ATOMIC_RELEASE);
+   __atomic_store_n(&control->target[1], tilt, __ATOMIC_RELEASE);
+   __atomic_store_n(&control->mode, SERVO_MODE_POSITION, __ATOMIC_RELEASE);
+}
+
+/**
+ * Hand the head back to the stick, a preset move stops where it is
+ */
+void servo_control_manual(SERVO_CONTROL *control)
+{
+   __atomic_store_n(&control->mode, SERVO_MODE_MANUAL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Where the head points, as last commanded, in tenths of a degree
+ */
+void servo_control_position(SERVO_CONTROL *control, int *pan, int *tilt)
+{
+   *pan = __atomic_load_n(&control->published[0], __ATOMIC_ACQUIRE);
+   *tilt = __atomic_load_n(&control->published[1], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @return 1 if the head has been still for settle_time and, on a preset
+ * move, is at its target
+ */
+int servo_control_settled(SERVO_CONTROL *control)
+{
+   int pan, tilt;
+
+   if (__atomic_load_n(&control->moving, __ATOMIC_ACQUIRE))
+      return 0;
+   if (__atomic_load_n(&control->mode, __ATOMIC_ACQUIRE) == SERVO_MODE_MANUAL)
+      return 1;
+   servo_control_position(control, &pan, &tilt);
+   return pan == __atomic_load_n(&control->target[0], __ATOMIC_ACQUIRE) &&
+          tilt == __atomic_load_n(&control->target[1], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @return when the stick last moved the head (CLOCK_MONOTONIC us), 0 if never
+ */
+int64_t servo_control_last_manual(SERVO_CONTROL *control)
+{
+   return __atomic_load_n(&control->last_manual, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Stand in for a transfer by keeping the CPU busy for as long, the way
+ * the bcm2835 library polls the peripheral's FIFO
+ */
+static void busy_wait(int us)
+{
+   int64_t end = clock_now_us() + us;
+
+   while (clock_now_us() < end)
+      ;
+}
+
+static int mock_read_stick(void *state, int *x, int *y)
+{
+   SERVO_MOCK_BUS *mock = (SERVO_MOCK_BUS *)state;
+   unsigned seed = (unsigned)mock->samples * 2654435761u;
+
+   busy_wait(mock->read_time);
+   mock->samples++;
+
+   *x = __atomic_load_n(&mock->x, __ATOMIC_ACQUIRE);
+   *y = __atomic_load_n(&mock->y, __ATOMIC_ACQUIRE);
+   if (mock->noise)
+   {
+      *x += rand_r(&seed) % (2 * mock->noise + 1) - mock->noise;
+      *y += rand_r(&seed) % (2 * mock->noise + 1) - mock->noise;
+   }
+   if (mock->glitch_every && mock->samples % mock->glitch_every == 0)
+      *x = SERVO_ADC_MAX;
+
+   *x = *x < 0 ? 0 : *x > SERVO_ADC_MAX ? SERVO_ADC_MAX : *x;
+   *y = *y < 0 ? 0 : *y > SERVO_ADC_MAX ? SERVO_ADC_MAX : *y;
+   return 0;
+}
+
+static int mock_write(void *state, const uint8_t *data, size_t length)
+{
+   SERVO_MOCK_BUS *mock = (SERVO_MOCK_BUS *)state;
+   SERVO_COMMAND command;
+
+   busy_wait(mock->write_time);
+   if (servo_decode_command(data, length, &command) != 0)
+      return -1;
+   if (mock->on_command)
+      mock->on_command(mock->userdata, &command);
+   return 0;
+}
+
+/**
+ * Centred stick, transfers as long as SPI at 3.9MHz and I2C at 100kHz take
+ */
+void servo_mock_init(SERVO_MOCK_BUS *mock)
+{
+   memset(mock, 0, sizeof(*mock));
+   mock->x = mock->y = (SERVO_ADC_MAX + 1) / 2;
+   mock->read_time = 15;
+   mock->write_time = (SERVO_COMMAND_LENGTH + 1) * 9 * 10;
+}
+
+const SERVO_BUS servo_mock_bus =
+{
+   "mock",
+   NULL,
+   mock_read_stick,
+   mock_write,
+   NULL
+};
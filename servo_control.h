@@ -0,0 +1,209 @@
+#ifndef SERVO_CONTROL_H_
+#define SERVO_CONTROL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+/// Control loop period, one stick sample and one servo command each, in microseconds
+#define SERVO_DEFAULT_PERIOD      5000
+
+/// Smoothing time constant of the stick filter, in microseconds
+#define SERVO_DEFAULT_SMOOTHING   8000
+
+/// Stick travel either side of centre treated as centre, in ADC counts
+#define SERVO_DEFAULT_DEADBAND    24
+
+/// Pan/tilt speed at full stick, in degrees per second
+#define SERVO_DEFAULT_MAX_SPEED   120
+
+/// Fine control near centre, 0 is linear, 1 is cubic
+#define SERVO_DEFAULT_EXPO        0.4f
+
+/// SCHED_FIFO priority of the control thread
+#define SERVO_DEFAULT_PRIORITY    50
+
+/// Bad stick reads in a row before the servos are stopped
+#define SERVO_MAX_READ_ERRORS     4
+
+/// Samples averaged for the centre position at start
+#define SERVO_CALIBRATION_SAMPLES 16
+
+/// Full scale of the joystick ADC
+#define SERVO_ADC_MAX             1023
+
+/// Jitter and cycle times are kept in buckets this wide, up to SERVO_STATS_BUCKETS of them (us)
+#define SERVO_STATS_RESOLUTION    10
+#define SERVO_STATS_BUCKETS       2000
+
+/// Preset moves in degrees per second
+#define SERVO_DEFAULT_SLEW_SPEED  60
+
+/// Time the head must be still before it counts as settled, in milliseconds
+#define SERVO_DEFAULT_SETTLE_TIME 400
+
+/// Servo travel, in tenths of a degree
+#define SERVO_POSITION_MAX        1800
+
+/// Command frames sent to the servo controller, see servo_code.ino
+#define SERVO_COMMAND_MAGIC       0x4a
+#define SERVO_POSITION_MAGIC      0x50
+#define SERVO_COMMAND_LENGTH      7
+
+/// Joystick ADC (MCP3008) transfer, a request out and the reading back in the same 3 bytes
+#define SERVO_ADC_FRAME_LENGTH    3
+
+/** Who is moving the head
+ */
+typedef enum
+{
+   SERVO_MODE_MANUAL = 0,           /// Stick speeds
+   SERVO_MODE_POSITION              /// Slewing to, or holding, a target position
+} SERVO_MODE;
+
+/** One command. A velocity command is integrated into positions by the
+ *  controller, which stops the servos if commands stop arriving; a
+ *  position command puts the servos straight there.
+ */
+typedef struct
+{
+   uint8_t sequence;
+   uint8_t position;                /// Pan/tilt are a position rather than speeds
+   int16_t pan;                     /// Tenths of a degree per second, positive is right, or tenths of a degree
+   int16_t tilt;                    /// Tenths of a degree per second, positive is up, or tenths of a degree
+} SERVO_COMMAND;
+
+/** Peripherals the control loop talks to. All are called on the control
+ *  thread except open and close.
+ */
+typedef struct
+{
+   const char *name;
+   int (*open)(void *state);                                        /// 0 on success
+   int (*read_stick)(void *state, int *x, int *y);                  /// ADC counts, 0 on success, -1 on a bad transfer
+   int (*write)(void *state, const uint8_t *data, size_t length);   /// 0 on success
+   void (*close)(void *state);
+} SERVO_BUS;
+
+/** Distribution of a time the loop measures each cycle
+ */
+typedef struct
+{
+   uint32_t buckets[SERVO_STATS_BUCKETS]; /// Last bucket also takes anything longer
+   uint64_t count;
+   int64_t sum;
+   int64_t max;
+} SERVO_STATS;
+
+/** Filter state for one stick axis
+ */
+typedef struct
+{
+   int centre;                      /// ADC counts at rest
+   int history[3];                  /// Last samples, for the median
+   float smoothed;                  /// Filtered deflection, -1 to 1
+} SERVO_AXIS;
+
+/** Manual pan/tilt control.
+ *  A fixed period thread samples the joystick, rejects single sample
+ *  glitches with a median of three, smooths with a one pole filter, maps
+ *  the deflection through a deadband and expo curve to pan/tilt speeds
+ *  and sends them to the servo controller, all in the same cycle. It runs
+ *  SCHED_FIFO with memory locked when it is allowed to, and keeps wakeup
+ *  jitter and cycle time distributions for every run.
+ *
+ *  The loop also keeps track of where the head points. servo_control_goto
+ *  slews it to a position at slew_speed, moving the stick takes it back
+ *  to manual control, and on_move hears when the head starts moving and
+ *  when it has been still for settle_time.
+ */
+typedef struct
+{
+   const SERVO_BUS *bus;
+   void *bus_state;
+
+   int period;                      /// SERVO_DEFAULT_PERIOD
+   int smoothing;                   /// SERVO_DEFAULT_SMOOTHING, 0 for none
+   int deadband;                    /// SERVO_DEFAULT_DEADBAND
+   int max_speed;                   /// SERVO_DEFAULT_MAX_SPEED
+   float expo;                      /// SERVO_DEFAULT_EXPO
+   int priority;                    /// SERVO_DEFAULT_PRIORITY, 0 for an ordinary thread
+   int invert_tilt;                 /// Stick forward tilts down
+   int slew_speed;                  /// SERVO_DEFAULT_SLEW_SPEED
+   int settle_time;                 /// SERVO_DEFAULT_SETTLE_TIME
+
+   void (*on_move)(void *userdata, int moving); /// Head started moving or settled, on the control thread, may be NULL
+   void *move_userdata;
+
+   SERVO_AXIS axes[2];              /// Pan, tilt
+   SERVO_COMMAND command;           /// Last command sent
+   int16_t speed[2];                /// Pan, tilt speed the stick asks for, tenths of a degree per second
+   int read_errors;                 /// Bad reads in a row
+
+   int mode;                        /// SERVO_MODE (atomic)
+   int target[2];                   /// Pan, tilt position a preset move goes to, tenths of a degree (atomic)
+   float position[2];               /// Pan, tilt position commanded, tenths of a degree
+   int published[2];                /// position, rounded, for other threads (atomic)
+   int moving;                      /// Head moving or not yet settled (atomic)
+   int64_t last_move;               /// When the position last changed (us)
+   int64_t last_manual;             /// When the stick last moved the head (us, atomic)
+
+   int realtime;                    /// Thread got SCHED_FIFO
+   int locked;                      /// Memory is locked
+   int quit;                        /// (atomic)
+   pthread_t thread;
+   int thread_running;
+
+   pthread_mutex_t stats_lock;      /// Guards the stats, taken once a cycle
+   SERVO_STATS jitter;              /// Wakeup after the cycle's deadline (us)
+   SERVO_STATS cycle;               /// Wakeup to command written (us)
+   uint64_t cycles;
+   uint64_t overruns;               /// Cycles that missed the next deadline
+   uint64_t bus_errors;             /// Reads and writes that failed
+
+   METRIC *jitter_metric;
+   METRIC *cycle_metric;
+   METRIC *overruns_metric;
+} SERVO_CONTROL;
+
+/** Stand-in bus for running the loop without hardware. The stick is
+ *  set from another thread, and transfers take as long as they would at
+ *  the I2C/SPI clock rates.
+ */
+typedef struct
+{
+   int x, y;                        /// Stick position in ADC counts (atomic)
+   int noise;                       /// Random counts added to each sample
+   int glitch_every;                /// Every Nth sample reads full scale, 0 for never
+   int read_time;                   /// Time a stick read takes (us)
+   int write_time;                  /// Time a command write takes (us)
+   uint64_t samples;
+
+   void (*on_command)(void *userdata, const SERVO_COMMAND *command); /// Called on the control thread, may be NULL
+   void *userdata;
+} SERVO_MOCK_BUS;
+
+extern const SERVO_BUS servo_mock_bus;
+
+void servo_mock_init(SERVO_MOCK_BUS *mock);
+
+void servo_encode_command(const SERVO_COMMAND *command, uint8_t *frame);
+int servo_decode_command(const uint8_t *frame, size_t length, SERVO_COMMAND *command);
+void servo_encode_adc_request(int channel, uint8_t *frame);
+int servo_decode_adc_reply(const uint8_t *frame);
+
+int servo_control_init(SERVO_CONTROL *control, const SERVO_BUS *bus, void *bus_state);
+int servo_control_start(SERVO_CONTROL *control);
+void servo_control_stop(SERVO_CONTROL *control);
+void servo_control_destroy(SERVO_CONTROL *control);
+int64_t servo_stats_percentile(const SERVO_STATS *stats, int percent);
+
+void servo_control_goto(SERVO_CONTROL *control, int pan, int tilt);
+void servo_control_manual(SERVO_CONTROL *control);
+void servo_control_position(SERVO_CONTROL *control, int *pan, int *tilt);
+int servo_control_settled(SERVO_CONTROL *control);
+int64_t servo_control_last_manual(SERVO_CONTROL *control);
+
+#endif /* SERVO_CONTROL_H_ */
@@ -0,0 +1,277 @@
+/**
+ * Soak test harness for the pipeline lifecycle.
+ *
+ * Cycles synthetic pipelines through create/capture/destroy thousands of
+ * times and tracks RSS and open file descriptors. Anything that leaks per
+ * restart (pool buffers, threads, files) shows up as steady growth.
+ * With -s the synthetic encoder wedges every Nth frame so the watchdog
+ * recovery path gets cycled as well, and with -a the analysis stream and
+ * motion gate run alongside the captures. -r records the analysis stream
+ * too, so the recorder's ring and segments go through every restart, and
+ * -p puts privacy masks on every frame so their filters do as well.
+ * -M runs everything inside a memory budget, and the report at the end
+ * gives each stage's high-water mark. Anything budgeted still held once
+ * the pipelines are gone is a leak whether or not a budget was set.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "synthetic_camera.h"
+
+#define MAX_PIPELINES 8
+
+/// Cycles run before the baseline is taken, lets the allocator warm up
+#define WARMUP_CYCLES 50
+
+/// RSS growth tolerated after warmup before calling it a leak
+#define RSS_TOLERANCE_KB 512
+
+/* The sanitizers hold on to freed memory and report leaks themselves,
+ * RSS only says something in a plain build
+ */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define RSS_CHECKED 0
+#else
+#define RSS_CHECKED 1
+#endif
+
+typedef struct
+{
+   CAMERA_PIPELINE pipeline;
+   SYNTHETIC_CAMERA camera;
+   int cycles;                      /// Cycles to run
+   int frames;                      /// Frames captured per cycle
+   int failures;                    /// Cycles that did not complete cleanly
+} SOAK_WORKER;
+
+static long read_rss_kb(void)
+{
+   long pages = 0, resident = 0;
+   FILE *statm = fopen("/proc/self/statm", "r");
+
+   if (!statm)
+      return -1;
+   if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+      resident = -1;
+   fclose(statm);
+
+   return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int count_fds(void)
+{
+   DIR *dir = opendir("/proc/self/fd");
+   struct dirent *entry;
+   int count = 0;
+
+   if (!dir)
+      return -1;
+   while ((entry = readdir(dir)) != NULL)
+      if (entry->d_name[0] != '.')
+         count++;
+   closedir(dir);
+
+   return count - 1; // the one opendir is using
+}
+
+static void *soak_thread(void *arg)
+{
+   SOAK_WORKER *worker = (SOAK_WORKER *)arg;
+
+   for (int cycle = 0; cycle < worker->cycles; cycle++)
+   {
+      // Same frame numbers every cycle so the output files get overwritten
+      worker->pipeline.frame = 0;
+
+      if (pipeline_setup(&worker->pipeline) != 0)
+      {
+         worker->failures++;
+         continue;
+      }
+
+      for (int f = 0; f < worker->frames; f++)
+         if (pipeline_capture_frame(&worker->pipeline) != 0)
+            worker->failures++;
+
+      pipeline_teardown(&worker->pipeline);
+   }
+   return NULL;
+}
+
+static void print_usage(const char *app)
+{
+   fprintf(stderr, "Usage: %s [-c cycles] [-f frames_per_cycle] [-n pipelines] [-i report_interval] [-o directory]\n"
+                   "          [-s stall_every] [-w watchdog_deadline_ms] [-M budget_mb] [-a] [-r] [-p]\n", app);
+}
+
+int main(int argc, char **argv)
+{
+   SOAK_WORKER workers[MAX_PIPELINES];
+   pthread_t threads[MAX_PIPELINES];
+   STORAGE_MANAGER storage;
+   CAPTURE_SCHEDULER scheduler;
+   const char *directory = "/tmp";
+   int cycles = 5000, frames = 1, num_pipelines = 1, interval = 500;
+   int stall_every = 0, deadline = WATCHDOG_DEFAULT_DEADLINE, analysis = 0, recording = 0, masking = 0;
+   uint64_t stalls = 0, recoveries = 0, rebuilds = 0, segments = 0;
+   int64_t downtime = 0;
+   long rss_base = 0, rss_peak = 0, rss = 0;
+   int fds_base = 0, fds = 0, failures = 0, budget = 0, opt;
+   size_t held = 0;
+
+   while ((opt = getopt(argc, argv, "c:f:n:i:o:s:w:M:arph")) != -1)
+   {
+      switch (opt)
+      {
+         case 'c' : cycles = atoi(optarg); break;
+         case 'f' : frames = atoi(optarg); break;
+         case 'n' : num_pipelines = atoi(optarg); break;
+         case 'i' : interval = atoi(optarg); break;
+         case 'o' : directory = optarg; break;
+         case 's' : stall_every = atoi(optarg); break;
+         case 'w' : deadline = atoi(optarg); break;
+         case 'M' : budget = atoi(optarg); break;
+         case 'a' : analysis = 1; break;
+         case 'r' : recording = analysis = 1; break;
+         case 'p' : masking = 1; break;
+         default :
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+      }
+   }
+
+   if (num_pipelines < 1 || num_pipelines > MAX_PIPELINES || cycles < 1 || frames < 1 || interval < 1)
+   {
+      print_usage(argv[0]);
+      return 1;
+   }
+
+   if (budget > 0 && memory_budget_init((size_t)budget * 1024 * 1024) != 0)
+      return 1;
+
+   if (storage_init(&storage, directory, "soak%d_%04d") != 0 ||
+         scheduler_init(&scheduler, FRAME_NEXT_IMMEDIATELY, 0, 0) != 0)
+   {
+      fprintf(stderr, "Out of memory\n");
+      return 1;
+   }
+
+   for (int i = 0; i < num_pipelines; i++)
+   {
+      SOAK_WORKER *worker = &workers[i];
+
+      synthetic_camera_set_defaults(&worker->camera);
+      // Small frames through small buffers, several buffers per frame
+      worker->camera.width = 160;
+      worker->camera.height = 120;
+      worker->camera.buffer_size = 4096;
+      worker->camera.stall_every = stall_every;
+      worker->camera.analysis_interval = 1000;
+
+      if (pipeline_init(&worker->pipeline, i, &synthetic_backend, &worker->camera, &storage, &scheduler) != 0)
+      {
+         fprintf(stderr, "Unable to create pipeline\n");
+         return 1;
+      }
+      worker->pipeline.watchdog.deadline = deadline;
+      worker->pipeline.analysis = analysis;
+      worker->pipeline.recording = recording;
+      if (masking)
+      {
+         static const PRIVACY_POINT window[] = { { 0.1f, 0.1f }, { 0.4f, 0.1f }, { 0.4f, 0.5f }, { 0.1f, 0.5f } };
+         static const PRIVACY_POINT door[] = { { 0.6f, 0.3f }, { 0.9f, 0.4f }, { 0.7f, 0.9f } };
+
+         privacy_mask_add(&worker->pipeline.privacy, PRIVACY_FILL_BLACK, window, 4);
+         privacy_mask_add(&worker->pipeline.privacy, PRIVACY_FILL_BLUR, door, 3);
+      }
+      worker->frames = frames;
+      worker->failures = 0;
+   }
+
+   printf("%8s %10s %6s\n", "cycle", "rss_kb", "fds");
+
+   // Run in slices so the numbers can be sampled between them
+   for (int done = 0; done < cycles; )
+   {
+      int slice = done < WARMUP_CYCLES ? WARMUP_CYCLES : interval;
+
+      if (slice > cycles - done)
+         slice = cycles - done;
+
+      for (int i = 0; i < num_pipelines; i++)
+      {
+         workers[i].cycles = slice;
+         if (pthread_create(&threads[i], NULL, soak_thread, &workers[i]) != 0)
+         {
+            fprintf(stderr, "Unable to start soak thread\n");
+            return 1;
+         }
+      }
+      for (int i = 0; i < num_pipelines; i++)
+         pthread_join(threads[i], NULL);
+
+      done += slice;
+      rss = read_rss_kb();
+      fds = count_fds();
+
+      if (done == slice)
+      {
+         rss_base = rss_peak = rss;
+         fds_base = fds;
+      }
+      if (rss > rss_peak)
+         rss_peak = rss;
+
+      printf("%8d %10ld %6d\n", done, rss, fds);
+      fflush(stdout);
+   }
+
+   for (int i = 0; i < num_pipelines; i++)
+   {
+      WATCHDOG *watchdog = &workers[i].pipeline.watchdog;
+
+      // Stalled frames are expected failures when they are being injected
+      failures += workers[i].failures - (int)watchdog->stalls;
+      failures += (int)workers[i].pipeline.recorder.write_errors;
+      segments += workers[i].pipeline.recorder.segments;
+      stalls += watchdog->stalls;
+      recoveries += watchdog->recoveries;
+      rebuilds += workers[i].pipeline.full_rebuilds;
+      downtime += watchdog->downtime;
+
+      pipeline_destroy(&workers[i].pipeline);
+   }
+
+   printf("pipelines %d cycles %d frames %llu failures %d\n", num_pipelines, cycles,
+          (unsigned long long)storage.files_written, failures);
+   printf("stalls %llu recoveries %llu full rebuilds %llu downtime %lld ms\n",
+          (unsigned long long)stalls, (unsigned long long)recoveries,
+          (unsigned long long)rebuilds, (long long)downtime / 1000);
+   if (recording)
+      printf("segments %llu\n", (unsigned long long)segments);
+   printf("rss %ld -> %ld kB (peak %ld), fds %d -> %d\n", rss_base, rss, rss_peak, fds_base, fds);
+   memory_budget_report(stdout);
+
+   scheduler_destroy(&scheduler);
+   storage_destroy(&storage);
+
+   for (int i = 0; i < MEMORY_STAGE_COUNT; i++)
+      held += memory_used(i);
+   if (held)
+      printf("%zu bytes of budgeted memory still held\n", held);
+   memory_budget_destroy();
+
+   if (failures || recoveries != stalls || fds != fds_base || held ||
+       (RSS_CHECKED && rss - rss_base > RSS_TOLERANCE_KB))
+   {
+      printf("FAIL\n");
+      return 1;
+   }
+   printf("PASS\n");
+   return 0;
+}
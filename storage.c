@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "frame_clock.h"
+#include "clock_now.h"
+
+static double bytes_written(void *userdata)
+{
+   return (double)__atomic_load_n(&((STORAGE_MANAGER *)userdata)->bytes_written, __ATOMIC_RELAXED);
+}
+
+static double files_written(void *userdata)
+{
+   return (double)__atomic_load_n(&((STORAGE_MANAGER *)userdata)->files_written, __ATOMIC_RELAXED);
+}
+
+static double write_errors(void *userdata)
+{
+   return (double)__atomic_load_n(&((STORAGE_MANAGER *)userdata)->write_errors, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set up the storage shared by all the pipelines
+ *
+ * @param storage Manager to initialise
+ * @param directory Output directory, NULL for the current one
+ * @param pattern Filename pattern, NULL for STORAGE_DEFAULT_PATTERN
+ * @return 0 on success, -1 if out of memory
+ */
+int storage_init(STORAGE_MANAGER *storage, const char *directory, const char *pattern)
+{
+   memset(storage, 0, sizeof(*storage));
+   storage->index_fd = -1;
+
+   storage->directory = strdup(directory ? directory : ".");
+   storage->pattern = strdup(pattern ? pattern : STORAGE_DEFAULT_PATTERN);
+
+   if (!storage->directory || !storage->pattern ||
+       buffer_pool_init(&storage->names, "filenames", MEMORY_STAGE_METADATA, 2 * STORAGE_NAME_MAX,
+                        STORAGE_NAME_BLOCKS) != 0)
+   {
+      storage_destroy(storage);
+      return -1;
+   }
+
+   storage->write_latency_metric = metrics_histogram("storage_write_latency_us", "Time spent writing each encoder buffer",
+                                                     NULL, metrics_latency_bounds, METRICS_LATENCY_BOUNDS_NUM);
+   storage->counter_metrics[0] = metrics_callback("storage_bytes_written_total", "Bytes written to storage",
+                                                  NULL, METRIC_COUNTER, bytes_written, storage);
+   storage->counter_metrics[1] = metrics_callback("storage_files_written_total", "Files committed to storage",
+                                                  NULL, METRIC_COUNTER, files_written, storage);
+   storage->counter_metrics[2] = metrics_callback("storage_write_errors_total", "Failed opens, writes and renames",
+                                                  NULL, METRIC_COUNTER, write_errors, storage);
+   return 0;
+}
+
+void storage_destroy(STORAGE_MANAGER *storage)
+{
+   for (int i = 0; i < 3; i++)
+   {
+      metrics_unregister(storage->counter_metrics[i]);
+      storage->counter_metrics[i] = NULL;
+   }
+
+   if (storage->index_fd >= 0)
+      close(storage->index_fd);
+   storage->index_fd = -1;
+
+   buffer_pool_destroy(&storage->names);
+   free(storage->directory);
+   free(storage->pattern);
+   storage->directory = NULL;
+   storage->pattern = NULL;
+}
+
+/**
+ * Keep an index in the output directory, a line per committed file with
+ * when its first frame was taken by the wall clock and CLOCK_MONOTONIC,
+ * so files from different cameras can be lined up. Appended to if it
+ * already exists. Each line goes out in one write to a file opened for
+ * appending, so writers never wait on each other for it.
+ *
+ * @param name Index filename within the directory, STORAGE_DEFAULT_INDEX
+ * @return 0 on success, -1 if it can't be opened
+ */
+int storage_open_index(STORAGE_MANAGER *storage, const char *name)
+{
+   static const char header[] = "# file\tcamera\tframe\trealtime\tmonotonic_us\n";
+   char path[STORAGE_NAME_MAX];
+
+   if (snprintf(path, sizeof(path), "%s/%s", storage->directory, name) >= (int)sizeof(path))
+      return -1;
+
+   if (storage->index_fd >= 0)
+      close(storage->index_fd);
+   storage->index_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (storage->index_fd < 0)
+   {
+      fprintf(stderr, "Unable to open index %s; %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   if (lseek(storage->index_fd, 0, SEEK_END) == 0 && write(storage->index_fd, header, sizeof(header) - 1) < 0)
+      __atomic_add_fetch(&storage->write_errors, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/**
+ * Add a committed file to the index
+ */
+static void index_file(STORAGE_WRITER *writer)
+{
+   STORAGE_MANAGER *storage = writer->storage;
+   const char *name = writer->final_name + strlen(storage->directory) + 1;
+   int64_t time = writer->time ? writer->time : clock_now_us(), realtime = frame_clock_realtime(time);
+   char line[STORAGE_NAME_MAX + 80];
+   int length;
+
+   length = snprintf(line, sizeof(line), "%s\t%d\t%d\t%lld.%06lld\t%lld\n", name, writer->camera, writer->frame,
+                     (long long)(realtime / 1000000), (long long)(realtime % 1000000), (long long)time);
+   if (length < 0 || length >= (int)sizeof(line) || write(storage->index_fd, line, length) != length)
+      __atomic_add_fetch(&storage->write_errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Generates the filenames for a camera/frame into the caller's buffers,
+ * nothing is allocated so it is safe for every frame.
+ *
+ * @param storage Manager holding the directory and pattern
+ * @param camera Camera number
+ * @param frame Frame number
+ * @param extension File extension without the dot
+ * @param final_name Receives the name the file gets once complete
+ * @param temp_name Receives the name used while writing
+ * @param size Bytes in each of final_name and temp_name
+ * @return 0 on success, -1 if a name doesn't fit
+ */
+int storage_name_file(STORAGE_MANAGER *storage, int camera, int frame, const char *extension,
+                      char *final_name, char *temp_name, size_t size)
+{
+   char base[STORAGE_NAME_MAX];
+   int length;
+
+   length = snprintf(base, sizeof(base), storage->pattern, camera, frame);
+   if (length < 0 || (size_t)length >= sizeof(base))
+      return -1;
+
+   length = snprintf(final_name, size, "%s/%s.%s", storage->directory, base, extension);
+   if (length < 0 || (size_t)length + 1 >= size)
+      return -1;
+
+   snprintf(temp_name, size, "%s~", final_name);
+   return 0;
+}
+
+void storage_writer_init(STORAGE_WRITER *writer, STORAGE_MANAGER *storage)
+{
+   memset(writer, 0, sizeof(*writer));
+   writer->storage = storage;
+}
+
+/**
+ * Open the next output file for a pipeline.
+ * Technically it opens the temp~ filename which gets renamed on close.
+ * If the file can't be opened the writer stays usable but discards data.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int storage_writer_open(STORAGE_WRITER *writer, int camera, int frame, const char *extension)
+{
+   if (writer->file_handle || writer->final_name)
+      storage_writer_close(writer, 0);
+
+   // Names come from the pool so opening a file per frame never allocates
+   writer->final_name = buffer_pool_get(&writer->storage->names);
+   if (!writer->final_name)
+   {
+      fprintf(stderr, "Too many files open, no room for their names\n");
+      __atomic_add_fetch(&writer->storage->write_errors, 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+   writer->temp_name = writer->final_name + STORAGE_NAME_MAX;
+
+   if (storage_name_file(writer->storage, camera, frame, extension,
+                         writer->final_name, writer->temp_name, STORAGE_NAME_MAX) != 0)
+   {
+      fprintf(stderr, "Unable to create filenames\n");
+      __atomic_add_fetch(&writer->storage->write_errors, 1, __ATOMIC_RELAXED);
+      storage_writer_close(writer, 0);
+      return -1;
+   }
+
+   writer->bytes = 0;
+   writer->camera = camera;
+   writer->frame = frame;
+   writer->time = 0;
+   writer->file_handle = fopen(writer->temp_name, "wb");
+
+   if (!writer->file_handle)
+   {
+      // Notify user, carry on but discarding encoded output buffers
+      fprintf(stderr, "%s: Error opening output file: %s; %s\n", __func__, writer->temp_name, strerror(errno));
+      __atomic_add_fetch(&writer->storage->write_errors, 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * Record when the file's first frame was taken, for the index.
+ * Only the first stamp after opening counts.
+ *
+ * @param time CLOCK_MONOTONIC (us)
+ */
+void storage_writer_stamp(STORAGE_WRITER *writer, int64_t time)
+{
+   if (!writer->time)
+      writer->time = time;
+}
+
+/**
+ * Write encoded data to the open file
+ *
+ * @return Bytes written, length if no file is open (data is discarded)
+ */
+size_t storage_writer_write(STORAGE_WRITER *writer, const void *data, size_t length)
+{
+   size_t bytes_written;
+   int64_t start;
+
+   if (!writer->file_handle || !length)
+      return length;
+
+   start = clock_now_us();
+   bytes_written = fwrite(data, 1, length, writer->file_handle);
+   metrics_observe(writer->storage->write_latency_metric, (uint64_t)(clock_now_us() - start));
+   writer->bytes += bytes_written;
+   __atomic_add_fetch(&writer->storage->bytes_written, bytes_written, __ATOMIC_RELAXED);
+
+   if (bytes_written != length)
+      __atomic_add_fetch(&writer->storage->write_errors, 1, __ATOMIC_RELAXED);
+
+   return bytes_written;
+}
+
+/**
+ * Close the current file, renaming it to its final name if commit is set
+ * otherwise removing the partial file.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int storage_writer_close(STORAGE_WRITER *writer, int commit)
+{
+   int result = 0;
+
+   if (writer->file_handle)
+   {
+      if (fclose(writer->file_handle) != 0)
+         commit = 0, result = -1;
+      writer->file_handle = NULL;
+
+      if (!commit)
+         remove(writer->temp_name);
+      else if (0 != rename(writer->temp_name, writer->final_name))
+      {
+         fprintf(stderr, "Could not rename temp file to: %s; %s\n", writer->final_name, strerror(errno));
+         result = -1;
+      }
+
+      if (result == 0 && commit)
+      {
+         __atomic_add_fetch(&writer->storage->files_written, 1, __ATOMIC_RELAXED);
+         if (writer->storage->index_fd >= 0)
+            index_file(writer);
+      }
+      else
+         __atomic_add_fetch(&writer->storage->write_errors, 1, __ATOMIC_RELAXED);
+   }
+
+   if (writer->final_name)
+      buffer_pool_put(&writer->storage->names, writer->final_name);
+   writer->final_name = NULL;
+   writer->temp_name = NULL;
+
+   return result;
+}
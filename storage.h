@@ -0,0 +1,67 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "memory_budget.h"
+
+/// Default output filename pattern, %d camera number then %d frame number
+#define STORAGE_DEFAULT_PATTERN "cam%d_%04d"
+
+/// Longest output path, final and temporary names each
+#define STORAGE_NAME_MAX        256
+
+/// Files that can be open at once across all the writers, two per pipeline is plenty
+#define STORAGE_NAME_BLOCKS     32
+
+/// Index of when each committed file's first frame was taken, in the output directory
+#define STORAGE_DEFAULT_INDEX   "index.tsv"
+
+/** Storage shared by every camera pipeline.
+ *  Only holds configuration and counters, each pipeline has its own
+ *  STORAGE_WRITER so writes never serialise on a shared lock.
+ */
+typedef struct
+{
+   char *directory;                 /// Directory files are written to
+   char *pattern;                   /// sprintf pattern, camera number then frame number
+   uint64_t bytes_written;          /// Total bytes written by all writers (atomic)
+   uint64_t files_written;          /// Files successfully committed (atomic)
+   uint64_t write_errors;           /// Failed writes/renames (atomic)
+   BUFFER_POOL names;               /// A block per open file holding its two names, metadata stage
+   int index_fd;                    /// Index file opened for appending, -1 for none
+
+   METRIC *write_latency_metric;    /// Time spent in each write (us)
+   METRIC *counter_metrics[3];      /// Callback metrics reading the counters above
+} STORAGE_MANAGER;
+
+/** One file being written by a pipeline.
+ */
+typedef struct
+{
+   STORAGE_MANAGER *storage;        /// Manager the file belongs to
+   FILE *file_handle;               /// File handle to write buffer data to, NULL if not open
+   char *final_name;                /// Name the file gets once writing is complete, from storage->names
+   char *temp_name;                 /// Name used while the file is being written, same block
+   size_t bytes;                    /// Bytes written to the current file
+   int camera;                      /// Camera and frame the file was opened for, for the index
+   int frame;
+   int64_t time;                    /// When the file's first frame was taken, CLOCK_MONOTONIC (us), 0 if unknown
+} STORAGE_WRITER;
+
+int storage_init(STORAGE_MANAGER *storage, const char *directory, const char *pattern);
+void storage_destroy(STORAGE_MANAGER *storage);
+int storage_open_index(STORAGE_MANAGER *storage, const char *name);
+
+int storage_name_file(STORAGE_MANAGER *storage, int camera, int frame, const char *extension,
+                      char *final_name, char *temp_name, size_t size);
+
+void storage_writer_init(STORAGE_WRITER *writer, STORAGE_MANAGER *storage);
+int storage_writer_open(STORAGE_WRITER *writer, int camera, int frame, const char *extension);
+void storage_writer_stamp(STORAGE_WRITER *writer, int64_t time);
+size_t storage_writer_write(STORAGE_WRITER *writer, const void *data, size_t length);
+int storage_writer_close(STORAGE_WRITER *writer, int commit);
+
+#endif /* STORAGE_H_ */
@@ -0,0 +1,614 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "synthetic_camera.h"
+
+/**
+ * Assign a default set of parameters to the synthetic camera
+ *
+ * @param camera Pointer to camera structure to assign defaults to
+ */
+void synthetic_camera_set_defaults(SYNTHETIC_CAMERA *camera)
+{
+   memset(camera, 0, sizeof(*camera));
+   camera->width = SYNTHETIC_DEFAULT_WIDTH;
+   camera->height = SYNTHETIC_DEFAULT_HEIGHT;
+   camera->buffer_num = SYNTHETIC_DEFAULT_BUFFER_NUM;
+   camera->buffer_size = SYNTHETIC_DEFAULT_BUFFER_SIZE;
+   camera->encode_time = 0;
+   camera->stall_every = 0;
+   camera->analysis_width = SYNTHETIC_DEFAULT_ANALYSIS_WIDTH;
+   camera->analysis_height = SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT;
+   camera->analysis_interval = SYNTHETIC_DEFAULT_ANALYSIS_INTERVAL;
+   camera->video_gop = SYNTHETIC_DEFAULT_VIDEO_GOP;
+   camera->clock_drift = SYNTHETIC_DEFAULT_CLOCK_DRIFT;
+}
+
+/**
+ * Read the simulated sensor clock, microseconds since create running
+ * clock_drift ppm fast
+ */
+static int64_t sensor_time(SYNTHETIC_CAMERA *camera)
+{
+   int64_t elapsed = watchdog_now() - camera->clock_start;
+
+   return elapsed + elapsed * camera->clock_drift / 1000000;
+}
+
+/**
+ * Render the test pattern, a gradient with a bright square moving across it
+ * and a little sensor noise so nothing is ever perfectly static.
+ *
+ * @param luma Plane to render into
+ * @param width Width in pixels
+ * @param height Height in pixels
+ * @param stride Bytes per row
+ * @param frame Frame number, moves the square
+ */
+void synthetic_render_luma(uint8_t *luma, int width, int height, int stride, unsigned frame)
+{
+   int size = height / 8 > 0 ? height / 8 : 1;
+   int box_x = (int)((frame * 4) % (unsigned)(width > size ? width - size : 1));
+   int box_y = height / 2 - size / 2;
+   uint32_t noise = 0x12345678u ^ frame;
+
+   for (int y = 0; y < height; y++)
+   {
+      uint8_t *row = luma + (size_t)y * stride;
+
+      for (int x = 0; x < width; x++)
+      {
+         int value = 32 + (x * 128) / width + (y * 64) / height;
+
+         noise = noise * 1664525u + 1013904223u;
+         value += (int)(noise >> 29) - 4;
+
+         if (x >= box_x && x < box_x + size && y >= box_y && y < box_y + size)
+            value = 235;
+
+         row[x] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+      }
+   }
+}
+
+static SYNTHETIC_BUFFER *pool_get(SYNTHETIC_CAMERA *camera)
+{
+   SYNTHETIC_BUFFER *buffer;
+
+   pthread_mutex_lock(&camera->lock);
+   while (!camera->free_list && !camera->quit)
+      pthread_cond_wait(&camera->cond, &camera->lock);
+
+   buffer = camera->free_list;
+   if (buffer)
+   {
+      camera->free_list = buffer->next;
+      camera->buffers_in_use++;
+   }
+   pthread_mutex_unlock(&camera->lock);
+   return buffer;
+}
+
+static void pool_release(SYNTHETIC_CAMERA *camera, SYNTHETIC_BUFFER *buffer)
+{
+   pthread_mutex_lock(&camera->lock);
+   buffer->length = 0;
+   buffer->flags = 0;
+   buffer->next = camera->free_list;
+   camera->free_list = buffer;
+   camera->buffers_in_use--;
+   pthread_cond_broadcast(&camera->cond);
+   pthread_mutex_unlock(&camera->lock);
+}
+
+/**
+ *  buffer header callback function for the synthetic encoder
+ *
+ *  Same job as encoder_buffer_callback, hand the data to the pipeline,
+ *  release the buffer and flag the end of the frame.
+ */
+static void synthetic_buffer_callback(SYNTHETIC_CAMERA *camera, SYNTHETIC_BUFFER *buffer)
+{
+   int complete = 0, failed = 0;
+
+   watchdog_kick(&camera->pipeline->watchdog, camera->encoder_watch);
+   pipeline_count_buffer(camera->pipeline, buffer->length, buffer->alloc_size);
+
+   // We need to check we wrote what we wanted - it's possible we have run out of storage.
+   if (pipeline_write(camera->pipeline, buffer->data, buffer->length, buffer->pts) != buffer->length)
+   {
+      fprintf(stderr, "Unable to write buffer to file - aborting\n");
+      complete = failed = 1;
+   }
+
+   if (buffer->flags & SYNTHETIC_FLAG_FRAME_END)
+      complete = 1;
+
+   pool_release(camera, buffer);
+
+   if (complete)
+   {
+      pthread_mutex_lock(&camera->lock);
+      camera->capture_status = failed ? -1 : 0;
+      camera->capture_complete = 1;
+      pthread_cond_broadcast(&camera->cond);
+      pthread_mutex_unlock(&camera->lock);
+   }
+}
+
+/**
+ * Encode the next frame, a binary PGM of the test pattern
+ */
+static size_t encode_frame(SYNTHETIC_CAMERA *camera)
+{
+   int header = sprintf((char *)camera->frame, "P5\n%d %d\n255\n", camera->width, camera->height);
+
+   camera->frame_pts = sensor_time(camera);
+   synthetic_render_luma(camera->frame + header, camera->width, camera->height,
+                         camera->width, camera->frame_count++);
+   pipeline_mask_frame(camera->pipeline, &camera->frame_filter, camera->frame + header, NULL, NULL,
+                       camera->width, camera->height, camera->width, 0);
+
+   if (camera->encode_time)
+      usleep(camera->encode_time);
+
+   return header + (size_t)camera->width * camera->height;
+}
+
+static void *encoder_thread(void *arg)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)arg;
+
+   for (;;)
+   {
+      size_t length, offset = 0;
+      int stall;
+
+      pthread_mutex_lock(&camera->lock);
+      while (!camera->capture_requested && !camera->quit)
+         pthread_cond_wait(&camera->cond, &camera->lock);
+      camera->capture_requested = 0;
+      pthread_mutex_unlock(&camera->lock);
+
+      if (camera->quit)
+         break;
+
+      stall = camera->stall_every && (camera->frame_count + 1) % camera->stall_every == 0;
+      length = encode_frame(camera);
+
+      // Send the frame out in pool sized buffers, the last one flagged as the frame end
+      while (offset < length)
+      {
+         SYNTHETIC_BUFFER *buffer = pool_get(camera);
+         size_t chunk = length - offset;
+
+         if (!buffer)
+            break;
+
+         if (chunk > buffer->alloc_size)
+            chunk = buffer->alloc_size;
+
+         memcpy(buffer->data, camera->frame + offset, chunk);
+         buffer->length = chunk;
+         offset += chunk;
+         buffer->flags = offset == length ? SYNTHETIC_FLAG_FRAME_END : 0;
+         buffer->pts = camera->frame_pts;
+
+         if (stall && offset == length)
+         {
+            // Lose the frame end and hang like a wedged encoder, only quit gets us out
+            pool_release(camera, buffer);
+
+            pthread_mutex_lock(&camera->lock);
+            while (!camera->quit)
+               pthread_cond_wait(&camera->cond, &camera->lock);
+            pthread_mutex_unlock(&camera->lock);
+            return NULL;
+         }
+
+         synthetic_buffer_callback(camera, buffer);
+      }
+   }
+   return NULL;
+}
+
+static void stop_encoder(SYNTHETIC_CAMERA *camera)
+{
+   pthread_mutex_lock(&camera->lock);
+   camera->quit = 1;
+   pthread_cond_broadcast(&camera->cond);
+   pthread_mutex_unlock(&camera->lock);
+
+   pthread_join(camera->encoder_thread, NULL);
+   camera->encoder_running = 0;
+}
+
+static int start_encoder(SYNTHETIC_CAMERA *camera)
+{
+   camera->quit = 0;
+   camera->capture_requested = 0;
+   if (pthread_create(&camera->encoder_thread, NULL, encoder_thread, camera) != 0)
+      return -1;
+   camera->encoder_running = 1;
+   return 0;
+}
+
+/**
+ * "Encode" a frame as synthetic video. Keyframes are the raw frame, the
+ * rest the difference from the last frame with small differences
+ * quantised away, so static scenes make small packets as they would with
+ * H.264. The reference tracks what a decoder has, errors never build up.
+ *
+ * @return Bytes of packet in video_packet
+ */
+static size_t encode_video(SYNTHETIC_CAMERA *camera, const uint8_t *luma, int keyframe)
+{
+   SYNTHETIC_VIDEO_HEADER *header = (SYNTHETIC_VIDEO_HEADER *)camera->video_packet;
+   uint8_t *out = camera->video_packet + sizeof(*header);
+   int pixels = camera->analysis_width * camera->analysis_height;
+   int run = 0;
+
+   header->magic = SYNTHETIC_VIDEO_MAGIC;
+   header->width = (uint16_t)camera->analysis_width;
+   header->height = (uint16_t)camera->analysis_height;
+   header->keyframe = keyframe;
+
+   if (keyframe)
+   {
+      memcpy(camera->video_reference, luma, pixels);
+      memcpy(out, luma, pixels);
+      return sizeof(*header) + pixels;
+   }
+
+   for (int p = 0; p < pixels; p++)
+   {
+      int delta = luma[p] - camera->video_reference[p];
+
+      if (delta >= -SYNTHETIC_VIDEO_DEADZONE && delta <= SYNTHETIC_VIDEO_DEADZONE)
+         delta = 0;
+
+      // Every pair ends on a pixel, the last one always gets a pair
+      if (!delta && run < 255 && p != pixels - 1)
+      {
+         run++;
+         continue;
+      }
+
+      delta = delta < -127 ? -127 : delta > 127 ? 127 : delta;
+      *out++ = (uint8_t)run;
+      *out++ = (uint8_t)(int8_t)delta;
+      camera->video_reference[p] = (uint8_t)(camera->video_reference[p] + delta);
+      run = 0;
+   }
+   return (size_t)(out - camera->video_packet);
+}
+
+/**
+ * Decode the next synthetic video packet of a stream. Packets aren't
+ * length prefixed, a P-frame ends once its pairs have covered the frame.
+ *
+ * @param data Stream at the start of a packet
+ * @param length Bytes left in the stream
+ * @param luma Frame decoded so far, updated in place, must hold the packet's frame
+ * @param width Size of luma on entry, 0 if nothing decoded yet. Receives the packet's frame size
+ * @param height As width
+ * @return Bytes of the packet, 0 at the end of the stream, -1 if it is corrupt
+ *         or needs a keyframe first
+ */
+long synthetic_decode_video(const uint8_t *data, size_t length, uint8_t *luma, int *width, int *height)
+{
+   SYNTHETIC_VIDEO_HEADER header;
+   const uint8_t *in = data + sizeof(header), *end = data + length;
+   int pixels;
+
+   if (!length)
+      return 0;
+   if (length < sizeof(header))
+      return -1;
+
+   memcpy(&header, data, sizeof(header));
+   if (header.magic != SYNTHETIC_VIDEO_MAGIC || !header.width || !header.height)
+      return -1;
+
+   pixels = header.width * header.height;
+   if (header.keyframe)
+   {
+      if ((size_t)(end - in) < (size_t)pixels)
+         return -1;
+      memcpy(luma, in, pixels);
+      *width = header.width;
+      *height = header.height;
+      return (long)(sizeof(header) + pixels);
+   }
+
+   // A difference from a frame of another size is no use
+   if (*width != header.width || *height != header.height)
+      return -1;
+
+   for (int p = 0; p < pixels; p++)
+   {
+      if (end - in < 2)
+         return -1;
+      p += in[0];
+      if (p >= pixels)
+         return -1;
+      luma[p] = (uint8_t)(luma[p] + (int8_t)in[1]);
+      in += 2;
+   }
+   return (long)(in - data);
+}
+
+/**
+ * Low resolution stream for the pipeline's analysis, runs continuously
+ * alongside captures like the camera's video port does. A recording
+ * pipeline gets it encoded as well.
+ */
+static void *analysis_thread(void *arg)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)arg;
+   struct timespec next;
+
+   clock_gettime(CLOCK_REALTIME, &next);
+
+   pthread_mutex_lock(&camera->lock);
+   while (!camera->analysis_quit)
+   {
+      int64_t pts;
+
+      pthread_mutex_unlock(&camera->lock);
+
+      pts = sensor_time(camera);
+      synthetic_render_luma(camera->analysis_frame, camera->analysis_width, camera->analysis_height,
+                            camera->analysis_width, camera->analysis_count++);
+      pipeline_mask_frame(camera->pipeline, &camera->analysis_filter, camera->analysis_frame, NULL, NULL,
+                          camera->analysis_width, camera->analysis_height, camera->analysis_width, 0);
+
+      if (camera->video_packet)
+      {
+         int keyframe = camera->video_count++ % camera->video_gop == 0;
+         size_t length = encode_video(camera, camera->analysis_frame, keyframe);
+
+         pipeline_record(camera->pipeline, camera->video_packet, length, keyframe ? RECORDER_FLAG_KEYFRAME : 0,
+                         pts);
+      }
+
+      pipeline_analyse(camera->pipeline, camera->analysis_frame, camera->analysis_width,
+                       camera->analysis_height, camera->analysis_width, pts);
+
+      next.tv_nsec += (long)camera->analysis_interval * 1000;
+      next.tv_sec += next.tv_nsec / 1000000000L;
+      next.tv_nsec %= 1000000000L;
+
+      pthread_mutex_lock(&camera->lock);
+      while (!camera->analysis_quit &&
+             pthread_cond_timedwait(&camera->cond, &camera->lock, &next) == 0)
+         ;
+   }
+   pthread_mutex_unlock(&camera->lock);
+   return NULL;
+}
+
+static void stop_analysis(SYNTHETIC_CAMERA *camera)
+{
+   pthread_mutex_lock(&camera->lock);
+   camera->analysis_quit = 1;
+   pthread_cond_broadcast(&camera->cond);
+   pthread_mutex_unlock(&camera->lock);
+
+   pthread_join(camera->analysis_thread, NULL);
+   camera->analysis_running = 0;
+}
+
+static size_t analysis_size(SYNTHETIC_CAMERA *camera)
+{
+   return (size_t)camera->analysis_width * camera->analysis_height;
+}
+
+/// Worst case every pixel gets a pair
+static size_t video_packet_size(SYNTHETIC_CAMERA *camera)
+{
+   return sizeof(SYNTHETIC_VIDEO_HEADER) + 2 * analysis_size(camera);
+}
+
+static void synthetic_destroy(CAMERA_PIPELINE *pipeline)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)pipeline->backend_state;
+
+   // Analysis first, it uses the lock the encoder teardown destroys
+   if (camera->analysis_running)
+      stop_analysis(camera);
+
+   if (camera->encoder_running)
+   {
+      stop_encoder(camera);
+      pthread_cond_destroy(&camera->cond);
+      pthread_mutex_destroy(&camera->lock);
+   }
+
+   // Every buffer should be back in the pool once the encoder thread has gone
+   if (camera->buffers && camera->buffers_in_use)
+      fprintf(stderr, "Synthetic pool destroyed with %d buffers outstanding\n", camera->buffers_in_use);
+
+   if (camera->buffers)
+   {
+      for (int i = 0; i < camera->pool_buffers; i++)
+         memory_free(MEMORY_STAGE_PACKETS, camera->buffers[i].data, camera->buffer_size);
+      free(camera->buffers);
+   }
+
+   memory_free(MEMORY_STAGE_FRAMES, camera->frame, camera->frame_size);
+   memory_free(MEMORY_STAGE_FRAMES, camera->analysis_frame, analysis_size(camera));
+   memory_free(MEMORY_STAGE_FRAMES, camera->video_reference, analysis_size(camera));
+   memory_free(MEMORY_STAGE_PACKETS, camera->video_packet, video_packet_size(camera));
+   privacy_filter_destroy(&camera->frame_filter);
+   privacy_filter_destroy(&camera->analysis_filter);
+   camera->buffers = NULL;
+   camera->free_list = NULL;
+   camera->frame = NULL;
+   camera->analysis_frame = NULL;
+   camera->video_reference = NULL;
+   camera->video_packet = NULL;
+   camera->pipeline = NULL;
+}
+
+static int synthetic_create(CAMERA_PIPELINE *pipeline)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)pipeline->backend_state;
+
+   camera->pipeline = pipeline;
+   camera->quit = 0;
+   camera->buffers_in_use = 0;
+   camera->clock_start = watchdog_now();
+   privacy_filter_init(&camera->frame_filter, &pipeline->privacy);
+   privacy_filter_init(&camera->analysis_filter, &pipeline->privacy);
+   camera->frame_size = 32 + (size_t)camera->width * camera->height;
+   camera->frame = memory_alloc(MEMORY_STAGE_FRAMES, camera->frame_size);
+
+   if (!camera->frame || camera->buffer_num <= 0 || camera->buffer_size <= 0)
+      goto error;
+
+   // As many output buffers as asked for if the budget has room, fewer if not
+   camera->pool_buffers = memory_fit(MEMORY_STAGE_PACKETS, camera->buffer_size, camera->buffer_num, 1);
+   camera->buffers = calloc(camera->pool_buffers, sizeof(*camera->buffers));
+   if (!camera->buffers)
+      goto error;
+
+   camera->free_list = NULL;
+   for (int i = 0; i < camera->pool_buffers; i++)
+   {
+      SYNTHETIC_BUFFER *buffer = &camera->buffers[i];
+
+      buffer->data = memory_alloc(MEMORY_STAGE_PACKETS, camera->buffer_size);
+      if (!buffer->data)
+         goto error;
+      buffer->alloc_size = camera->buffer_size;
+      buffer->next = camera->free_list;
+      camera->free_list = buffer;
+   }
+
+   pthread_mutex_init(&camera->lock, NULL);
+   pthread_cond_init(&camera->cond, NULL);
+
+   if (start_encoder(camera) != 0)
+   {
+      pthread_cond_destroy(&camera->cond);
+      pthread_mutex_destroy(&camera->lock);
+      goto error;
+   }
+
+   camera->encoder_watch = watchdog_add_port(&pipeline->watchdog, "synthetic encoder output");
+
+   if (pipeline->analysis)
+   {
+      if (pipeline->recording)
+      {
+         camera->video_count = 0;
+         camera->video_reference = memory_alloc(MEMORY_STAGE_FRAMES, analysis_size(camera));
+         camera->video_packet = memory_alloc(MEMORY_STAGE_PACKETS, video_packet_size(camera));
+         if (!camera->video_reference || !camera->video_packet || camera->video_gop <= 0)
+            goto error;
+      }
+
+      camera->analysis_quit = 0;
+      camera->analysis_frame = memory_alloc(MEMORY_STAGE_FRAMES, analysis_size(camera));
+      if (!camera->analysis_frame ||
+          pthread_create(&camera->analysis_thread, NULL, analysis_thread, camera) != 0)
+         goto error;
+      camera->analysis_running = 1;
+   }
+
+   if (pipeline->verbose)
+      fprintf(stderr, "Camera %d: synthetic %dx%d component done\n", pipeline->camera_num,
+              camera->width, camera->height);
+   return 0;
+
+error:
+   synthetic_destroy(pipeline);
+   return -1;
+}
+
+static int synthetic_capture(CAMERA_PIPELINE *pipeline)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)pipeline->backend_state;
+   int status;
+
+   watchdog_arm(&pipeline->watchdog, camera->encoder_watch);
+
+   pthread_mutex_lock(&camera->lock);
+   camera->capture_complete = 0;
+   camera->capture_requested = 1;
+   pthread_cond_broadcast(&camera->cond);
+
+   // Wait for capture to complete
+   while (!camera->capture_complete && !camera->quit)
+      pthread_cond_wait(&camera->cond, &camera->lock);
+
+   status = camera->capture_complete ? camera->capture_status : -1;
+   pthread_mutex_unlock(&camera->lock);
+
+   watchdog_disarm(&pipeline->watchdog, camera->encoder_watch);
+
+   return status;
+}
+
+/**
+ * Watchdog says the encoder has stalled, give up on the frame
+ */
+static void synthetic_abort_capture(CAMERA_PIPELINE *pipeline)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)pipeline->backend_state;
+
+   pthread_mutex_lock(&camera->lock);
+   if (!camera->capture_complete)
+   {
+      camera->capture_status = PIPELINE_CAPTURE_STALLED;
+      camera->capture_complete = 1;
+      pthread_cond_broadcast(&camera->cond);
+   }
+   pthread_mutex_unlock(&camera->lock);
+}
+
+/**
+ * Restart just the encoder thread, the pool and test pattern carry on
+ */
+static int synthetic_recover(CAMERA_PIPELINE *pipeline)
+{
+   SYNTHETIC_CAMERA *camera = (SYNTHETIC_CAMERA *)pipeline->backend_state;
+
+   if (camera->encoder_running)
+      stop_encoder(camera);
+
+   if (camera->buffers_in_use)
+   {
+      fprintf(stderr, "Synthetic encoder lost %d buffers\n", camera->buffers_in_use);
+      return -1;
+   }
+
+   return start_encoder(camera);
+}
+
+/**
+ * The sensor clock, for the pipeline's frame clock. Any thread.
+ */
+static int64_t synthetic_sensor_time(CAMERA_PIPELINE *pipeline)
+{
+   return sensor_time((SYNTHETIC_CAMERA *)pipeline->backend_state);
+}
+
+const PIPELINE_BACKEND synthetic_backend =
+{
+   "synthetic",
+   "pgm",
+   synthetic_create,
+   synthetic_capture,
+   synthetic_destroy,
+   synthetic_abort_capture,
+   synthetic_recover,
+   NULL,
+   "syv",
+   NULL,
+   synthetic_sensor_time
+};
@@ -0,0 +1,118 @@
+#ifndef SYNTHETIC_CAMERA_H_
+#define SYNTHETIC_CAMERA_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "pipeline.h"
+
+#define SYNTHETIC_DEFAULT_WIDTH       640
+#define SYNTHETIC_DEFAULT_HEIGHT      480
+#define SYNTHETIC_DEFAULT_BUFFER_NUM  3
+#define SYNTHETIC_DEFAULT_BUFFER_SIZE (64 * 1024)
+
+#define SYNTHETIC_DEFAULT_ANALYSIS_WIDTH    160
+#define SYNTHETIC_DEFAULT_ANALYSIS_HEIGHT   120
+#define SYNTHETIC_DEFAULT_ANALYSIS_INTERVAL 100000
+
+#define SYNTHETIC_FLAG_FRAME_END      (1 << 0)
+
+/// Frames from one keyframe to the next in the synthetic video
+#define SYNTHETIC_DEFAULT_VIDEO_GOP   10
+
+/// Differences up to this are quantised away, as an encoder drops sensor noise
+#define SYNTHETIC_VIDEO_DEADZONE      6
+
+/// Sensor clock error (ppm), a cheap crystal's worth, so the frame clock has drift to track
+#define SYNTHETIC_DEFAULT_CLOCK_DRIFT 40
+
+/// "SYV1", starts every synthetic video packet
+#define SYNTHETIC_VIDEO_MAGIC         0x31565953u
+
+/** Header of a synthetic video packet. A keyframe is followed by the raw
+ *  luma, anything else by (run, delta) byte pairs: skip run pixels, add
+ *  delta to the next one.
+ */
+typedef struct
+{
+   uint32_t magic;                  /// SYNTHETIC_VIDEO_MAGIC
+   uint16_t width;
+   uint16_t height;
+   uint32_t keyframe;               /// Non zero for a keyframe
+} SYNTHETIC_VIDEO_HEADER;
+
+/** Buffer header handed from the synthetic encoder to its callback
+ */
+typedef struct SYNTHETIC_BUFFER
+{
+   struct SYNTHETIC_BUFFER *next;   /// Next free buffer
+   uint8_t *data;                   /// Payload
+   size_t alloc_size;               /// Size of data
+   size_t length;                   /// Bytes of data in use
+   uint32_t flags;                  /// SYNTHETIC_FLAG_ values
+   int64_t pts;                     /// Sensor time the frame was rendered (us)
+} SYNTHETIC_BUFFER;
+
+/** Synthetic camera + encoder standing in for the mmal components.
+ *  Renders a moving test pattern and "encodes" it as a PGM, delivered in
+ *  pool sized chunks from its own thread just like the encoder output port.
+ *  Privacy masks go on between rendering and encoding, as on the camera.
+ *  Frames are timestamped by a sensor clock that starts at create and runs
+ *  a little fast, as the camera's STC does against the host clock.
+ */
+typedef struct
+{
+   int width;                       /// Frame width
+   int height;                      /// Frame height
+   int buffer_num;                  /// Buffers in the output pool
+   int buffer_size;                 /// Size of each output buffer
+   int pool_buffers;                /// Buffers actually in the pool, buffer_num cut down to the memory budget
+   int encode_time;                 /// Simulated encode time per frame in microseconds
+   int stall_every;                 /// Lose the frame end of every Nth frame and hang, 0 never
+   int analysis_width;              /// Analysis stream frame size, only used if the pipeline asks for it
+   int analysis_height;
+   int analysis_interval;           /// Microseconds between analysis frames
+   int video_gop;                   /// SYNTHETIC_DEFAULT_VIDEO_GOP, video is the analysis stream encoded
+   int clock_drift;                 /// SYNTHETIC_DEFAULT_CLOCK_DRIFT, ppm the sensor clock runs fast
+   int64_t clock_start;             /// CLOCK_MONOTONIC the sensor clock counts from (us)
+
+   CAMERA_PIPELINE *pipeline;       /// Pipeline the output goes to
+   SYNTHETIC_BUFFER *buffers;       /// Pool storage
+   SYNTHETIC_BUFFER *free_list;     /// Buffers available to the encoder
+   int buffers_in_use;              /// Buffers currently out of the pool
+   uint8_t *frame;                  /// Encoded frame being sent
+   size_t frame_size;
+   int64_t frame_pts;               /// Sensor time it was rendered (us)
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int capture_requested;           /// Set by capture, cleared by the encoder thread
+   int capture_complete;            /// Set once the frame end buffer has been handled
+   int capture_status;              /// 0 if the frame was written completely
+   int quit;                        /// Tells the encoder thread to exit
+   pthread_t encoder_thread;
+   int encoder_running;
+   int encoder_watch;               /// Watchdog port for the encoder output
+   unsigned frame_count;            /// Frames rendered, drives the test pattern
+
+   uint8_t *analysis_frame;         /// Luma of the current analysis frame
+   unsigned analysis_count;         /// Analysis frames rendered
+   int analysis_quit;               /// Tells the analysis thread to exit
+   pthread_t analysis_thread;
+   int analysis_running;
+
+   uint8_t *video_reference;        /// Frame as a decoder of the video would have it
+   uint8_t *video_packet;           /// Packet being handed to the recorder
+   unsigned video_count;            /// Video frames encoded since create
+
+   PRIVACY_FILTER frame_filter;     /// Pipeline's privacy masks on the captured frames
+   PRIVACY_FILTER analysis_filter;  /// ...and on the analysis stream and video made from it
+} SYNTHETIC_CAMERA;
+
+extern const PIPELINE_BACKEND synthetic_backend;
+
+void synthetic_camera_set_defaults(SYNTHETIC_CAMERA *camera);
+void synthetic_render_luma(uint8_t *luma, int width, int height, int stride, unsigned frame);
+long synthetic_decode_video(const uint8_t *data, size_t length, uint8_t *luma, int *width, int *height);
+
+#endif /* SYNTHETIC_CAMERA_H_ */
@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "watchdog.h"
+
+/**
+ * Monotonic time in microseconds, what all the watchdog times are in
+ */
+int64_t watchdog_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Set up a watchdog, nothing is watched until ports are added and it is started
+ *
+ * @param watchdog Watchdog to initialise
+ * @param deadline Stall deadline in ms, 0 disables stall detection
+ * @param on_stall Called on the watchdog thread when an armed port stalls
+ * @param userdata Passed to on_stall
+ * @return 0 on success, -1 on failure
+ */
+int watchdog_init(WATCHDOG *watchdog, int deadline, WATCHDOG_STALL_CB on_stall, void *userdata)
+{
+   pthread_condattr_t attr;
+
+   memset(watchdog, 0, sizeof(*watchdog));
+   watchdog->deadline = deadline;
+   watchdog->on_stall = on_stall;
+   watchdog->userdata = userdata;
+
+   if (pthread_mutex_init(&watchdog->lock, NULL) != 0)
+      return -1;
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   if (pthread_cond_init(&watchdog->cond, &attr) != 0)
+   {
+      pthread_condattr_destroy(&attr);
+      pthread_mutex_destroy(&watchdog->lock);
+      return -1;
+   }
+   pthread_condattr_destroy(&attr);
+   return 0;
+}
+
+/**
+ * Register a port to watch
+ *
+ * @return Port index to pass to arm/kick, -1 if there is no room
+ */
+int watchdog_add_port(WATCHDOG *watchdog, const char *name)
+{
+   int port;
+
+   pthread_mutex_lock(&watchdog->lock);
+   port = watchdog->num_ports < WATCHDOG_MAX_PORTS ? watchdog->num_ports++ : -1;
+   if (port >= 0)
+   {
+      memset(&watchdog->ports[port], 0, sizeof(watchdog->ports[port]));
+      watchdog->ports[port].name = name;
+   }
+   pthread_mutex_unlock(&watchdog->lock);
+
+   return port;
+}
+
+/**
+ * Forget all the ports, used when the components they belong to are destroyed
+ */
+void watchdog_clear_ports(WATCHDOG *watchdog)
+{
+   pthread_mutex_lock(&watchdog->lock);
+   watchdog->num_ports = 0;
+   pthread_mutex_unlock(&watchdog->lock);
+}
+
+static void *watchdog_thread(void *arg)
+{
+   WATCHDOG *watchdog = (WATCHDOG *)arg;
+
+   pthread_mutex_lock(&watchdog->lock);
+
+   while (!watchdog->quit)
+   {
+      struct timespec wake;
+      int64_t deadline = (int64_t)watchdog->deadline * 1000;
+      int64_t now = watchdog_now();
+      int64_t next = now + deadline / 4;
+
+      for (int i = 0; i < watchdog->num_ports; i++)
+      {
+         WATCHDOG_PORT *port = &watchdog->ports[i];
+         int64_t last = __atomic_load_n(&port->last_activity, __ATOMIC_RELAXED);
+
+         if (!port->armed || port->stalled || now - last < deadline)
+            continue;
+
+         port->stalled = 1;
+         watchdog->stalls++;
+
+         fprintf(stderr, "Watchdog: no buffers on %s for %lld ms\n", port->name,
+                 (long long)(now - last) / 1000);
+
+         // The callback is free to call back into the watchdog
+         if (watchdog->on_stall)
+         {
+            pthread_mutex_unlock(&watchdog->lock);
+            watchdog->on_stall(watchdog->userdata, i);
+            pthread_mutex_lock(&watchdog->lock);
+         }
+      }
+
+      wake.tv_sec = next / 1000000;
+      wake.tv_nsec = (long)(next % 1000000) * 1000;
+      if (!watchdog->quit)
+         pthread_cond_timedwait(&watchdog->cond, &watchdog->lock, &wake);
+   }
+
+   pthread_mutex_unlock(&watchdog->lock);
+   return NULL;
+}
+
+/**
+ * Start the checking thread, does nothing if the watchdog is disabled
+ *
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int watchdog_start(WATCHDOG *watchdog)
+{
+   if (!watchdog->deadline || watchdog->running)
+      return 0;
+
+   watchdog->quit = 0;
+   if (pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog) != 0)
+      return -1;
+   watchdog->running = 1;
+   return 0;
+}
+
+void watchdog_stop(WATCHDOG *watchdog)
+{
+   if (!watchdog->running)
+      return;
+
+   pthread_mutex_lock(&watchdog->lock);
+   watchdog->quit = 1;
+   pthread_cond_broadcast(&watchdog->cond);
+   pthread_mutex_unlock(&watchdog->lock);
+
+   pthread_join(watchdog->thread, NULL);
+   watchdog->running = 0;
+}
+
+void watchdog_destroy(WATCHDOG *watchdog)
+{
+   watchdog_stop(watchdog);
+   pthread_cond_destroy(&watchdog->cond);
+   pthread_mutex_destroy(&watchdog->lock);
+}
+
+/**
+ * Change the deadline of a running watchdog, e.g. when the frame rate drops
+ * and frames legitimately take longer. A disabled watchdog stays disabled.
+ *
+ * @param deadline New stall deadline in ms
+ */
+void watchdog_set_deadline(WATCHDOG *watchdog, int deadline)
+{
+   pthread_mutex_lock(&watchdog->lock);
+   if (watchdog->deadline && deadline > 0)
+      watchdog->deadline = deadline;
+   pthread_cond_broadcast(&watchdog->cond);
+   pthread_mutex_unlock(&watchdog->lock);
+}
+
+/**
+ * Start expecting buffers on a port, the deadline runs from now
+ */
+void watchdog_arm(WATCHDOG *watchdog, int port)
+{
+   if (port < 0)
+      return;
+
+   pthread_mutex_lock(&watchdog->lock);
+   __atomic_store_n(&watchdog->ports[port].last_activity, watchdog_now(), __ATOMIC_RELAXED);
+   watchdog->ports[port].stalled = 0;
+   watchdog->ports[port].armed = 1;
+   pthread_mutex_unlock(&watchdog->lock);
+}
+
+void watchdog_disarm(WATCHDOG *watchdog, int port)
+{
+   if (port < 0)
+      return;
+
+   pthread_mutex_lock(&watchdog->lock);
+   watchdog->ports[port].armed = 0;
+   pthread_mutex_unlock(&watchdog->lock);
+}
+
+/**
+ * Record a buffer on a port, called from buffer callbacks so no locking
+ */
+void watchdog_kick(WATCHDOG *watchdog, int port)
+{
+   if (port < 0)
+      return;
+
+   __atomic_store_n(&watchdog->ports[port].last_activity, watchdog_now(), __ATOMIC_RELAXED);
+   __atomic_add_fetch(&watchdog->ports[port].buffers, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * When the port last saw a buffer, the start of the downtime for a stall
+ */
+int64_t watchdog_stalled_since(WATCHDOG *watchdog, int port)
+{
+   if (port < 0)
+      return watchdog_now();
+   return __atomic_load_n(&watchdog->ports[port].last_activity, __ATOMIC_RELAXED);
+}
+
+/**
+ * Account for a finished recovery attempt
+ *
+ * @param watchdog Watchdog that detected the stall
+ * @param stalled_since Time of the last buffer before the stall
+ * @param success Non zero if the pipeline is running again
+ */
+void watchdog_recovered(WATCHDOG *watchdog, int64_t stalled_since, int success)
+{
+   int64_t downtime = watchdog_now() - stalled_since;
+
+   pthread_mutex_lock(&watchdog->lock);
+   if (success)
+      watchdog->recoveries++;
+   else
+      watchdog->recovery_failures++;
+   watchdog->downtime += downtime;
+   watchdog->last_downtime = downtime;
+   pthread_mutex_unlock(&watchdog->lock);
+}
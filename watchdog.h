@@ -0,0 +1,66 @@
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/// Default time an armed port may go without a buffer before it counts as stalled (ms)
+#define WATCHDOG_DEFAULT_DEADLINE 3000
+
+#define WATCHDOG_MAX_PORTS 4
+
+typedef void (*WATCHDOG_STALL_CB)(void *userdata, int port);
+
+/** Buffer flow on one port
+ */
+typedef struct
+{
+   const char *name;                /// Port name for logging
+   int armed;                       /// Buffers are expected, stalls are detected
+   int stalled;                     /// Stall reported, cleared by the next arm
+   int64_t last_activity;           /// Monotonic time of the last buffer (us, atomic)
+   uint64_t buffers;                /// Buffers seen on the port (atomic)
+} WATCHDOG_PORT;
+
+/** Watches the buffer flow through a pipeline's ports and reports stalls.
+ *  Kicks from buffer callbacks are lock free, the checking is done on the
+ *  watchdog's own thread which calls on_stall once per stall.
+ */
+typedef struct
+{
+   WATCHDOG_PORT ports[WATCHDOG_MAX_PORTS];
+   int num_ports;
+   int deadline;                    /// Stall deadline in ms, 0 disables the watchdog
+   WATCHDOG_STALL_CB on_stall;      /// Called on the watchdog thread when a port stalls
+   void *userdata;                  /// Passed to on_stall
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_t thread;
+   int running;
+   int quit;
+
+   uint64_t stalls;                 /// Stalls detected
+   uint64_t recoveries;             /// Stalls recovered from
+   uint64_t recovery_failures;      /// Recoveries that failed
+   int64_t downtime;                /// Total time from last buffer to recovery (us)
+   int64_t last_downtime;           /// Downtime of the most recent recovery (us)
+} WATCHDOG;
+
+int64_t watchdog_now(void);
+
+int watchdog_init(WATCHDOG *watchdog, int deadline, WATCHDOG_STALL_CB on_stall, void *userdata);
+int watchdog_add_port(WATCHDOG *watchdog, const char *name);
+void watchdog_clear_ports(WATCHDOG *watchdog);
+int watchdog_start(WATCHDOG *watchdog);
+void watchdog_stop(WATCHDOG *watchdog);
+void watchdog_destroy(WATCHDOG *watchdog);
+void watchdog_set_deadline(WATCHDOG *watchdog, int deadline);
+
+void watchdog_arm(WATCHDOG *watchdog, int port);
+void watchdog_disarm(WATCHDOG *watchdog, int port);
+void watchdog_kick(WATCHDOG *watchdog, int port);
+int64_t watchdog_stalled_since(WATCHDOG *watchdog, int port);
+void watchdog_recovered(WATCHDOG *watchdog, int64_t stalled_since, int success);
+
+#endif /* WATCHDOG_H_ */